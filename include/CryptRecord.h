@@ -0,0 +1,90 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Authenticated encryption of small, independent records
+ *
+ * Derives an encryption key and a separate MAC key from a passphrase (PBKDF2 with HMAC-SHA256)
+ * and seals records with AES-256-CTR and HMAC-SHA256 (encrypt-then-MAC).\n
+ * Each sealed record has the layout <tt>IV | ciphertext | MAC</tt>. The MAC also covers
+ * caller-supplied associated data, which allows chaining records to each other.\n
+ * \n
+ * In contrast to #CryptStream, which encrypts one stream per file, a RecordCipher
+ * derives its keys once and can then seal any number of records cheaply.
+ */
+class RecordCipher
+{
+public:
+	static const size_t SaltLength = 16;
+	static const size_t IvLength = 16;
+	static const size_t MacLength = 32;
+	/// Number of bytes a sealed record is longer than its plaintext
+	static const size_t Overhead = IvLength + MacLength;
+	/// Length of the raw key material: encryption key followed by the MAC key
+	static const size_t KeyMaterialLength = 64;
+
+	/**
+	 * @brief Derive the record keys
+	 * @param passphrase Passphrase to derive the keys from
+	 * @param salt Random salt of #SaltLength bytes. Use #generateSalt to create one.
+	 * @param iterationCount Number of PBKDF2 iterations
+	 */
+	RecordCipher (const std::string &passphrase, const std::string &salt, int iterationCount);
+	~RecordCipher ();
+
+	/**
+	 * @brief Create a cipher from raw key material instead of a passphrase
+	 * @param keyMaterial #KeyMaterialLength random bytes, e.g. from #generateKeyMaterial
+	 *
+	 * Such a cipher has no salt and an iteration count of 0.
+	 */
+	static std::unique_ptr<RecordCipher> fromKeyMaterial (const std::string &keyMaterial);
+	
+	/// @return A new random salt
+	static std::string generateSalt ();
+	
+	/// @return #KeyMaterialLength new random bytes
+	static std::string generateKeyMaterial ();
+
+	/**
+	 * @brief Encrypt and authenticate a record
+	 * @param plaintext Data to encrypt
+	 * @param associatedData Data that is authenticated along with the record, but not stored in it
+	 */
+	std::string seal (const std::string &plaintext, const std::string &associatedData = std::string()) const;
+
+	/**
+	 * @brief Verify and decrypt a sealed record
+	 * @throw std::runtime_error If the record has been modified, does not belong to the given
+	 * associated data or was sealed with a different key.
+	 */
+	std::string open (const std::string &sealed, const std::string &associatedData = std::string()) const;
+
+	/// @return The MAC tag of a sealed record
+	static std::string macOf (const std::string &sealed);
+
+	/// @return true if @p passphrase derives the same keys as the one this cipher was created with
+	bool matchesPassphrase (const std::string &passphrase) const;
+
+	const std::string &salt () const { return _salt; }
+	int iterationCount () const { return _iterationCount; }
+private:
+	std::string _salt;
+	int _iterationCount;
+	/// Encryption key followed by the MAC key
+	std::vector<unsigned char> _keys;
+
+	explicit RecordCipher (std::vector<unsigned char> &&keys);
+	static std::vector<unsigned char> _deriveKeys (const std::string &passphrase, const std::string &salt, int iterationCount);
+	std::string _mac (const std::string &iv, const char *data, size_t length, const std::string &associatedData) const;
+
+	RecordCipher (const RecordCipher &) = delete;
+	RecordCipher &operator= (const RecordCipher &) = delete;
+};
+
+}
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <streambuf>
 #include <vector>
 #include <memory>
+#include <string>
 
 struct bio_st;
 struct evp_cipher_st;
@@ -13,6 +15,8 @@ struct evp_pkey_st;
 
 namespace XKey {
 
+class ThreadPool;
+
 enum ModeInfo {
 	NO_OPTIONS = 0,
 	/// Encode content in base64
@@ -50,6 +54,13 @@ public:
 	 */
 	CryptStream (const std::string &filename, OperationMode open_mode,
 		     int mode = BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER);
+	/**
+	 * @brief Create a CryptStream on an open file descriptor, like the one of an #AtomicFile
+	 * 
+	 * The descriptor is not closed. Streams opened this way do not support #readRange.
+	 */
+	CryptStream (int fd, OperationMode open_mode,
+		     int mode = BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER);
 	~CryptStream ();
 	
 	bool isEncrypted () const;
@@ -71,6 +82,70 @@ public:
 			       const char *digestName = nullptr,
 			       const char *iv = nullptr, int keyIterationCount = -1);
 	
+	/**
+	 * @brief Initialization vector of the stream
+	 * 
+	 * A new random IV is generated for each written file, so it also identifies a specific version of a keystore.
+	 * Only valid after #setEncryptionKey was called.
+	 */
+	const std::string &iv () const { return _iv; }
+	
+	/// Position of one encrypted block in the file
+	struct Frame
+	{
+		/// Offset of the block in the (base64-decoded) data following the header
+		uint64_t offset;
+		/// Offset of the first cleartext byte of the block in the cleartext stream
+		uint64_t plainOffset;
+	};
+
+	/**
+	 * @brief Blocks written so far
+	 *
+	 * Only recorded for encrypted streams opened for writing. Call sync() first to include the last block.
+	 */
+	const std::vector<Frame> &frames () const { return _frames; }
+
+	/**
+	 * @brief Derive a key for another purpose from the key of this stream
+	 * @param label Purpose of the key. Different labels yield independent keys.
+	 * @return 64 bytes of key material (HMAC-SHA512 of @p label)
+	 */
+	std::string deriveKey (const std::string &label) const;
+
+	/**
+	 * @brief Read part of the cleartext without decrypting the stream from the beginning
+	 *
+	 * Seeks to the block at @p frame, verifies the checksums of all blocks needed and decrypts them.
+	 * Requires a cipher in counter (CTR) mode, which allows decrypting from any position.
+	 * The stream itself is not affected.
+	 * @param frame A block starting at or before @p begin
+	 * @param begin,end Cleartext range to read
+	 */
+	std::string readRange (const Frame &frame, uint64_t begin, uint64_t end);
+
+	/// @return true if #readRange is supported for this stream: opened by file name for reading, in CTR mode
+	bool supportsRandomAccess () const;
+
+	/**
+	 * @brief Read the rest of the cleartext at once
+	 *
+	 * Reads the remaining blocks from the file first, then verifies their checksums and decrypts them on
+	 * the workers of @p pool. In counter (CTR) mode, each worker continues the key stream at the first byte
+	 * of its share of the blocks; with other ciphers, the blocks are decrypted one after another.
+	 * The stream is at its end afterwards.
+	 */
+	std::string readAll (ThreadPool &pool);
+	
+	/**
+	 * @brief Write the last block and flush all buffers to the file
+	 *
+	 * Done by the destructor as well. Call it before syncing, moving or reading the written file.
+	 * Nothing can be written afterwards.
+	 * @throw std::runtime_error if the data could not be written
+	 */
+	void finish ();
+	
 	/// Init crypto library after application startup
 	static void InitCrypto ();
 	
@@ -83,6 +158,10 @@ private:
 	int_type overflow (int_type c) override;
 	int sync() override;
 	
+	explicit CryptStream (OperationMode open_mode);
+	/// Set up the filters on top of _file_bio
+	void _setup (int mode);
+	
 	/// Read header from file and put results in *headerMode
 	void _evaluateHeader (int *headerMode);
 	
@@ -112,11 +191,20 @@ private:
 	//
 	int _pbkdfIterationCount = DEFAULT_KEY_ITERATION_COUNT;
 	std::string _iv;
+	std::string _filename;
+	/// Offset of the data following the header in the file
+	int _dataOffset = 0;
+	std::vector<Frame> _frames;
+	uint64_t _writtenBytes = 0, _writtenPlain = 0;
+	/// Cleartext bytes decrypted so far
+	uint64_t _readPlain = 0;
 	const evp_cipher_st *_cipher = 0;
 	const evp_md_st *_md = 0;
 	
 	struct BlockHead;
 	void makeMessageDigest (const unsigned char *data, size_t length, unsigned char *mdOut);
+	/// @return A new cipher context continuing the key stream at @p plainOffset (CTR mode only)
+	std::unique_ptr<evp_cipher_ctx_st, void(*)(evp_cipher_ctx_st*)> _cipherAt (uint64_t plainOffset) const;
 	bio_st *bioChain () const { return &*_bio_chain; }
 };
 
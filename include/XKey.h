@@ -1,12 +1,36 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <deque>
 #include <memory>
+#include <vector>
+
+#include "XKeyMatcher.h"
 
 namespace XKey {
 
 class Folder;
+class Entry;
+class SubtreeFilter;
+
+/**
+ * @brief Reference to a binary attachment of an entry
+ * 
+ * The content is stored out of line in an #AttachmentStore, encrypted with the attachment's own key.
+ * Only this reference is part of the keystore.
+ */
+struct Attachment
+{
+	/// Identifier of the blob in the attachment store
+	std::string id;
+	/// File name as shown to the user
+	std::string name;
+	/// Size of the content in bytes
+	uint64_t size;
+	/// Random key material the blob is encrypted with
+	std::string key;
+};
 
 /**
  * @brief A single key entry
@@ -15,8 +39,8 @@ class Entry
 {
 public:
 	inline Entry () { }
-	inline Entry (const std::string &title, const std::string &user, const std::string &url,
-		      const std::string &pwd, const std::string &email, const std::string &comment);
+	inline Entry (std::string title, std::string user, std::string url,
+		      std::string pwd, std::string email, std::string comment);
 	
 	const std::string& title() const { return _title; }
 	const std::string& username() const { return _username; }
@@ -24,6 +48,11 @@ public:
 	const std::string& password() const { return _password; }
 	const std::string& email() const { return _email; }
 	const std::string& comment() const { return _comment; }
+	
+	/// Binary attachments. Their content is not loaded with the entry, see #AttachmentStore.
+	const std::vector<Attachment>& attachments() const { return _attachments; }
+	void setAttachments (std::vector<Attachment> attachments) { _attachments = std::move(attachments); }
+	void addAttachment (Attachment attachment) { _attachments.push_back (std::move(attachment)); }
 private:
 	std::string _title;
 	std::string _username;
@@ -31,10 +60,62 @@ private:
 	std::string _password;
 	std::string _email;
 	std::string _comment;
+	std::vector<Attachment> _attachments;
 };
 
 typedef std::unique_ptr<Folder> RootFolder_Ptr;
 
+/**
+ * @brief Source for entries of a folder that have not been decoded yet
+ * 
+ * A folder with an entry source decodes its entries on first access.
+ * This allows opening large keystores without decoding the entries of folders that are never looked at.
+ */
+class EntrySource
+{
+public:
+	virtual ~EntrySource () { }
+	
+	/// @return Number of entries the source decodes to
+	virtual size_t size () const = 0;
+	
+	/// Decode all entries and append them to @p entries
+	virtual void decode (std::deque<Entry> *entries) const = 0;
+};
+
+/**
+ * @brief Interface to get notified about modifications of a folder hierarchy
+ *
+ * Observers are registered at the root folder with Folder::addObserver and get called
+ * for every modification made through the Folder API anywhere in the hierarchy.\n
+ * Modifications made directly through the non-const #Folder::entries and #Folder::subfolders
+ * containers are not reported.
+ */
+class TreeObserver
+{
+public:
+	virtual ~TreeObserver () { }
+
+	/// Called after @p folder got a new entry at @p index
+	virtual void entryAdded (const Folder &folder, int index) { }
+	/// Called after the entry at @p index in @p folder was replaced
+	virtual void entryChanged (const Folder &folder, int index, const Entry &oldEntry) { }
+	/// Called after the entry @p oldEntry at @p index was removed from @p folder
+	virtual void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) { }
+	/// Called after @p folder was created
+	virtual void folderAdded (const Folder &folder) { }
+	/// Called right before @p folder is removed from @p parent, while it is still accessible
+	virtual void folderRemoved (const Folder &parent, const Folder &folder) { }
+	/// Called after @p folder was renamed
+	virtual void folderRenamed (const Folder &folder, const std::string &oldName) { }
+	/// Called after @p folder was moved by #moveFolder. It was located at @p oldRow in @p oldParent before.
+	virtual void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) { }
+	/// Called before the notifications of a #Batch that is being committed
+	virtual void batchStarted (const Folder &root) { }
+	/// Called once after all modifications of a #Batch have been applied and notified
+	virtual void batchCommitted (const Folder &root, size_t operations) { }
+};
+
 /**
  * @brief Key folder containing subfolders and any amount of keys
  */
@@ -50,6 +131,8 @@ public:
 	
 	void addEntry (Entry entry);
 	Entry& getEntryAt (int index);
+	/// Replace the entry at @p index
+	void setEntryAt (int index, Entry entry);
 	void removeEntry (int index);
 	Folder* createSubfolder (const std::string &name);
 	void removeSubfolder (int index);
@@ -58,27 +141,84 @@ public:
 	const Folder* getSubfolder (const std::string &name) const;
 	
 	const std::deque<Folder>& subfolders () const { return _subfolders; }
-	const std::deque<Entry>& entries () const { return _entries; }
+	const std::deque<Entry>& entries () const { _materialize(); return _entries; }
 	
 	std::deque<Folder>& subfolders () { return _subfolders; }
-	std::deque<Entry>& entries () { return _entries; }
+	std::deque<Entry>& entries () { _materialize(); return _entries; }
+	
+	/// @return Number of entries, without decoding lazily loaded entries
+	size_t entryCount () const;
+	
+	/**
+	 * @brief Defer decoding the entries of this folder until they are first accessed
+	 * 
+	 * The folder must not contain any entries yet.\n
+	 * Decoding happens on access through a const method, so lazily loaded folders must not be shared between threads.
+	 * Call #materialize before doing so.
+	 */
+	void setEntrySource (std::unique_ptr<EntrySource> source);
+	
+	/// @return false if this folder's entries have not been decoded yet
+	bool isMaterialized () const { return !_entrySource; }
+	/// @return The source of the entries that have not been decoded yet, or nullptr
+	const EntrySource *entrySource () const { return _entrySource.get(); }
+	
+	/// Decode all lazily loaded entries in this folder and its subfolders
+	void materialize () const;
 	
 	/// @return this items index in the parent's folder-list
 	int row() const;
 	
+	/**
+	 * @brief Identifier of this folder, unique within the process
+	 * 
+	 * In contrast to the address of the folder object, the id stays the same when the folder
+	 * is moved or when siblings are inserted or removed.
+	 */
+	uint64_t id() const { return _id; }
+	
+	/**
+	 * @brief Register an observer for modifications of this hierarchy
+	 * 
+	 * May only be called on a root folder. The observer is not owned and must be removed before it is destroyed.
+	 */
+	void addObserver (TreeObserver *observer);
+	void removeObserver (TreeObserver *observer);
+	
 	void operator= (Folder &&);
 private:
 	std::string _name;
 	std::deque<Folder> _subfolders;
 	std::deque<Entry> _entries;
 	Folder *_parent;
+	uint64_t _id;
+	/// Observers of the hierarchy. Only used in root folders.
+	std::vector<TreeObserver*> _observers;
+	/// Entries that have not been decoded yet
+	mutable std::unique_ptr<EntrySource> _entrySource;
+	
+	void _materialize () const {
+		if (_entrySource)
+			_decodeEntries();
+	}
+	void _decodeEntries () const;
 	
 	Folder ();
+	
+	const std::vector<TreeObserver*> *_treeObservers () const;
+	Folder *_createSubfolder (const std::string &name);
 	// Disallow copying
 	Folder (const Folder &) = delete;
 	Folder &operator= (const Folder &) = delete;
 
+	/// Copy name and entries of @p other, and with @p subfolders replace the subfolders by copies of those of @p other
+	void _copyContentFrom (const Folder &other, bool subfolders = true);
+
 	friend RootFolder_Ptr createRootFolder ();
+	friend RootFolder_Ptr cloneFolderTree (const Folder &source);
+	friend Folder *moveFolder (Folder *oldFolder, Folder *newParent, int newPosition);
+	friend class Batch;
+	friend class KeystoreHandle;
 	struct construct_key {};
 public:
 	/// Only to be called internally
@@ -94,6 +234,13 @@ inline RootFolder_Ptr createRootFolder () {
 	return RootFolder_Ptr (new Folder());
 }
 
+/**
+ * @brief Create a deep copy of a folder hierarchy
+ * @param source Folder to copy. Its subfolders and entries are copied recursively.
+ * @return New root folder. The copy has no parent, even if @p source has one.
+ */
+RootFolder_Ptr cloneFolderTree (const Folder &source);
+
 /**
  * @brief Result structure for searching in a key-tree structure
  * 
@@ -124,21 +271,102 @@ struct SearchResult
 	int _lastIndex;
 };
 
+/**
+ * @brief Prepared search string
+ * 
+ * The search string is split into words and a #SubstringMatcher is prepared for each of them once,
+ * so the query can be matched against any number of entries without preparing it again.
+ * An entry matches if any of the words is contained in any of its fields, ignoring case.
+ */
+class SearchQuery
+{
+public:
+	/// @param searchString The words to search for, separated by spaces
+	explicit SearchQuery (const std::string &searchString);
+	
+	/// @return true if @p entry matches the query
+	bool matches (const Entry &entry) const;
+	/// @return true if each of the words is contained in some field of @p entry
+	bool matchesAll (const Entry &entry) const;
+	
+	/// @return The case-folded words of the query
+	const std::vector<std::string> &tokens () const { return _tokens; }
+	
+	bool empty () const { return _tokens.empty(); }
+private:
+	std::vector<std::string> _tokens;
+	std::vector<SubstringMatcher> _matchers;
+};
+
+/**
+ * @brief Resumable search over a folder hierarchy
+ * 
+ * Visits all entries in tree order (the entries of a folder first, then its subfolders) with an explicit stack,
+ * so continuing a search does not need to find its way back from the last match.
+
+ * The hierarchy must not be modified while the cursor is used.
+ * With a #SubtreeFilter, folders whose subtree can not contain a match are skipped.
+ */
+class SearchCursor
+{
+public:
+	SearchCursor (SearchQuery query, const Folder *rootFolder, const SubtreeFilter *filter = nullptr);
+	
+	/// @return The next match, or an empty SearchResult if there are no more matches
+	SearchResult next ();
+	
+	/// @return true if the whole hierarchy has been searched
+	bool atEnd () const { return _stack.empty(); }
+private:
+	struct Frame
+	{
+		const Folder *folder;
+		size_t nextEntry;
+		size_t nextSubfolder;
+	};
+	SearchQuery _query;
+	const SubtreeFilter *_filter;
+	std::vector<Frame> _stack;
+
+	bool _mayMatch (const Folder *folder) const;
+};
+
+/**
+ * @brief Find all matching entries in one traversal
+ * @param filter Optional filter of @p rootFolder's hierarchy to skip subtrees without matches
+ * @return All matches in tree order
+ */
+std::vector<SearchResult> findAll (const SearchQuery &query, const Folder *rootFolder, const SubtreeFilter *filter = nullptr);
+
+class ThreadPool;
+
+/**
+ * @brief Find all matching entries using the worker threads of @p pool
+ *
+ * The hierarchy is flattened in tree order and cut into work units of about the same number of entries,
+ * several per thread, so the workers can steal from each other if some units take longer to match.
+ * Small hierarchies are searched serially.
+ * @return All matches in tree order, the same as the serial #findAll
+ */
+std::vector<SearchResult> findAll (const SearchQuery &query, const Folder *rootFolder, ThreadPool &pool);
+
 /**
  * @brief Search for entries in a folder hierarchy incrementally
  * @param searchString The string to search for. If it contains spaces, all words will be searched for independently
  * @param rootFolder Root-node of the hierarchy
+ * @param filter Optional filter of the hierarchy to skip subtrees without matches
  * @return Empty SearchResult-set if no matching entry was found
  */
-SearchResult startSearch (const std::string &searchString, const Folder *rootFolder);
+SearchResult startSearch (const std::string &searchString, const Folder *rootFolder, const SubtreeFilter *filter = nullptr);
 
 /**
  * @brief Continue a search that was previously started with @startSearch
  * @param searchString String to search for. Should be the same as the one for @startSearch
  * @param lastResult reference to the last result of either @startSearch or @continueSearch
+ * @param filter Optional filter of the hierarchy to skip subtrees without matches
  * @return Next result, ort empty SearchResult if no matching entry was found
  */
-SearchResult continueSearch (const std::string &searchString, const SearchResult &lastResult);
+SearchResult continueSearch (const std::string &searchString, const SearchResult &lastResult, const SubtreeFilter *filter = nullptr);
 
 /**
  * @brief Search folder by name in a folder hierarchy.
@@ -147,6 +375,7 @@ SearchResult continueSearch (const std::string &searchString, const SearchResult
  * @return NULL if the folder was not found.
  */
 const Folder *getFolderByPath (const Folder *root, const std::string &search_path);
+Folder *getFolderByPath (Folder *root, const std::string &search_path);
 
 /**
  * @brief Move a folder in the hierarchy
@@ -159,9 +388,10 @@ Folder *moveFolder (Folder *oldFolder, Folder *newParent, int newPosition);
 
 // Impl
 
-Entry::Entry (const std::string &title, const std::string &user, const std::string &url,
-	      const std::string &pwd, const std::string &email, const std::string &comment)
-	: _title(title), _username (user), _url(url), _password (pwd), _email(email), _comment (comment)
+Entry::Entry (std::string title, std::string user, std::string url,
+	      std::string pwd, std::string email, std::string comment)
+	: _title(std::move(title)), _username (std::move(user)), _url(std::move(url)), _password (std::move(pwd)),
+	  _email(std::move(email)), _comment (std::move(comment))
 {}
 
 }
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+
+namespace XKey {
+
+/**
+ * @brief Replace a file atomically and durably
+ *
+ * The new content is written to an unnamed file in the directory of the target (O_TMPFILE), so an interrupted
+ * save leaves nothing behind. Where the file system does not support that, a file named like the target with the
+ * suffix ".tmp." and a random part is used instead. #commit flushes the content, takes over the mode and access ACL
+ * of the file being replaced, moves the new file into place and flushes the directory. Until then the target keeps its previous
+ * content, also when the system crashes; once #commit returns, the new content survives a crash.\n
+ * \n
+ * Usage: write to #fd, for example through a CryptStream created on it, call CryptStream::finish and #commit.
+ */
+class AtomicFile
+{
+public:
+	enum Flags {
+		NONE = 0,
+		/// Always write to a named temporary file, even if unnamed files are supported
+		NAMED_TEMPORARY = 1,
+		/// Do not flush the file and the directory. The replacement stays atomic, but not durable.
+		NO_SYNC = 2,
+		/// Flush the file, but not the directory. Call #syncDirectory after committing several files to it.
+		NO_DIRECTORY_SYNC = 4,
+	};
+
+	/**
+	 * @brief Create the file for the new content of @p path
+	 * @param flags Combination of @ref Flags
+	 * @throw std::runtime_error if the file can not be created
+	 */
+	explicit AtomicFile (const std::string &path, int flags = NONE);
+	/// Discards the new content unless #commit was called
+	~AtomicFile ();
+
+	const std::string &path () const { return _path; }
+
+	/// Descriptor of the file for the new content
+	int fd () const { return _fd; }
+
+	/// @return true if the new content is written to an unnamed file
+	bool isUnnamed () const { return _tmpPath.empty(); }
+
+	/**
+	 * @brief Replace the target file with the new content
+	 *
+	 * A new file gets the mode 0600. The descriptor is closed afterwards.
+	 * @throw std::runtime_error if the content could not be flushed or moved into place. The target is unchanged then.
+	 */
+	void commit ();
+
+	/// Replace the content of @p path with @p data
+	static void write (const std::string &path, const std::string &data, int flags = NONE);
+
+	/// Flush the entries of the directory containing @p path
+	static void syncDirectory (const std::string &path);
+
+private:
+	std::string _path;
+	/// Name of the temporary file, empty for an unnamed file
+	std::string _tmpPath;
+	int _fd;
+	int _flags;
+
+	/// Create a temporary file with a name of its own
+	/// @return Its descriptor
+	int _createNamed ();
+	/// Link the unnamed file to a temporary name, or copy it to a named file if it can not be linked
+	void _name ();
+	void _copyToNamed ();
+
+	AtomicFile (const AtomicFile &) = delete;
+	AtomicFile &operator= (const AtomicFile &) = delete;
+};
+
+}
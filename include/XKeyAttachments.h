@@ -0,0 +1,86 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <iosfwd>
+#include <string>
+
+namespace XKey {
+
+/**
+ * @brief Storage for the binary attachments of a keystore
+ *
+ * Attachments are stored out of line: each one is a separate blob file in a directory next to the keystore
+ * (see #directoryName). Entries only carry an #Attachment reference, so attachments are neither loaded
+ * with the keystore, nor searched, nor rewritten when the keystore is saved.\n
+ * \n
+ * Every blob is encrypted and authenticated with its own random key (see RecordCipher), which is
+ * stored in the attachment reference inside the encrypted keystore. The blob directory therefore
+ * does not depend on the keystore passphrase.
+ * Content is processed in chunks of #ChunkSize bytes, so blobs are streamed to and from disk
+ * and never held in memory as a whole.
+ */
+class AttachmentStore
+{
+public:
+	/// Size of the plaintext chunks blobs are encrypted in
+	static const size_t ChunkSize = 64 * 1024;
+
+	/// @param keystoreFile Path to the keystore file the attachments belong to
+	explicit AttachmentStore (const std::string &keystoreFile);
+
+	/// @return Path of the attachment directory belonging to @p keystoreFile
+	static std::string directoryName (const std::string &keystoreFile);
+
+	const std::string &directory () const { return _dir; }
+
+	/**
+	 * @brief Encrypt the content of @p in into a new blob
+	 * @param name Name to show for the attachment
+	 * @return Reference to the new blob. Add it to an entry with Entry::addAttachment.
+	 */
+	Attachment add (const std::string &name, std::istream &in);
+
+	/// Add the content of the file at @p path as attachment, named after the file
+	Attachment addFile (const std::string &path);
+
+	/**
+	 * @brief Decrypt the content of an attachment and write it to @p out
+	 * @throw std::runtime_error if the blob is missing, corrupt or has been tampered with.
+	 * In that case, @p out may already have received part of the content.
+	 */
+	void read (const Attachment &attachment, std::ostream &out) const;
+
+	/// Write the content of an attachment to a new file at @p path, only accessible by the owner
+	void extractFile (const Attachment &attachment, const std::string &path) const;
+
+	/// @return true if the blob of @p attachment exists in the store
+	bool contains (const Attachment &attachment) const;
+
+	/// Delete the blob of @p attachment
+	void remove (const Attachment &attachment);
+
+	/**
+	 * @brief Delete all blobs that are not referenced by any entry in @p root
+	 *
+	 * Call this after the keystore has been saved, so blobs of removed attachments do not pile up.
+	 * @return Number of deleted blobs
+	 */
+	size_t collectGarbage (const Folder &root);
+
+	/**
+	 * @brief Copy all blobs referenced by entries in @p root to @p target, if not present there yet
+	 *
+	 * Needed when the keystore is saved to a different file. Blobs are copied as they are, without re-encryption.
+	 * @return Number of copied blobs
+	 */
+	size_t copyReferenced (const Folder &root, const AttachmentStore &target) const;
+
+private:
+	std::string _dir;
+
+	std::string _blobPath (const std::string &id) const;
+	void _ensureDirectory () const;
+};
+
+}
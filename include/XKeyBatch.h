@@ -0,0 +1,84 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <map>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Group of modifications of a folder hierarchy that is applied as a whole
+ *
+ * Modifications are staged with the methods of this class and only applied by #commit.
+ * Entry indices always refer to the state of the folder before the batch, so e.g. several
+ * selected rows can be removed without adjusting the indices of the following ones.\n
+ * \n
+ * #commit validates all staged operations before changing anything. If an operation is invalid,
+ * it throws and leaves the hierarchy unchanged (rollback). Otherwise the entries of each affected
+ * folder are rebuilt in a single pass and the staged folder moves are performed.\n
+ * \n
+ * Observers of the hierarchy get the individual notifications of all operations, enclosed by
+ * TreeObserver::batchStarted and a single TreeObserver::batchCommitted, so they can defer
+ * expensive updates until the whole batch has been applied.
+ */
+class Batch
+{
+public:
+	/// @param root Root of the hierarchy to modify
+	explicit Batch (Folder *root);
+
+	/// Append @p entry to @p folder
+	void addEntry (Folder *folder, Entry entry);
+	/// Replace the entry at @p index in @p folder
+	void setEntry (Folder *folder, int index, Entry entry);
+	/// Remove the entry at @p index from @p folder
+	void removeEntry (Folder *folder, int index);
+	/// Move the entry at @p index in @p from to the end of @p to, as it is now
+	void moveEntry (Folder *from, int index, Folder *to);
+
+	/**
+	 * @brief Move @p folder to the end of the subfolders of @p newParent
+	 *
+	 * Folder moves are performed in the order they were staged, after all entry modifications.
+	 * Moving folders invalidates pointers to folders of the hierarchy.
+	 */
+	void moveFolder (Folder *folder, Folder *newParent);
+
+	/// @return Number of staged operations
+	size_t size () const { return _size; }
+	bool empty () const { return _size == 0; }
+
+	/**
+	 * @brief Apply all staged operations
+	 * @throw std::invalid_argument if an operation is invalid. The hierarchy is not modified in that case
+	 * and the staged operations are kept.
+	 */
+	void commit ();
+
+	/// Discard all staged operations
+	void rollback ();
+
+private:
+	/// Staged entry modifications of one folder
+	struct FolderChanges
+	{
+		std::vector<int> removed;
+		std::map<int, Entry> changed;
+		std::vector<Entry> added;
+	};
+
+	Folder *_root;
+	std::map<Folder*, FolderChanges> _changes;
+	std::vector<std::pair<Folder*, Folder*>> _moves;
+	size_t _size;
+
+	void _checkFolder (const Folder *folder) const;
+	void _applyEntryChanges (const std::vector<TreeObserver*> *observers);
+	std::vector<std::pair<std::vector<int>, std::vector<int>>> _planMoves () const;
+
+	Batch (const Batch &) = delete;
+	Batch &operator= (const Batch &) = delete;
+};
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace XKey {
+
+class BinaryKeystore;
+class ThreadPool;
+
+/**
+ * @brief Unowned reference to a string inside a #BinaryKeystore
+ *
+ * Valid as long as the keystore it was taken from.
+ */
+class StringView
+{
+public:
+	StringView () : _data(""), _size(0) { }
+	StringView (const char *data, size_t size) : _data(data), _size(size) { }
+
+	const char *data () const { return _data; }
+	size_t size () const { return _size; }
+	bool empty () const { return _size == 0; }
+	/// Copy the string
+	std::string str () const { return std::string (_data, _size); }
+
+	bool operator== (const std::string &other) const { return other.size() == _size && memcmp (other.data(), _data, _size) == 0; }
+	bool operator!= (const std::string &other) const { return !(*this == other); }
+private:
+	const char *_data;
+	size_t _size;
+};
+
+inline std::ostream &operator<< (std::ostream &out, const StringView &s) {
+	return out.write (s.data(), s.size());
+}
+
+/// Read-only key entry inside a #BinaryKeystore
+class EntryView
+{
+public:
+	StringView title () const { return _field (0); }
+	StringView username () const { return _field (1); }
+	StringView url () const { return _field (2); }
+	StringView password () const { return _field (3); }
+	StringView email () const { return _field (4); }
+	StringView comment () const { return _field (5); }
+
+	size_t attachmentCount () const;
+	/// @return A copy of the attachment reference at @p index
+	Attachment attachment (size_t index) const;
+
+	/// @return A copy of the entry
+	Entry toEntry () const;
+private:
+	friend class FolderView;
+	EntryView (const BinaryKeystore *store, uint32_t index) : _store(store), _index(index) { }
+	StringView _field (int field) const;
+
+	const BinaryKeystore *_store;
+	uint32_t _index;
+};
+
+/// Read-only folder inside a #BinaryKeystore
+class FolderView
+{
+public:
+	StringView name () const;
+
+	size_t entryCount () const;
+	EntryView entry (size_t index) const;
+
+	size_t subfolderCount () const;
+	FolderView subfolder (size_t index) const;
+	/// Find the subfolder named @p name. @return false if there is none.
+	bool findSubfolder (const std::string &name, FolderView *subfolder) const;
+private:
+	friend class BinaryKeystore;
+	FolderView (const BinaryKeystore *store, uint32_t index) : _store(store), _index(index) { }
+
+	const BinaryKeystore *_store;
+	uint32_t _index;
+};
+
+/**
+ * @brief Keystore cleartext in the binary body format, accessed in place
+ *
+ * An alternative to the Json body that needs neither parsing nor escaping (see Writer::WRITE_BINARY).
+ * All numbers are little-endian:
+ *
+ *     magic "XKB1", uint64 size of the following data
+ *     uint32 number of folders, entries, attachments; uint64 size of the string blob
+ *     folder table:     name, uint32 first entry, entry count, first subfolder, subfolder count
+ *     entry table:      title, username, url, password, email, comment, uint32 first attachment, attachment count
+ *     attachment table: id, name, key, uint64 size
+ *     string blob
+ *
+ * Strings are stored as uint32 offset into the blob and uint32 length. The folders are stored breadth-first,
+ * starting with the root, so the subfolders of a folder are consecutive, as are its entries and their attachments.\n
+ * \n
+ * All tables are validated when the keystore is loaded. The views then point straight into the cleartext,
+ * so read-only consumers like listings and lookups do not allocate memory per folder or entry.
+ * The cleartext is wiped when the keystore is destroyed.
+ */
+class BinaryKeystore
+{
+public:
+	/// First bytes of the binary body. A Json body can not start with them.
+	static const char Magic[4];
+
+	/**
+	 * @brief Read the binary body from @p in
+	 * @throw std::runtime_error if the body is truncated or its tables are inconsistent
+	 */
+	explicit BinaryKeystore (std::istream &in);
+	/// Take the complete binary body from @p body, starting with #Magic
+	explicit BinaryKeystore (std::string body);
+	~BinaryKeystore ();
+
+	/// @return true if the next character of @p in starts a binary body, without consuming it
+	static bool detect (std::istream &in);
+
+	/// Write the hierarchy below @p root in the binary body format
+	static void write (std::ostream &out, const Folder &root);
+
+	FolderView root () const { return FolderView (this, 0); }
+
+	/**
+	 * @brief Read a binary body from @p in into the folder hierarchy below @p root
+	 * @param lazy Only create the folders. Their entries are copied from the cleartext, which is kept in memory,
+	 *   when they are first accessed (see Folder::setEntrySource).
+	 */
+	static void read (std::istream &in, Folder *root, bool lazy);
+
+	/**
+	 * @brief Read the binary body @p body into the folder hierarchy below @p root
+	 *
+	 * The top-level folders are copied on the workers of @p pool, each into a hierarchy of its own,
+	 * and moved below @p root in their order afterwards. Observers of @p root are only notified
+	 * of the top-level folders.
+	 */
+	static void read (std::string body, Folder *root, bool lazy, ThreadPool &pool);
+
+	BinaryKeystore (const BinaryKeystore &) = delete;
+	BinaryKeystore &operator= (const BinaryKeystore &) = delete;
+private:
+	friend class EntryView;
+	friend class FolderView;
+
+	std::string _data;
+	uint32_t _folderCount, _entryCount, _attachmentCount;
+	const char *_folders, *_entries, *_attachments, *_strings;
+	uint64_t _stringsSize;
+
+	StringView _string (const char *ref) const;
+	void _validate ();
+};
+
+}
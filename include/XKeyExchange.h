@@ -0,0 +1,66 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <iostream>
+#include <string>
+
+namespace XKey {
+
+/**
+ * @brief Formats to exchange key entries with other password managers
+ *
+ * All formats carry the folder of each entry and its title, username, password, URL, email and comment.
+ * Attachments are not exchanged.
+ */
+enum class ExchangeFormat
+{
+	/**
+	 * Comma-separated values as in RFC 4180, with a header row. Written with the columns
+	 * `group,title,username,password,url,email,comment`, where the group is the folder path like `/Team/Servers`.
+	 * When reading, the columns are recognized by their name in any order, including the names used by
+	 * common password managers (e.g. `name`, `login_username`, `notes`). Other columns are ignored.
+	 */
+	CSV,
+	/**
+	 * Newline-delimited Json: one object per line with the members of a keystore entry
+	 * and the folder path as `path`, like `{"path":"/Team/Servers","title":"db",...}`.
+	 */
+	NDJSON,
+	/**
+	 * XML as exported by KeePass 2 ("KeePass XML (2.x)"). Groups map to folders. The standard fields
+	 * map to the entry fields, the field `Email` to the email address. Other fields are appended to the comment.
+	 * Entry histories, metadata and deleted objects are skipped.
+	 */
+	KEEPASS_XML,
+};
+
+/**
+ * @brief Format by name
+ * @param name `csv`, `ndjson` or `keepass`, or a file name ending with `.csv`, `.ndjson`, `.jsonl` or `.xml`
+ * @throw std::invalid_argument if the format is not known
+ */
+ExchangeFormat exchangeFormatFromName (const std::string &name);
+
+/**
+ * @brief Import key entries from @p in into the hierarchy below @p target
+ *
+ * The records are read and decoded one after another, so only one record is held in memory besides the
+ * hierarchy. Folders are created as needed below @p target. The entries are inserted with a #Batch per
+ * few thousand records. Records without a folder go into @p target itself, or into the subfolder
+ * `Imported` if @p target is the root folder, which does not keep entries.\n
+ * If a record can not be read, the records before it remain imported.
+ * @return Number of imported entries
+ * @throw std::runtime_error if the input is invalid, with the line number of the error
+ */
+size_t importEntries (std::istream &in, ExchangeFormat format, Folder *target);
+
+/**
+ * @brief Write all entries below @p root to @p out
+ *
+ * The records are written while traversing the hierarchy. Folder paths are relative to @p root.
+ * @return Number of exported entries
+ */
+size_t exportEntries (std::ostream &out, ExchangeFormat format, const Folder &root);
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Fuzzy search string that ranks entries by relevance
+ *
+ * Each space-separated word of the search string matches a field if its characters occur in the field
+ * in the same order, not necessarily next to each other (ignoring case). The match is scored like in fzf:
+ * every matched character counts, characters at the beginning of words and runs of consecutive characters
+ * get a bonus and gaps inside the match cost a penalty. The score of a word is that of its best field,
+ * weighted by the field: title matches count most, followed by URL, user name and email, and comment.\n
+ * The score of an entry is the sum of the scores of its words. Like #SearchQuery, an entry matches if any word matches.
+ */
+class FuzzyQuery
+{
+public:
+	/// @param searchString The words to search for, separated by spaces
+	explicit FuzzyQuery (const std::string &searchString);
+
+	/**
+	 * @brief Score an entry
+	 * @param minScore Stop scoring as soon as the entry can not get a score above @p minScore
+	 * @return The score of the entry, or 0 if it does not match or can not score above @p minScore
+	 */
+	int score (const Entry &entry, int minScore = 0) const;
+
+	bool empty () const { return _tokens.empty(); }
+private:
+	struct Token
+	{
+		std::string text;
+		bool ascii;
+		/// Highest possible unweighted score of the token in a field
+		int maxScore;
+	};
+	std::vector<Token> _tokens;
+	/// Highest possible score of all tokens
+	int _maxScore;
+};
+
+/// An entry found by a fuzzy search, with its score
+struct RankedResult
+{
+	SearchResult result;
+	int score;
+};
+
+/**
+ * @brief Find the @p count best matching entries in a folder hierarchy
+ *
+ * Only the best @p count entries found so far are kept. Entries are scored against the lowest of those,
+ * so most entries are rejected after the first few fields.
+ * @return The best matches, highest score first. Matches with equal scores are in tree order.
+ */
+std::vector<RankedResult> findBest (const FuzzyQuery &query, const Folder *rootFolder, size_t count);
+
+/// Rank the given results, e.g. the substring matches found by a #SearchIndex, and keep the best @p count
+std::vector<RankedResult> findBest (const FuzzyQuery &query, const std::vector<SearchResult> &candidates, size_t count);
+
+/**
+ * @brief Order all @p candidates by relevance, e.g. to step through every substring match found by a #SearchIndex
+ * @return The candidates matched by @p query, highest score first, followed by the others. Equal scores keep their order.
+ */
+std::vector<SearchResult> rankAll (const FuzzyQuery &query, const std::vector<SearchResult> &candidates);
+
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Thread-safe handle to a folder hierarchy
+ *
+ * The handle owns a sequence of immutable versions of the keystore tree.\n
+ * Any number of reader threads can acquire a #ReadLock and work on the version
+ * that was current at that time, without ever blocking on a mutex.
+ * A single writer at a time applies mutations to a private copy of the tree and
+ * publishes the result as the new current version.\n
+ * \n
+ * Old versions are reclaimed with epoch based reclamation: a version that has been
+ * replaced is only deleted after every reader that could still see it has released its lock.\n
+ * \n
+ * The version replaced by a write is not deleted but reused by the next one: once no reader can see it
+ * anymore, only the folders changed by the last write are copied into it, so a write costs about the size
+ * of the modified folders rather than the size of the whole tree.
+ */
+class KeystoreHandle
+{
+public:
+	/// Maximum number of concurrently held read locks. Further readers spin until a slot is free.
+	static const int MaxReaders = 64;
+
+	/**
+	 * @brief Guard for read access to one version of the keystore
+	 *
+	 * The folder hierarchy returned by #root stays valid and unchanged until the lock is destroyed.
+	 * Read locks must not outlive the handle they were acquired from.
+	 */
+	class ReadLock
+	{
+	public:
+		ReadLock (ReadLock &&o);
+		~ReadLock ();
+
+		const Folder &root () const { return *_root; }
+		const Folder *operator-> () const { return _root; }
+
+		/// Version number of the tree this lock refers to
+		uint64_t version () const { return _version; }
+	private:
+		ReadLock (const KeystoreHandle *handle, int slot);
+
+		const KeystoreHandle *_handle;
+		const Folder *_root;
+		uint64_t _version;
+		int _slot;
+
+		ReadLock (const ReadLock &) = delete;
+		ReadLock &operator= (const ReadLock &) = delete;
+		friend class KeystoreHandle;
+	};
+
+	/**
+	 * @brief Create a handle that takes ownership of a folder hierarchy
+	 * @param root Initial version of the tree. Must be a root folder.
+	 * Lazily loaded folders are decoded (see Folder::materialize) before the tree is shared.
+	 */
+	explicit KeystoreHandle (RootFolder_Ptr root);
+	/// All read locks must have been released before destroying the handle
+	~KeystoreHandle ();
+
+	/// Acquire read access to the current version of the tree
+	ReadLock read () const;
+
+	/**
+	 * @brief Apply a mutation to the tree and publish the result
+	 * @param mutation Function that modifies the given (private) copy of the current tree.
+	 * If it throws, nothing is published and the exception is passed on.
+	 * @return Version number of the published tree
+	 *
+	 * Writers are serialized. The mutation works on a private copy of the current version. That is the
+	 * previous version brought up to date if no reader holds it anymore, otherwise a deep copy.\n
+	 * The mutation must modify the tree through the Folder API or a #Batch, so its changes are reported
+	 * to observers (see TreeObserver). Adding, removing or moving a folder copies the whole subtree of its
+	 * parent into the next version, modifying entries or renaming a folder only that folder.
+	 */
+	uint64_t write (const std::function<void(Folder *root)> &mutation);
+
+	/**
+	 * @brief Replace the whole tree with a new hierarchy
+	 *
+	 * Like the constructor, this decodes all lazily loaded folders of @p newRoot.
+	 * @return Version number of the published tree
+	 */
+	uint64_t replace (RootFolder_Ptr newRoot);
+
+	/// Version number of the most recently published tree
+	uint64_t version () const;
+
+	/**
+	 * @brief Delete all replaced versions that are no longer visible to any reader
+	 *
+	 * This is called automatically after each write.
+	 * @return Number of versions still waiting for readers to leave
+	 */
+	size_t collect ();
+
+private:
+	struct Version
+	{
+		RootFolder_Ptr root;
+		uint64_t number;
+	};
+
+	struct alignas(64) ReaderSlot
+	{
+		/// Epoch observed by the reader in this slot, or 0 if the slot is unused
+		std::atomic<uint64_t> epoch;
+	};
+
+	std::atomic<Version*> _current;
+	mutable std::atomic<uint64_t> _globalEpoch;
+	mutable ReaderSlot _readers[MaxReaders];
+
+	std::mutex _writeMutex;
+	/// Replaced versions with the epoch after which they became invisible
+	std::vector<std::pair<uint64_t, Version*>> _retired;
+	/// Version replaced by the last write, with the epoch after which it became invisible
+	std::pair<uint64_t, Version*> _spare;
+	/// Folders changed by the last write, by their rows from the root. Mapped to true if their subfolders changed.
+	std::map<std::vector<int>, bool> _changes;
+
+	uint64_t _publish (RootFolder_Ptr newRoot, bool keepSpare);
+	/// @return A copy of the current version for the next write
+	RootFolder_Ptr _writableCopy ();
+	size_t _collect ();
+	/// @return Lowest epoch observed by a current reader, or UINT64_MAX if there is none
+	uint64_t _oldestReader () const;
+	int _acquireSlot () const;
+	void _releaseSlot (int slot) const;
+
+	KeystoreHandle (const KeystoreHandle &) = delete;
+	KeystoreHandle &operator= (const KeystoreHandle &) = delete;
+};
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "XKey.h"
+#include "CryptStream.h"
+
+#include <memory>
+#include <string>
+
+namespace Json { class Value; }
+
+namespace XKey {
+
+class RecordCipher;
+
+/**
+ * @brief Append-only change journal for incremental saves
+ *
+ * A journal is a sidecar file next to the keystore (see #fileName) that stores the modifications
+ * made since the keystore file (the "base image") was last written completely.
+ * Each #commit appends one small record with all changes recorded since the previous commit,
+ * instead of rewriting the whole keystore.\n
+ * \n
+ * Records are encrypted and authenticated with a #RecordCipher. Every record's MAC also covers the MAC
+ * of its predecessor, so records can neither be modified, reordered nor removed from the middle of the journal.
+ * The journal header references the base image by its IV (see CryptStream::iv()); a journal written for
+ * another version of the keystore is ignored.\n
+ * \n
+ * Folders are addressed by their row path from the root, entries by their index within the folder.
+ * Replaying the records in order on top of the base image restores the saved state.\n
+ * \n
+ * Usage: register the journal as #TreeObserver at the root folder to record changes.
+ * Once the journal grows beyond the compaction threshold, write the whole keystore again and
+ * start a fresh journal with #reset.
+ */
+class Journal
+	: public TreeObserver
+{
+public:
+	/// Default journal size in bytes after which #needsCompaction returns true
+	static const size_t DEFAULT_COMPACTION_THRESHOLD = 1024 * 1024;
+
+	/// @param keystoreFile Path to the keystore file the journal belongs to
+	explicit Journal (const std::string &keystoreFile);
+	~Journal ();
+
+	/// @return Path of the journal file belonging to @p keystoreFile
+	static std::string fileName (const std::string &keystoreFile);
+
+	enum OpenMode {
+		/// Take new records after opening. A record whose appending was interrupted is cut off the file.
+		READ_WRITE,
+		/// Only replay the journal. The file is not modified and the journal stays closed.
+		READ_ONLY
+	};
+
+	/**
+	 * @brief Open an existing journal and replay it on top of the base image
+	 *
+	 * All records are decrypted and checked against the hierarchy before the first one is applied,
+	 * so @p root is left unchanged if the journal is corrupt.
+	 * @param passphrase Passphrase of the keystore
+	 * @param baseId Identifier of the base image (the IV of the keystore file)
+	 * @param root Root folder of the base image. The journalled changes are applied to it.
+	 * @return Number of replayed records. 0 if there is no journal or it belongs to a different base image.
+	 * In that case, the journal stays closed until #reset is called.
+	 * @throw std::runtime_error if the journal is corrupt or has been tampered with
+	 */
+	size_t open (const std::string &passphrase, const std::string &baseId, Folder *root, OpenMode mode = READ_WRITE);
+
+	/**
+	 * @brief Start a new, empty journal for a freshly written base image
+	 *
+	 * Replaces any previous journal file and discards pending changes.
+	 */
+	void reset (const std::string &passphrase, const std::string &baseId,
+	            int keyIterationCount = CryptStream::DEFAULT_KEY_ITERATION_COUNT);
+
+	/// Delete the journal file of @p keystoreFile, if there is one
+	static void remove (const std::string &keystoreFile);
+
+	/// @return true if the journal file of @p keystoreFile contains any records
+	static bool hasRecords (const std::string &keystoreFile);
+
+	/// @return true if the journal can take new records (after a successful #open or #reset)
+	bool isOpen () const { return _cipher != nullptr; }
+
+	/// @return true if changes have been recorded since the last #commit
+	bool hasPendingChanges () const;
+
+	/// Forget all recorded, uncommitted changes
+	void discardPendingChanges ();
+
+	/**
+	 * @brief Append all pending changes as one record to the journal file
+	 *
+	 * The record is flushed to disk before this method returns.
+	 */
+	void commit ();
+
+	/// @return Size of the journal file in bytes
+	size_t size () const { return _size; }
+
+	void setCompactionThreshold (size_t bytes) { _threshold = bytes; }
+
+	/// @return true if the journal grew too large and the keystore should be written completely again
+	bool needsCompaction () const { return _size > _threshold; }
+
+	/// @return true if @p passphrase is the passphrase the journal is encrypted with
+	bool matchesPassphrase (const std::string &passphrase) const;
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderAdded (const Folder &folder) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderRenamed (const Folder &folder, const std::string &oldName) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+
+private:
+	std::string _file;
+	std::unique_ptr<RecordCipher> _cipher;
+	/// MAC of the last record, or the header for an empty journal
+	std::string _chain;
+	size_t _size;
+	size_t _threshold;
+	std::unique_ptr<Json::Value> _pending;
+	bool _replaying;
+
+	void _record (Json::Value &&op);
+
+	Journal (const Journal &) = delete;
+	Journal &operator= (const Journal &) = delete;
+};
+
+}
@@ -1,34 +1,164 @@
 #pragma once
 
+#include "XKey.h"
+
 #include <string>
 #include <iostream>
+#include <streambuf>
+#include <unordered_map>
+#include <vector>
 
 namespace Json { class Value; }
 
 namespace XKey {
 
-class Folder;
+class ThreadPool;
 
 /**
  * @brief Reader to parse XKey structures from cleartext streams
+ *
+ * Reads both the Json body and the binary body format (see BinaryKeystore).
  */
 class Parser
 {
 public:
+	enum ReaderFlags {
+		/**
+		 * Decode the stream directly into the folder hierarchy while reading it in chunks.
+		 * Memory use stays close to the size of the resulting hierarchy.
+		 */
+		READ_NONE = 0,
+		/**
+		 * Only build the folder hierarchy while reading.
+		 * The entries of each folder are decoded when they are first accessed (see Folder::setEntrySource).
+		 * The cleartext is kept in memory until all folders have been decoded.
+		 */
+		READ_LAZY = 1,
+	};
+
+	/**
+	 * @brief Read a folder hierarchy from a cleartext stream
+	 * @param in Stream to read from
+	 * @param root Root folder to add the folders of the stream to
+	 * @param flags Combination of @ref ReaderFlags
+	 * @return false if the stream could not be read. See #error for details.
+	 */
+	bool read (std::istream &in, Folder *root, int flags = READ_NONE);
+
 	/**
-	 * 
+	 * @brief Read a folder hierarchy, decoding its top-level folders in parallel
+	 *
+	 * The cleartext is read into memory first. A #CryptStream is decrypted on the workers of @p pool
+	 * (see CryptStream::readAll). The top-level folders are then decoded on the workers, each into a
+	 * hierarchy of its own, and moved below @p root in their order. With #READ_LAZY, only the folders
+	 * are built in parallel. Observers of @p root are only notified of the top-level folders.\n
+	 * A Json body written with Writer::WRITE_SUBTREE_INDEX is split at the recorded byte ranges. Without
+	 * the index, the top-level folders have to be skipped over once to find them.
 	 */
-	bool read (std::istream &in, Folder *root);
+	bool read (std::istream &in, Folder *root, ThreadPool &pool, int flags = READ_NONE);
 
 	const std::string& error () const;
+
+	/// Create a key entry from its Json representation
+	static Entry parseEntry (const Json::Value &key_entry);
+
+	/// Position of a key entry in the cleartext of a keystore
+	struct EntryLocation
+	{
+		/// Path of the folder containing the entry, like Folder::fullPath
+		std::string folderPath;
+		/// Byte range of the Json object of the entry
+		size_t begin, end;
+	};
+
+	/**
+	 * @brief Find all key entries in the cleartext of a keystore without decoding them
+	 * @return The entries in tree order
+	 * @throw std::runtime_error if @p text is not a valid keystore
+	 */
+	static std::vector<EntryLocation> locateEntries (const std::string &text);
 private:
-	void parse_folder (const Json::Value &folder, Folder *parent);
-	void parse_folder_list (const Json::Value &item, Folder *parent);
-	void parse_key (const Json::Value &key_entry, Folder *parent);
+	void read_stream (std::istream &in, Folder *root);
+	void read_lazy (std::istream &in, Folder *root);
 	
 	std::string errorMsg;
 };
 
+/**
+ * @brief Stream buffer that keeps the written cleartext in memory
+ *
+ * Used where the cleartext is needed after writing it, like for TokenIndex::write. The buffer is wiped when
+ * it is destroyed, and the previous storage is wiped whenever it grows, so no copies are left behind.
+ */
+class CleartextBuffer
+	: public std::streambuf
+{
+public:
+	CleartextBuffer () { }
+	~CleartextBuffer ();
+
+	/// @return Everything written so far
+	const std::string &text () const { return _text; }
+
+	CleartextBuffer (const CleartextBuffer &) = delete;
+	CleartextBuffer &operator= (const CleartextBuffer &) = delete;
+protected:
+	std::streamsize xsputn (const char *s, std::streamsize n) override;
+	int_type overflow (int_type c) override;
+private:
+	std::string _text;
+
+	/// Make room for @p n more bytes
+	void _reserve (size_t n);
+};
+
+/**
+ * @brief Serialized entries of the folders of a hierarchy, reused when it is written again
+ *
+ * Register the cache as #TreeObserver at the root folder and pass it to each Writer::write. The writer stores
+ * the Json array of the entries of each folder it serializes, and copies it verbatim on the next write if
+ * the entries of the folder were not modified since. Only the folders themselves, which are small, and the
+ * entries of modified folders are encoded again, so saving after an edit takes time in proportion to the
+ * edit rather than to the keystore.\n
+ * \n
+ * Renaming or moving folders keeps their fragments. Modifications made directly through the non-const
+ * containers are not reported, call #invalidate after them.\n
+ * \n
+ * The fragments hold the cleartext of the entries. They are wiped when they are discarded.
+ */
+class SerializationCache
+	: public TreeObserver
+{
+public:
+	SerializationCache () { }
+	~SerializationCache ();
+
+	/// @return The serialized entries of @p folder, or nullptr if the folder was modified since it was written
+	const std::string *fragment (const Folder &folder) const;
+	/// Store the serialized entries of @p folder, used by Writer::write
+	void setFragment (const Folder &folder, std::string fragment);
+
+	/// Discard the fragment of @p folder
+	void invalidate (const Folder &folder);
+	/// Discard all fragments
+	void clear ();
+
+	/// @return Size of all fragments in bytes
+	size_t memoryUsage () const;
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+
+	SerializationCache (const SerializationCache &) = delete;
+	SerializationCache &operator= (const SerializationCache &) = delete;
+private:
+	/// Json arrays of the entries by Folder::id
+	std::unordered_map<uint64_t, std::string> _fragments;
+};
+
 /**
  * @brief Writer to write XKey structures to cleartext streams
  */
@@ -39,9 +169,25 @@ public:
 		WRITE_NONE = 0,
 		/// Write formatted Json output
 		WRITE_FORMATTED = 1,
+		/// Write the binary body format instead of Json, see BinaryKeystore
+		WRITE_BINARY = 2,
+		/**
+		 * Record the byte range of each top-level folder at the end of the Json root object,
+		 * so Parser::read can split the cleartext between threads without scanning it first.
+		 */
+		WRITE_SUBTREE_INDEX = 4,
 	};
 
-	bool write (std::ostream &out, const Folder &root, int flags = WRITE_NONE);
+	/**
+	 * @brief Write the folder hierarchy below @p root to @p out
+	 *
+	 * The Json text is written while traversing the hierarchy, without building it in memory first.
+	 * The entries of lazily loaded folders that were never decoded are copied from the cleartext they were
+	 * loaded from (see Parser::READ_LAZY), unless the output is formatted.
+	 * @param cache Fragments of the previous write to reuse, and to update. Not used for formatted output.
+	 * @return false if the stream could not be written. See #error for details.
+	 */
+	bool write (std::ostream &out, const Folder &root, int flags = WRITE_NONE, SerializationCache *cache = nullptr);
 
 	const std::string& error () const;
 
@@ -66,9 +212,10 @@ public:
 	 * @brief Remove a file from the filesystem
 	 */
 	static void removeFile (const std::string &file);
+
+	/// Write the Json representation of a key entry to @p key
+	static void serializeEntry (Json::Value &key, const Entry &entry);
 private:
-	void serialize_folder (Json::Value &parent, const Folder &folder);
-	
 	std::string errorMsg;
 };
 
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace XKey {
+
+/**
+ * @brief Case-insensitive substring search for one needle
+ *
+ * The needle is case-folded once on construction. For needles consisting of ASCII characters only,
+ * the haystack is scanned with a vectorized kernel (AVX2 or SSE2, selected at runtime, with a scalar fallback)
+ * that compares the first and the last byte of the needle at 16 or 32 positions at once and only verifies
+ * the positions where both match.\n
+ * ASCII needles can not match inside of multi-byte UTF-8 sequences, so this is also correct for UTF-8 text.
+ * Needles with non-ASCII characters are matched by decoding the haystack and folding its code points
+ * (Latin-1, Latin Extended-A, Greek and Cyrillic letters), which is slower.
+ */
+class SubstringMatcher
+{
+public:
+	explicit SubstringMatcher (const std::string &needle);
+
+	/// @return true if the needle occurs in @p haystack, ignoring case
+	bool matches (const char *haystack, size_t length) const;
+	bool matches (const std::string &haystack) const { return matches (haystack.data(), haystack.size()); }
+
+	/// @return The case-folded needle
+	const std::string &needle () const { return _needle; }
+
+	/// @return Name of the kernel used for ASCII needles on this machine: "avx2", "sse2" or "scalar"
+	static const char *implementation ();
+
+	/// Convert the letters of UTF-8 text to lower case, as done for the needle and for non-ASCII matching
+	static std::string foldCase (const std::string &text);
+private:
+	std::string _needle;
+	bool _ascii;
+};
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace XKey {
+
+/// SHA-256 digest of an entry or a subtree
+typedef std::array<unsigned char, 32> ContentHash;
+
+/**
+ * @brief Content hashes of all folders of a hierarchy, kept up to date while it is modified
+ *
+ * The hash of an entry covers all its fields and attachment references. The hash of a folder covers its name,
+ * the hashes of its entries and the hashes of its subfolders, in their order. Two folders with the same hash
+ * therefore have the same content, and comparing two hierarchies only needs to descend into the subfolders
+ * whose hashes differ (see #diffTrees).\n
+ * \n
+ * Register the tree as #TreeObserver at the root folder. A modification updates the entry hashes of the
+ * affected folder and marks the folder and its ancestors, so only the hashes along the modified paths are
+ * computed again when they are needed next. Entries changed in a #Batch are hashed again per folder.
+ * Modifications made directly through the non-const containers are not reported, call #invalidate after them.\n
+ * Hashing accesses all entries, so lazily loaded folders are decoded. Not thread-safe.
+ */
+class MerkleTree
+	: public TreeObserver
+{
+public:
+	/// Hash the hierarchy below @p root
+	explicit MerkleTree (const Folder &root);
+
+	/// @return The hash of @p folder, which must be part of the hierarchy
+	const ContentHash &hash (const Folder &folder) const;
+	const ContentHash &rootHash () const { return hash (*_root); }
+	/// @return The hashes of the entries of @p folder, in their order
+	const std::vector<ContentHash> &entryHashes (const Folder &folder) const;
+
+	/// Hash the entries of @p folder again, and compute its hash and the ones of its ancestors when needed
+	void invalidate (const Folder &folder);
+
+	static ContentHash hashEntry (const Entry &entry);
+	/// @return The hash as 64 hex digits
+	static std::string toHex (const ContentHash &hash);
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderAdded (const Folder &folder) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderRenamed (const Folder &folder, const std::string &oldName) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+	void batchStarted (const Folder &root) override;
+	void batchCommitted (const Folder &root, size_t operations) override;
+
+private:
+	struct Node
+	{
+		/// Hashes of the entries, in their order
+		std::vector<ContentHash> entries;
+		ContentHash hash;
+		/// #entries has to be computed again
+		bool entriesDirty;
+		/// #hash has to be computed again
+		bool dirty;
+	};
+
+	const Folder *_root;
+	/// Nodes by Folder::id
+	mutable std::unordered_map<uint64_t, Node> _nodes;
+	/// Inside a #Batch the entry notifications refer to the reordered lists, so the entries are hashed again
+	bool _inBatch;
+
+	Node &_node (const Folder &folder) const;
+	void _markDirty (const Folder *folder);
+	void _erase (const Folder &folder);
+};
+
+/// A difference between two hierarchies, as found by #diffTrees
+struct TreeDifference
+{
+	enum Kind { ENTRY_ADDED, ENTRY_REMOVED, ENTRY_CHANGED, FOLDER_ADDED, FOLDER_REMOVED };
+
+	Kind kind;
+	/// Path of the folder containing the entry, or of the added or removed folder
+	std::string path;
+	/// The entry in the first and in the second hierarchy, nullptr if it does not exist there
+	const Entry *before, *after;
+};
+
+/**
+ * @brief Compare two hierarchies
+ *
+ * Folders are matched by name, and only subfolders with different hashes are compared. Within a folder,
+ * identical entries are matched first and the remaining ones by title, in their order. Entries that are
+ * left over in @p a were removed, those in @p b were added. Added or removed folders are reported as a whole.\n
+ * The entry pointers are valid as long as the hierarchies are not modified.
+ */
+std::vector<TreeDifference> diffTrees (const Folder &a, const MerkleTree &hashesA, const Folder &b, const MerkleTree &hashesB);
+
+/// An entry or folder both sides of a #mergeTrees changed in different ways
+struct MergeConflict
+{
+	/// Path of the folder containing the entry, or of the folder
+	std::string path;
+	/// Title of the entry, empty for a folder
+	std::string title;
+	/// What happened on both sides, like "changed on both sides"
+	std::string reason;
+};
+
+/**
+ * @brief Three-way merge of two hierarchies that were both modified from @p base
+ *
+ * Folders are matched by name, entries by title (the n-th entry with a title matches the n-th one in the other
+ * hierarchies). Changes made on only one side are taken over, changes made identically on both sides once.
+ * Subtrees whose hashes show that one side did not change them are taken from the other side as a whole.\n
+ * If both sides changed an entry differently, the version of @p ours is kept. If one side removed an entry or
+ * folder that the other side changed, the changed version is kept. Both cases are reported in @p conflicts.\n
+ * Entries keep the order of @p ours, followed by the entries only added in @p theirs.
+ * @return The merged hierarchy
+ */
+RootFolder_Ptr mergeTrees (const Folder &base, const Folder &ours, const Folder &theirs, std::vector<MergeConflict> *conflicts);
+
+}
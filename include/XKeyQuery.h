@@ -0,0 +1,72 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Search query with field qualifiers and boolean operators, compiled into an evaluation plan
+ *
+ * Syntax:
+ * - `word` matches entries containing the word in any field, ignoring case
+ * - `"some words"` matches the phrase including its spaces
+ * - `title:word`, `user:word`, `url:word`, `email:word`, `comment:word` only look at that field
+ *   (`username:`, `mail:` and `note:` are accepted as well). The text after the colon can be quoted.
+ *   Words with an unknown qualifier, like `https://host`, are searched as they are.
+ * - `-term` or `NOT term` excludes entries matching the term
+ * - Terms separated by spaces or `AND` must all match, `OR` (or `|`) binds weaker than AND
+ * - Parentheses group terms: `(url:github OR url:gitlab) -title:old`
+ *
+ * The query is parsed once into a tree of predicates. The operands of AND and OR are ordered by their
+ * estimated cost and selectivity, so the predicates that are cheap to evaluate and most likely decide
+ * the result are tested first. Longer words and fewer fields are considered more selective and cheaper.
+ */
+class QueryPlan
+{
+public:
+	enum Field {
+		TITLE = 1, USERNAME = 2, URL = 4, EMAIL = 8, COMMENT = 16,
+		ALL_FIELDS = TITLE | USERNAME | URL | EMAIL | COMMENT
+	};
+
+	/// @throws std::invalid_argument if the query has a syntax error
+	explicit QueryPlan (const std::string &query);
+
+	/// @return true if @p entry matches the query
+	bool matches (const Entry &entry) const;
+
+	/// @return All matching entries in tree order
+	std::vector<SearchResult> findAll (const Folder *rootFolder) const;
+
+	/// @return The plan in evaluation order, e.g. `AND(url:"github", NOT(title:"old"))`
+	std::string describe () const;
+
+	/// @return true if @p query uses any syntax beyond plain words, i.e. it would match differently than #SearchQuery
+	static bool hasOperators (const std::string &query);
+private:
+	enum Kind { TERM, AND, OR, NOT };
+	struct Node
+	{
+		Kind kind;
+		int fields;
+		/// Index into _matchers for terms
+		size_t matcher;
+		std::vector<size_t> children;
+		/// Estimated cost of evaluating the node, and probability that it matches
+		double cost, selectivity;
+	};
+	std::vector<Node> _nodes;
+	std::vector<SubstringMatcher> _matchers;
+	size_t _root;
+
+	bool _evaluate (size_t node, const Entry &entry) const;
+	void _describe (size_t node, std::string *out) const;
+	void _optimize (size_t node);
+
+	friend class QueryParser;
+};
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "XKey.h"
+#include "CryptStream.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+class RecordCipher;
+class SerializationCache;
+
+/**
+ * @brief Encrypted history of the saved versions of a keystore
+ *
+ * The revisions are stored in a directory next to the keystore (see #directoryName). Each revision is the
+ * Json cleartext of the keystore, stored either completely (a checkpoint) or as binary delta against the
+ * revision before it, which only holds the byte ranges that changed. The history therefore grows with the
+ * size of the changes rather than with the size of the keystore. A checkpoint is written every
+ * #checkpointInterval revisions, so restoring a revision applies at most that many deltas.\n
+ * \n
+ * Revision files are encrypted and authenticated with a #RecordCipher derived from the passphrase. An index
+ * file holds the list of revisions and the MAC of every revision file, so revisions can neither be modified
+ * nor swapped with each other.
+ */
+class RevisionStore
+{
+public:
+	/// Default number of revisions after which a complete checkpoint is stored again
+	static const int DEFAULT_CHECKPOINT_INTERVAL = 16;
+
+	struct Revision
+	{
+		/// Number of the revision, counting from 1
+		unsigned number;
+		/// Time of recording, in seconds since the epoch
+		int64_t time;
+		/// Stored completely rather than as delta
+		bool checkpoint;
+		/// Size of the cleartext in bytes
+		size_t size;
+		/// Size of the revision file in bytes
+		size_t storedSize;
+	};
+
+	/// @param keystoreFile Path to the keystore file the history belongs to
+	explicit RevisionStore (const std::string &keystoreFile);
+	~RevisionStore ();
+
+	/// @return Path of the revision directory belonging to @p keystoreFile
+	static std::string directoryName (const std::string &keystoreFile);
+
+	/// @return true if @p keystoreFile has a revision history
+	static bool exists (const std::string &keystoreFile);
+
+	const std::string &directory () const { return _dir; }
+
+	/**
+	 * @brief Open the history, or start a new one if there is none
+	 * @param keyIterationCount PBKDF2 iterations for a new history. An existing one keeps its own.
+	 * @throw std::runtime_error if the index is corrupt or encrypted with a different passphrase
+	 */
+	void open (const std::string &passphrase, int keyIterationCount = CryptStream::DEFAULT_KEY_ITERATION_COUNT);
+
+	bool isOpen () const { return _cipher != nullptr; }
+
+	/// @return true if @p passphrase is the passphrase the history is encrypted with
+	bool matchesPassphrase (const std::string &passphrase) const;
+
+	/// Encrypt all revisions with @p passphrase from now on. Rewrites every revision file.
+	void changePassphrase (const std::string &passphrase, int keyIterationCount = CryptStream::DEFAULT_KEY_ITERATION_COUNT);
+
+	/// @return The recorded revisions, oldest first
+	const std::vector<Revision> &revisions () const { return _revisions; }
+
+	int checkpointInterval () const { return _interval; }
+	/// Store a checkpoint at least every @p interval revisions, taking effect with the next #record
+	void setCheckpointInterval (int interval);
+
+	/**
+	 * @brief Add the hierarchy below @p root as new revision
+	 *
+	 * Nothing is recorded if it equals the latest revision. The revision file and the index are flushed to
+	 * disk before this method returns.
+	 * @param cache Serialized entries to reuse, see Writer::write
+	 * @return Number of the new revision, or of the latest one if nothing changed
+	 */
+	unsigned record (const Folder &root, SerializationCache *cache = nullptr);
+
+	/**
+	 * @brief Add the revision @p number to @p root
+	 * @throw std::runtime_error if there is no such revision, or a revision file is missing or corrupt
+	 */
+	void restore (unsigned number, Folder *root) const;
+
+	/// @return Json cleartext of revision @p number
+	std::string text (unsigned number) const;
+
+	RevisionStore (const RevisionStore &) = delete;
+	RevisionStore &operator= (const RevisionStore &) = delete;
+private:
+	std::string _dir;
+	std::unique_ptr<RecordCipher> _cipher;
+	int _interval;
+	std::vector<Revision> _revisions;
+	/// Names and MACs of the revision files, in the order of _revisions
+	std::vector<std::string> _files, _macs;
+	/// Cleartext of the latest revision, the base of the next delta. Empty if not known yet.
+	std::string _latest;
+
+	const Revision &_revision (unsigned number) const;
+	/// Read, verify and decrypt the file of _revisions[index]
+	std::string _load (size_t index) const;
+	void _writeIndex () const;
+	void _collectGarbage () const;
+};
+
+}
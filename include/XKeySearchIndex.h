@@ -0,0 +1,101 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Trigram index for substring searches in a folder hierarchy
+ *
+ * The index maps every three-character sequence (ASCII case-folded) of the entry fields to the
+ * list of entries containing it. A search token of three or more characters only has to be verified
+ * against the entries in the intersection of the posting lists of its trigrams, instead of against
+ * every entry of the hierarchy. Shorter tokens fall back to verifying all entries.\n
+ * \n
+ * Register the index as #TreeObserver at the root folder to keep it up to date;
+ * modifications made while it is not registered require a #rebuild.\n
+ * Searching does not modify the hierarchy, but is not thread-safe.
+ */
+class SearchIndex
+	: public TreeObserver
+{
+public:
+	/// Build the index for all entries of the hierarchy below @p root
+	explicit SearchIndex (const Folder &root);
+
+	/// Discard the index and index the hierarchy below @p root again
+	void rebuild (const Folder &root);
+
+	/**
+	 * @brief Find all entries matching the search string
+	 *
+	 * Same semantics as #startSearch: an entry matches if any space-separated word of @p searchString
+	 * is contained in any of its fields.
+	 * @return All matches in tree order: the entries of a folder first, followed by the matches in its subfolders
+	 */
+	std::vector<SearchResult> find (const std::string &searchString) const;
+	std::vector<SearchResult> find (const SearchQuery &query) const;
+
+	/// @return Number of indexed entries
+	size_t size () const { return _docs.size() - _dead; }
+
+	/// @return Counter that is incremented on every modification of the indexed hierarchy
+	uint64_t generation () const { return _generation; }
+
+	/// Append the trigrams of @p field to @p out, case-folded like the words of a SearchQuery
+	static void collectTrigrams (const std::string &field, std::vector<uint32_t> *out);
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderAdded (const Folder &folder) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+	void batchStarted (const Folder &root) override;
+	void batchCommitted (const Folder &root, size_t operations) override;
+
+private:
+	typedef uint32_t DocId;
+	/// An indexed entry, identified by its folder and position
+	struct Doc
+	{
+		uint64_t folder;
+		int index;
+		bool alive;
+	};
+	/// Position of a folder in the hierarchy
+	struct FolderLocation
+	{
+		const Folder *folder;
+		size_t rank;
+	};
+
+	const Folder *_root;
+	std::vector<Doc> _docs;
+	size_t _dead;
+	/// Documents of each folder (by Folder::id), in the order of its entries
+	std::unordered_map<uint64_t, std::vector<DocId>> _folderDocs;
+	std::unordered_map<uint32_t, std::vector<DocId>> _postings;
+	uint64_t _generation;
+	/// Folders by id, recomputed after structural modifications
+	mutable std::unordered_map<uint64_t, FolderLocation> _locations;
+	mutable bool _locationsValid;
+	/// A Batch is being committed. The notifications refer to the state before the batch.
+	bool _inBatch;
+
+	void _indexFolder (const Folder &folder);
+	DocId _addDoc (const Folder &folder, int index);
+	void _removeDoc (DocId id);
+	void _removeFolder (const Folder &folder);
+	void _updateLocations () const;
+	void _changed ();
+	/// Rebuild once too many documents have been removed, but not in the middle of a batch
+	void _compactIfNeeded ();
+};
+
+}
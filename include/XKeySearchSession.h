@@ -0,0 +1,55 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Search that is refined while the search string is typed
+ *
+ * An entry matches if each space-separated word of the search string is contained in one of its fields.
+ * Typing more characters or more words can therefore only remove matches: if the new search string
+ * extends the previous one, only the previous matches are checked again instead of the whole hierarchy.\n
+ * The results of the chain of search strings leading to the current one are kept, so going back with
+ * backspace returns cached results without searching at all.\n
+ * \n
+ * The results refer to the entries of the hierarchy. After any modification of the hierarchy, #reset
+ * has to be called before the next #update.
+ * A #SubtreeFilter lets the first search skip subtrees that can not contain all words.
+ */
+class SearchSession
+{
+public:
+	/// Maximum number of cached search strings
+	static const size_t MaxCachedQueries = 64;
+
+	explicit SearchSession (const Folder *rootFolder, const SubtreeFilter *filter = nullptr);
+
+	/**
+	 * @brief Search for @p searchString
+	 * @return All entries containing every word of @p searchString, in tree order.
+	 *   Valid until the next call of #update or #reset.
+	 */
+	const std::vector<SearchResult> &update (const std::string &searchString);
+
+	/// Discard all cached results
+	void reset ();
+
+	/// @return Number of entries that were checked by the last #update
+	size_t lastScanned () const { return _lastScanned; }
+private:
+	const Folder *_root;
+	const SubtreeFilter *_filter;
+	/// Chain of search strings, each one a prefix of the next one, with their results
+	std::vector<std::pair<std::string, std::vector<SearchResult>>> _cache;
+	std::vector<SearchResult> _noResults;
+	size_t _lastScanned;
+
+	void _scanFolder (const SearchQuery &query, const Folder *folder, std::vector<SearchResult> *results);
+};
+
+}
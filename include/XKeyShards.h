@@ -0,0 +1,126 @@
+#pragma once
+
+#include "XKey.h"
+#include "CryptStream.h"
+
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+
+namespace XKey {
+
+class ThreadPool;
+
+/**
+ * @brief Keystore stored as a directory with one encrypted file per top-level folder
+ *
+ * The directory contains a manifest (see #manifestPath), which is encrypted with the passphrase like a keystore
+ * file, and one shard file per folder at the shard depth (see #depth), holding that folder and its subtree.
+ * The manifest contains the random key all shards are encrypted with (see RecordCipher), the folders above the
+ * shard depth, and the file name and MAC of every shard. A shard therefore can neither be swapped with another
+ * one nor be replaced by an older version of itself, and changing the passphrase only rewrites the manifest.\n
+ * \n
+ * Register the keystore as #TreeObserver at the root folder after #open. Modifications mark the shard they
+ * happen in, and #save only writes the marked shards and the ones that are new. Changed shards are written to
+ * new files before the manifest is replaced, so an interrupted save leaves the previous version intact, and
+ * copies of the directory that were modified in different top-level folders only differ in those shards.
+ * Modifications made directly through the non-const containers are not reported, call #invalidate after them.
+ */
+class ShardedKeystore
+	: public TreeObserver
+{
+public:
+	/**
+	 * @param directory Path of the keystore directory. It is created by the first #save.
+	 * @param depth Level of the folders that are stored in shards of their own, 1 for the top-level folders.
+	 * Replaced by the depth of the manifest when the keystore is opened.
+	 */
+	explicit ShardedKeystore (const std::string &directory, int depth = 1);
+	~ShardedKeystore ();
+
+	/// @return Path of the manifest in the keystore directory @p directory
+	static std::string manifestPath (const std::string &directory);
+
+	/// @return true if @p path is a directory containing a manifest
+	static bool isSharded (const std::string &path);
+
+	const std::string &directory () const { return _dir; }
+
+	int depth () const { return _depth; }
+	/// Store the folders at level @p depth in shards of their own from the next #save on, which writes all shards
+	void setDepth (int depth);
+
+	/// @return Number of shards as of the last #open or #save
+	size_t shardCount () const { return _shards.size(); }
+
+	/**
+	 * @brief Read the keystore
+	 *
+	 * The shards are decrypted, verified and decoded on the workers of @p pool, each into a hierarchy of
+	 * its own, and then added below their parent folders in their order. Observers of @p root are only
+	 * notified of the added folders.
+	 * @param manifest Stream to read the manifest from, usually a #CryptStream of #manifestPath
+	 * @param root Root folder to add the folders of the keystore to
+	 * @param flags Parser::ReaderFlags for the shards. With Parser::READ_LAZY, entries are decoded on first access.
+	 * @throw std::runtime_error if the manifest or a shard can not be read, is corrupt or does not match the manifest
+	 */
+	void open (std::istream &manifest, Folder *root, ThreadPool &pool, int flags = 0);
+
+	/// Read the keystore, decrypting the manifest with @p passphrase. See CryptStream::setEncryptionKey for @p keyIterationCount.
+	void open (const std::string &passphrase, Folder *root, ThreadPool &pool, int flags = 0, int keyIterationCount = -1);
+
+	/**
+	 * @brief Write the hierarchy below @p root
+	 *
+	 * Writes the shards that were modified since the last #open or #save, or that were not stored yet, and
+	 * then a new manifest. Shard files that are no longer referenced by the manifest are deleted.
+	 * @param passphrase Passphrase to encrypt the manifest with
+	 * @param mode Combination of @ref ModeInfo for the manifest. Must include USE_ENCRYPTION.
+	 * @param keyIterationCount See CryptStream::setEncryptionKey
+	 * @return Number of shards written
+	 * @throw std::runtime_error if a file could not be written
+	 */
+	size_t save (const Folder &root, const std::string &passphrase, int mode = BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER,
+	             int keyIterationCount = -1);
+
+	/// Write the shard containing @p folder with the next #save
+	void invalidate (const Folder &folder);
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderAdded (const Folder &folder) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderRenamed (const Folder &folder, const std::string &oldName) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+
+	ShardedKeystore (const ShardedKeystore &) = delete;
+	ShardedKeystore &operator= (const ShardedKeystore &) = delete;
+private:
+	struct Shard
+	{
+		/// Name of the shard file in the directory
+		std::string file;
+		/// MAC of the sealed shard, recorded in the manifest
+		std::string mac;
+		/// Modified since it was read or written
+		bool dirty;
+	};
+
+	std::string _dir;
+	int _depth;
+	/// Key material of the shards, see RecordCipher::fromKeyMaterial
+	std::string _key;
+	/// Shards by the Folder::id of their folder
+	std::unordered_map<uint64_t, Shard> _shards;
+	/// Root of the hierarchy of the last #open or #save
+	const Folder *_root;
+
+	/// @return The folder of the shard @p folder belongs to, nullptr if it is above the shard depth
+	const Folder *_shardOf (const Folder *folder) const;
+	void _markDirty (const Folder *folder);
+	void _collectGarbage () const;
+};
+
+}
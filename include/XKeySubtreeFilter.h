@@ -0,0 +1,78 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Bloom filters of the trigrams below each folder, to skip subtrees while searching
+ *
+ * For each folder, a Bloom filter summarizes the three-character sequences (case-folded as by #SearchIndex)
+ * of all entry fields in the folder and its subfolders. If a filter does not contain all trigrams of a search
+ * word, no entry below the folder contains the word and a search does not need to enter the subtree.
+ * Words shorter than three characters can not rule out any folder.\n
+ * Each filter is sized for about 8 bits per distinct trigram of its subtree, which gives a false positive
+ * rate of a few percent. This is far smaller than an inverted index with posting lists.\n
+ * \n
+ * Register the filter as #TreeObserver at the root folder. Added and changed entries are inserted into
+ * the filters of their folder and its ancestors right away. Removed entries stay in the filters (which
+ * only causes false positives), and moved folders and filters that are filled beyond their capacity are
+ * rebuilt from their subtree when they are needed next.\n
+ * Building a filter accesses all entries of the subtree, so create the filter on the first search, not
+ * while lazily loading a keystore. Neither building nor querying the filter is thread-safe.
+ */
+class SubtreeFilter
+	: public TreeObserver
+{
+public:
+	/// Build the filters for the hierarchy below @p root
+	explicit SubtreeFilter (const Folder &root);
+
+	/// Discard all filters and build them again
+	void rebuild (const Folder &root);
+
+	/// @return false if no entry below @p folder can match @p query (see SearchQuery::matches)
+	bool mayMatch (const Folder &folder, const SearchQuery &query) const;
+
+	/// @return false if no entry below @p folder can match all words of @p query (see SearchQuery::matchesAll)
+	bool mayMatchAll (const Folder &folder, const SearchQuery &query) const;
+
+	/// @return Total size of all filters in bytes
+	size_t memoryUsage () const;
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+
+private:
+	struct Filter
+	{
+		/// Bit array, the number of bits is a power of two
+		std::vector<uint64_t> bits;
+		/// Number of trigrams inserted, and the number the filter was sized for
+		size_t count, capacity;
+		/// The filter has to be rebuilt before it can be used
+		bool dirty;
+
+		void insert (uint32_t trigram);
+		bool contains (uint32_t trigram) const;
+	};
+
+	const Folder *_root;
+	/// Filters by Folder::id
+	mutable std::unordered_map<uint64_t, Filter> _filters;
+
+	const Filter &_filter (const Folder &folder) const;
+	void _build (const Folder &folder, std::vector<uint32_t> *trigrams) const;
+	bool _mayContain (const Folder &folder, const std::string &token) const;
+	void _insertEntry (const Folder &folder, const Entry &entry);
+	void _markDirty (const Folder *folder);
+};
+
+}
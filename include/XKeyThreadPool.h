@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Fixed set of worker threads with work stealing
+ *
+ * Every worker has its own task queue. #run distributes the tasks evenly over the queues;
+ * a worker takes tasks from the back of its own queue and, once that is empty, steals from the
+ * front of the queues of the other workers. Uneven tasks, like the subtrees of a skewed folder
+ * hierarchy, thus keep all workers busy until the end.\n
+ * \n
+ * #run blocks until all of its tasks are done. Concurrent calls are executed one after another.
+ */
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	/// @param threads Number of worker threads. 0 uses one thread per hardware thread.
+	explicit ThreadPool (unsigned threads = 0);
+	~ThreadPool ();
+
+	/// @return Number of worker threads
+	unsigned size () const { return _workers.size(); }
+
+	/**
+	 * @brief Execute the tasks on the workers and wait for them to finish
+	 *
+	 * If tasks throw, the remaining tasks are still executed and the first exception is rethrown.
+	 */
+	void run (std::vector<Task> tasks);
+
+private:
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Task> queue;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::mutex _runMutex;
+	std::mutex _stateMutex;
+	std::condition_variable _workAvailable;
+	std::condition_variable _allDone;
+	/// Tasks of the current run that have not finished yet
+	size_t _pending;
+	/// Incremented for every run, so idle workers notice new work
+	size_t _round;
+	bool _stop;
+	std::exception_ptr _error;
+
+	void _workerMain (size_t self);
+	bool _takeTask (size_t self, Task *task);
+
+	ThreadPool (const ThreadPool &) = delete;
+	ThreadPool &operator= (const ThreadPool &) = delete;
+};
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "XKey.h"
+#include "CryptStream.h"
+
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief Encrypted index to find entries by title or URL without decrypting the whole keystore
+ *
+ * The index is a sidecar file next to the keystore (see #fileName). It maps blinded tokens to the
+ * entries containing them. A token is a case-folded word of the title or URL of an entry (words are
+ * separated by all ASCII characters except letters and digits, so `https://mail.example.org` has the tokens
+ * `https`, `mail`, `example` and `org`). Tokens are blinded with a keyed HMAC, so the index does not contain
+ * any cleartext, and the whole index is additionally encrypted with a #RecordCipher. Both keys are derived
+ * from the key of the keystore (see CryptStream::deriveKey).\n
+ * For each entry, the index stores the position of its cleartext and the first encrypted block of the
+ * keystore that contains it. A #lookup decrypts the index and then only the blocks holding matching
+ * entries (see CryptStream::readRange).\n
+ * \n
+ * The index is bound to the IV of the keystore file it was written for, and it is ignored when the keystore
+ * has been written again or when changes have been saved to the journal since (see Journal).\n
+ * \n
+ * Trade-off: the blinded tokens are only visible after decrypting the index, but the index reveals
+ * some information even to someone without the passphrase:
+ * - its size gives an estimate of the number of entries and distinct words
+ * - someone able to observe file access learns which parts of the keystore a lookup reads, and therefore
+ *   whether two lookups found the same entries
+ * Lookups only find whole words; use a full search for substrings or other fields.
+ */
+class TokenIndex
+{
+public:
+	/// An entry found by #lookup
+	struct Match
+	{
+		/// Path of the folder containing the entry, like Folder::fullPath
+		std::string folderPath;
+		Entry entry;
+	};
+
+	/// @return Path of the index file belonging to @p keystoreFile
+	static std::string fileName (const std::string &keystoreFile);
+
+	/**
+	 * @brief Write the index for a freshly written keystore
+	 * @param keystoreFile Path of the keystore file
+	 * @param stream The encrypting stream the keystore has been written with, after CryptStream::sync
+	 * @param cleartext The cleartext written to @p stream
+	 * @throw std::runtime_error if the index cannot be written
+	 */
+	static void write (const std::string &keystoreFile, const CryptStream &stream, const std::string &cleartext);
+
+	/// Delete the index file of @p keystoreFile, if there is one
+	static void remove (const std::string &keystoreFile);
+
+	/**
+	 * @brief Find all entries whose title or URL contain each word of @p searchString
+	 * @param keystoreFile Path of the keystore file
+	 * @param stream The keystore opened for reading, with its encryption key set. Nothing is read from the stream itself.
+	 * @param matches Receives the matching entries in tree order
+	 * @return false if there is no usable index: the index is missing or outdated, or @p stream does not
+	 *   allow random access. Search the whole keystore instead.
+	 * @throw std::runtime_error if the index or the keystore have been tampered with
+	 */
+	static bool lookup (const std::string &keystoreFile, CryptStream &stream, const std::string &searchString,
+	                    std::vector<Match> *matches);
+
+	/// @return The entries a #lookup for @p searchString finds, by searching the folder hierarchy
+	static std::vector<SearchResult> find (const std::string &searchString, const Folder *rootFolder);
+
+	/// @return The case-folded words of @p text, as used for the index
+	static std::vector<std::string> tokenize (const std::string &text);
+};
+
+}
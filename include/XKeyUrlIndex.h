@@ -0,0 +1,145 @@
+#pragma once
+
+#include "XKey.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * @brief The parts of a URL that decide which credentials belong to it
+ *
+ * Also accepts the incomplete URLs that are common in keystores, like `github.com` or `intranet:8080/login`.
+ */
+struct NormalizedUrl
+{
+	/// Lower case scheme like `https`. Empty if the URL has none.
+	std::string scheme;
+	/// Lower case host name without trailing dot, or the IP address (without brackets for IPv6)
+	std::string host;
+	/// Explicit port, 0 if the URL does not specify one
+	int port;
+	/**
+	 * @brief The domain below the public suffix, e.g. `example.co.uk` for `login.example.co.uk`
+	 *
+	 * Without a list of all public suffixes, second-level domains like `co.uk` are recognized by their
+	 * well-known labels (`co`, `com`, `org`, `ac`, ...) below a two-letter country code.
+	 * Equal to #host for IP addresses and single-label hosts.
+	 */
+	std::string registrableDomain;
+
+	NormalizedUrl () : port(0) { }
+
+	/// @return false if no host could be found in the URL
+	bool valid () const { return !host.empty(); }
+
+	/// @return true if #host is an IPv4 or IPv6 address
+	bool isIpAddress () const;
+
+	/// Parse and normalize @p url. The result is invalid if @p url does not contain a host name.
+	static NormalizedUrl parse (const std::string &url);
+};
+
+/**
+ * @brief Index of the entries of a folder hierarchy by the host name of their URL, for autofill
+ *
+ * The host names are stored in a trie of their labels in reverse order (`com` → `example` → `login`),
+ * so a lookup walks at most one node per label of the requested host, independent of the number of entries.\n
+ * \n
+ * Register the index as #TreeObserver at the root folder to keep it up to date;
+ * modifications made while it is not registered require a #rebuild.
+ */
+class UrlIndex
+	: public TreeObserver
+{
+public:
+	/// An entry found by #lookup
+	struct Match
+	{
+		SearchResult result;
+		/// Number of labels the host of the entry is shorter than the requested host, 0 for the same host
+		int distance;
+		/// true if the entry specifies the same scheme as the requested URL
+		bool sameScheme;
+	};
+
+	/// Build the index for all entries of the hierarchy below @p root
+	explicit UrlIndex (const Folder &root);
+
+	/// Discard the index and index the hierarchy below @p root again
+	void rebuild (const Folder &root);
+
+	/**
+	 * @brief Find the entries whose URL belongs to @p url
+	 *
+	 * Matches the entries for the same host and for its parent domains down to the registrable domain,
+	 * so an entry for `example.com` is found for `https://login.example.com/path`, but an entry for
+	 * `mail.example.com` or `com` is not. If either URL specifies a port, entries for another port
+	 * (explicit, or the default port of the scheme) are not matched.
+	 * @return The matches, the ones with the same host first, then by #Match::sameScheme, then in tree order
+	 */
+	std::vector<Match> lookup (const std::string &url) const;
+
+	/// @return Number of indexed entries with a valid URL
+	size_t size () const { return _indexed - _dead; }
+
+	// TreeObserver
+	void entryAdded (const Folder &folder, int index) override;
+	void entryChanged (const Folder &folder, int index, const Entry &oldEntry) override;
+	void entryRemoved (const Folder &folder, int index, const Entry &oldEntry) override;
+	void folderAdded (const Folder &folder) override;
+	void folderRemoved (const Folder &parent, const Folder &folder) override;
+	void folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) override;
+	void batchStarted (const Folder &root) override;
+	void batchCommitted (const Folder &root, size_t operations) override;
+
+private:
+	typedef uint32_t DocId;
+	static const DocId NoDoc = UINT32_MAX;
+	/// An indexed entry, identified by its folder and position
+	struct Doc
+	{
+		uint64_t folder;
+		int index;
+		bool alive;
+		std::string scheme;
+		int port;
+	};
+	/// Node of the label trie
+	struct Node
+	{
+		std::unordered_map<std::string, uint32_t> children;
+		std::vector<DocId> docs;
+	};
+	/// Position of a folder in the hierarchy
+	struct FolderLocation
+	{
+		const Folder *folder;
+		size_t rank;
+	};
+
+	const Folder *_root;
+	std::vector<Doc> _docs;
+	std::vector<Node> _nodes;
+	size_t _indexed, _dead;
+	/// Documents of each folder (by Folder::id), in the order of its entries. #NoDoc for entries without a valid URL
+	std::unordered_map<uint64_t, std::vector<DocId>> _folderDocs;
+	/// Folders by id, recomputed after structural modifications
+	mutable std::unordered_map<uint64_t, FolderLocation> _locations;
+	mutable bool _locationsValid;
+	/// A Batch is being committed. The notifications refer to the state before the batch.
+	bool _inBatch;
+
+	void _indexFolder (const Folder &folder);
+	DocId _addDoc (const Folder &folder, int index);
+	void _removeDoc (DocId id);
+	void _removeFolder (const Folder &folder);
+	void _updateLocations () const;
+	/// Rebuild once too many documents have been removed, but not in the middle of a batch
+	void _compactIfNeeded ();
+};
+
+}
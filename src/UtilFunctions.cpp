@@ -1,6 +1,7 @@
 #include <XKey.h>
 #include <CryptStream.h>
 #include <XKeyJsonSerialization.h>
+#include <XKeyBinaryFormat.h>
 // Needed for no-echo password query
 #include <termios.h>
 #include <stdio.h>
@@ -37,6 +38,8 @@ void print_entry (const XKey::Entry &entry, int print_options, int depth = 0, st
 	}
 	if (print_options & PRINT_COMMENT) {
 		out << "\n" << entry.comment() << " ";
+		for (const XKey::Attachment &a : entry.attachments())
+			out << "\n    Attachment: " << a.name << " (" << a.size << " bytes)";
 	}
 	out << "\n";
 }
@@ -52,6 +55,34 @@ void print_folder (const XKey::Folder &f, int print_options, int depth = 0, std:
 	}
 }
 
+void print_entry (const XKey::EntryView &entry, int print_options, int depth = 0, std::ostream &out = std::cout)
+{
+	out << std::string(depth*2, '-') << "    # " << entry.title();
+	if (!entry.username().empty())
+		out << ", User: " << entry.username();
+	if (!entry.url().empty())
+		out << ", " << entry.url();
+	if (print_options & PRINT_PASSWORD)
+		out << ", Password: " << entry.password() << " ";
+	if (print_options & PRINT_COMMENT) {
+		out << "\n" << entry.comment() << " ";
+		for (size_t i = 0; i < entry.attachmentCount(); ++i) {
+			const XKey::Attachment a = entry.attachment (i);
+			out << "\n    Attachment: " << a.name << " (" << a.size << " bytes)";
+		}
+	}
+	out << "\n";
+}
+
+void print_folder (const XKey::FolderView &f, int print_options, int depth = 0, std::ostream &out = std::cout) {
+	if (depth != 0)
+		out << std::string(depth*2, '-') << " " << f.name() << "\n";
+	for (size_t i = 0; i < f.entryCount(); ++i)
+		print_entry (f.entry(i), print_options, depth, out);
+	for (size_t i = 0; i < f.subfolderCount(); ++i)
+		print_folder (f.subfolder(i), print_options, depth+1, out);
+}
+
 //
 bool writeToFile (const XKey::Folder &root, const std::string &filename, const std::string &key) {
 	XKey::CryptStream crypt_source (filename, XKey::CryptStream::WRITE);
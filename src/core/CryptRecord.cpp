@@ -0,0 +1,135 @@
+#include "CryptRecord.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+namespace XKey {
+
+static const size_t KeyLength = RecordCipher::KeyMaterialLength / 2;
+
+RecordCipher::RecordCipher (const std::string &passphrase, const std::string &salt, int iterationCount)
+	: _salt(salt), _iterationCount(iterationCount), _keys (_deriveKeys(passphrase, salt, iterationCount))
+{ }
+
+RecordCipher::RecordCipher (std::vector<unsigned char> &&keys)
+	: _iterationCount(0), _keys(std::move(keys))
+{ }
+
+std::unique_ptr<RecordCipher> RecordCipher::fromKeyMaterial (const std::string &keyMaterial) {
+	if (keyMaterial.size() != KeyMaterialLength)
+		throw std::invalid_argument ("Invalid key length for record cipher");
+	return std::unique_ptr<RecordCipher> (new RecordCipher(std::vector<unsigned char> (keyMaterial.begin(), keyMaterial.end())));
+}
+
+RecordCipher::~RecordCipher () {
+	OPENSSL_cleanse (_keys.data(), _keys.size());
+}
+
+std::string RecordCipher::generateSalt () {
+	std::string salt (SaltLength, '\0');
+	if (!RAND_bytes((unsigned char*)&salt[0], SaltLength))
+		throw std::runtime_error ("Could not generate random bytes to create salt");
+	return salt;
+}
+
+std::string RecordCipher::generateKeyMaterial () {
+	std::string keys (KeyMaterialLength, '\0');
+	if (!RAND_bytes((unsigned char*)&keys[0], KeyMaterialLength))
+		throw std::runtime_error ("Could not generate random bytes to create key");
+	return keys;
+}
+
+std::vector<unsigned char> RecordCipher::_deriveKeys (const std::string &passphrase, const std::string &salt, int iterationCount) {
+	if (salt.size() != SaltLength)
+		throw std::invalid_argument ("Invalid salt length for record cipher");
+	if (iterationCount <= 0)
+		throw std::invalid_argument ("Invalid key iteration count");
+	std::vector<unsigned char> keys (KeyMaterialLength);
+	int r = PKCS5_PBKDF2_HMAC (passphrase.c_str(), passphrase.size(), (const unsigned char*)salt.data(), salt.size(),
+	                           iterationCount, EVP_sha256(), keys.size(), keys.data());
+	if (r != 1)
+		throw std::runtime_error ("PBKDF2 algorithm to derive record keys failed");
+	return keys;
+}
+
+std::string RecordCipher::_mac (const std::string &iv, const char *data, size_t length, const std::string &associatedData) const {
+	std::unique_ptr<EVP_PKEY, void(*)(EVP_PKEY*)> key (EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, nullptr, &_keys[KeyLength], KeyLength),
+	                                                  &EVP_PKEY_free);
+	std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> ctx (EVP_MD_CTX_create(), &EVP_MD_CTX_free);
+	if (!key || !ctx || EVP_DigestSignInit(&*ctx, nullptr, EVP_sha256(), nullptr, &*key) != 1)
+		throw std::runtime_error ("Failed to initialize message digest");
+	// Length-prefix the associated data, so it can not be shifted into the record
+	const uint64_t adLength = associatedData.size();
+	unsigned char adLengthBytes[8];
+	for (int i = 0; i < 8; ++i)
+		adLengthBytes[i] = (adLength >> (8 * i)) & 0xff;
+	if (EVP_DigestSignUpdate (&*ctx, adLengthBytes, sizeof(adLengthBytes)) != 1 ||
+	    EVP_DigestSignUpdate (&*ctx, associatedData.data(), associatedData.size()) != 1 ||
+	    EVP_DigestSignUpdate (&*ctx, iv.data(), iv.size()) != 1 ||
+	    EVP_DigestSignUpdate (&*ctx, data, length) != 1)
+		throw std::runtime_error ("Failed to update message digest");
+	std::string mac (MacLength, '\0');
+	size_t macLength = mac.size();
+	if (EVP_DigestSignFinal (&*ctx, (unsigned char*)&mac[0], &macLength) != 1 || macLength != MacLength)
+		throw std::runtime_error ("Failed to finalize message digest");
+	return mac;
+}
+
+static void crypt_ctr (const unsigned char *key, const std::string &iv, const char *in, size_t length, char *out) {
+	std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> ctx (EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free);
+	if (!ctx || EVP_EncryptInit_ex(&*ctx, EVP_aes_256_ctr(), nullptr, key, (const unsigned char*)iv.data()) != 1)
+		throw std::runtime_error ("Failed to initialize cipher context");
+	int outLength = 0;
+	if (length > 0 && EVP_EncryptUpdate(&*ctx, (unsigned char*)out, &outLength, (const unsigned char*)in, length) != 1)
+		throw std::runtime_error ("Failed to encrypt record");
+	assert ((size_t)outLength == length);
+}
+
+std::string RecordCipher::seal (const std::string &plaintext, const std::string &associatedData) const {
+	std::string iv (IvLength, '\0');
+	if (!RAND_bytes((unsigned char*)&iv[0], IvLength))
+		throw std::runtime_error ("Could not generate random bytes to create initialization vector");
+	std::string sealed (IvLength + plaintext.size() + MacLength, '\0');
+	std::copy (iv.begin(), iv.end(), sealed.begin());
+	crypt_ctr (&_keys[0], iv, plaintext.data(), plaintext.size(), &sealed[IvLength]);
+	const std::string mac = _mac (iv, &sealed[IvLength], plaintext.size(), associatedData);
+	std::copy (mac.begin(), mac.end(), sealed.end() - MacLength);
+	return sealed;
+}
+
+std::string RecordCipher::open (const std::string &sealed, const std::string &associatedData) const {
+	if (sealed.size() < Overhead)
+		throw std::runtime_error ("Encrypted record is truncated");
+	const std::string iv = sealed.substr (0, IvLength);
+	const size_t length = sealed.size() - Overhead;
+	const std::string mac = _mac (iv, &sealed[IvLength], length, associatedData);
+	if (CRYPTO_memcmp (mac.data(), &sealed[IvLength + length], MacLength) != 0)
+		throw std::runtime_error ("Message digest does not match encrypted record");
+	std::string plaintext (length, '\0');
+	crypt_ctr (&_keys[0], iv, &sealed[IvLength], length, length ? &plaintext[0] : 0);
+	return plaintext;
+}
+
+std::string RecordCipher::macOf (const std::string &sealed) {
+	if (sealed.size() < Overhead)
+		throw std::runtime_error ("Encrypted record is truncated");
+	return sealed.substr (sealed.size() - MacLength);
+}
+
+bool RecordCipher::matchesPassphrase (const std::string &passphrase) const {
+	if (_iterationCount == 0)
+		return false; // Created from raw key material
+	std::vector<unsigned char> keys = _deriveKeys (passphrase, _salt, _iterationCount);
+	const bool equal = (CRYPTO_memcmp (keys.data(), _keys.data(), keys.size()) == 0);
+	OPENSSL_cleanse (keys.data(), keys.size());
+	return equal;
+}
+
+}
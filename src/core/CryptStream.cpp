@@ -1,8 +1,12 @@
 #include "CryptStream.h"
 #include "XKey.h"
+#include "XKeyThreadPool.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring> 
+#include <fstream>
+#include <memory>
 #include <stdexcept>
 #include <sys/stat.h>
 
@@ -46,7 +50,7 @@ static std::string hex2uc (const char *in, int in_length) {
 }
 
 const size_t BufSize = 256;
-CryptStream::CryptStream (const std::string &filename, OperationMode open_mode, int m_info)
+CryptStream::CryptStream (OperationMode open_mode)
 	: _buffer( BufSize + put_back_),
 	_cipherCtx(nullptr, &EVP_CIPHER_CTX_free),
 	_mdCtx(nullptr, &EVP_MD_CTX_free),
@@ -60,7 +64,12 @@ CryptStream::CryptStream (const std::string &filename, OperationMode open_mode,
 	setp(&_buffer.front(), end - 2); // -1 to make overflow() easier, another -1 to terminate with null
 	
 	umask(0700);
-	
+}
+
+CryptStream::CryptStream (const std::string &filename, OperationMode open_mode, int m_info)
+	: CryptStream (open_mode)
+{
+	_filename = filename;
 	_file_bio = BIO_new_file(filename.c_str(), (_mode == READ) ? "rb" : "wb");
 	if (!_file_bio) {
 		if (_mode == READ)
@@ -68,7 +77,28 @@ CryptStream::CryptStream (const std::string &filename, OperationMode open_mode,
 		else
 			throw std::runtime_error ("Could not open keystore file for writing. Please check filesystem permissions.");
 	}
-	
+	_setup (m_info);
+}
+
+CryptStream::CryptStream (int fd, OperationMode open_mode, int m_info)
+	: CryptStream (open_mode)
+{
+	_file_bio = BIO_new_fd(fd, BIO_NOCLOSE);
+	if (!_file_bio)
+		throw std::runtime_error ("Could not create OpenSSL file BIO structure");
+	if (_mode == WRITE) {
+		// Unlike a file BIO, a descriptor is not buffered: write whole blocks
+		BIO *buffer = BIO_new(BIO_f_buffer());
+		if (!buffer) {
+			BIO_free (_file_bio);
+			throw std::runtime_error ("Could not create OpenSSL buffer BIO structure");
+		}
+		_file_bio = BIO_push(buffer, _file_bio);
+	}
+	_setup (m_info);
+}
+
+void CryptStream::_setup (int m_info) {
 	_bio_chain.reset (_file_bio);
 	
 	if (_mode == READ && (m_info & EVALUATE_FILE_HEADER)) {
@@ -103,6 +133,15 @@ CryptStream::~CryptStream () {
 		(void)BIO_flush(bioChain());
 }
 
+void CryptStream::finish () {
+	if (!_initialized || _mode != WRITE)
+		return;
+	sync();
+	if (BIO_flush(bioChain()) != 1)
+		throw std::runtime_error ("Failed to write keystore file");
+	_initialized = false;
+}
+
 bool CryptStream::isEncrypted () const {
 	return _cipherCtx != 0;
 }
@@ -161,6 +200,7 @@ void CryptStream::_evaluateHeader (int *headerMode) {
 	if (_pbkdfIterationCount <= 0)
 		throw std::runtime_error ("Invalid key iteration count");
 	this->_iv.assign( hex2uc(iv, EVP_CIPHER_iv_length(_cipher) * 2) );
+	_dataOffset = offset;
 	(void)BIO_seek (_file_bio, offset);
 	*headerMode = ((useEncryption) ? (*headerMode | USE_ENCRYPTION) : (*headerMode & ~USE_ENCRYPTION));
 	*headerMode = ((useBase64Encode) ? (*headerMode | BASE64_ENCODED) : (*headerMode & ~BASE64_ENCODED));
@@ -217,15 +257,22 @@ struct CryptStream::BlockHead {
 	unsigned char checksum[MaxCheckSumLength];
 } __attribute__((packed, aligned(1))) ;
 
-void CryptStream::makeMessageDigest (const unsigned char *data, size_t length, unsigned char *mdOut) {
-	if (EVP_DigestSignInit(&*_mdCtx, nullptr, _md, nullptr, &*_mdKey) != 1)
+/// HMAC of @p data with @p key, using the message digest context @p ctx
+static void message_digest (EVP_MD_CTX *ctx, const EVP_MD *md, EVP_PKEY *key,
+                            const unsigned char *data, size_t length, unsigned char *mdOut)
+{
+	if (EVP_DigestSignInit(ctx, nullptr, md, nullptr, key) != 1)
 		throw std::runtime_error ("Failed to initialize message digest");
-	if (EVP_DigestSignUpdate (&*_mdCtx, data, length) != 1)
+	if (EVP_DigestSignUpdate (ctx, data, length) != 1)
 		throw std::runtime_error ("Failed to update message digest");
-	size_t checkSumLen = EVP_MD_size(_md);
-	if (EVP_DigestSignFinal(&*_mdCtx, &mdOut[0], &checkSumLen) != 1)
+	size_t checkSumLen = EVP_MD_size(md);
+	if (EVP_DigestSignFinal(ctx, &mdOut[0], &checkSumLen) != 1)
 		throw std::runtime_error ("Failed to finalize message digest");
-	assert (checkSumLen == (size_t)EVP_MD_size(_md));
+	assert (checkSumLen == (size_t)EVP_MD_size(md));
+}
+
+void CryptStream::makeMessageDigest (const unsigned char *data, size_t length, unsigned char *mdOut) {
+	message_digest (&*_mdCtx, _md, &*_mdKey, data, length, mdOut);
 }
 
 CryptStream::int_type CryptStream::underflow() {
@@ -274,6 +321,7 @@ CryptStream::int_type CryptStream::underflow() {
 		if (EVP_CipherUpdate (&*_cipherCtx, (unsigned char*)start, &outLen, bytes, head.length) != 1)
 			throw std::runtime_error ("Failed to decrypt block");
 		assert (outLen == n);
+		_readPlain += n;
 	} else {
 		n = BIO_read(bioChain(), start, _buffer.size() - (start - base));
 		if (n <= 0) {
@@ -307,6 +355,9 @@ CryptStream::int_type CryptStream::overflow (int_type ch) {
 	
 	if (_cipherCtx) {
 		assert (_md);
+		// An empty block would end the stream for the reader
+		if (n == 0)
+			return 0;
 		BlockHead head;
 		head.length = n;
 		unsigned char cryptBlock[ n + EVP_MAX_BLOCK_LENGTH ];
@@ -315,6 +366,9 @@ CryptStream::int_type CryptStream::overflow (int_type ch) {
 			throw std::runtime_error ("Failed to encrypt block");
 		assert (length == n);
 		makeMessageDigest (cryptBlock, length, &head.checksum[0]);
+		_frames.push_back (Frame {_writtenBytes, _writtenPlain});
+		_writtenBytes += sizeof(head.length) + EVP_MD_size(_md) + length;
+		_writtenPlain += length;
 		
 		r = BIO_write(bioChain(), &head, sizeof(head.length) + EVP_MD_size(_md));
 		if (r <= 0)
@@ -330,6 +384,217 @@ CryptStream::int_type CryptStream::overflow (int_type ch) {
 	return r;
 }
 
+std::string CryptStream::deriveKey (const std::string &label) const {
+	if (!_mdKey)
+		throw std::logic_error ("CryptStream has no encryption key");
+	std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> ctx (EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+	unsigned char key[EVP_MAX_MD_SIZE];
+	size_t length = sizeof(key);
+	if (!ctx || EVP_DigestSignInit (&*ctx, nullptr, EVP_sha512(), nullptr, &*_mdKey) != 1 ||
+	    EVP_DigestSignUpdate (&*ctx, label.data(), label.size()) != 1 || EVP_DigestSignFinal (&*ctx, key, &length) != 1)
+	{
+		throw std::runtime_error ("Failed to derive key");
+	}
+	std::string result ((const char*)key, length);
+	OPENSSL_cleanse (key, sizeof(key));
+	return result;
+}
+
+bool CryptStream::supportsRandomAccess () const {
+	return _mode == READ && _initialized && _cipherCtx && _cipher && EVP_CIPHER_mode(_cipher) == EVP_CIPH_CTR_MODE && !_filename.empty();
+}
+
+/// Base64 encoding (as done by OpenSSL) writes 48 bytes as one line of 64 characters and a newline
+static const uint64_t Base64LineBytes = 48, Base64LineLength = 65;
+
+/// Read @p length bytes at @p offset of the data following the header of a keystore file
+static std::string read_data (std::ifstream &file, int dataOffset, bool encoded, uint64_t offset, size_t length) {
+	const uint64_t skip = encoded ? offset % Base64LineBytes : 0;
+	const uint64_t start = encoded ? (offset / Base64LineBytes) * Base64LineLength : offset;
+	const uint64_t size = encoded ? ((skip + length + Base64LineBytes - 1) / Base64LineBytes) * Base64LineLength : length;
+	std::string raw (size, '\0');
+	file.clear();
+	file.seekg (dataOffset + start);
+	file.read (&raw[0], size);
+	raw.resize (file.gcount());
+	if (!encoded) {
+		if (raw.size() < length)
+			throw std::runtime_error ("Unexpected end of keystore file");
+		return raw;
+	}
+	std::unique_ptr<EVP_ENCODE_CTX, void(*)(EVP_ENCODE_CTX*)> ctx (EVP_ENCODE_CTX_new(), &EVP_ENCODE_CTX_free);
+	if (!ctx)
+		throw std::runtime_error ("Could not create base64 decoder");
+	std::string decoded (raw.size(), '\0');
+	int n = 0, last = 0;
+	EVP_DecodeInit (&*ctx);
+	if (EVP_DecodeUpdate (&*ctx, (unsigned char*)&decoded[0], &n, (const unsigned char*)raw.data(), raw.size()) < 0 ||
+	    EVP_DecodeFinal (&*ctx, (unsigned char*)&decoded[n], &last) != 1)
+	{
+		throw std::runtime_error ("Invalid base64 encoding in keystore file");
+	}
+	if ((size_t)(n + last) < skip + length)
+		throw std::runtime_error ("Unexpected end of keystore file");
+	return decoded.substr (skip, length);
+}
+
+std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> CryptStream::_cipherAt (uint64_t plainOffset) const {
+	// Continue the key stream at the first byte of the block: the counter is the IV plus the block number
+	std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> ctx (EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free);
+	if (!ctx || EVP_CIPHER_CTX_copy (&*ctx, &*_cipherCtx) != 1)
+		throw std::runtime_error ("Failed to initialize cipher context");
+	std::string counter = _iv;
+	uint64_t carry = plainOffset / 16;
+	for (size_t i = counter.size(); i > 0 && carry; --i) {
+		carry += (unsigned char)counter[i - 1];
+		counter[i - 1] = (char)(carry & 0xFF);
+		carry >>= 8;
+	}
+	unsigned char discard[16] = {0};
+	int outLen;
+	if (EVP_CipherInit_ex (&*ctx, nullptr, nullptr, nullptr, (const unsigned char*)counter.data(), -1) != 1 ||
+	    EVP_CipherUpdate (&*ctx, discard, &outLen, discard, plainOffset % 16) != 1)
+	{
+		throw std::runtime_error ("Failed to initialize cipher context");
+	}
+	return ctx;
+}
+
+std::string CryptStream::readRange (const Frame &frame, uint64_t begin, uint64_t end) {
+	if (!supportsRandomAccess())
+		throw std::logic_error ("Random access needs a CryptStream opened for reading with a cipher in CTR mode");
+	if (begin < frame.plainOffset || end < begin)
+		throw std::invalid_argument ("Invalid range to read from CryptStream");
+	std::ifstream file (_filename, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error ("Could not open keystore file");
+
+	std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)> ctx = _cipherAt (frame.plainOffset);
+	int outLen;
+	const size_t headSize = sizeof(BlockHead::length) + EVP_MD_size(_md);
+	std::string result;
+	uint64_t offset = frame.offset, position = frame.plainOffset;
+	while (position < end) {
+		const std::string head = read_data (file, _dataOffset, _isEncoded, offset, headSize);
+		uint16_t length;
+		memcpy (&length, head.data(), sizeof(length));
+		if (length == 0)
+			throw std::runtime_error ("Unexpected end of keystore data");
+		const std::string block = read_data (file, _dataOffset, _isEncoded, offset + headSize, length);
+		unsigned char compChecksum[MaxCheckSumLength];
+		makeMessageDigest ((const unsigned char*)block.data(), length, compChecksum);
+		if (CRYPTO_memcmp (compChecksum, head.data() + sizeof(length), EVP_MD_size(_md)) != 0)
+			throw std::runtime_error ("Message digest does not match message");
+		std::string plain (length, '\0');
+		if (EVP_CipherUpdate (&*ctx, (unsigned char*)&plain[0], &outLen, (const unsigned char*)block.data(), length) != 1)
+			throw std::runtime_error ("Failed to decrypt block");
+		if (position + length > begin) {
+			const size_t from = (begin > position) ? begin - position : 0;
+			const size_t to = std::min<uint64_t> (length, end - position);
+			result.append (plain, from, to - from);
+		}
+		OPENSSL_cleanse (&plain[0], plain.size());
+		position += length;
+		offset += headSize + length;
+	}
+	return result;
+}
+
+/// Cleartext each task of CryptStream::readAll decrypts at least
+static const uint64_t MinReadAllShare = 64 * 1024;
+
+std::string CryptStream::readAll (ThreadPool &pool) {
+	if (_mode != READ)
+		throw std::logic_error ("readAll needs a CryptStream opened for reading");
+	if (!_initialized)
+		throw std::logic_error ("CryptStream not fully initialized");
+	// Cleartext that has already been decrypted into the buffer
+	std::string result (gptr(), egptr());
+	setg (eback(), egptr(), egptr());
+
+	std::string raw;
+	char chunk[16 * 1024];
+	int n;
+	while ((n = BIO_read (bioChain(), chunk, sizeof(chunk))) > 0)
+		raw.append (chunk, n);
+	if (n < 0)
+		throw std::runtime_error ("Error reading from OpenSSL BIO");
+	if (!_cipherCtx) {
+		result += raw;
+		OPENSSL_cleanse (&raw[0], raw.size());
+		return result;
+	}
+
+	struct Block
+	{
+		size_t offset;
+		uint64_t plainOffset;
+		uint16_t length;
+	};
+	const size_t headSize = sizeof(BlockHead::length) + EVP_MD_size(_md);
+	std::vector<Block> blocks;
+	uint64_t plain = _readPlain;
+	for (size_t pos = 0; pos < raw.size(); ) {
+		uint16_t length;
+		if (raw.size() - pos < headSize)
+			throw std::runtime_error ("Unexpected end of keystore data");
+		memcpy (&length, &raw[pos], sizeof(length));
+		if (length == 0)
+			break;
+		if (raw.size() - pos - headSize < length)
+			throw std::runtime_error ("Unexpected end of keystore data");
+		blocks.push_back (Block {pos, plain, length});
+		pos += headSize + length;
+		plain += length;
+	}
+	const size_t base = result.size();
+	const uint64_t first = _readPlain;
+	result.resize (base + (plain - first));
+
+	auto decrypt = [&] (EVP_CIPHER_CTX *ctx, EVP_MD_CTX *mdCtx, size_t begin, size_t end) {
+		unsigned char compChecksum[MaxCheckSumLength];
+		for (size_t i = begin; i < end; ++i) {
+			const Block &b = blocks[i];
+			const unsigned char *bytes = (const unsigned char*)&raw[b.offset + headSize];
+			message_digest (mdCtx, _md, &*_mdKey, bytes, b.length, compChecksum);
+			if (CRYPTO_memcmp (compChecksum, &raw[b.offset + sizeof(b.length)], EVP_MD_size(_md)) != 0)
+				throw std::runtime_error ("Message digest does not match message");
+			int outLen;
+			if (EVP_CipherUpdate (ctx, (unsigned char*)&result[base + (b.plainOffset - first)], &outLen, bytes, b.length) != 1)
+				throw std::runtime_error ("Failed to decrypt block");
+		}
+	};
+	try {
+		if (!supportsRandomAccess()) {
+			decrypt (&*_cipherCtx, &*_mdCtx, 0, blocks.size());
+		} else {
+			// Consecutive blocks per task, a few tasks per worker so they can balance
+			const uint64_t share = std::max<uint64_t> (MinReadAllShare, (plain - first) / (4 * pool.size() + 1));
+			std::vector<ThreadPool::Task> tasks;
+			for (size_t begin = 0; begin < blocks.size(); ) {
+				size_t end = begin;
+				while (end < blocks.size() && blocks[end].plainOffset - blocks[begin].plainOffset < share)
+					++end;
+				// The contexts are copied from the one of the stream, which is not touched by the workers
+				std::shared_ptr<EVP_CIPHER_CTX> ctx (_cipherAt (blocks[begin].plainOffset).release(), &EVP_CIPHER_CTX_free);
+				tasks.push_back ([ctx, begin, end, &decrypt] () {
+					std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> mdCtx (EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+					if (!mdCtx)
+						throw std::runtime_error ("Failed to initialize message digest");
+					decrypt (&*ctx, &*mdCtx, begin, end);
+				});
+				begin = end;
+			}
+			pool.run (std::move(tasks));
+		}
+	} catch (...) {
+		OPENSSL_cleanse (&result[0], result.size());
+		throw;
+	}
+	_readPlain = plain;
+	return result;
+}
+
 int CryptStream::sync () {
 	if (_mode == WRITE) {
 		overflow(traits_type::eof());
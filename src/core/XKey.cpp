@@ -1,6 +1,9 @@
 #include "XKey.h"
+#include "XKeySubtreeFilter.h"
+#include "XKeyThreadPool.h"
 
 #include <algorithm>
+#include <atomic>
 #include <stdexcept>
 #include <memory>
 #include <cassert>
@@ -18,92 +21,223 @@ static void tokenize (const std::string &str, std::vector<std::string> *tokens,
 	}
 }
 
-static bool compareCaseInsensitive (char a, char b) {
-	return std::tolower(a) == std::tolower (b);
+// SearchQuery
+
+SearchQuery::SearchQuery (const std::string &searchString) {
+	std::vector<std::string> words;
+	tokenize (searchString, &words, ' ');
+	for (const std::string &w : words) {
+		_matchers.emplace_back (w);
+		_tokens.push_back (_matchers.back().needle());
+	}
+}
+
+bool SearchQuery::matches (const Entry &ent) const {
+	for (const SubstringMatcher &m : _matchers) {
+		if (m.matches (ent.title()) || m.matches (ent.comment()) || m.matches (ent.url()) ||
+		    m.matches (ent.username()) || m.matches (ent.email()))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SearchQuery::matchesAll (const Entry &ent) const {
+	for (const SubstringMatcher &m : _matchers) {
+		if (!m.matches (ent.title()) && !m.matches (ent.comment()) && !m.matches (ent.url()) &&
+		    !m.matches (ent.username()) && !m.matches (ent.email()))
+		{
+			return false;
+		}
+	}
+	return !_matchers.empty();
+}
+
+// SearchCursor
+
+SearchCursor::SearchCursor (SearchQuery query, const Folder *rootFolder, const SubtreeFilter *filter)
+	: _query(std::move(query)), _filter(filter)
+{
+	if (rootFolder && !_query.empty() && _mayMatch (rootFolder))
+		_stack.push_back (Frame {rootFolder, 0, 0});
+}
+
+bool SearchCursor::_mayMatch (const Folder *folder) const {
+	return !_filter || _filter->mayMatch (*folder, _query);
+}
+
+SearchResult SearchCursor::next () {
+	while (!_stack.empty()) {
+		Frame &top = _stack.back();
+		const std::deque<Entry> &entries = top.folder->entries();
+		if (top.nextEntry < entries.size()) {
+			const size_t index = top.nextEntry++;
+			if (_query.matches (entries[index]))
+				return SearchResult (&entries[index], top.folder, index);
+		} else if (top.nextSubfolder < top.folder->subfolders().size()) {
+			const Folder *sub = &top.folder->subfolders()[top.nextSubfolder++];
+			if (_mayMatch (sub))
+				_stack.push_back (Frame {sub, 0, 0});
+		} else {
+			_stack.pop_back();
+		}
+	}
+	return SearchResult();
 }
 
-static inline bool match_in_string (const std::string &needle, const std::string &haystack) {
-	return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(), &compareCaseInsensitive) != haystack.end();
+std::vector<SearchResult> findAll (const SearchQuery &query, const Folder *rootFolder, const SubtreeFilter *filter) {
+	std::vector<SearchResult> results;
+	SearchCursor cursor (query, rootFolder, filter);
+	for (SearchResult r = cursor.next(); r.hasMatch(); r = cursor.next())
+		results.push_back (r);
+	return results;
 }
 
-static SearchResult search_folder (const std::vector<std::string> &tokens, const Folder *f, int begin_index = 0) {
+/// Hierarchies with fewer entries are not worth distributing over threads
+static const size_t ParallelSearchMinEntries = 4096;
+
+std::vector<SearchResult> findAll (const SearchQuery &query, const Folder *rootFolder, ThreadPool &pool) {
+	if (!rootFolder || query.empty())
+		return std::vector<SearchResult>();
+	// Flatten the hierarchy in tree order. This also loads lazily decoded folders,
+	// which must not happen concurrently.
+	std::vector<const Folder*> folders;
+	size_t total = 0;
+	std::vector<const Folder*> stack {rootFolder};
+	while (!stack.empty()) {
+		const Folder *f = stack.back();
+		stack.pop_back();
+		folders.push_back (f);
+		total += f->entries().size();
+		for (auto it = f->subfolders().rbegin(); it != f->subfolders().rend(); ++it)
+			stack.push_back (&*it);
+	}
+	if (pool.size() < 2 || total < ParallelSearchMinEntries)
+		return findAll (query, rootFolder);
+
+	// Work units are consecutive runs of entries, spanning folder boundaries and splitting large folders
+	struct Segment
+	{
+		const Folder *folder;
+		size_t begin, end;
+	};
+	const size_t grain = std::max<size_t> (256, total / (pool.size() * 8));
+	std::vector<std::vector<Segment>> units (1);
+	size_t unitSize = 0;
+	for (const Folder *f : folders) {
+		const size_t count = f->entries().size();
+		for (size_t begin = 0; begin < count; ) {
+			const size_t end = std::min (count, begin + grain - unitSize);
+			units.back().push_back (Segment {f, begin, end});
+			unitSize += end - begin;
+			begin = end;
+			if (unitSize == grain) {
+				units.emplace_back();
+				unitSize = 0;
+			}
+		}
+	}
+
+	std::vector<std::vector<SearchResult>> unitResults (units.size());
+	std::vector<ThreadPool::Task> tasks;
+	tasks.reserve (units.size());
+	for (size_t u = 0; u < units.size(); ++u) {
+		tasks.push_back ([&query, &units, &unitResults, u] {
+			for (const Segment &s : units[u]) {
+				const std::deque<Entry> &entries = s.folder->entries();
+				for (size_t i = s.begin; i < s.end; ++i) {
+					if (query.matches (entries[i]))
+						unitResults[u].push_back (SearchResult (&entries[i], s.folder, i));
+				}
+			}
+		});
+	}
+	pool.run (std::move(tasks));
+
+	std::vector<SearchResult> results;
+	for (const std::vector<SearchResult> &r : unitResults)
+		results.insert (results.end(), r.begin(), r.end());
+	return results;
+}
+
+// Incremental search
+
+static SearchResult search_folder (const SearchQuery &query, const Folder *f, int begin_index = 0) {
 	if (begin_index > f->entries().size())
 		throw std::invalid_argument ("begin_index parameter for search_folder greater than number of sumfolders");
 	int ind = begin_index;
 	for (auto ent = f->entries().begin() + begin_index; ent != f->entries().end(); ++ent) {
-		for (const std::string &word : tokens) {
-			if (match_in_string (word, ent->title()) || match_in_string(word, ent->comment()) ||
-			    match_in_string(word, ent->url()) || match_in_string(word, ent->username()) ||
-			    match_in_string(word, ent->email()))
-			{
-				return SearchResult (&*ent, f, ind);
-			}
-		}
+		if (query.matches (*ent))
+			return SearchResult (&*ent, f, ind);
 		++ind;
 	}
 	return SearchResult();
 }
 
-static SearchResult search_down_recursive (const std::vector<std::string> &tokens, const Folder *startFolder) {
+static SearchResult search_down_recursive (const SearchQuery &query, const Folder *startFolder, const SubtreeFilter *filter) {
+	if (filter && !filter->mayMatch (*startFolder, query))
+		return SearchResult();
 	// First look through all entries in THIS folder
-	SearchResult e = search_folder (tokens, startFolder);
+	SearchResult e = search_folder (query, startFolder);
 	if (e.hasMatch())
 		return e;
 	// Now look through all subfolders
 	for (const Folder &s : startFolder->subfolders()) {
-		SearchResult e = search_down_recursive(tokens, &s);
+		SearchResult e = search_down_recursive(query, &s, filter);
 		if (e.hasMatch())
 			return e;
 	}
 	return SearchResult();
 }
 
-static SearchResult search_up_recursive (const std::vector<std::string> &tokens, const Folder *lastFolder) {
+static SearchResult search_up_recursive (const SearchQuery &query, const Folder *lastFolder, const SubtreeFilter *filter) {
 	const XKey::Folder *p = lastFolder->parent();
 	// Start with the first SIBLING of lastFolder
 	for (std::deque<Folder>::const_iterator folderIt = p->subfolders().begin() + lastFolder->row()+1;
 	     folderIt < p->subfolders().end(); ++folderIt)
 	{
-		SearchResult e = search_down_recursive(tokens, &*folderIt);
+		SearchResult e = search_down_recursive(query, &*folderIt, filter);
 		if (e.hasMatch())
 			return e;
 	}
 	// Go up the hierarchy
 	if (p->parent())
-		return search_up_recursive (tokens, p);
+		return search_up_recursive (query, p, filter);
 	else
 		return SearchResult();
 }
 
-SearchResult continueSearch (const std::string &searchString, const SearchResult &lastResult) {
+SearchResult continueSearch (const std::string &searchString, const SearchResult &lastResult, const SubtreeFilter *filter) {
 	if (!lastResult._lastFolder)
 		return SearchResult();
-	std::vector<std::string> tokens;
-	tokenize (searchString, &tokens, ' ');
+	const SearchQuery query (searchString);
 	const XKey::Folder *startFolder = lastResult._lastFolder;
 	// Look for siblings from the first result
-	SearchResult res = search_folder (tokens, startFolder, lastResult._lastIndex + 1);
+	SearchResult res = search_folder (query, startFolder, lastResult._lastIndex + 1);
 	if (res.hasMatch())
 		return res;
+	// Then in the subfolders of this folder
+	for (const Folder &s : startFolder->subfolders()) {
+		res = search_down_recursive (query, &s, filter);
+		if (res.hasMatch())
+			return res;
+	}
 	// Now look ABOVE this folder.
 	if (startFolder->parent())
-		return search_up_recursive (tokens, startFolder);
+		return search_up_recursive (query, startFolder, filter);
 	return SearchResult { }; // No match
 }
 
-SearchResult startSearch (const std::string &searchString, const XKey::Folder *startFolder) {
-	std::vector<std::string> tokens;
-	tokenize (searchString, &tokens, ' ');
-	return search_down_recursive(tokens, startFolder);
+SearchResult startSearch (const std::string &searchString, const XKey::Folder *startFolder, const SubtreeFilter *filter) {
+	return search_down_recursive(SearchQuery (searchString), startFolder, filter);
 }
 
 const XKey::Folder *getFolderByPath (const XKey::Folder *root, const std::string &search_path) {
 	std::vector<std::string> searchPathComponents;
-	std::vector<std::string>::const_iterator currentSearchPathComponent;
-	if (search_path.size() > 0) {
+	if (search_path.size() > 0)
 		tokenize(search_path, &searchPathComponents, '/');
-		currentSearchPathComponent = searchPathComponents.begin();
-	}
+	std::vector<std::string>::const_iterator currentSearchPathComponent = searchPathComponents.begin();
 	const XKey::Folder *current = root;
 	while (currentSearchPathComponent != searchPathComponents.end() && current) {
 		current = current->getSubfolder(*currentSearchPathComponent++);
@@ -111,21 +245,50 @@ const XKey::Folder *getFolderByPath (const XKey::Folder *root, const std::string
 	return current;
 }
 
+XKey::Folder *getFolderByPath (XKey::Folder *root, const std::string &search_path) {
+	return const_cast<XKey::Folder*> (getFolderByPath ((const XKey::Folder*)root, search_path));
+}
+
 // Folder:
 
-Folder::Folder () :_parent(0) { }
+static uint64_t next_folder_id () {
+	static std::atomic<uint64_t> counter (0);
+	return ++counter;
+}
+
+Folder::Folder () :_parent(0), _id(next_folder_id()) { }
 
-Folder::Folder (const std::string &name, Folder *par, const construct_key &) : _name(name), _parent(par) {}
+Folder::Folder (const std::string &name, Folder *par, const construct_key &) : _name(name), _parent(par), _id(next_folder_id()) {}
 
 void Folder::operator= (Folder &&o) {
+	_id = o._id;
 	_name = std::move(o._name);
 	_entries = std::move(o._entries);
+	_entrySource = std::move(o._entrySource);
 	_subfolders = std::move(o._subfolders);
 	// Fix subfolders parent-ptr
 	for (auto &it : _subfolders)
 		it._parent = this;
 }
 
+void Folder::_copyContentFrom (const Folder &other, bool subfolders) {
+	_name = other._name;
+	_entries = other.entries();
+	if (!subfolders)
+		return;
+	_subfolders.clear();
+	for (const Folder &sub : other._subfolders) {
+		_subfolders.emplace_back (sub._name, this, construct_key{});
+		_subfolders.back()._copyContentFrom (sub);
+	}
+}
+
+RootFolder_Ptr cloneFolderTree (const Folder &source) {
+	RootFolder_Ptr root (new Folder());
+	root->_copyContentFrom (source);
+	return root;
+}
+
 std::string	Folder::fullPath () const {
 	std::string fp;
 	const Folder *p = this;
@@ -138,32 +301,115 @@ std::string	Folder::fullPath () const {
 	return fp;
 }
 
+const std::vector<TreeObserver*> *Folder::_treeObservers () const {
+	const Folder *root = this;
+	while (root->_parent)
+		root = root->_parent;
+	return (root->_observers.empty()) ? 0 : &root->_observers;
+}
+
+void Folder::addObserver (TreeObserver *observer) {
+	if (_parent)
+		throw std::logic_error ("Observers can only be registered at the root folder");
+	_observers.push_back (observer);
+}
+
+void Folder::removeObserver (TreeObserver *observer) {
+	_observers.erase (std::remove(_observers.begin(), _observers.end(), observer), _observers.end());
+}
+
+size_t Folder::entryCount () const {
+	return (_entrySource) ? _entrySource->size() : _entries.size();
+}
+
+void Folder::setEntrySource (std::unique_ptr<EntrySource> source) {
+	if (!_entries.empty() || _entrySource)
+		throw std::logic_error ("Entry source can only be set for folders without entries");
+	_entrySource = std::move(source);
+}
+
+void Folder::_decodeEntries () const {
+	std::deque<Entry> decoded;
+	_entrySource->decode (&decoded);
+	// Decoding does not change the logical state of the folder
+	const_cast<std::deque<Entry>&> (_entries) = std::move(decoded);
+	_entrySource.reset();
+}
+
+void Folder::materialize () const {
+	_materialize();
+	for (const Folder &f : _subfolders)
+		f.materialize();
+}
+
 void Folder::addEntry (Entry entry) {
+	_materialize();
 	_entries.insert (_entries.end(), std::move(entry));
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		for (TreeObserver *o : *obs)
+			o->entryAdded (*this, _entries.size() - 1);
+	}
+}
+
+void Folder::setEntryAt (int index, Entry entry) {
+	_materialize();
+	if (index < 0 || index >= _entries.size())
+		throw std::invalid_argument ("Invalid key-entry index: Can not be replaced");
+	Entry &target = _entries[index];
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		const Entry old = std::move(target);
+		target = std::move(entry);
+		for (TreeObserver *o : *obs)
+			o->entryChanged (*this, index, old);
+	} else {
+		target = std::move(entry);
+	}
 }
 
 void Folder::removeEntry (int index) {
+	_materialize();
 	if (index < 0 || index >= _entries.size())
 		throw std::invalid_argument ("Invalid key-entry index: Can not be removed");
-	_entries.erase(_entries.begin() + index);
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		const Entry old = std::move(_entries[index]);
+		_entries.erase(_entries.begin() + index);
+		for (TreeObserver *o : *obs)
+			o->entryRemoved (*this, index, old);
+	} else {
+		_entries.erase(_entries.begin() + index);
+	}
 }
 
 Entry &Folder::getEntryAt (int index) {
+	_materialize();
 	if (index < 0 || index >= _entries.size())
 		throw std::invalid_argument ("Invalid key-entry index: Can not be found");
 	return *(_entries.begin() + index);
 }
 
-Folder *Folder::createSubfolder (const std::string &name) {
+Folder *Folder::_createSubfolder (const std::string &name) {
 	if (getSubfolder(name))
 		throw std::invalid_argument ("Can not create a second folder with the same name within the same parent");
 	_subfolders.emplace_back (name, this, construct_key{});
 	return &_subfolders.back();
 }
 
+Folder *Folder::createSubfolder (const std::string &name) {
+	Folder *f = _createSubfolder (name);
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		for (TreeObserver *o : *obs)
+			o->folderAdded (*f);
+	}
+	return f;
+}
+
 void Folder::removeSubfolder (int index) {
 	if (index < 0 || index >= subfolders().size())
 		throw std::invalid_argument ("Invalid subfolder index: Can not be removed");
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		for (TreeObserver *o : *obs)
+			o->folderRemoved (*this, _subfolders[index]);
+	}
 	_subfolders.erase(_subfolders.begin() + index);
 }
 
@@ -189,16 +435,28 @@ int Folder::row() const {
 }
 
 void Folder::setName (const std::string &name) {
-	this->_name = name;
+	if (const std::vector<TreeObserver*> *obs = _treeObservers()) {
+		const std::string oldName = std::move(this->_name);
+		this->_name = name;
+		for (TreeObserver *o : *obs)
+			o->folderRenamed (*this, oldName);
+	} else {
+		this->_name = name;
+	}
 }
 
 Folder *moveFolder (Folder *oldFolder, Folder *newParent, int newPosition) {
 	Folder *oldParent = oldFolder->parent();
 	if (!oldParent)
 		return oldFolder;
-	XKey::Folder *newFolder = newParent->createSubfolder(oldFolder->name());
+	const int oldRow = oldFolder->row();
+	XKey::Folder *newFolder = newParent->_createSubfolder(oldFolder->name());
 	*newFolder = std::move(*oldFolder);
-	oldParent->removeSubfolder(oldFolder->row());
+	oldParent->_subfolders.erase(oldParent->_subfolders.begin() + oldRow);
+	if (const std::vector<TreeObserver*> *obs = newFolder->_treeObservers()) {
+		for (TreeObserver *o : *obs)
+			o->folderMoved (*newFolder, *oldParent, oldRow);
+	}
 	return newFolder;
 }
 
@@ -0,0 +1,203 @@
+#include "XKeyAtomicFile.h"
+#include "XKeyBytes.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+// Unix
+#include <fcntl.h>
+#include <sys/acl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/rand.h>
+
+namespace XKey {
+
+/// Number of random names tried before giving up
+static const int NameAttempts = 16;
+
+static std::string directory_of (const std::string &path) {
+	const size_t slash = path.rfind ('/');
+	if (slash == std::string::npos)
+		return ".";
+	return (slash == 0) ? "/" : path.substr (0, slash);
+}
+
+static std::string error_text () {
+	return std::string(strerror(errno));
+}
+
+/// Copy the content of the file @p from to the empty file @p to
+static void copy_content (int from, int to) {
+	char buffer[64 * 1024];
+	bool ok = true;
+	for (off_t offset = 0; ok; ) {
+		const ssize_t r = pread (from, buffer, sizeof(buffer), offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			ok = (r == 0);
+			break;
+		}
+		for (ssize_t done = 0; ok && done < r; ) {
+			const ssize_t w = ::write (to, buffer + done, r - done);
+			if (w >= 0)
+				done += w;
+			else
+				ok = (errno == EINTR);
+		}
+		offset += r;
+	}
+	const std::string error = error_text();
+	wipe (buffer, sizeof(buffer));
+	if (!ok)
+		throw std::runtime_error ("Could not copy the new content: " + error);
+}
+
+/// @return A name for a temporary file next to @p path, with a random suffix
+static std::string temporary_name (const std::string &path) {
+	unsigned char suffix[6];
+	if (!RAND_bytes (suffix, sizeof(suffix)))
+		throw std::runtime_error ("Failed to generate a temporary file name");
+	return path + ".tmp." + to_hex (suffix, sizeof(suffix));
+}
+
+AtomicFile::AtomicFile (const std::string &path, int flags)
+	: _path(path), _fd(-1), _flags(flags)
+{
+#ifdef O_TMPFILE
+	// Fails if the kernel or the file system does not support unnamed files.
+	// Readable, so the content can be copied if the file can not be linked (see _name).
+	if (!(flags & NAMED_TEMPORARY))
+		_fd = ::open (directory_of(path).c_str(), O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+#endif
+	if (_fd < 0)
+		_fd = _createNamed();
+	// The umask may have removed permissions of the owner
+	if (fchmod (_fd, S_IRUSR | S_IWUSR) != 0) {
+		const std::string error = error_text();
+		close (_fd);
+		if (!_tmpPath.empty())
+			unlink (_tmpPath.c_str());
+		throw std::runtime_error ("Could not set permissions on " + path + ": " + error);
+	}
+}
+
+AtomicFile::~AtomicFile () {
+	if (_fd < 0)
+		return;
+	close (_fd);
+	_fd = -1;
+	if (!_tmpPath.empty())
+		unlink (_tmpPath.c_str());
+}
+
+void AtomicFile::commit () {
+	if (_fd < 0)
+		throw std::logic_error ("File " + _path + " was already committed");
+	// Take over mode and access ACL of the file being replaced
+	struct stat st;
+	if (stat (_path.c_str(), &st) == 0) {
+		if (fchmod (_fd, st.st_mode & 07777) != 0)
+			throw std::runtime_error ("Could not set permissions on " + _path + ": " + error_text());
+		if (acl_t acl = acl_get_file (_path.c_str(), ACL_TYPE_ACCESS)) {
+			// Not supported by every file system, the mode is kept then
+			acl_set_fd (_fd, acl);
+			acl_free (acl);
+		}
+	}
+	if (!(_flags & NO_SYNC) && fdatasync (_fd) != 0)
+		throw std::runtime_error ("Failed to flush " + _path + ": " + error_text());
+	// An unnamed file can not replace an existing one, so it is linked to a temporary name first
+	if (_tmpPath.empty())
+		_name();
+	if (rename (_tmpPath.c_str(), _path.c_str()) != 0)
+		throw std::runtime_error ("Could not replace " + _path + ": " + error_text());
+	close (_fd);
+	_fd = -1;
+	_tmpPath.clear();
+	if (!(_flags & (NO_SYNC | NO_DIRECTORY_SYNC)))
+		syncDirectory (_path);
+}
+
+int AtomicFile::_createNamed () {
+	for (int attempt = 0; attempt < NameAttempts; ++attempt) {
+		const std::string name = temporary_name (_path);
+		const int fd = ::open (name.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			_tmpPath = name;
+			return fd;
+		}
+		if (errno != EEXIST)
+			throw std::runtime_error ("Could not create file " + name + ": " + error_text());
+	}
+	throw std::runtime_error ("Could not create a temporary file for " + _path);
+}
+
+void AtomicFile::_name () {
+	const std::string fdPath = "/proc/self/fd/" + std::to_string(_fd);
+	for (int attempt = 0; attempt < NameAttempts; ++attempt) {
+		const std::string name = temporary_name (_path);
+		// /proc may not be mounted, and AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH on kernels before 6.10
+		if (linkat (AT_FDCWD, fdPath.c_str(), AT_FDCWD, name.c_str(), AT_SYMLINK_FOLLOW) == 0 ||
+		    (errno != EEXIST && linkat (_fd, "", AT_FDCWD, name.c_str(), AT_EMPTY_PATH) == 0))
+		{
+			_tmpPath = name;
+			return;
+		}
+		if (errno != EEXIST)
+			break;
+	}
+	_copyToNamed();
+}
+
+void AtomicFile::_copyToNamed () {
+	const int named = _createNamed();
+	try {
+		struct stat st;
+		if (fstat (_fd, &st) != 0 || fchmod (named, st.st_mode & 07777) != 0)
+			throw std::runtime_error ("Could not set permissions on " + _tmpPath + ": " + error_text());
+		if (acl_t acl = acl_get_fd (_fd)) {
+			acl_set_fd (named, acl);
+			acl_free (acl);
+		}
+		copy_content (_fd, named);
+		if (!(_flags & NO_SYNC) && fdatasync (named) != 0)
+			throw std::runtime_error ("Failed to flush " + _tmpPath + ": " + error_text());
+	} catch (...) {
+		close (named);
+		throw;
+	}
+	close (_fd);
+	_fd = named;
+}
+
+void AtomicFile::write (const std::string &path, const std::string &data, int flags) {
+	AtomicFile file (path, flags);
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t r = ::write (file.fd(), data.data() + done, data.size() - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			throw std::runtime_error ("Failed to write " + path + ": " + error_text());
+		done += r;
+	}
+	file.commit();
+}
+
+void AtomicFile::syncDirectory (const std::string &path) {
+	const std::string dir = directory_of (path);
+	int fd = ::open (dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		throw std::runtime_error ("Could not open directory " + dir + ": " + error_text());
+	const int r = fsync (fd);
+	const std::string error = error_text();
+	close (fd);
+	if (r != 0)
+		throw std::runtime_error ("Failed to flush directory " + dir + ": " + error);
+}
+
+}
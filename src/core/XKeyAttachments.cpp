@@ -0,0 +1,260 @@
+#include "XKeyAttachments.h"
+#include "CryptRecord.h"
+#include "XKeyAtomicFile.h"
+#include "XKeyBytes.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <vector>
+// Unix
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/rand.h>
+
+namespace XKey {
+
+static const char BlobHeader[] = "*167110-blob* # v:1 #\n";
+static const size_t BlobHeaderSize = sizeof(BlobHeader) - 1;
+static const size_t RecordLengthSize = 4;
+static const size_t IdLength = 16;
+
+/// Blob ids end up in file names, so only accept the format #add generates
+static bool is_valid_id (const std::string &id) {
+	return id.size() == IdLength * 2 &&
+		std::all_of (id.begin(), id.end(), [] (char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+/// Associated data of a chunk: its position and whether it is the last one, bound to the blob id
+static std::string chunk_ad (const std::string &id, uint64_t index, bool last) {
+	std::string ad = id;
+	for (int i = 0; i < 8; ++i)
+		ad.push_back ((char)((index >> (8 * i)) & 0xff));
+	ad.push_back (last ? '\1' : '\0');
+	return ad;
+}
+
+static void write_all (int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t r = ::write (fd, data, length);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error ("Failed to write attachment: " + std::string(strerror(errno)));
+		}
+		data += r;
+		length -= r;
+	}
+}
+
+static void for_each_attachment (const Folder &folder, const std::function<void(const Attachment&)> &fn) {
+	for (const Entry &e : folder.entries()) {
+		for (const Attachment &a : e.attachments())
+			fn (a);
+	}
+	for (const Folder &f : folder.subfolders())
+		for_each_attachment (f, fn);
+}
+
+/// Write a file that is moved into place once it is complete, so a blob is either missing or complete
+class BlobFileWriter
+{
+public:
+	explicit BlobFileWriter (const std::string &path)
+		: _file(path)
+	{ }
+	void write (const std::string &data) { write_all (_file.fd(), data.data(), data.size()); }
+	void commit () { _file.commit(); }
+private:
+	AtomicFile _file;
+};
+
+// AttachmentStore
+
+AttachmentStore::AttachmentStore (const std::string &keystoreFile)
+	: _dir(directoryName(keystoreFile))
+{ }
+
+std::string AttachmentStore::directoryName (const std::string &keystoreFile) {
+	return keystoreFile + ".attachments";
+}
+
+std::string AttachmentStore::_blobPath (const std::string &id) const {
+	if (!is_valid_id(id))
+		throw std::runtime_error ("Invalid attachment id");
+	return _dir + "/" + id;
+}
+
+void AttachmentStore::_ensureDirectory () const {
+	if (mkdir (_dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+		throw std::runtime_error ("Could not create attachment directory: " + std::string(strerror(errno)));
+}
+
+Attachment AttachmentStore::add (const std::string &name, std::istream &in) {
+	std::string id (IdLength, '\0');
+	if (!RAND_bytes((unsigned char*)&id[0], IdLength))
+		throw std::runtime_error ("Could not generate random bytes to create attachment id");
+	Attachment attachment {to_hex(id), name, 0, RecordCipher::generateKeyMaterial()};
+	std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (attachment.key);
+
+	_ensureDirectory();
+	BlobFileWriter file (_blobPath(attachment.id));
+	file.write (std::string(BlobHeader, BlobHeaderSize));
+	std::string chunk (ChunkSize, '\0');
+	for (uint64_t index = 0; ; ++index) {
+		in.read (&chunk[0], ChunkSize);
+		if (in.bad())
+			throw std::runtime_error ("Failed to read attachment content");
+		const size_t length = in.gcount();
+		const bool last = (length < ChunkSize || in.peek() == std::istream::traits_type::eof());
+		const std::string sealed = cipher->seal (chunk.substr(0, length), chunk_ad(attachment.id, index, last));
+		std::string record (RecordLengthSize, '\0');
+		for (size_t i = 0; i < RecordLengthSize; ++i)
+			record[i] = (char)((sealed.size() >> (8 * i)) & 0xff);
+		file.write (record + sealed);
+		attachment.size += length;
+		if (last)
+			break;
+	}
+	wipe (&chunk);
+	file.commit();
+	return attachment;
+}
+
+Attachment AttachmentStore::addFile (const std::string &path) {
+	std::ifstream in (path, std::ios::binary);
+	if (!in.is_open())
+		throw std::runtime_error ("Could not open file " + path);
+	const size_t slash = path.find_last_of ('/');
+	return add ((slash == std::string::npos) ? path : path.substr(slash + 1), in);
+}
+
+void AttachmentStore::read (const Attachment &attachment, std::ostream &out) const {
+	std::ifstream in (_blobPath(attachment.id), std::ios::binary);
+	if (!in.is_open())
+		throw std::runtime_error ("Attachment " + attachment.name + " is missing");
+	std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (attachment.key);
+	std::string header (BlobHeaderSize, '\0');
+	if (!in.read (&header[0], BlobHeaderSize) || header != BlobHeader)
+		throw std::runtime_error ("Invalid attachment file format");
+
+	uint64_t size = 0;
+	std::string sealed;
+	for (uint64_t index = 0; ; ++index) {
+		unsigned char lengthBytes[RecordLengthSize];
+		if (!in.read ((char*)lengthBytes, RecordLengthSize))
+			throw std::runtime_error ("Attachment file is truncated");
+		size_t length = 0;
+		for (size_t i = 0; i < RecordLengthSize; ++i)
+			length |= (size_t)lengthBytes[i] << (8 * i);
+		if (length < RecordCipher::Overhead || length > ChunkSize + RecordCipher::Overhead)
+			throw std::runtime_error ("Invalid attachment file format");
+		sealed.resize (length);
+		if (!in.read (&sealed[0], length))
+			throw std::runtime_error ("Attachment file is truncated");
+		// The final chunk is marked in its associated data, so truncation at a chunk boundary is detected
+		const bool last = (in.peek() == std::istream::traits_type::eof());
+		std::string chunk = cipher->open (sealed, chunk_ad(attachment.id, index, last));
+		size += chunk.size();
+		out.write (chunk.data(), chunk.size());
+		wipe (&chunk);
+		if (!out)
+			throw std::runtime_error ("Failed to write attachment content");
+		if (last)
+			break;
+	}
+	if (size != attachment.size)
+		throw std::runtime_error ("Attachment " + attachment.name + " has an unexpected size");
+}
+
+void AttachmentStore::extractFile (const Attachment &attachment, const std::string &path) const {
+	std::ofstream out;
+	{
+		// Create the file with restrictive permissions before any content is written
+		int fd = ::open (path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fd < 0)
+			throw std::runtime_error ("Could not create file " + path + ": " + std::string(strerror(errno)));
+		close (fd);
+	}
+	out.open (path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		throw std::runtime_error ("Could not open file " + path);
+	try {
+		read (attachment, out);
+		out.close();
+		if (!out)
+			throw std::runtime_error ("Failed to write file " + path);
+	} catch (...) {
+		out.close();
+		unlink (path.c_str());
+		throw;
+	}
+}
+
+bool AttachmentStore::contains (const Attachment &attachment) const {
+	return access (_blobPath(attachment.id).c_str(), F_OK) == 0;
+}
+
+void AttachmentStore::remove (const Attachment &attachment) {
+	if (unlink (_blobPath(attachment.id).c_str()) != 0 && errno != ENOENT)
+		throw std::runtime_error ("Failed to remove attachment: " + std::string(strerror(errno)));
+}
+
+size_t AttachmentStore::collectGarbage (const Folder &root) {
+	std::set<std::string> referenced;
+	for_each_attachment (root, [&referenced] (const Attachment &a) { referenced.insert (a.id); });
+
+	std::unique_ptr<DIR, int(*)(DIR*)> dir (opendir (_dir.c_str()), &closedir);
+	if (!dir)
+		return 0;
+	std::vector<std::string> unused;
+	while (struct dirent *d = readdir (&*dir)) {
+		const std::string name = d->d_name;
+		// Left behind by an interrupted AtomicFile, named <id>.tmp.<random>
+		const size_t tmp = name.find (".tmp");
+		const bool stale = (tmp != std::string::npos && is_valid_id(name.substr(0, tmp)));
+		if (stale || (is_valid_id(name) && referenced.count(name) == 0))
+			unused.push_back (name);
+	}
+	for (const std::string &name : unused) {
+		if (unlink ((_dir + "/" + name).c_str()) != 0 && errno != ENOENT)
+			throw std::runtime_error ("Failed to remove attachment: " + std::string(strerror(errno)));
+	}
+	return unused.size();
+}
+
+size_t AttachmentStore::copyReferenced (const Folder &root, const AttachmentStore &target) const {
+	if (target._dir == _dir)
+		return 0;
+	std::set<std::string> ids;
+	for_each_attachment (root, [&ids] (const Attachment &a) { ids.insert (a.id); });
+	size_t copied = 0;
+	std::vector<char> buffer (ChunkSize);
+	for (const std::string &id : ids) {
+		if (access (target._blobPath(id).c_str(), F_OK) == 0)
+			continue;
+		std::ifstream in (_blobPath(id), std::ios::binary);
+		if (!in.is_open())
+			throw std::runtime_error ("Attachment " + id + " is missing");
+		target._ensureDirectory();
+		BlobFileWriter file (target._blobPath(id));
+		while (in.read (buffer.data(), buffer.size()) || in.gcount() > 0)
+			file.write (std::string(buffer.data(), in.gcount()));
+		if (in.bad())
+			throw std::runtime_error ("Failed to read attachment " + id);
+		file.commit();
+		++copied;
+	}
+	return copied;
+}
+
+}
@@ -0,0 +1,261 @@
+#include "XKeyBatch.h"
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+namespace XKey {
+
+Batch::Batch (Folder *root)
+	: _root(root), _size(0)
+{
+	if (!root || root->parent())
+		throw std::invalid_argument ("Batch needs a root folder");
+}
+
+void Batch::_checkFolder (const Folder *folder) const {
+	if (!folder)
+		throw std::invalid_argument ("Batch operation without folder");
+	const Folder *f = folder;
+	while (f->parent())
+		f = f->parent();
+	if (f != _root)
+		throw std::invalid_argument ("Folder does not belong to the hierarchy of the batch");
+}
+
+void Batch::addEntry (Folder *folder, Entry entry) {
+	_checkFolder (folder);
+	_changes[folder].added.push_back (std::move(entry));
+	++_size;
+}
+
+void Batch::setEntry (Folder *folder, int index, Entry entry) {
+	_checkFolder (folder);
+	_changes[folder].changed[index] = std::move(entry);
+	++_size;
+}
+
+void Batch::removeEntry (Folder *folder, int index) {
+	_checkFolder (folder);
+	_changes[folder].removed.push_back (index);
+	++_size;
+}
+
+void Batch::moveEntry (Folder *from, int index, Folder *to) {
+	_checkFolder (from);
+	_checkFolder (to);
+	if (index < 0 || index >= (int)from->entries().size())
+		throw std::invalid_argument ("Invalid key-entry index: Can not be moved");
+	Entry entry = from->entries()[index];
+	removeEntry (from, index);
+	addEntry (to, std::move(entry));
+}
+
+void Batch::moveFolder (Folder *folder, Folder *newParent) {
+	_checkFolder (folder);
+	_checkFolder (newParent);
+	_moves.emplace_back (folder, newParent);
+	++_size;
+}
+
+void Batch::rollback () {
+	_changes.clear();
+	_moves.clear();
+	_size = 0;
+}
+
+std::vector<std::pair<std::vector<int>, std::vector<int>>> Batch::_planMoves () const {
+	// Perform the moves on a shadow of the affected part of the hierarchy, to validate them
+	// and to find the row paths of the folders at the time each move is performed.
+	std::map<const Folder*, const Folder*> parents;
+	std::map<const Folder*, std::vector<const Folder*>> children;
+	auto parentOf = [&parents] (const Folder *f) -> const Folder* {
+		auto it = parents.find (f);
+		return (it != parents.end()) ? it->second : f->parent();
+	};
+	auto childrenOf = [&children] (const Folder *f) -> std::vector<const Folder*>& {
+		auto it = children.find (f);
+		if (it == children.end()) {
+			std::vector<const Folder*> list;
+			for (const Folder &c : f->subfolders())
+				list.push_back (&c);
+			it = children.insert (std::make_pair(f, std::move(list))).first;
+		}
+		return it->second;
+	};
+	auto pathOf = [&parentOf, &childrenOf] (const Folder *f) {
+		std::vector<int> path;
+		for (const Folder *p = parentOf(f); p; f = p, p = parentOf(f)) {
+			const std::vector<const Folder*> &siblings = childrenOf (p);
+			path.push_back (std::find(siblings.begin(), siblings.end(), f) - siblings.begin());
+		}
+		std::reverse (path.begin(), path.end());
+		return path;
+	};
+
+	std::vector<std::pair<std::vector<int>, std::vector<int>>> plan;
+	for (const auto &move : _moves) {
+		const Folder *folder = move.first, *target = move.second;
+		const Folder *oldParent = parentOf (folder);
+		if (!oldParent)
+			throw std::invalid_argument ("The root folder can not be moved");
+		if (oldParent == target)
+			throw std::invalid_argument ("Folder " + folder->name() + " is already located in the target folder");
+		for (const Folder *t = target; t; t = parentOf(t)) {
+			if (t == folder)
+				throw std::invalid_argument ("Folder " + folder->name() + " can not be moved into itself");
+		}
+		std::vector<const Folder*> &targetChildren = childrenOf (target);
+		for (const Folder *c : targetChildren) {
+			if (c->name() == folder->name())
+				throw std::invalid_argument ("Target folder already contains a folder named " + folder->name());
+		}
+		plan.emplace_back (pathOf(folder), pathOf(target));
+		std::vector<const Folder*> &siblings = childrenOf (oldParent);
+		siblings.erase (std::find(siblings.begin(), siblings.end(), folder));
+		targetChildren.push_back (folder);
+		parents[folder] = target;
+	}
+	return plan;
+}
+
+void Batch::_applyEntryChanges (const std::vector<TreeObserver*> *observers) {
+	// Rebuild the entry list of every folder in one pass. Entries are moved into the new lists
+	// and only moved back if that fails, so the hierarchy is unchanged on exceptions.
+	enum Origin { ORIGINAL, CHANGED, ADDED };
+	struct Rebuilt {
+		Folder *folder;
+		FolderChanges *changes;
+		std::deque<Entry> entries;
+		std::vector<std::pair<Origin, int>> origins;
+		/// Entries were only added. They were appended at this index instead of rebuilding the list.
+		size_t appendAt;
+	};
+	const size_t NoAppend = (size_t)-1;
+	std::vector<Rebuilt> rebuilt;
+	rebuilt.reserve (_changes.size());
+	try {
+		for (auto &it : _changes) {
+			rebuilt.push_back (Rebuilt {it.first, &it.second, std::deque<Entry>(), std::vector<std::pair<Origin, int>>(), NoAppend});
+			Rebuilt &r = rebuilt.back();
+			std::deque<Entry> &old = r.folder->_entries;
+			if (r.changes->removed.empty() && r.changes->changed.empty()) {
+				// Bulk insertion: the existing entries stay where they are
+				r.origins.reserve (r.changes->added.size());
+				r.appendAt = old.size();
+				for (size_t i = 0; i < r.changes->added.size(); ++i) {
+					old.push_back (std::move(r.changes->added[i]));
+					r.origins.emplace_back (ADDED, i);
+				}
+				continue;
+			}
+			std::vector<bool> removed (old.size(), false);
+			for (int index : r.changes->removed)
+				removed[index] = true;
+			r.origins.reserve (old.size() + r.changes->added.size());
+			for (size_t i = 0; i < old.size(); ++i) {
+				if (removed[i])
+					continue;
+				auto changed = r.changes->changed.find (i);
+				if (changed != r.changes->changed.end()) {
+					r.entries.push_back (std::move(changed->second));
+					r.origins.emplace_back (CHANGED, i);
+				} else {
+					r.entries.push_back (std::move(old[i]));
+					r.origins.emplace_back (ORIGINAL, i);
+				}
+			}
+			for (size_t i = 0; i < r.changes->added.size(); ++i) {
+				r.entries.push_back (std::move(r.changes->added[i]));
+				r.origins.emplace_back (ADDED, i);
+			}
+		}
+	} catch (...) {
+		for (Rebuilt &r : rebuilt) {
+			if (r.appendAt != NoAppend) {
+				for (size_t i = 0; i < r.origins.size(); ++i)
+					r.changes->added[i] = std::move(r.folder->_entries[r.appendAt + i]);
+				r.folder->_entries.resize (r.appendAt);
+				continue;
+			}
+			for (size_t i = 0; i < r.origins.size(); ++i) {
+				const int index = r.origins[i].second;
+				switch (r.origins[i].first) {
+				case ORIGINAL: r.folder->_entries[index] = std::move(r.entries[i]); break;
+				case CHANGED: r.changes->changed[index] = std::move(r.entries[i]); break;
+				case ADDED: r.changes->added[index] = std::move(r.entries[i]); break;
+				}
+			}
+		}
+		throw;
+	}
+	// Install the new lists. The old ones still hold removed and replaced entries for the observers.
+	for (Rebuilt &r : rebuilt) {
+		if (r.appendAt == NoAppend)
+			r.folder->_entries.swap (r.entries);
+	}
+	if (!observers)
+		return;
+	for (TreeObserver *o : *observers)
+		o->batchStarted (*_root);
+	for (Rebuilt &r : rebuilt) {
+		const std::deque<Entry> &old = r.entries;
+		std::vector<int> removed = r.changes->removed;
+		std::sort (removed.rbegin(), removed.rend());
+		for (int index : removed) {
+			for (TreeObserver *o : *observers)
+				o->entryRemoved (*r.folder, index, old[index]);
+		}
+		for (size_t i = 0; i < r.origins.size(); ++i) {
+			if (r.origins[i].first == CHANGED) {
+				for (TreeObserver *o : *observers)
+					o->entryChanged (*r.folder, i, old[r.origins[i].second]);
+			} else if (r.origins[i].first == ADDED) {
+				const int index = (r.appendAt == NoAppend) ? i : r.appendAt + i;
+				for (TreeObserver *o : *observers)
+					o->entryAdded (*r.folder, index);
+			}
+		}
+	}
+}
+
+void Batch::commit () {
+	// Validate everything before touching the hierarchy
+	for (auto &it : _changes) {
+		const int count = it.first->entries().size();
+		std::vector<int> removed = it.second.removed;
+		std::sort (removed.begin(), removed.end());
+		if (std::adjacent_find(removed.begin(), removed.end()) != removed.end())
+			throw std::invalid_argument ("Key-entry is removed twice in the same batch");
+		if (!removed.empty() && (removed.front() < 0 || removed.back() >= count))
+			throw std::invalid_argument ("Invalid key-entry index: Can not be removed");
+		for (const auto &changed : it.second.changed) {
+			if (changed.first < 0 || changed.first >= count)
+				throw std::invalid_argument ("Invalid key-entry index: Can not be replaced");
+			if (std::binary_search(removed.begin(), removed.end(), changed.first))
+				throw std::invalid_argument ("Key-entry is replaced and removed in the same batch");
+		}
+	}
+	const std::vector<std::pair<std::vector<int>, std::vector<int>>> plan = _planMoves();
+
+	const std::vector<TreeObserver*> *observers = _root->_treeObservers();
+	_applyEntryChanges (observers);
+	auto resolve = [this] (const std::vector<int> &path) {
+		Folder *f = _root;
+		for (int row : path)
+			f = &f->subfolders()[row];
+		return f;
+	};
+	for (const auto &move : plan) {
+		Folder *target = resolve (move.second);
+		XKey::moveFolder (resolve(move.first), target, target->subfolders().size());
+	}
+	const size_t operations = _size;
+	rollback();
+	if (observers) {
+		for (TreeObserver *o : *observers)
+			o->batchCommitted (*_root, operations);
+	}
+}
+
+}
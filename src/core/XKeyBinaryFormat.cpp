@@ -0,0 +1,396 @@
+#include "XKeyBinaryFormat.h"
+#include "XKeyBytes.h"
+#include "XKeyThreadPool.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace XKey {
+
+const char BinaryKeystore::Magic[4] = {'X', 'K', 'B', '1'};
+
+/// Sizes of the parts of the body, see BinaryKeystore
+static const size_t PrefixSize = sizeof(BinaryKeystore::Magic) + 8;
+static const size_t CountsSize = 3 * 4 + 8;
+static const size_t StringRefSize = 8;
+static const size_t FolderRecordSize = StringRefSize + 4 * 4;
+static const size_t EntryRecordSize = 6 * StringRefSize + 2 * 4;
+static const size_t AttachmentRecordSize = 3 * StringRefSize + 8;
+
+static inline uint32_t get_u32 (const char *p) {
+	const unsigned char *u = reinterpret_cast<const unsigned char*> (p);
+	return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline uint64_t get_u64 (const char *p) {
+	return (uint64_t)get_u32 (p) | ((uint64_t)get_u32 (p + 4) << 32);
+}
+
+static inline void put_u32 (std::ostream &out, uint32_t v) {
+	const char bytes[4] = {(char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24)};
+	out.write (bytes, sizeof(bytes));
+}
+
+static inline void put_u64 (std::ostream &out, uint64_t v) {
+	put_u32 (out, (uint32_t)v);
+	put_u32 (out, (uint32_t)(v >> 32));
+}
+
+/// Writes string references, assigning consecutive ranges of the blob
+class StringRefWriter
+{
+public:
+	explicit StringRefWriter (std::ostream &out) : _out(out), _offset(0) { }
+
+	void put (const std::string &s) {
+		put_u32 (_out, (uint32_t)_offset);
+		put_u32 (_out, (uint32_t)s.size());
+		_offset += s.size();
+	}
+private:
+	std::ostream &_out;
+	uint64_t _offset;
+};
+
+static void check_count (uint64_t count) {
+	if (count > UINT32_MAX)
+		throw std::runtime_error ("Keystore is too large for the binary format");
+}
+
+void BinaryKeystore::write (std::ostream &out, const Folder &root) {
+	// Breadth-first, so the subfolders of each folder are consecutive
+	std::vector<const Folder*> folders {&root};
+	for (size_t i = 0; i < folders.size(); ++i) {
+		for (const Folder &f : folders[i]->subfolders())
+			folders.push_back (&f);
+	}
+	uint64_t entryCount = 0, attachmentCount = 0, stringsSize = 0;
+	for (const Folder *f : folders) {
+		stringsSize += f->name().size();
+		entryCount += f->entries().size();
+		for (const Entry &e : f->entries()) {
+			stringsSize += e.title().size() + e.username().size() + e.url().size() + e.password().size() +
+				e.email().size() + e.comment().size();
+			attachmentCount += e.attachments().size();
+			for (const Attachment &a : e.attachments())
+				stringsSize += a.id.size() + a.name.size() + a.key.size();
+		}
+	}
+	check_count (folders.size());
+	check_count (entryCount);
+	check_count (attachmentCount);
+	check_count (stringsSize);
+
+	out.write (Magic, sizeof(Magic));
+	put_u64 (out, CountsSize + folders.size() * FolderRecordSize + entryCount * EntryRecordSize +
+		attachmentCount * AttachmentRecordSize + stringsSize);
+	put_u32 (out, (uint32_t)folders.size());
+	put_u32 (out, (uint32_t)entryCount);
+	put_u32 (out, (uint32_t)attachmentCount);
+	put_u64 (out, stringsSize);
+
+	// The blob holds the folder names, then the fields of the entries, then the strings of the attachments
+	StringRefWriter strings (out);
+	uint32_t nextEntry = 0, nextSubfolder = 1;
+	for (const Folder *f : folders) {
+		strings.put (f->name());
+		put_u32 (out, nextEntry);
+		put_u32 (out, (uint32_t)f->entries().size());
+		put_u32 (out, nextSubfolder);
+		put_u32 (out, (uint32_t)f->subfolders().size());
+		nextEntry += f->entries().size();
+		nextSubfolder += f->subfolders().size();
+	}
+	uint32_t nextAttachment = 0;
+	for (const Folder *f : folders) {
+		for (const Entry &e : f->entries()) {
+			for (const std::string *field : {&e.title(), &e.username(), &e.url(), &e.password(), &e.email(), &e.comment()})
+				strings.put (*field);
+			put_u32 (out, nextAttachment);
+			put_u32 (out, (uint32_t)e.attachments().size());
+			nextAttachment += e.attachments().size();
+		}
+	}
+	for (const Folder *f : folders) {
+		for (const Entry &e : f->entries()) {
+			for (const Attachment &a : e.attachments()) {
+				strings.put (a.id);
+				strings.put (a.name);
+				strings.put (a.key);
+				put_u64 (out, a.size);
+			}
+		}
+	}
+
+	for (const Folder *f : folders)
+		out.write (f->name().data(), f->name().size());
+	for (const Folder *f : folders) {
+		for (const Entry &e : f->entries()) {
+			for (const std::string *field : {&e.title(), &e.username(), &e.url(), &e.password(), &e.email(), &e.comment()})
+				out.write (field->data(), field->size());
+		}
+	}
+	for (const Folder *f : folders) {
+		for (const Entry &e : f->entries()) {
+			for (const Attachment &a : e.attachments()) {
+				out.write (a.id.data(), a.id.size());
+				out.write (a.name.data(), a.name.size());
+				out.write (a.key.data(), a.key.size());
+			}
+		}
+	}
+}
+
+bool BinaryKeystore::detect (std::istream &in) {
+	return in.rdbuf()->sgetc() == Magic[0];
+}
+
+BinaryKeystore::BinaryKeystore (std::istream &in)
+	: _folderCount(0), _entryCount(0), _attachmentCount(0),
+	  _folders(nullptr), _entries(nullptr), _attachments(nullptr), _strings(nullptr), _stringsSize(0)
+{
+	char prefix[PrefixSize];
+	if (in.rdbuf()->sgetn (prefix, sizeof(prefix)) != (std::streamsize)sizeof(prefix) ||
+	    !std::equal (Magic, Magic + sizeof(Magic), prefix))
+	{
+		throw std::runtime_error ("Not a binary keystore");
+	}
+	const uint64_t size = get_u64 (prefix + sizeof(Magic));
+	if (size < CountsSize)
+		throw std::runtime_error ("Invalid binary keystore: truncated");
+	// Allocated once, so no copy of the cleartext is left behind by reallocations
+	_data.assign (size, '\0');
+	if (in.rdbuf()->sgetn (&_data[0], size) != (std::streamsize)size)
+		throw std::runtime_error ("Invalid binary keystore: truncated");
+	try {
+		_validate();
+	} catch (...) {
+		// The destructor does not run for an object that was not constructed
+		wipe (&_data);
+		throw;
+	}
+}
+
+BinaryKeystore::BinaryKeystore (std::string body)
+	: _folderCount(0), _entryCount(0), _attachmentCount(0),
+	  _folders(nullptr), _entries(nullptr), _attachments(nullptr), _strings(nullptr), _stringsSize(0)
+{
+	if (body.size() < PrefixSize || !std::equal (Magic, Magic + sizeof(Magic), body.data())) {
+		wipe (&body);
+		throw std::runtime_error ("Not a binary keystore");
+	}
+	const uint64_t size = get_u64 (body.data() + sizeof(Magic));
+	// The body is moved, not copied, so the cleartext exists only once
+	_data = std::move (body);
+	if (size < CountsSize || size > _data.size() - PrefixSize) {
+		wipe (&_data);
+		throw std::runtime_error ("Invalid binary keystore: truncated");
+	}
+	std::copy (_data.begin() + PrefixSize, _data.begin() + PrefixSize + size, _data.begin());
+	wipe (&_data[size], _data.size() - size);
+	_data.resize (size);
+	try {
+		_validate();
+	} catch (...) {
+		// The destructor does not run for an object that was not constructed
+		wipe (&_data);
+		throw;
+	}
+}
+
+BinaryKeystore::~BinaryKeystore () {
+	wipe (&_data);
+}
+
+void BinaryKeystore::_validate () {
+	const char *p = _data.data();
+	_folderCount = get_u32 (p);
+	_entryCount = get_u32 (p + 4);
+	_attachmentCount = get_u32 (p + 8);
+	_stringsSize = get_u64 (p + 12);
+	const uint64_t tablesSize = (uint64_t)_folderCount * FolderRecordSize + (uint64_t)_entryCount * EntryRecordSize +
+		(uint64_t)_attachmentCount * AttachmentRecordSize;
+	if (_folderCount == 0 || _stringsSize > _data.size() || CountsSize + tablesSize != _data.size() - _stringsSize)
+		throw std::runtime_error ("Invalid binary keystore: inconsistent sizes");
+	_folders = p + CountsSize;
+	_entries = _folders + (size_t)_folderCount * FolderRecordSize;
+	_attachments = _entries + (size_t)_entryCount * EntryRecordSize;
+	_strings = _attachments + (size_t)_attachmentCount * AttachmentRecordSize;
+
+	auto check_string = [this] (const char *ref) {
+		if ((uint64_t)get_u32 (ref) + get_u32 (ref + 4) > _stringsSize)
+			throw std::runtime_error ("Invalid binary keystore: string out of range");
+	};
+	// Each folder but the root is a subfolder of an earlier one, and the ranges of entries,
+	// subfolders and attachments follow each other without gaps
+	uint64_t nextEntry = 0, nextSubfolder = 1, nextAttachment = 0;
+	for (uint32_t i = 0; i < _folderCount; ++i) {
+		const char *f = _folders + (size_t)i * FolderRecordSize;
+		check_string (f);
+		if (get_u32 (f + 8) != nextEntry || get_u32 (f + 16) != nextSubfolder || (i > 0 && nextSubfolder <= i))
+			throw std::runtime_error ("Invalid binary keystore: inconsistent folder table");
+		nextEntry += get_u32 (f + 12);
+		nextSubfolder += get_u32 (f + 20);
+	}
+	if (nextEntry != _entryCount || nextSubfolder != _folderCount)
+		throw std::runtime_error ("Invalid binary keystore: inconsistent folder table");
+	for (uint32_t i = 0; i < _entryCount; ++i) {
+		const char *e = _entries + (size_t)i * EntryRecordSize;
+		for (int field = 0; field < 6; ++field)
+			check_string (e + field * StringRefSize);
+		if (get_u32 (e + 6 * StringRefSize) != nextAttachment)
+			throw std::runtime_error ("Invalid binary keystore: inconsistent entry table");
+		nextAttachment += get_u32 (e + 6 * StringRefSize + 4);
+	}
+	if (nextAttachment != _attachmentCount)
+		throw std::runtime_error ("Invalid binary keystore: inconsistent entry table");
+	for (uint32_t i = 0; i < _attachmentCount; ++i) {
+		const char *a = _attachments + (size_t)i * AttachmentRecordSize;
+		for (int field = 0; field < 3; ++field)
+			check_string (a + field * StringRefSize);
+	}
+}
+
+StringView BinaryKeystore::_string (const char *ref) const {
+	return StringView (_strings + get_u32 (ref), get_u32 (ref + 4));
+}
+
+// Views
+
+StringView FolderView::name () const {
+	return _store->_string (_store->_folders + (size_t)_index * FolderRecordSize);
+}
+
+size_t FolderView::entryCount () const {
+	return get_u32 (_store->_folders + (size_t)_index * FolderRecordSize + 12);
+}
+
+EntryView FolderView::entry (size_t index) const {
+	if (index >= entryCount())
+		throw std::out_of_range ("Invalid entry index");
+	return EntryView (_store, get_u32 (_store->_folders + (size_t)_index * FolderRecordSize + 8) + index);
+}
+
+size_t FolderView::subfolderCount () const {
+	return get_u32 (_store->_folders + (size_t)_index * FolderRecordSize + 20);
+}
+
+FolderView FolderView::subfolder (size_t index) const {
+	if (index >= subfolderCount())
+		throw std::out_of_range ("Invalid subfolder index");
+	return FolderView (_store, get_u32 (_store->_folders + (size_t)_index * FolderRecordSize + 16) + index);
+}
+
+bool FolderView::findSubfolder (const std::string &name, FolderView *subfolder) const {
+	for (size_t i = 0; i < subfolderCount(); ++i) {
+		const FolderView sub = this->subfolder (i);
+		if (sub.name() == name) {
+			*subfolder = sub;
+			return true;
+		}
+	}
+	return false;
+}
+
+StringView EntryView::_field (int field) const {
+	return _store->_string (_store->_entries + (size_t)_index * EntryRecordSize + field * StringRefSize);
+}
+
+size_t EntryView::attachmentCount () const {
+	return get_u32 (_store->_entries + (size_t)_index * EntryRecordSize + 6 * StringRefSize + 4);
+}
+
+Attachment EntryView::attachment (size_t index) const {
+	if (index >= attachmentCount())
+		throw std::out_of_range ("Invalid attachment index");
+	const uint32_t first = get_u32 (_store->_entries + (size_t)_index * EntryRecordSize + 6 * StringRefSize);
+	const char *a = _store->_attachments + (size_t)(first + index) * AttachmentRecordSize;
+	return Attachment {_store->_string (a).str(), _store->_string (a + StringRefSize).str(),
+		get_u64 (a + 3 * StringRefSize), _store->_string (a + 2 * StringRefSize).str()};
+}
+
+Entry EntryView::toEntry () const {
+	Entry e (title().str(), username().str(), url().str(), password().str(), email().str(), comment().str());
+	const size_t count = attachmentCount();
+	if (count > 0) {
+		std::vector<Attachment> attachments;
+		attachments.reserve (count);
+		for (size_t i = 0; i < count; ++i)
+			attachments.push_back (attachment (i));
+		e.setAttachments (std::move(attachments));
+	}
+	return e;
+}
+
+// Reading into a folder hierarchy
+
+/**
+ * Copies the entries of a folder out of the cleartext, which is kept until the last folder has been decoded
+ */
+class BinaryEntrySource
+	: public EntrySource
+{
+public:
+	BinaryEntrySource (const std::shared_ptr<const BinaryKeystore> &store, FolderView folder)
+		: _store(store), _folder(folder) { }
+
+	size_t size () const override { return _folder.entryCount(); }
+
+	void decode (std::deque<Entry> *entries) const override {
+		for (size_t i = 0; i < _folder.entryCount(); ++i)
+			entries->push_back (_folder.entry(i).toEntry());
+	}
+private:
+	std::shared_ptr<const BinaryKeystore> _store;
+	FolderView _folder;
+};
+
+static void copy_folder (const std::shared_ptr<const BinaryKeystore> &store, const FolderView &view, Folder *folder, bool lazy) {
+	if (lazy && view.entryCount() > 0) {
+		folder->setEntrySource (std::unique_ptr<EntrySource> (new BinaryEntrySource (store, view)));
+	} else {
+		for (size_t i = 0; i < view.entryCount(); ++i)
+			folder->addEntry (view.entry(i).toEntry());
+	}
+	for (size_t i = 0; i < view.subfolderCount(); ++i) {
+		const FolderView sub = view.subfolder (i);
+		copy_folder (store, sub, folder->createSubfolder (sub.name().str()), lazy);
+	}
+}
+
+void BinaryKeystore::read (std::istream &in, Folder *root, bool lazy) {
+	const std::shared_ptr<const BinaryKeystore> store (new BinaryKeystore (in));
+	const FolderView view = store->root();
+	// The root folder may already have entries, so they are copied right away
+	for (size_t i = 0; i < view.entryCount(); ++i)
+		root->addEntry (view.entry(i).toEntry());
+	for (size_t i = 0; i < view.subfolderCount(); ++i) {
+		const FolderView sub = view.subfolder (i);
+		copy_folder (store, sub, root->createSubfolder (sub.name().str()), lazy);
+	}
+}
+
+void BinaryKeystore::read (std::string body, Folder *root, bool lazy, ThreadPool &pool) {
+	const std::shared_ptr<const BinaryKeystore> store (new BinaryKeystore (std::move(body)));
+	const FolderView view = store->root();
+	for (size_t i = 0; i < view.entryCount(); ++i)
+		root->addEntry (view.entry(i).toEntry());
+	std::vector<RootFolder_Ptr> parts (view.subfolderCount());
+	std::vector<ThreadPool::Task> tasks;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		tasks.push_back ([&store, &view, &parts, i, lazy] () {
+			const FolderView sub = view.subfolder (i);
+			parts[i] = createRootFolder();
+			copy_folder (store, sub, parts[i]->createSubfolder (sub.name().str()), lazy);
+		});
+	}
+	pool.run (std::move(tasks));
+	for (RootFolder_Ptr &part : parts) {
+		Folder &sub = part->subfolders().front();
+		*root->createSubfolder (sub.name()) = std::move (sub);
+	}
+}
+
+}
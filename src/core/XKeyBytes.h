@@ -0,0 +1,61 @@
+#pragma once
+
+// Helpers for binary strings shared by the core sources; not part of the public interface
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+#include <openssl/crypto.h>
+
+namespace XKey {
+
+/// @return Lower case hexadecimal representation of @p length bytes at @p data
+inline std::string to_hex (const unsigned char *data, size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	std::string out;
+	out.reserve (length * 2);
+	for (size_t i = 0; i < length; ++i) {
+		out.push_back (digits[data[i] >> 4]);
+		out.push_back (digits[data[i] & 0xf]);
+	}
+	return out;
+}
+
+inline std::string to_hex (const std::string &in) {
+	return to_hex ((const unsigned char*)in.data(), in.size());
+}
+
+/// @throw std::runtime_error if @p in is not an even number of hexadecimal digits
+inline std::string from_hex (const std::string &in) {
+	if (in.size() % 2 != 0)
+		throw std::runtime_error ("Invalid hexadecimal format");
+	std::string out;
+	out.reserve (in.size() / 2);
+	for (size_t i = 0; i < in.size(); i += 2) {
+		int v = 0;
+		for (size_t j = i; j < i + 2; ++j) {
+			const char c = in[j];
+			v <<= 4;
+			if (c >= '0' && c <= '9') v |= c - '0';
+			else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+			else throw std::runtime_error ("Invalid hexadecimal format");
+		}
+		out.push_back ((char)v);
+	}
+	return out;
+}
+
+/// Overwrite @p size bytes at @p data in a way the compiler does not optimize away
+inline void wipe (void *data, size_t size) {
+	if (size > 0)
+		OPENSSL_cleanse (data, size);
+}
+
+inline void wipe (std::string *s) {
+	if (!s->empty())
+		wipe (&(*s)[0], s->size());
+}
+
+}
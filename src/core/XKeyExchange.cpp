@@ -0,0 +1,816 @@
+#include "XKeyExchange.h"
+#include "XKeyBatch.h"
+#include "XKeyJsonScanner.h"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace XKey {
+
+/// Entries staged in one #Batch while importing
+static const size_t ImportBatchSize = 4096;
+
+static std::string to_lower (std::string s) {
+	std::transform (s.begin(), s.end(), s.begin(), [] (unsigned char c) { return std::tolower(c); });
+	return s;
+}
+
+static bool ends_with (const std::string &s, const char *suffix) {
+	const size_t n = strlen (suffix);
+	return s.size() >= n && s.compare (s.size() - n, n, suffix) == 0;
+}
+
+ExchangeFormat exchangeFormatFromName (const std::string &name) {
+	const std::string n = to_lower (name);
+	if (n == "csv" || ends_with (n, ".csv"))
+		return ExchangeFormat::CSV;
+	if (n == "ndjson" || n == "jsonl" || ends_with (n, ".ndjson") || ends_with (n, ".jsonl"))
+		return ExchangeFormat::NDJSON;
+	if (n == "keepass" || n == "xml" || ends_with (n, ".xml"))
+		return ExchangeFormat::KEEPASS_XML;
+	throw std::invalid_argument ("Unknown exchange format '" + name + "'. Use csv, ndjson or keepass");
+}
+
+// Reading
+
+/// Character input that counts lines for error messages
+class InputReader
+{
+public:
+	static const int End = std::char_traits<char>::eof();
+
+	explicit InputReader (std::streambuf *in) : _in(in), _line(1) { }
+
+	int peek () { return _in->sgetc(); }
+
+	int get () {
+		const int c = _in->sbumpc();
+		if (c == '\n')
+			++_line;
+		return c;
+	}
+
+	/// Read up to the next newline. @return false at the end of the input
+	bool getLine (std::string *line) {
+		line->clear();
+		int c = get();
+		if (c == End)
+			return false;
+		for (; c != End && c != '\n'; c = get())
+			line->push_back ((char)c);
+		if (!line->empty() && line->back() == '\r')
+			line->pop_back();
+		return true;
+	}
+
+	size_t line () const { return _line; }
+
+	void fail (const std::string &msg) const {
+		throw std::runtime_error (msg + " in line " + std::to_string(_line));
+	}
+private:
+	std::streambuf *_in;
+	size_t _line;
+};
+
+/// Inserts imported entries in batches, creating their folders on the way
+class ImportSink
+{
+public:
+	explicit ImportSink (Folder *target)
+		: _target(target), _batch(root_of (target)), _default(nullptr), _count(0) { }
+
+	Folder *target () const { return _target; }
+
+	/// @return The folder for records without a folder
+	Folder *defaultFolder () {
+		if (!_default)
+			_default = _target->parent() ? _target : subfolder (_target, "Imported");
+		return _default;
+	}
+
+	/// @return The subfolder @p name of @p parent. It is created if it does not exist.
+	Folder *subfolder (Folder *parent, const std::string &name) {
+		Folder *f = parent->getSubfolder (name);
+		return f ? f : parent->createSubfolder (name);
+	}
+
+	/// @return The folder at @p path below the target, like `/Team/Servers`. Missing folders are created.
+	Folder *folder (const std::string &path) {
+		auto it = _folders.find (path);
+		if (it != _folders.end())
+			return it->second;
+		Folder *f = _target;
+		size_t begin = 0;
+		while (begin < path.size()) {
+			size_t end = path.find ('/', begin);
+			if (end == std::string::npos)
+				end = path.size();
+			if (end > begin)
+				f = subfolder (f, path.substr (begin, end - begin));
+			begin = end + 1;
+		}
+		if (f == _target)
+			f = defaultFolder();
+		_folders[path] = f;
+		return f;
+	}
+
+	void add (Folder *folder, Entry entry) {
+		_batch.addEntry (folder, std::move(entry));
+		++_count;
+		if (_batch.size() >= ImportBatchSize)
+			_batch.commit();
+	}
+
+	/// Insert the remaining entries. @return Number of imported entries
+	size_t finish () {
+		_batch.commit();
+		return _count;
+	}
+private:
+	Folder *_target;
+	Batch _batch;
+	Folder *_default;
+	/// Folders by path, as most records are in the same folder as the one before
+	std::unordered_map<std::string, Folder*> _folders;
+	size_t _count;
+
+	static Folder *root_of (Folder *f) {
+		while (f->parent())
+			f = f->parent();
+		return f;
+	}
+};
+
+// CSV
+
+enum CsvColumn { COLUMN_GROUP, COLUMN_TITLE, COLUMN_USERNAME, COLUMN_PASSWORD, COLUMN_URL, COLUMN_EMAIL, COLUMN_COMMENT, COLUMN_IGNORED };
+
+/// Column names of XKey, KeePass, Bitwarden, LastPass and others
+static const struct { const char *name; CsvColumn column; } CsvColumnNames[] = {
+	{"group", COLUMN_GROUP}, {"folder", COLUMN_GROUP}, {"path", COLUMN_GROUP}, {"grouping", COLUMN_GROUP},
+	{"title", COLUMN_TITLE}, {"name", COLUMN_TITLE}, {"account", COLUMN_TITLE},
+	{"username", COLUMN_USERNAME}, {"user", COLUMN_USERNAME}, {"user name", COLUMN_USERNAME}, {"login", COLUMN_USERNAME},
+	{"login name", COLUMN_USERNAME}, {"login_username", COLUMN_USERNAME},
+	{"password", COLUMN_PASSWORD}, {"login_password", COLUMN_PASSWORD},
+	{"url", COLUMN_URL}, {"website", COLUMN_URL}, {"web site", COLUMN_URL}, {"uri", COLUMN_URL}, {"login_uri", COLUMN_URL},
+	{"email", COLUMN_EMAIL}, {"e-mail", COLUMN_EMAIL},
+	{"comment", COLUMN_COMMENT}, {"comments", COLUMN_COMMENT}, {"notes", COLUMN_COMMENT}, {"note", COLUMN_COMMENT},
+	{"extra", COLUMN_COMMENT},
+};
+
+/// Read one record into @p fields. @return false at the end of the input
+static bool read_csv_record (InputReader &in, std::vector<std::string> *fields) {
+	fields->clear();
+	if (in.peek() == InputReader::End)
+		return false;
+	fields->emplace_back();
+	bool quoted = false, atStart = true;
+	for (;;) {
+		const int c = in.get();
+		if (quoted) {
+			if (c == InputReader::End)
+				in.fail ("Unterminated quoted field");
+			if (c == '"' && in.peek() == '"') {
+				in.get();
+				fields->back().push_back ('"');
+			} else if (c == '"') {
+				quoted = false;
+			} else {
+				fields->back().push_back ((char)c);
+			}
+			continue;
+		}
+		if (c == InputReader::End || c == '\n')
+			return true;
+		if (c == '\r') {
+			if (in.peek() == '\n')
+				in.get();
+			return true;
+		}
+		if (c == ',') {
+			fields->emplace_back();
+			atStart = true;
+		} else if (c == '"' && atStart) {
+			quoted = true;
+			atStart = false;
+		} else {
+			fields->back().push_back ((char)c);
+			atStart = false;
+		}
+	}
+}
+
+static void import_csv (InputReader &in, ImportSink &sink) {
+	std::vector<std::string> fields;
+	if (!read_csv_record (in, &fields))
+		in.fail ("Missing CSV header");
+	// A byte order mark, as written by spreadsheet applications
+	if (fields[0].compare (0, 3, "\xef\xbb\xbf") == 0)
+		fields[0].erase (0, 3);
+	std::vector<CsvColumn> columns;
+	bool known = false;
+	for (const std::string &f : fields) {
+		std::string name = to_lower (f);
+		name.erase (0, name.find_first_not_of (' '));
+		name.erase (name.find_last_not_of (' ') + 1);
+		CsvColumn column = COLUMN_IGNORED;
+		for (const auto &c : CsvColumnNames) {
+			if (name == c.name && std::find (columns.begin(), columns.end(), c.column) == columns.end())
+				column = c.column;
+		}
+		columns.push_back (column);
+		known |= (column != COLUMN_IGNORED && column != COLUMN_GROUP);
+	}
+	if (!known)
+		in.fail ("CSV header does not name any entry field");
+
+	while (read_csv_record (in, &fields)) {
+		if (fields.size() == 1 && fields[0].empty())
+			continue;
+		std::string values[COLUMN_IGNORED];
+		for (size_t i = 0; i < fields.size() && i < columns.size(); ++i) {
+			if (columns[i] != COLUMN_IGNORED)
+				values[columns[i]].swap (fields[i]);
+		}
+		sink.add (sink.folder (values[COLUMN_GROUP]), Entry (std::move(values[COLUMN_TITLE]), std::move(values[COLUMN_USERNAME]),
+			std::move(values[COLUMN_URL]), std::move(values[COLUMN_PASSWORD]), std::move(values[COLUMN_EMAIL]),
+			std::move(values[COLUMN_COMMENT])));
+	}
+}
+
+// NDJSON
+
+static const char *const RecordFields[] = {"path", "title", "username", "url", "password", "email", "comment"};
+
+/// Decode the record in @p line. Read with the scanner of the keystore parser, so strings may contain NUL characters.
+/// @param fields Receives the members named like #RecordFields, empty if missing or null
+static void read_record (const std::string &line, size_t number, std::string (&fields)[7]) {
+	for (std::string &f : fields)
+		f.clear();
+	JsonScanner s (line.data(), line.data() + line.size());
+	try {
+		s.expect ('{');
+		if (!s.consume('}')) {
+			std::string name;
+			do {
+				s.readString (&name);
+				s.expect (':');
+				const auto field = std::find_if (std::begin(RecordFields), std::end(RecordFields), [&name] (const char *f) { return name == f; });
+				if (field == std::end(RecordFields)) {
+					s.skipValue();
+				} else if (s.peek() == 'n') {
+					s.skipValue();
+					fields[field - std::begin(RecordFields)].clear();
+				} else if (s.peek() == '"') {
+					s.readString (&fields[field - std::begin(RecordFields)]);
+				} else {
+					s.fail ("Member '" + name + "' is not a string");
+				}
+			} while (s.consume(','));
+			s.expect ('}');
+		}
+		if (!s.atEnd())
+			s.fail ("Unexpected content after the object");
+	} catch (const std::runtime_error &e) {
+		throw std::runtime_error ("Invalid Json object in line " + std::to_string(number) + ": " + e.what());
+	}
+}
+
+static void import_ndjson (InputReader &in, ImportSink &sink) {
+	std::string line;
+	std::string fields[7];
+	for (size_t number = 1; in.getLine (&line); number = in.line()) {
+		if (line.find_first_not_of (" \t") == std::string::npos)
+			continue;
+		read_record (line, number, fields);
+		sink.add (sink.folder (fields[0]), Entry (std::move(fields[1]), std::move(fields[2]), std::move(fields[3]),
+			std::move(fields[4]), std::move(fields[5]), std::move(fields[6])));
+	}
+}
+
+// KeePass XML
+
+/// Minimal pull parser for XML as written by KeePass: elements, attributes, text, CDATA and comments
+class XmlReader
+{
+public:
+	enum Token { START, END, TEXT, END_OF_INPUT };
+
+	explicit XmlReader (InputReader &in) : _in(in), _pendingEnd(false) { }
+
+	/// Read the next token. A self-closing element yields START and END.
+	Token next () {
+		if (_pendingEnd) {
+			_pendingEnd = false;
+			return END;
+		}
+		for (;;) {
+			const int c = _in.peek();
+			if (c == InputReader::End)
+				return END_OF_INPUT;
+			if (c != '<') {
+				_text.clear();
+				while (_in.peek() != '<' && _in.peek() != InputReader::End)
+					_readChar (&_text);
+				return TEXT;
+			}
+			_in.get();
+			const int d = _in.peek();
+			if (d == '?') {
+				_skipPast ("?>");
+			} else if (d == '!') {
+				_in.get();
+				if (_in.peek() == '-') {
+					_expect ("--");
+					_skipPast ("-->");
+				} else if (_in.peek() == '[') {
+					_expect ("[CDATA[");
+					_text.clear();
+					_readPast ("]]>", &_text);
+					return TEXT;
+				} else {
+					_skipDeclaration();
+				}
+			} else if (d == '/') {
+				_in.get();
+				_readName (&_name);
+				_skipSpace();
+				_expect (">");
+				return END;
+			} else {
+				_readStartTag();
+				return START;
+			}
+		}
+	}
+
+	/// Name of the element of the last START or END
+	const std::string &name () const { return _name; }
+	/// Content of the last TEXT
+	const std::string &text () const { return _text; }
+
+	/// @return The value of attribute @p name of the last START, or an empty string
+	std::string attribute (const char *name) const {
+		for (const auto &a : _attributes) {
+			if (a.first == name)
+				return a.second;
+		}
+		return std::string();
+	}
+
+	/// Skip the content of the element of the last START, including its end tag
+	void skipElement () {
+		for (int depth = 1; depth > 0; ) {
+			switch (next()) {
+			case START: ++depth; break;
+			case END: --depth; break;
+			case TEXT: break;
+			case END_OF_INPUT: _in.fail ("Unexpected end of XML");
+			}
+		}
+	}
+
+	/// @return The text content of the element of the last START, up to and including its end tag
+	std::string readText () {
+		std::string text;
+		for (;;) {
+			switch (next()) {
+			case START: skipElement(); break;
+			case END: return text;
+			case TEXT: text += _text; break;
+			case END_OF_INPUT: _in.fail ("Unexpected end of XML");
+			}
+		}
+	}
+
+	const InputReader &input () const { return _in; }
+private:
+	InputReader &_in;
+	std::string _name, _text;
+	std::vector<std::pair<std::string, std::string>> _attributes;
+	bool _pendingEnd;
+
+	int _get () {
+		const int c = _in.get();
+		if (c == InputReader::End)
+			_in.fail ("Unexpected end of XML");
+		return c;
+	}
+
+	void _expect (const char *s) {
+		for (; *s; ++s) {
+			if (_get() != *s)
+				_in.fail ("Invalid XML");
+		}
+	}
+
+	void _skipSpace () {
+		while (isspace (_in.peek()))
+			_in.get();
+	}
+
+	/// Read up to and including @p end, appending the characters before it to @p out
+	void _readPast (const char *end, std::string *out) {
+		const size_t n = strlen (end);
+		std::string tail;
+		for (;;) {
+			tail.push_back ((char)_get());
+			if (tail.size() >= n && tail.compare (tail.size() - n, n, end) == 0) {
+				out->append (tail, 0, tail.size() - n);
+				return;
+			}
+			if (tail.size() > 64) {
+				out->append (tail, 0, tail.size() - n);
+				tail.erase (0, tail.size() - n);
+			}
+		}
+	}
+
+	void _skipPast (const char *end) {
+		std::string ignored;
+		_readPast (end, &ignored);
+	}
+
+	/// Skip a declaration like <!DOCTYPE ...>, including an internal subset in brackets
+	void _skipDeclaration () {
+		int depth = 0;
+		for (int c = _get(); c != '>' || depth > 0; c = _get()) {
+			if (c == '[')
+				++depth;
+			else if (c == ']')
+				--depth;
+		}
+	}
+
+	void _readName (std::string *name) {
+		name->clear();
+		while (_in.peek() != InputReader::End && !isspace (_in.peek()) && _in.peek() != '>' && _in.peek() != '/' && _in.peek() != '=')
+			name->push_back ((char)_in.get());
+		if (name->empty())
+			_in.fail ("Invalid XML name");
+	}
+
+	void _readStartTag () {
+		_readName (&_name);
+		_attributes.clear();
+		for (;;) {
+			_skipSpace();
+			const int c = _in.peek();
+			if (c == '/') {
+				_in.get();
+				_expect (">");
+				_pendingEnd = true;
+				return;
+			}
+			if (c == '>') {
+				_in.get();
+				return;
+			}
+			_attributes.emplace_back();
+			_readName (&_attributes.back().first);
+			_skipSpace();
+			_expect ("=");
+			_skipSpace();
+			const int quote = _get();
+			if (quote != '"' && quote != '\'')
+				_in.fail ("Invalid XML attribute");
+			while (_in.peek() != quote)
+				_readChar (&_attributes.back().second);
+			_in.get();
+		}
+	}
+
+	/// Read a character or an entity reference
+	void _readChar (std::string *out) {
+		const int c = _get();
+		if (c != '&') {
+			out->push_back ((char)c);
+			return;
+		}
+		std::string entity;
+		for (int d = _get(); d != ';'; d = _get()) {
+			entity.push_back ((char)d);
+			if (entity.size() > 10)
+				_in.fail ("Invalid XML entity");
+		}
+		if (entity == "lt") out->push_back ('<');
+		else if (entity == "gt") out->push_back ('>');
+		else if (entity == "amp") out->push_back ('&');
+		else if (entity == "quot") out->push_back ('"');
+		else if (entity == "apos") out->push_back ('\'');
+		else if (entity.size() > 1 && entity[0] == '#') {
+			const bool hex = (entity[1] == 'x' || entity[1] == 'X');
+			const std::string digits = entity.substr (hex ? 2 : 1);
+			if (digits.empty() || digits.find_first_not_of (hex ? "0123456789abcdefABCDEF" : "0123456789") != std::string::npos)
+				_in.fail ("Invalid XML character reference");
+			_appendUtf8 (out, std::stoul (digits, nullptr, hex ? 16 : 10));
+		} else {
+			_in.fail ("Unknown XML entity &" + entity + ";");
+		}
+	}
+
+	void _appendUtf8 (std::string *out, unsigned long cp) {
+		if (cp < 0x80) {
+			out->push_back ((char)cp);
+		} else if (cp < 0x800) {
+			out->push_back ((char)(0xC0 | (cp >> 6)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		} else if (cp < 0x10000) {
+			out->push_back ((char)(0xE0 | (cp >> 12)));
+			out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		} else if (cp < 0x110000) {
+			out->push_back ((char)(0xF0 | (cp >> 18)));
+			out->push_back ((char)(0x80 | ((cp >> 12) & 0x3F)));
+			out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		} else {
+			_in.fail ("Invalid XML character reference");
+		}
+	}
+};
+
+static Entry read_keepass_entry (XmlReader &xml) {
+	std::string title, username, url, password, email, comment, extra;
+	for (XmlReader::Token t; (t = xml.next()) != XmlReader::END; ) {
+		if (t == XmlReader::END_OF_INPUT)
+			xml.input().fail ("Unexpected end of XML");
+		if (t != XmlReader::START)
+			continue;
+		if (xml.name() != "String") {
+			// Times, AutoType, History with the previous versions of the entry, ...
+			xml.skipElement();
+			continue;
+		}
+		std::string key, value;
+		for (XmlReader::Token s; (s = xml.next()) != XmlReader::END; ) {
+			if (s == XmlReader::END_OF_INPUT)
+				xml.input().fail ("Unexpected end of XML");
+			if (s != XmlReader::START)
+				continue;
+			if (xml.name() == "Key") {
+				key = xml.readText();
+			} else if (xml.name() == "Value") {
+				if (to_lower (xml.attribute ("Protected")) == "true")
+					xml.input().fail ("Encrypted field. Export the database as 'KeePass XML (2.x)' instead");
+				value = xml.readText();
+			} else {
+				xml.skipElement();
+			}
+		}
+		if (key == "Title") title.swap (value);
+		else if (key == "UserName") username.swap (value);
+		else if (key == "URL") url.swap (value);
+		else if (key == "Password") password.swap (value);
+		else if (key == "Notes") comment.swap (value);
+		else if (to_lower (key) == "email" || to_lower (key) == "e-mail") email.swap (value);
+		else if (!value.empty()) extra += "\n" + key + ": " + value;
+	}
+	// Custom fields are kept in the comment, after the notes
+	if (!extra.empty())
+		comment += comment.empty() ? extra.substr (1) : extra;
+	return Entry (std::move(title), std::move(username), std::move(url), std::move(password), std::move(email), std::move(comment));
+}
+
+/// @param parent Folder for the group, nullptr for the top-level group of KeePass
+static void read_keepass_group (XmlReader &xml, ImportSink &sink, Folder *parent) {
+	Folder *folder = nullptr;
+	for (XmlReader::Token t; (t = xml.next()) != XmlReader::END; ) {
+		if (t == XmlReader::END_OF_INPUT)
+			xml.input().fail ("Unexpected end of XML");
+		if (t != XmlReader::START)
+			continue;
+		const std::string element = xml.name();
+		if (element == "Name" && !folder) {
+			// The top-level group (named after the database) is the import target itself
+			const std::string name = xml.readText();
+			folder = parent ? sink.subfolder (parent, name) : sink.target();
+		} else if (element == "Entry" || element == "Group") {
+			if (!folder)
+				xml.input().fail ("Group without name");
+			if (element == "Entry")
+				sink.add (parent ? folder : sink.defaultFolder(), read_keepass_entry (xml));
+			else
+				read_keepass_group (xml, sink, folder);
+		} else {
+			xml.skipElement();
+		}
+	}
+}
+
+static void import_keepass (InputReader &in, ImportSink &sink) {
+	XmlReader xml (in);
+	XmlReader::Token t;
+	while ((t = xml.next()) == XmlReader::TEXT)
+		;
+	if (t != XmlReader::START || xml.name() != "KeePassFile")
+		in.fail ("Not a KeePass XML file");
+	while ((t = xml.next()) != XmlReader::END) {
+		if (t == XmlReader::END_OF_INPUT)
+			in.fail ("Unexpected end of XML");
+		if (t != XmlReader::START)
+			continue;
+		if (xml.name() != "Root") {
+			// Meta
+			xml.skipElement();
+			continue;
+		}
+		while ((t = xml.next()) != XmlReader::END) {
+			if (t == XmlReader::END_OF_INPUT)
+				in.fail ("Unexpected end of XML");
+			if (t == XmlReader::START && xml.name() == "Group")
+				read_keepass_group (xml, sink, nullptr);
+			else if (t == XmlReader::START)
+				xml.skipElement(); // DeletedObjects
+		}
+	}
+}
+
+size_t importEntries (std::istream &in, ExchangeFormat format, Folder *target) {
+	if (!target)
+		throw std::invalid_argument ("Need a folder to import entries into");
+	InputReader reader (in.rdbuf());
+	ImportSink sink (target);
+	try {
+		switch (format) {
+		case ExchangeFormat::CSV: import_csv (reader, sink); break;
+		case ExchangeFormat::NDJSON: import_ndjson (reader, sink); break;
+		case ExchangeFormat::KEEPASS_XML: import_keepass (reader, sink); break;
+		}
+	} catch (...) {
+		// Keep the records read so far, as documented
+		sink.finish();
+		throw;
+	}
+	return sink.finish();
+}
+
+// Writing
+
+static void write_csv_field (std::ostream &out, const std::string &s) {
+	if (s.find_first_of (",\"\r\n") == std::string::npos && (s.empty() || (s.front() != ' ' && s.back() != ' '))) {
+		out << s;
+		return;
+	}
+	out.put ('"');
+	for (char c : s) {
+		if (c == '"')
+			out.put ('"');
+		out.put (c);
+	}
+	out.put ('"');
+}
+
+static void write_csv (std::ostream &out, const Folder &folder, const std::string &path, size_t *count) {
+	for (const Entry &e : folder.entries()) {
+		for (const std::string *field : {&path, &e.title(), &e.username(), &e.password(), &e.url(), &e.email(), &e.comment()}) {
+			if (field != &path)
+				out.put (',');
+			write_csv_field (out, *field);
+		}
+		out.put ('\n');
+		++*count;
+	}
+	for (const Folder &f : folder.subfolders())
+		write_csv (out, f, path + "/" + f.name(), count);
+}
+
+/// @return @p s as quoted Json string, escaped like Json::FastWriter does.
+/// Unlike Json::valueToQuotedString, this does not stop at an embedded NUL character.
+static std::string json_quoted (const std::string &s) {
+	static const char digits[] = "0123456789ABCDEF";
+	std::string out;
+	out.reserve (s.size() + 2);
+	out.push_back ('"');
+	for (char c : s) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\b': out += "\\b"; break;
+		case '\f': out += "\\f"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if ((unsigned char)c < 0x20) {
+				const char escape[] = {'\\', 'u', '0', '0', digits[(c >> 4) & 0xf], digits[c & 0xf]};
+				out.append (escape, sizeof(escape));
+			} else {
+				out.push_back (c);
+			}
+		}
+	}
+	out.push_back ('"');
+	return out;
+}
+
+static void write_ndjson (std::ostream &out, const Folder &folder, const std::string &path, size_t *count) {
+	const std::string quotedPath = json_quoted (path);
+	for (const Entry &e : folder.entries()) {
+		// Members in the order of Json::FastWriter, as in the keystore
+		out << "{\"comment\":" << json_quoted (e.comment())
+		    << ",\"email\":" << json_quoted (e.email())
+		    << ",\"password\":" << json_quoted (e.password())
+		    << ",\"path\":" << quotedPath
+		    << ",\"title\":" << json_quoted (e.title())
+		    << ",\"url\":" << json_quoted (e.url())
+		    << ",\"username\":" << json_quoted (e.username()) << "}\n";
+		++*count;
+	}
+	for (const Folder &f : folder.subfolders())
+		write_ndjson (out, f, path + "/" + f.name(), count);
+}
+
+/// Write @p s as XML text. Characters that XML 1.0 does not allow are dropped, as KeePass does.
+static void write_xml_text (std::ostream &out, const std::string &s) {
+	for (char c : s) {
+		switch (c) {
+		case '<': out << "&lt;"; break;
+		case '>': out << "&gt;"; break;
+		case '&': out << "&amp;"; break;
+		case '"': out << "&quot;"; break;
+		default:
+			if ((unsigned char)c >= 0x20 || c == '\t' || c == '\n' || c == '\r')
+				out.put (c);
+		}
+	}
+}
+
+/// KeePass identifies groups and entries by a random UUID
+static void write_xml_uuid (std::ostream &out, const std::string &indent) {
+	unsigned char uuid[16], encoded[32];
+	if (!RAND_bytes (uuid, sizeof(uuid)))
+		throw std::runtime_error ("Could not generate random bytes for a UUID");
+	const int length = EVP_EncodeBlock (encoded, uuid, sizeof(uuid));
+	out << indent << "<UUID>";
+	out.write ((const char*)encoded, length);
+	out << "</UUID>\n";
+}
+
+static void write_keepass_string (std::ostream &out, const std::string &indent, const char *key, const std::string &value,
+                                  bool protect = false) {
+	out << indent << "<String>\n" << indent << "\t<Key>" << key << "</Key>\n" << indent << "\t<Value"
+	    << (protect ? " ProtectInMemory=\"True\">" : ">");
+	write_xml_text (out, value);
+	out << "</Value>\n" << indent << "</String>\n";
+}
+
+static void write_keepass_group (std::ostream &out, const Folder &folder, const std::string &name, int depth, size_t *count) {
+	const std::string indent (depth, '\t'), inner (depth + 1, '\t');
+	out << indent << "<Group>\n";
+	write_xml_uuid (out, inner);
+	out << inner << "<Name>";
+	write_xml_text (out, name);
+	out << "</Name>\n";
+	for (const Entry &e : folder.entries()) {
+		out << inner << "<Entry>\n";
+		const std::string fields = inner + "\t";
+		write_xml_uuid (out, fields);
+		write_keepass_string (out, fields, "Title", e.title());
+		write_keepass_string (out, fields, "UserName", e.username());
+		write_keepass_string (out, fields, "Password", e.password(), true);
+		write_keepass_string (out, fields, "URL", e.url());
+		write_keepass_string (out, fields, "Notes", e.comment());
+		if (!e.email().empty())
+			write_keepass_string (out, fields, "Email", e.email());
+		out << inner << "</Entry>\n";
+		++*count;
+	}
+	for (const Folder &f : folder.subfolders())
+		write_keepass_group (out, f, f.name(), depth + 1, count);
+	out << indent << "</Group>\n";
+}
+
+size_t exportEntries (std::ostream &out, ExchangeFormat format, const Folder &root) {
+	size_t count = 0;
+	switch (format) {
+	case ExchangeFormat::CSV:
+		out << "group,title,username,password,url,email,comment\n";
+		write_csv (out, root, std::string(), &count);
+		break;
+	case ExchangeFormat::NDJSON:
+		write_ndjson (out, root, std::string(), &count);
+		break;
+	case ExchangeFormat::KEEPASS_XML:
+		out << "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\n<KeePassFile>\n\t<Root>\n";
+		write_keepass_group (out, root, root.name().empty() ? "XKey" : root.name(), 2, &count);
+		out << "\t</Root>\n</KeePassFile>\n";
+		break;
+	}
+	out.flush();
+	if (!out.good())
+		throw std::runtime_error ("Could not write the exported entries");
+	return count;
+}
+
+}
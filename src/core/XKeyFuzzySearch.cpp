@@ -0,0 +1,230 @@
+#include "XKeyFuzzySearch.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace XKey {
+
+// Scoring scheme of fzf
+static const int ScoreMatch = 16;
+static const int ScoreGapStart = 3;
+static const int ScoreGapExtension = 1;
+static const int BonusBoundary = 8;
+static const int BonusCamelCase = 7;
+static const int BonusConsecutive = 4;
+static const int BonusFirstCharMultiplier = 2;
+
+/// Weight of a word matching the respective field
+static const int WeightTitle = 4, WeightUrl = 3, WeightUsername = 2, WeightEmail = 2, WeightComment = 1;
+static const int MaxWeight = WeightTitle;
+
+static inline char fold_ascii (char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline bool is_ascii (const std::string &text) {
+	return std::none_of (text.begin(), text.end(), [] (char c) { return (unsigned char)c >= 0x80; });
+}
+
+static inline bool is_word_char (unsigned char c) {
+	return c >= 0x80 || std::isalnum (c);
+}
+
+/// Bonus for a match at position @p i, depending on the character before it
+static int char_bonus (const std::string &text, size_t i) {
+	const unsigned char cur = text[i];
+	if (i == 0)
+		return is_word_char(cur) ? BonusBoundary : 0;
+	const unsigned char prev = text[i - 1];
+	if (!is_word_char(prev) && is_word_char(cur))
+		return BonusBoundary;
+	if ((std::islower(prev) && std::isupper(cur)) || (!std::isdigit(prev) && std::isdigit(cur)))
+		return BonusCamelCase;
+	return 0;
+}
+
+/// Score of the case-folded @p token in @p text, or 0 if its characters do not occur in order
+static int score_text (const std::string &text, const std::string &token) {
+	const size_t n = text.size(), m = token.size();
+	// Find the first position where the token ends ...
+	size_t i = 0, j = 0;
+	for (; i < n && j < m; ++i) {
+		if (fold_ascii(text[i]) == token[j])
+			++j;
+	}
+	if (j < m)
+		return 0;
+	const size_t end = i;
+	// ... and the shortest match ending there
+	size_t start = end;
+	for (j = m; j > 0; ) {
+		if (fold_ascii(text[--start]) == token[j - 1])
+			--j;
+	}
+
+	int score = 0, runBonus = 0;
+	bool previousMatched = false, inGap = false;
+	for (i = start, j = 0; i < end; ++i) {
+		if (j < m && fold_ascii(text[i]) == token[j]) {
+			int bonus = char_bonus (text, i);
+			if (previousMatched)
+				bonus = std::max (bonus, std::max (runBonus, BonusConsecutive));
+			else
+				runBonus = bonus;
+			score += ScoreMatch + ((j == 0) ? bonus * BonusFirstCharMultiplier : bonus);
+			previousMatched = true;
+			inGap = false;
+			++j;
+		} else {
+			score -= inGap ? ScoreGapExtension : ScoreGapStart;
+			previousMatched = false;
+			inGap = true;
+		}
+	}
+	return std::max (score, 1);
+}
+
+// FuzzyQuery
+
+FuzzyQuery::FuzzyQuery (const std::string &searchString)
+	: _maxScore(0)
+{
+	size_t begin = searchString.find_first_not_of (' ');
+	while (begin != std::string::npos) {
+		const size_t end = std::min (searchString.find (' ', begin), searchString.size());
+		const std::string word = SubstringMatcher::foldCase (searchString.substr (begin, end - begin));
+		const int maxScore = word.size() * (ScoreMatch + BonusBoundary) + BonusBoundary * (BonusFirstCharMultiplier - 1);
+		_tokens.push_back (Token {word, is_ascii(word), maxScore});
+		_maxScore += maxScore * MaxWeight;
+		begin = searchString.find_first_not_of (' ', end);
+	}
+}
+
+int FuzzyQuery::score (const Entry &entry, int minScore) const {
+	const std::pair<const std::string*, int> fields[] = {
+		{&entry.title(), WeightTitle}, {&entry.url(), WeightUrl}, {&entry.username(), WeightUsername},
+		{&entry.email(), WeightEmail}, {&entry.comment(), WeightComment}
+	};
+	int total = 0, remaining = _maxScore;
+	for (const Token &token : _tokens) {
+		remaining -= token.maxScore * MaxWeight;
+		int best = 0;
+		for (const auto &field : fields) {
+			// Fields are ordered by weight, so the remaining ones can not do better
+			const int fieldMax = token.maxScore * field.second;
+			if (best >= fieldMax)
+				break;
+			if (total + fieldMax + remaining <= minScore)
+				break; // Even a perfect match in the remaining fields is not good enough
+			const std::string &text = *field.first;
+			// Only non-ASCII words can match non-ASCII letters with a different case
+			const int s = (token.ascii || is_ascii(text)) ? score_text (text, token.text)
+				: score_text (SubstringMatcher::foldCase(text), token.text);
+			best = std::max (best, s * field.second);
+		}
+		total += best;
+		if (total + remaining <= minScore)
+			return 0;
+	}
+	return total;
+}
+
+// Top-k selection
+
+namespace {
+
+struct Candidate
+{
+	int score;
+	size_t sequence;
+	SearchResult result;
+};
+
+/// Order of the results: higher score first, then earlier in the search order
+struct Better
+{
+	bool operator() (const Candidate &a, const Candidate &b) const {
+		return (a.score != b.score) ? a.score > b.score : a.sequence < b.sequence;
+	}
+};
+
+/// Keeps the best candidates in a heap with the worst of them on top
+class TopK
+{
+public:
+	explicit TopK (size_t count) : _count(count), _sequence(0) { }
+
+	void offer (const FuzzyQuery &query, const SearchResult &r) {
+		const size_t sequence = _sequence++;
+		// Later entries only replace the worst one if they are strictly better
+		const int threshold = full() ? _heap.front().score : 0;
+		const int score = query.score (*r.match(), threshold);
+		if (score <= threshold)
+			return;
+		_heap.push_back (Candidate {score, sequence, r});
+		std::push_heap (_heap.begin(), _heap.end(), Better());
+		if (_heap.size() > _count) {
+			std::pop_heap (_heap.begin(), _heap.end(), Better());
+			_heap.pop_back();
+		}
+	}
+
+	std::vector<RankedResult> results () {
+		std::sort_heap (_heap.begin(), _heap.end(), Better());
+		std::vector<RankedResult> ranked;
+		ranked.reserve (_heap.size());
+		for (const Candidate &c : _heap)
+			ranked.push_back (RankedResult {c.result, c.score});
+		return ranked;
+	}
+private:
+	size_t _count;
+	size_t _sequence;
+	std::vector<Candidate> _heap;
+
+	bool full () const { return _heap.size() >= _count; }
+};
+
+}
+
+static void rank_folder (const FuzzyQuery &query, const Folder *folder, TopK *top) {
+	const std::deque<Entry> &entries = folder->entries();
+	for (size_t i = 0; i < entries.size(); ++i)
+		top->offer (query, SearchResult (&entries[i], folder, i));
+	for (const Folder &sub : folder->subfolders())
+		rank_folder (query, &sub, top);
+}
+
+std::vector<RankedResult> findBest (const FuzzyQuery &query, const Folder *rootFolder, size_t count) {
+	if (!rootFolder || query.empty() || count == 0)
+		return std::vector<RankedResult>();
+	TopK top (count);
+	rank_folder (query, rootFolder, &top);
+	return top.results();
+}
+
+std::vector<RankedResult> findBest (const FuzzyQuery &query, const std::vector<SearchResult> &candidates, size_t count) {
+	if (query.empty() || count == 0)
+		return std::vector<RankedResult>();
+	TopK top (count);
+	for (const SearchResult &r : candidates)
+		top.offer (query, r);
+	return top.results();
+}
+
+std::vector<SearchResult> rankAll (const FuzzyQuery &query, const std::vector<SearchResult> &candidates) {
+	std::vector<RankedResult> ranked;
+	ranked.reserve (candidates.size());
+	for (const SearchResult &r : candidates)
+		ranked.push_back (RankedResult {r, query.score (*r.match())});
+	std::stable_sort (ranked.begin(), ranked.end(), [] (const RankedResult &a, const RankedResult &b) {
+		return a.score > b.score;
+	});
+	std::vector<SearchResult> results;
+	results.reserve (ranked.size());
+	for (const RankedResult &r : ranked)
+		results.push_back (r.result);
+	return results;
+}
+
+}
@@ -0,0 +1,226 @@
+#include "XKeyHandle.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <thread>
+
+namespace XKey {
+
+namespace {
+
+/// Records the folders a write changes, by their rows from the root
+class ChangeRecorder : public TreeObserver
+{
+public:
+	explicit ChangeRecorder (std::map<std::vector<int>, bool> *changes) : _changes(changes) { }
+
+	void entryAdded (const Folder &folder, int) override { _record (folder, false); }
+	void entryChanged (const Folder &folder, int, const Entry &) override { _record (folder, false); }
+	void entryRemoved (const Folder &folder, int, const Entry &) override { _record (folder, false); }
+	void folderAdded (const Folder &folder) override { _record (*folder.parent(), true); }
+	void folderRemoved (const Folder &parent, const Folder &) override { _record (parent, true); }
+	void folderRenamed (const Folder &folder, const std::string &) override { _record (folder, false); }
+	void folderMoved (const Folder &folder, const Folder &oldParent, int) override {
+		_record (oldParent, true);
+		_record (*folder.parent(), true);
+	}
+private:
+	std::map<std::vector<int>, bool> *_changes;
+
+	void _record (const Folder &folder, bool subfolders) {
+		std::vector<int> path;
+		for (const Folder *f = &folder; f->parent(); f = f->parent())
+			path.push_back (f->row());
+		std::reverse (path.begin(), path.end());
+		bool &changed = (*_changes)[path];
+		changed = changed || subfolders;
+	}
+};
+
+template<class F>
+F *resolve (F *root, const std::vector<int> &path) {
+	for (int row : path)
+		root = &root->subfolders()[row];
+	return root;
+}
+
+}
+
+// ReadLock
+
+KeystoreHandle::ReadLock::ReadLock (const KeystoreHandle *handle, int slot)
+	: _handle(handle), _root(0), _version(0), _slot(slot)
+{
+	// The slot epoch was published before loading the current version,
+	// so the writer can not reclaim the version we get here.
+	const Version *v = _handle->_current.load();
+	_root = v->root.get();
+	_version = v->number;
+}
+
+KeystoreHandle::ReadLock::ReadLock (ReadLock &&o)
+	: _handle(o._handle), _root(o._root), _version(o._version), _slot(o._slot)
+{
+	o._handle = 0;
+	o._root = 0;
+	o._slot = -1;
+}
+
+KeystoreHandle::ReadLock::~ReadLock () {
+	if (_handle)
+		_handle->_releaseSlot (_slot);
+}
+
+// KeystoreHandle
+
+KeystoreHandle::KeystoreHandle (RootFolder_Ptr root)
+	: _current(0), _globalEpoch(1), _spare(0, nullptr)
+{
+	if (!root || root->parent())
+		throw std::invalid_argument ("KeystoreHandle needs a root folder");
+	for (ReaderSlot &s : _readers)
+		s.epoch.store (0);
+	// Lazy decoding modifies the tree, which is not safe with concurrent readers
+	root->materialize();
+	_current.store (new Version {std::move(root), 1});
+}
+
+KeystoreHandle::~KeystoreHandle () {
+	for (const ReaderSlot &s : _readers) {
+		(void)s;
+		assert (s.epoch.load() == 0 && "KeystoreHandle destroyed while a ReadLock is held");
+	}
+	for (auto &it : _retired)
+		delete it.second;
+	delete _spare.second;
+	delete _current.load();
+}
+
+int KeystoreHandle::_acquireSlot () const {
+	for (;;) {
+		for (int i = 0; i < MaxReaders; ++i) {
+			uint64_t expected = 0;
+			if (_readers[i].epoch.load(std::memory_order_relaxed) != 0)
+				continue;
+			if (_readers[i].epoch.compare_exchange_strong (expected, _globalEpoch.load()))
+				return i;
+		}
+		// All slots taken: wait for a reader to leave
+		std::this_thread::yield();
+	}
+}
+
+void KeystoreHandle::_releaseSlot (int slot) const {
+	assert (slot >= 0 && slot < MaxReaders);
+	_readers[slot].epoch.store (0, std::memory_order_release);
+}
+
+KeystoreHandle::ReadLock KeystoreHandle::read () const {
+	return ReadLock (this, _acquireSlot());
+}
+
+uint64_t KeystoreHandle::version () const {
+	return _current.load()->number;
+}
+
+uint64_t KeystoreHandle::write (const std::function<void(Folder *root)> &mutation) {
+	std::lock_guard<std::mutex> lock (_writeMutex);
+	RootFolder_Ptr copy = _writableCopy();
+	// If the mutation throws, the copy is dropped and the next write starts from a deep copy again
+	_changes.clear();
+	std::map<std::vector<int>, bool> changes;
+	ChangeRecorder recorder (&changes);
+	copy->addObserver (&recorder);
+	mutation (copy.get());
+	copy->removeObserver (&recorder);
+	_changes = std::move(changes);
+	return _publish (std::move(copy), true);
+}
+
+RootFolder_Ptr KeystoreHandle::_writableCopy () {
+	Version *spare = _spare.second;
+	_spare.second = nullptr;
+	if (spare && _spare.first > _oldestReader()) {
+		// Still visible to a reader: reclaimed later like any other version
+		_retired.push_back (std::make_pair(_spare.first, spare));
+		spare = nullptr;
+	}
+	const Folder &current = *_current.load()->root;
+	if (!spare)
+		return cloneFolderTree (current);
+
+	RootFolder_Ptr root = std::move(spare->root);
+	delete spare;
+	// The spare is the version before the current one: copy the folders changed by the last write.
+	// The map is sorted, so a folder whose subfolders changed comes before the folders below it,
+	// whose paths may not be valid anymore and which are copied along with it.
+	std::vector<const std::vector<int>*> copiedSubtrees;
+	for (const auto &change : _changes) {
+		const std::vector<int> &path = change.first;
+		const bool covered = std::any_of (copiedSubtrees.begin(), copiedSubtrees.end(), [&path] (const std::vector<int> *p) {
+			return p->size() <= path.size() && std::equal (p->begin(), p->end(), path.begin());
+		});
+		if (covered)
+			continue;
+		resolve (root.get(), path)->_copyContentFrom (*resolve (&current, path), change.second);
+		if (change.second)
+			copiedSubtrees.push_back (&path);
+	}
+	return root;
+}
+
+uint64_t KeystoreHandle::replace (RootFolder_Ptr newRoot) {
+	if (!newRoot || newRoot->parent())
+		throw std::invalid_argument ("KeystoreHandle needs a root folder");
+	newRoot->materialize();
+	std::lock_guard<std::mutex> lock (_writeMutex);
+	return _publish (std::move(newRoot), false);
+}
+
+uint64_t KeystoreHandle::_publish (RootFolder_Ptr newRoot, bool keepSpare) {
+	Version *old = _current.load();
+	const uint64_t number = old->number + 1;
+	_current.store (new Version {std::move(newRoot), number});
+	// Readers entering from now on observe the new epoch, and with it the new version.
+	const uint64_t retireEpoch = _globalEpoch.fetch_add(1) + 1;
+	if (_spare.second) {
+		_retired.push_back (_spare);
+		_spare.second = nullptr;
+	}
+	if (keepSpare) {
+		_spare = std::make_pair (retireEpoch, old);
+	} else {
+		_retired.push_back (std::make_pair(retireEpoch, old));
+		_changes.clear();
+	}
+	_collect();
+	return number;
+}
+
+size_t KeystoreHandle::collect () {
+	std::lock_guard<std::mutex> lock (_writeMutex);
+	return _collect();
+}
+
+uint64_t KeystoreHandle::_oldestReader () const {
+	uint64_t oldestReader = UINT64_MAX;
+	for (const ReaderSlot &s : _readers) {
+		const uint64_t e = s.epoch.load();
+		if (e != 0)
+			oldestReader = std::min (oldestReader, e);
+	}
+	return oldestReader;
+}
+
+size_t KeystoreHandle::_collect () {
+	const uint64_t oldestReader = _oldestReader();
+	auto last = std::partition (_retired.begin(), _retired.end(),
+		[oldestReader] (const std::pair<uint64_t, Version*> &r) { return r.first > oldestReader; });
+	for (auto it = last; it != _retired.end(); ++it)
+		delete it->second;
+	_retired.erase (last, _retired.end());
+	return _retired.size();
+}
+
+}
@@ -0,0 +1,437 @@
+#include "XKeyJournal.h"
+#include "CryptRecord.h"
+#include "XKeyBytes.h"
+#include "XKeyJsonSerialization.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+// Unix
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace XKey {
+
+static const int JournalVersion = 1;
+static const size_t HeaderSize = 256;
+static const size_t RecordLengthSize = 4;
+
+static void write_all (int fd, const std::string &data, off_t offset) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t r = pwrite (fd, data.data() + done, data.size() - done, offset + done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error ("Failed to write journal: " + std::string(strerror(errno)));
+		}
+		done += r;
+	}
+}
+
+struct ReplayGuard
+{
+	ReplayGuard (bool &flag) : f(flag) { f = true; }
+	~ReplayGuard () { f = false; }
+private:
+	bool &f;
+};
+
+static Json::Value row_path (const Folder &folder) {
+	std::vector<int> rows;
+	for (const Folder *f = &folder; f->parent(); f = f->parent())
+		rows.push_back (f->row());
+	Json::Value path (Json::arrayValue);
+	for (auto it = rows.rbegin(); it != rows.rend(); ++it)
+		path.append (*it);
+	return path;
+}
+
+/// Operation of a journal record, decoded and checked before any operation is applied
+struct Operation
+{
+	enum Type { ADD, SET, DEL, MKDIR, RMDIR, RENAME, MOVE } type;
+	std::vector<int> path;
+	std::vector<int> target;
+	int index;
+	std::string name;
+	Entry entry;
+};
+
+static std::vector<int> read_path (const Json::Value &path) {
+	if (!path.isArray())
+		throw std::runtime_error ("Invalid journal record: Missing folder path");
+	std::vector<int> rows;
+	for (const Json::Value &row : path) {
+		if (!row.isInt() || row.asInt() < 0)
+			throw std::runtime_error ("Invalid journal record: Folder does not exist");
+		rows.push_back (row.asInt());
+	}
+	return rows;
+}
+
+static Operation read_operation (const Json::Value &op) {
+	if (!op.isObject())
+		throw std::runtime_error ("Invalid journal record: Operation is not an object");
+	static const char *const types[] = {"add", "set", "del", "mkdir", "rmdir", "rename", "move"};
+	const std::string type = op.get("op", "").asString();
+	const auto it = std::find (std::begin(types), std::end(types), type);
+	if (it == std::end(types))
+		throw std::runtime_error ("Invalid journal record: Unknown operation " + type);
+	Operation o;
+	o.type = (Operation::Type)(it - std::begin(types));
+	o.path = read_path (op["path"]);
+	o.index = op.get("index", -1).asInt();
+	if (o.type == Operation::ADD || o.type == Operation::SET)
+		o.entry = Parser::parseEntry (op["entry"]);
+	if (o.type == Operation::MKDIR || o.type == Operation::RENAME)
+		o.name = op.get("name", "").asString();
+	if (o.type == Operation::MOVE)
+		o.target = read_path (op["target"]);
+	return o;
+}
+
+/// Names and entry counts of a folder hierarchy, to check journalled operations without modifying it
+struct Shape
+{
+	std::string name;
+	size_t entries;
+	std::deque<Shape> subfolders;
+
+	Shape (const std::string &n, size_t e) : name(n), entries(e) { }
+	explicit Shape (const Folder &f) : name(f.name()), entries(f.entryCount()) {
+		for (const Folder &sub : f.subfolders())
+			subfolders.emplace_back (sub);
+	}
+	bool hasSubfolder (const std::string &n) const {
+		return std::any_of (subfolders.begin(), subfolders.end(), [&n] (const Shape &s) { return s.name == n; });
+	}
+};
+
+static Shape *resolve_path (Shape *root, const std::vector<int> &path) {
+	for (int row : path) {
+		if (row >= (int)root->subfolders.size())
+			throw std::runtime_error ("Invalid journal record: Folder does not exist");
+		root = &root->subfolders[row];
+	}
+	return root;
+}
+
+/// Apply @p op to @p root. Throws without changing anything if it can not be applied.
+static void apply (const Operation &op, Shape *root) {
+	Shape *folder = resolve_path (root, op.path);
+	switch (op.type) {
+	case Operation::ADD:
+		++folder->entries;
+		break;
+	case Operation::SET:
+	case Operation::DEL:
+		if (op.index < 0 || (size_t)op.index >= folder->entries)
+			throw std::runtime_error ("Invalid journal record: Entry does not exist");
+		if (op.type == Operation::DEL)
+			--folder->entries;
+		break;
+	case Operation::MKDIR:
+		if (folder->hasSubfolder (op.name))
+			throw std::runtime_error ("Invalid journal record: Folder exists already");
+		folder->subfolders.emplace_back (op.name, 0);
+		break;
+	case Operation::RMDIR: {
+		if (op.path.empty())
+			throw std::runtime_error ("Invalid journal record: Can not remove root folder");
+		Shape *parent = resolve_path (root, std::vector<int>(op.path.begin(), op.path.end() - 1));
+		parent->subfolders.erase (parent->subfolders.begin() + op.path.back());
+		break;
+	}
+	case Operation::RENAME:
+		folder->name = op.name;
+		break;
+	case Operation::MOVE: {
+		if (op.path.empty())
+			return; // Like moveFolder, moving the root does nothing
+		Shape *target = resolve_path (root, op.target);
+		if (op.target.size() >= op.path.size() && std::equal (op.path.begin(), op.path.end(), op.target.begin()))
+			throw std::runtime_error ("Invalid journal record: Can not move a folder into itself");
+		if (target->hasSubfolder (folder->name))
+			throw std::runtime_error ("Invalid journal record: Folder exists already");
+		target->subfolders.push_back (std::move(*folder));
+		Shape *parent = resolve_path (root, std::vector<int>(op.path.begin(), op.path.end() - 1));
+		parent->subfolders.erase (parent->subfolders.begin() + op.path.back());
+		break;
+	}
+	}
+}
+
+static Folder *resolve_path (Folder *root, const std::vector<int> &path) {
+	for (int row : path)
+		root = &root->subfolders()[row];
+	return root;
+}
+
+/// Apply @p op to @p root. It must have been applied to the Shape of @p root first.
+static void apply (const Operation &op, Folder *root) {
+	Folder *folder = resolve_path (root, op.path);
+	switch (op.type) {
+	case Operation::ADD: folder->addEntry (op.entry); break;
+	case Operation::SET: folder->setEntryAt (op.index, op.entry); break;
+	case Operation::DEL: folder->removeEntry (op.index); break;
+	case Operation::MKDIR: folder->createSubfolder (op.name); break;
+	case Operation::RMDIR: folder->parent()->removeSubfolder (op.path.back()); break;
+	case Operation::RENAME: folder->setName (op.name); break;
+	case Operation::MOVE: {
+		Folder *target = resolve_path (root, op.target);
+		moveFolder (folder, target, target->subfolders().size());
+		break;
+	}
+	}
+}
+
+// Journal
+
+Journal::Journal (const std::string &keystoreFile)
+	: _file(fileName(keystoreFile)), _size(0), _threshold(DEFAULT_COMPACTION_THRESHOLD),
+	_pending(new Json::Value(Json::arrayValue)), _replaying(false)
+{ }
+
+Journal::~Journal () { }
+
+std::string Journal::fileName (const std::string &keystoreFile) {
+	return keystoreFile + ".journal";
+}
+
+void Journal::remove (const std::string &keystoreFile) {
+	if (unlink (fileName(keystoreFile).c_str()) != 0 && errno != ENOENT)
+		throw std::runtime_error ("Failed to remove journal file: " + std::string(strerror(errno)));
+}
+
+bool Journal::hasRecords (const std::string &keystoreFile) {
+	struct stat st;
+	return stat (fileName(keystoreFile).c_str(), &st) == 0 && (size_t)st.st_size > HeaderSize;
+}
+
+bool Journal::hasPendingChanges () const {
+	return !_pending->empty();
+}
+
+void Journal::discardPendingChanges () {
+	*_pending = Json::Value (Json::arrayValue);
+}
+
+bool Journal::matchesPassphrase (const std::string &passphrase) const {
+	return _cipher && _cipher->matchesPassphrase(passphrase);
+}
+
+size_t Journal::open (const std::string &passphrase, const std::string &baseId, Folder *root, OpenMode mode) {
+	if (!root)
+		throw std::invalid_argument ("Need a root folder to replay the journal");
+	_cipher.reset();
+	discardPendingChanges();
+	std::ifstream in (_file, std::ios::binary);
+	if (!in.is_open())
+		return 0;
+	const std::string data ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (data.size() < HeaderSize)
+		return 0; // Creating the journal was interrupted
+	const std::string header = data.substr (0, HeaderSize);
+	int version = 0, iterationCount = 0;
+	char base[65], salt[33];
+	if (sscanf (header.c_str(), "*167110-journal* # v:%i # base:%64s # salt:%32s # count:%i #",
+	            &version, base, salt, &iterationCount) != 4)
+		return 0;
+	if (version != JournalVersion)
+		throw std::runtime_error ("Unsupported journal version");
+	if (from_hex(base) != baseId)
+		return 0; // Journal belongs to another version of the keystore
+	std::unique_ptr<RecordCipher> cipher (new RecordCipher(passphrase, from_hex(salt), iterationCount));
+
+	// Decrypt all records and check their operations on the shape of the hierarchy first,
+	// so a corrupt record does not leave the hierarchy partially replayed
+	std::vector<Operation> operations;
+	Shape shape (*root);
+	std::string chain = header;
+	size_t pos = HeaderSize, records = 0;
+	while (pos + RecordLengthSize <= data.size()) {
+		size_t length = 0;
+		for (size_t i = 0; i < RecordLengthSize; ++i)
+			length |= (size_t)(unsigned char)data[pos + i] << (8 * i);
+		if (pos + RecordLengthSize + length > data.size())
+			break; // Appending the last record was interrupted
+		const std::string sealed = data.substr (pos + RecordLengthSize, length);
+		std::string text = cipher->open (sealed, chain);
+		Json::Reader r;
+		Json::Value ops;
+		const bool parsed = r.parse (text, ops, false);
+		wipe (&text);
+		if (!parsed || !ops.isArray())
+			throw std::runtime_error ("Invalid journal record: " + r.getFormattedErrorMessages());
+		for (const Json::Value &op : ops) {
+			operations.push_back (read_operation (op));
+			apply (operations.back(), &shape);
+		}
+		chain = RecordCipher::macOf (sealed);
+		pos += RecordLengthSize + length;
+		++records;
+	}
+	{
+		ReplayGuard guard (_replaying);
+		for (const Operation &op : operations)
+			apply (op, root);
+	}
+	if (mode == READ_ONLY)
+		return records;
+	if (pos < data.size() && truncate (_file.c_str(), pos) != 0)
+		throw std::runtime_error ("Failed to truncate journal file: " + std::string(strerror(errno)));
+	_cipher = std::move(cipher);
+	_chain = chain;
+	_size = pos;
+	return records;
+}
+
+void Journal::reset (const std::string &passphrase, const std::string &baseId, int keyIterationCount) {
+	std::unique_ptr<RecordCipher> cipher (new RecordCipher(passphrase, RecordCipher::generateSalt(), keyIterationCount));
+	char buf[HeaderSize + 1];
+	int r = snprintf (buf, HeaderSize, "*167110-journal* # v:%i # base:%.64s # salt:%.32s # count:%i #",
+	                  JournalVersion, to_hex(baseId).c_str(), to_hex(cipher->salt()).c_str(), keyIterationCount);
+	if (r < 0 || (size_t)r >= HeaderSize)
+		throw std::runtime_error ("Failed to create journal header");
+	memset (buf + r, '*', HeaderSize - r - 1);
+	buf[HeaderSize - 1] = '\n';
+	const std::string header (buf, HeaderSize);
+
+	int fd = ::open (_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		throw std::runtime_error ("Could not open journal file for writing: " + std::string(strerror(errno)));
+	try {
+		// Independent of the process umask, only the owner may access the journal
+		if (fchmod (fd, S_IRUSR | S_IWUSR) != 0)
+			throw std::runtime_error ("Could not set permissions on journal file");
+		write_all (fd, header, 0);
+		if (fdatasync (fd) != 0)
+			throw std::runtime_error ("Failed to flush journal file: " + std::string(strerror(errno)));
+	} catch (...) {
+		close (fd);
+		throw;
+	}
+	close (fd);
+	_cipher = std::move(cipher);
+	_chain = header;
+	_size = HeaderSize;
+	discardPendingChanges();
+}
+
+void Journal::commit () {
+	if (!isOpen())
+		throw std::logic_error ("Journal is not open");
+	if (!hasPendingChanges())
+		return;
+	Json::FastWriter w;
+	std::string text = w.write (*_pending);
+	const std::string sealed = _cipher->seal (text, _chain);
+	wipe (&text);
+	std::string record (RecordLengthSize, '\0');
+	for (size_t i = 0; i < RecordLengthSize; ++i)
+		record[i] = (char)((sealed.size() >> (8 * i)) & 0xff);
+	record += sealed;
+
+	int fd = ::open (_file.c_str(), O_WRONLY);
+	if (fd < 0)
+		throw std::runtime_error ("Could not open journal file for writing: " + std::string(strerror(errno)));
+	try {
+		write_all (fd, record, _size);
+		if (fdatasync (fd) != 0)
+			throw std::runtime_error ("Failed to flush journal file: " + std::string(strerror(errno)));
+	} catch (...) {
+		close (fd);
+		throw;
+	}
+	close (fd);
+	_chain = RecordCipher::macOf (sealed);
+	_size += record.size();
+	discardPendingChanges();
+}
+
+void Journal::_record (Json::Value &&op) {
+	if (_replaying || !isOpen())
+		return;
+	_pending->append (op);
+}
+
+void Journal::entryAdded (const Folder &folder, int index) {
+	if (_replaying || !isOpen())
+		return;
+	Json::Value op;
+	op["op"] = "add";
+	op["path"] = row_path (folder);
+	Writer::serializeEntry (op["entry"], folder.entries()[index]);
+	_record (std::move(op));
+}
+
+void Journal::entryChanged (const Folder &folder, int index, const Entry &) {
+	if (_replaying || !isOpen())
+		return;
+	Json::Value op;
+	op["op"] = "set";
+	op["path"] = row_path (folder);
+	op["index"] = index;
+	Writer::serializeEntry (op["entry"], folder.entries()[index]);
+	_record (std::move(op));
+}
+
+void Journal::entryRemoved (const Folder &folder, int index, const Entry &) {
+	Json::Value op;
+	op["op"] = "del";
+	op["path"] = row_path (folder);
+	op["index"] = index;
+	_record (std::move(op));
+}
+
+void Journal::folderAdded (const Folder &folder) {
+	Json::Value op;
+	op["op"] = "mkdir";
+	op["path"] = row_path (*folder.parent());
+	op["name"] = folder.name();
+	_record (std::move(op));
+}
+
+void Journal::folderRemoved (const Folder &, const Folder &folder) {
+	Json::Value op;
+	op["op"] = "rmdir";
+	op["path"] = row_path (folder);
+	_record (std::move(op));
+}
+
+void Journal::folderRenamed (const Folder &folder, const std::string &) {
+	Json::Value op;
+	op["op"] = "rename";
+	op["path"] = row_path (folder);
+	op["name"] = folder.name();
+	_record (std::move(op));
+}
+
+void Journal::folderMoved (const Folder &folder, const Folder &oldParent, int oldRow) {
+	Json::Value source = row_path (oldParent);
+	const Json::ArrayIndex depth = source.size();
+	source.append (oldRow);
+	// The target path is recorded as it was before the move: Removing the folder
+	// shifted all following siblings (and their subtrees) up by one row.
+	Json::Value target = row_path (*folder.parent());
+	bool belowOldParent = (target.size() > depth);
+	for (Json::ArrayIndex i = 0; belowOldParent && i < depth; ++i)
+		belowOldParent = (target[i] == source[i]);
+	if (belowOldParent && target[depth].asInt() >= oldRow)
+		target[depth] = target[depth].asInt() + 1;
+	Json::Value op;
+	op["op"] = "move";
+	op["path"] = source;
+	op["target"] = target;
+	_record (std::move(op));
+}
+
+}
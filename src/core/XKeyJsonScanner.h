@@ -0,0 +1,313 @@
+#pragma once
+
+// Json scanner shared by the keystore parser and the import of Json records; not part of the public interface
+
+#include "XKeyBytes.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace XKey {
+
+/**
+ * Minimal Json scanner that validates and skips over values, or decodes them in place.
+ *
+ * Reads either a range of memory or a stream. A stream is read in chunks that are wiped after use,
+ * so the cleartext is never held in memory completely. #position is only valid for memory ranges.
+ */
+class JsonScanner
+{
+public:
+	JsonScanner (const char *begin, const char *end) : _in(nullptr), _begin(begin), _p(begin), _end(end), _offset(0) { }
+	
+	explicit JsonScanner (std::streambuf *in)
+		: _in(in), _buffer(ChunkSize), _begin(_buffer.data()), _p(_begin), _end(_begin), _offset(0) { }
+	
+	~JsonScanner () {
+		wipe (_buffer.data(), _buffer.size());
+	}
+	
+	const char *position () const { return _p; }
+	
+	/// Continue at @p p, which must be inside the memory range
+	void skipTo (const char *p) { _p = p; }
+	
+	/// @return true if only whitespace and comments are left
+	bool atEnd () {
+		skipWhitespace();
+		return !available();
+	}
+	
+	void skipWhitespace () {
+		for (;;) {
+			while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\n' || *_p == '\r'))
+				++_p;
+			if (_p < _end) {
+				if (*_p != '/')
+					return;
+				// Comments, as accepted by Json::Reader
+				++_p;
+				const char c = next ("Invalid comment");
+				if (c == '/') {
+					while (available() && *_p != '\n')
+						++_p;
+				} else if (c == '*') {
+					char last = '\0', d;
+					while ((d = next ("Unterminated comment")) != '/' || last != '*')
+						last = d;
+				} else {
+					fail ("Invalid comment");
+				}
+			} else if (!available()) {
+				return;
+			}
+		}
+	}
+	
+	char peek () {
+		skipWhitespace();
+		return available() ? *_p : '\0';
+	}
+	
+	bool consume (char c) {
+		if (peek() != c)
+			return false;
+		++_p;
+		return true;
+	}
+	
+	void expect (char c) {
+		if (!consume(c))
+			fail (std::string("Expected '") + c + "'");
+	}
+	
+	/// Read a string value and decode its escape sequences
+	std::string readString () {
+		std::string out;
+		scanString (&out);
+		return out;
+	}
+	
+	/// Decode a string value into @p out, replacing its content
+	void readString (std::string *out) {
+		out->clear();
+		scanString (out);
+	}
+	
+	/**
+	 * @brief Read a string, boolean or null value, converted like Json::Value::asString
+	 * @return false if the value is not a string. @p out then contains `true` or `false`, or is empty for null.
+	 */
+	bool readScalar (std::string *out) {
+		out->clear();
+		switch (peek()) {
+		case '"':
+			scanString (out);
+			return true;
+		case 't':
+			out->assign ("true");
+			skipLiteral ("true");
+			return false;
+		case 'f':
+			out->assign ("false");
+			skipLiteral ("false");
+			return false;
+		case 'n':
+			skipLiteral ("null");
+			return false;
+		default:
+			fail ("Type is not convertible to string");
+			return false;
+		}
+	}
+	
+	uint64_t readUInt64 () {
+		std::string text;
+		if (peek() != '-')
+			scanNumber (&text);
+		if (text.empty() || text.size() > 19 || !std::all_of (text.begin(), text.end(), [] (char c) { return c >= '0' && c <= '9'; }))
+			fail ("Expected an unsigned integer");
+		return std::stoull (text);
+	}
+	
+	void skipValue () {
+		switch (peek()) {
+		case '{':
+			++_p;
+			if (consume('}'))
+				return;
+			do {
+				scanString (nullptr);
+				expect (':');
+				skipValue();
+			} while (consume(','));
+			expect ('}');
+			return;
+		case '[':
+			++_p;
+			if (consume(']'))
+				return;
+			do {
+				skipValue();
+			} while (consume(','));
+			expect (']');
+			return;
+		case '"':
+			scanString (nullptr);
+			return;
+		case 't':
+			return skipLiteral ("true");
+		case 'f':
+			return skipLiteral ("false");
+		case 'n':
+			return skipLiteral ("null");
+		default:
+			scanNumber (nullptr);
+		}
+	}
+	
+	void fail (const std::string &msg) const {
+		throw std::runtime_error (msg + " at offset " + std::to_string(_offset + (_p - _begin)));
+	}
+private:
+	/// Size of the chunks read from a stream
+	static const size_t ChunkSize = 64 * 1024;
+	
+	std::streambuf *_in;
+	std::vector<char> _buffer;
+	const char *_begin, *_p, *_end;
+	/// Stream position of _begin
+	size_t _offset;
+	
+	/// @return false at the end of the input. Reads the next chunk of a stream if the current one is used up.
+	bool available () {
+		if (_p < _end)
+			return true;
+		if (!_in)
+			return false;
+		_offset += _end - _begin;
+		const std::streamsize n = _in->sgetn (_buffer.data(), _buffer.size());
+		_p = _begin;
+		_end = _begin + std::max<std::streamsize> (n, 0);
+		return _p < _end;
+	}
+	
+	char next (const char *error) {
+		if (!available())
+			fail (error);
+		return *_p++;
+	}
+	
+	void skipLiteral (const char *literal) {
+		for (const char *l = literal; *l; ++l) {
+			if (!available() || *_p != *l)
+				fail ("Invalid value");
+			++_p;
+		}
+	}
+	
+	void scanNumber (std::string *out) {
+		bool empty = true;
+		while (available() && (isdigit((unsigned char)*_p) || *_p == '-' || *_p == '+' || *_p == '.' || *_p == 'e' || *_p == 'E')) {
+			if (out)
+				out->push_back (*_p);
+			++_p;
+			empty = false;
+		}
+		if (empty)
+			fail ("Invalid value");
+	}
+	
+	static void appendUtf8 (std::string *out, unsigned long cp) {
+		if (cp < 0x80) {
+			out->push_back ((char)cp);
+		} else if (cp < 0x800) {
+			out->push_back ((char)(0xC0 | (cp >> 6)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		} else if (cp < 0x10000) {
+			out->push_back ((char)(0xE0 | (cp >> 12)));
+			out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		} else {
+			out->push_back ((char)(0xF0 | (cp >> 18)));
+			out->push_back ((char)(0x80 | ((cp >> 12) & 0x3F)));
+			out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+			out->push_back ((char)(0x80 | (cp & 0x3F)));
+		}
+	}
+	
+	unsigned long readHex4 () {
+		unsigned long v = 0;
+		for (int i = 0; i < 4; ++i) {
+			const char c = next ("Invalid unicode escape sequence");
+			v <<= 4;
+			if (c >= '0' && c <= '9') v |= c - '0';
+			else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+			else fail ("Invalid unicode escape sequence");
+		}
+		return v;
+	}
+	
+	void scanString (std::string *out) {
+		if (peek() != '"')
+			fail ("Expected string");
+		++_p;
+		for (;;) {
+			const char *chunk = _p;
+			while (_p < _end && *_p != '"' && *_p != '\\')
+				++_p;
+			if (out)
+				out->append (chunk, _p);
+			if (_p >= _end) {
+				// The string continues in the next chunk of the stream
+				if (!available())
+					fail ("Unterminated string");
+				continue;
+			}
+			if (*_p++ == '"')
+				return;
+			const char esc = next ("Unterminated string");
+			char c;
+			switch (esc) {
+			case '"': c = '"'; break;
+			case '\\': c = '\\'; break;
+			case '/': c = '/'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u': {
+				unsigned long cp = readHex4();
+				if (cp >= 0xD800 && cp <= 0xDBFF) {
+					// Surrogate pair
+					if (next ("Missing low surrogate in unicode escape sequence") != '\\' ||
+					    next ("Missing low surrogate in unicode escape sequence") != 'u')
+					{
+						fail ("Missing low surrogate in unicode escape sequence");
+					}
+					const unsigned long low = readHex4();
+					if (low < 0xDC00 || low > 0xDFFF)
+						fail ("Invalid low surrogate in unicode escape sequence");
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				if (out)
+					appendUtf8 (out, cp);
+				continue;
+			}
+			default:
+				fail ("Invalid escape sequence");
+			}
+			if (out)
+				out->push_back (c);
+		}
+	}
+};
+
+}
@@ -1,7 +1,14 @@
 #include "XKeyJsonSerialization.h"
+#include "XKeyBinaryFormat.h"
+#include "XKeyBytes.h"
+#include "XKeyJsonScanner.h"
+#include "XKeyThreadPool.h"
+#include "CryptStream.h"
 #include "XKey.h"
 #include <json/json.h>
 #include <fstream>
+#include <iterator>
+#include <algorithm>
 #include <json/writer.h>
 // Unix
 #include <sys/stat.h>
@@ -26,7 +33,474 @@ private:
 	std::ios::iostate origState;
 };
 
-bool Parser::read (std::istream &stream, Folder *new_folder_root) {
+/// Cleartext shared by lazily loaded folders. Wiped when the last folder has been decoded.
+typedef std::shared_ptr<const std::string> SharedText;
+
+struct WipingDeleter
+{
+	void operator() (const std::string *text) const {
+		std::string *s = const_cast<std::string*> (text);
+		wipe (s);
+		delete s;
+	}
+};
+
+/**
+ * Decodes the "keys" array of a folder from a byte range of the cleartext
+ */
+class JsonEntrySource
+	: public EntrySource
+{
+public:
+	JsonEntrySource (const SharedText &text, size_t begin, size_t end, size_t count)
+		: _text(text), _begin(begin), _end(end), _count(count) { }
+	
+	size_t size () const override { return _count; }
+	
+	void decode (std::deque<Entry> *entries) const override;
+	
+	/// The Json array of the entries in the cleartext
+	const char *data () const { return _text->data() + _begin; }
+	size_t length () const { return _end - _begin; }
+private:
+	SharedText _text;
+	size_t _begin, _end, _count;
+};
+
+// Streaming reader: decodes the cleartext directly into the folder hierarchy
+
+static const char *const EntryFields[] = {"title", "username", "url", "password", "email", "comment"};
+
+static Attachment read_attachment (JsonScanner &s) {
+	Attachment a {std::string(), std::string(), 0, std::string()};
+	bool hasId = false, hasKey = false;
+	std::string key;
+	s.expect ('{');
+	if (!s.consume('}')) {
+		do {
+			const std::string field = s.readString();
+			s.expect (':');
+			if (field == "id") {
+				hasId = s.readScalar (&a.id);
+			} else if (field == "key") {
+				hasKey = s.readScalar (&key);
+			} else if (field == "name") {
+				s.readScalar (&a.name);
+			} else if (field == "size") {
+				a.size = s.readUInt64();
+			} else {
+				s.skipValue();
+			}
+		} while (s.consume(','));
+		s.expect ('}');
+	}
+	if (!hasId || !hasKey)
+		throw std::runtime_error ("Invalid attachment entry: missing id or key");
+	a.key = from_hex (key);
+	return a;
+}
+
+/// Decode a key entry, the same way as Parser::parseEntry
+static Entry read_entry (JsonScanner &s) {
+	std::string fields[6];
+	bool isString[6] = {false, false, false, false, false, false};
+	std::vector<Attachment> attachments;
+	s.expect ('{');
+	if (!s.consume('}')) {
+		std::string name;
+		do {
+			s.readString (&name);
+			s.expect (':');
+			const auto field = std::find_if (std::begin(EntryFields), std::end(EntryFields), [&name] (const char *f) { return name == f; });
+			if (field != std::end(EntryFields)) {
+				const size_t i = field - std::begin(EntryFields);
+				isString[i] = s.readScalar (&fields[i]);
+			} else if (name == "attachments" && s.peek() == '[') {
+				attachments.clear();
+				s.expect ('[');
+				if (!s.consume(']')) {
+					do {
+						attachments.push_back (read_attachment (s));
+					} while (s.consume(','));
+					s.expect (']');
+				}
+			} else {
+				s.skipValue();
+			}
+		} while (s.consume(','));
+		s.expect ('}');
+	}
+	if (!isString[0] || !isString[1] || !isString[2] || !isString[3] || !isString[5])
+		std::cerr << "Error when parsing key entry: Missing or invalid field\n";
+	if (!isString[4])
+		fields[4].clear();
+	Entry entry (std::move(fields[0]), std::move(fields[1]), std::move(fields[2]), std::move(fields[3]),
+	             std::move(fields[4]), std::move(fields[5]));
+	entry.setAttachments (std::move(attachments));
+	return entry;
+}
+
+static void read_folder_list (JsonScanner &s, Folder *parent);
+
+static void read_folder (JsonScanner &s, Folder *parent) {
+	// Json::FastWriter orders the members by name, so the name of a folder comes after its content.
+	// The content is collected in a folder of its own, which is moved into place once the name is known.
+	RootFolder_Ptr content = createRootFolder();
+	Folder *f = content.get();
+	std::string name;
+	bool hasName = false;
+	s.expect ('{');
+	if (!s.consume('}')) {
+		do {
+			const std::string key = s.readString();
+			s.expect (':');
+			if (key == "name") {
+				if (s.peek() != '"')
+					s.fail ("Invalid subfolder entry: missing name");
+				s.readString (&name);
+				hasName = true;
+			} else if (key == "keys" && s.peek() == '[') {
+				s.expect ('[');
+				if (!s.consume(']')) {
+					do {
+						if (s.peek() != '{')
+							s.fail ("Invalid key-entry in folder");
+						f->addEntry (read_entry (s));
+					} while (s.consume(','));
+					s.expect (']');
+				}
+			} else if (key == "folders" && s.peek() == '[') {
+				read_folder_list (s, f);
+			} else {
+				s.skipValue();
+			}
+		} while (s.consume(','));
+		s.expect ('}');
+	}
+	if (!hasName)
+		throw std::runtime_error ("Invalid subfolder entry: missing name");
+	if (parent->getSubfolder (name))
+		s.fail ("Invalid subfolder entry: duplicate name \"" + name + "\"");
+	content->setName (name);
+	*parent->createSubfolder (name) = std::move (*content);
+}
+
+static void read_folder_list (JsonScanner &s, Folder *parent) {
+	s.expect ('[');
+	if (s.consume(']'))
+		return;
+	do {
+		if (s.peek() != '{')
+			s.fail ("Invalid entry in subfolder list");
+		read_folder (s, parent);
+	} while (s.consume(','));
+	s.expect (']');
+}
+
+void JsonEntrySource::decode (std::deque<Entry> *entries) const {
+	JsonScanner s (_text->data() + _begin, _text->data() + _end);
+	s.expect ('[');
+	if (s.consume(']'))
+		return;
+	do {
+		entries->push_back (read_entry (s));
+	} while (s.consume(','));
+	s.expect (']');
+}
+
+static void read_root (JsonScanner &s, Folder *root) {
+	// Of the root object, only the subfolders are read
+	s.expect ('{');
+	if (s.consume('}'))
+		return;
+	do {
+		const std::string key = s.readString();
+		s.expect (':');
+		if (key == "folders" && s.peek() == '[')
+			read_folder_list (s, root);
+		else
+			s.skipValue();
+	} while (s.consume(','));
+	s.expect ('}');
+}
+
+void Parser::read_stream (std::istream &stream, Folder *root) {
+	JsonScanner s (stream.rdbuf());
+	read_root (s, root);
+}
+
+/// Folder as found by the JsonScanner: name and the byte range of its entries
+struct FolderSkeleton
+{
+	FolderSkeleton () : hasName(false), keysBegin(0), keysEnd(0), keyCount(0) { }
+	std::string name;
+	bool hasName;
+	const char *keysBegin, *keysEnd;
+	size_t keyCount;
+	std::vector<FolderSkeleton> subfolders;
+};
+
+static void scan_folder_list (JsonScanner &s, std::vector<FolderSkeleton> *list);
+
+static void scan_folder (JsonScanner &s, FolderSkeleton *folder) {
+	s.expect ('{');
+	if (s.consume('}'))
+		return;
+	do {
+		const std::string key = s.readString();
+		s.expect (':');
+		if (key == "name") {
+			if (s.peek() != '"')
+				s.fail ("Invalid subfolder entry: missing name");
+			folder->name = s.readString();
+			folder->hasName = true;
+		} else if (key == "keys" && s.peek() == '[') {
+			folder->keysBegin = s.position();
+			folder->keyCount = 0;
+			s.expect ('[');
+			if (!s.consume(']')) {
+				do {
+					if (s.peek() != '{')
+						s.fail ("Invalid key-entry in folder");
+					s.skipValue();
+					++folder->keyCount;
+				} while (s.consume(','));
+				s.expect (']');
+			}
+			folder->keysEnd = s.position();
+		} else if (key == "folders" && s.peek() == '[') {
+			folder->subfolders.clear();
+			scan_folder_list (s, &folder->subfolders);
+		} else {
+			s.skipValue();
+		}
+	} while (s.consume(','));
+	s.expect ('}');
+}
+
+static void scan_folder_list (JsonScanner &s, std::vector<FolderSkeleton> *list) {
+	s.expect ('[');
+	if (s.consume(']'))
+		return;
+	do {
+		if (s.peek() != '{')
+			s.fail ("Invalid entry in subfolder list");
+		list->emplace_back();
+		scan_folder (s, &list->back());
+	} while (s.consume(','));
+	s.expect (']');
+}
+
+static void build_skeleton (const std::vector<FolderSkeleton> &list, Folder *parent, const SharedText &text) {
+	for (const FolderSkeleton &sk : list) {
+		if (!sk.hasName)
+			throw std::runtime_error ("Invalid subfolder entry: missing name");
+		Folder *f = parent->createSubfolder (sk.name);
+		if (sk.keyCount > 0) {
+			const char *base = text->data();
+			f->setEntrySource (std::unique_ptr<EntrySource> (new JsonEntrySource (text,
+				sk.keysBegin - base, sk.keysEnd - base, sk.keyCount)));
+		}
+		build_skeleton (sk.subfolders, f, text);
+	}
+}
+
+static void read_skeleton (const SharedText &text, Folder *root) {
+	JsonScanner s (text->data(), text->data() + text->size());
+	FolderSkeleton skeletonRoot;
+	scan_folder (s, &skeletonRoot);
+	build_skeleton (skeletonRoot.subfolders, root, text);
+}
+
+void Parser::read_lazy (std::istream &stream, Folder *root) {
+	SharedText text (new std::string ((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>()),
+	                 WipingDeleter());
+	read_skeleton (text, root);
+}
+
+// Parallel reader: decodes the top-level folders on the workers of a ThreadPool
+
+/// Byte range of a top-level folder in the cleartext
+struct SubtreeRange
+{
+	size_t begin, end;
+};
+
+/// Read the index written with Writer::WRITE_SUBTREE_INDEX. @return No ranges if there is no valid index.
+static std::vector<SubtreeRange> read_subtree_index (const std::string &text) {
+	std::vector<SubtreeRange> index;
+	// The index is the last member of the root object, and a member name can not contain an unescaped quote
+	const size_t pos = text.rfind ("\"subtrees\"");
+	if (pos == std::string::npos)
+		return index;
+	try {
+		JsonScanner s (text.data() + pos, text.data() + text.size());
+		s.readString();
+		s.expect (':');
+		s.expect ('[');
+		if (!s.consume(']')) {
+			do {
+				s.expect ('[');
+				const uint64_t begin = s.readUInt64();
+				s.expect (',');
+				const uint64_t length = s.readUInt64();
+				s.expect (']');
+				if (begin > text.size() || length > text.size() - begin)
+					s.fail ("Subtree range out of bounds");
+				index.push_back (SubtreeRange {(size_t)begin, (size_t)(begin + length)});
+			} while (s.consume(','));
+			s.expect (']');
+		}
+		s.expect ('}');
+		if (!s.atEnd())
+			index.clear();
+	} catch (const std::runtime_error &) {
+		index.clear();
+	}
+	return index;
+}
+
+/**
+ * Find the byte ranges of the top-level folders while checking the structure of the root object.
+ * Folders recorded in @p index are jumped over, all others are skipped over value by value.
+ */
+static std::vector<SubtreeRange> locate_subtrees (const std::string &text, const std::vector<SubtreeRange> &index) {
+	const char *base = text.data();
+	JsonScanner s (base, base + text.size());
+	std::vector<SubtreeRange> ranges;
+	s.expect ('{');
+	if (s.consume('}'))
+		return ranges;
+	do {
+		const std::string key = s.readString();
+		s.expect (':');
+		if (key == "folders" && s.peek() == '[') {
+			s.expect ('[');
+			if (!s.consume(']')) {
+				do {
+					if (s.peek() != '{')
+						s.fail ("Invalid entry in subfolder list");
+					const size_t begin = s.position() - base, i = ranges.size();
+					// Whether the range really holds exactly one folder is checked when it is decoded
+					if (i < index.size() && index[i].begin == begin && index[i].end > begin && base[index[i].end - 1] == '}')
+						s.skipTo (base + index[i].end);
+					else
+						s.skipValue();
+					ranges.push_back (SubtreeRange {begin, (size_t)(s.position() - base)});
+				} while (s.consume(','));
+				s.expect (']');
+			}
+		} else {
+			s.skipValue();
+		}
+	} while (s.consume(','));
+	s.expect ('}');
+	return ranges;
+}
+
+/// Decode the folders in @p ranges in parallel, each below a root folder of its own
+static std::vector<RootFolder_Ptr> read_subtrees (const std::string &text, const std::vector<SubtreeRange> &ranges, ThreadPool &pool) {
+	std::vector<RootFolder_Ptr> parts (ranges.size());
+	std::vector<ThreadPool::Task> tasks;
+	for (size_t i = 0; i < ranges.size(); ++i) {
+		tasks.push_back ([&text, &ranges, &parts, i] () {
+			JsonScanner s (text.data() + ranges[i].begin, text.data() + ranges[i].end);
+			parts[i] = createRootFolder();
+			read_folder (s, parts[i].get());
+			if (!s.atEnd())
+				s.fail ("Subtree index does not match the folder list");
+		});
+	}
+	pool.run (std::move(tasks));
+	return parts;
+}
+
+/// Scan the folders in @p ranges in parallel, see read_lazy
+static std::vector<FolderSkeleton> scan_subtrees (const std::string &text, const std::vector<SubtreeRange> &ranges, ThreadPool &pool) {
+	std::vector<FolderSkeleton> skeletons (ranges.size());
+	std::vector<ThreadPool::Task> tasks;
+	for (size_t i = 0; i < ranges.size(); ++i) {
+		tasks.push_back ([&text, &ranges, &skeletons, i] () {
+			JsonScanner s (text.data() + ranges[i].begin, text.data() + ranges[i].end);
+			scan_folder (s, &skeletons[i]);
+			if (!s.atEnd())
+				s.fail ("Subtree index does not match the folder list");
+		});
+	}
+	pool.run (std::move(tasks));
+	return skeletons;
+}
+
+static void read_parallel (const SharedText &text, Folder *root, bool lazy, ThreadPool &pool) {
+	std::vector<RootFolder_Ptr> parts;
+	std::vector<FolderSkeleton> skeletons;
+	try {
+		const std::vector<SubtreeRange> ranges = locate_subtrees (*text, read_subtree_index (*text));
+		if (lazy)
+			skeletons = scan_subtrees (*text, ranges, pool);
+		else
+			parts = read_subtrees (*text, ranges, pool);
+	} catch (const std::exception &) {
+		// An outdated index or an invalid keystore: read it one folder after another,
+		// which also reports errors with their offset in the whole cleartext
+		if (lazy) {
+			read_skeleton (text, root);
+		} else {
+			JsonScanner s (text->data(), text->data() + text->size());
+			read_root (s, root);
+		}
+		return;
+	}
+	if (lazy) {
+		build_skeleton (skeletons, root, text);
+		return;
+	}
+	for (RootFolder_Ptr &part : parts) {
+		// Each part was decoded on its own, so the names of the top-level folders are checked here
+		Folder &sub = part->subfolders().front();
+		if (root->getSubfolder (sub.name()))
+			throw std::runtime_error ("Invalid subfolder entry: duplicate name \"" + sub.name() + "\"");
+		*root->createSubfolder (sub.name()) = std::move (sub);
+	}
+}
+
+/// @return The rest of the cleartext of @p stream
+static std::string read_all (std::istream &stream, ThreadPool &pool) {
+	if (CryptStream *crypt = dynamic_cast<CryptStream*> (stream.rdbuf()))
+		return crypt->readAll (pool);
+	return std::string ((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+}
+
+static void locate_entries (const std::vector<FolderSkeleton> &list, const std::string &parentPath, const char *base,
+                            std::vector<Parser::EntryLocation> *locations) {
+	for (const FolderSkeleton &sk : list) {
+		if (!sk.hasName)
+			throw std::runtime_error ("Invalid subfolder entry: missing name");
+		const std::string path = parentPath + "/" + sk.name;
+		if (sk.keyCount > 0) {
+			JsonScanner s (sk.keysBegin, sk.keysEnd);
+			s.expect ('[');
+			do {
+				s.skipWhitespace();
+				const char *entry = s.position();
+				s.skipValue();
+				locations->push_back (Parser::EntryLocation {path, (size_t)(entry - base), (size_t)(s.position() - base)});
+			} while (s.consume(','));
+		}
+		locate_entries (sk.subfolders, path, base, locations);
+	}
+}
+
+std::vector<Parser::EntryLocation> Parser::locateEntries (const std::string &text) {
+	JsonScanner s (text.data(), text.data() + text.size());
+	FolderSkeleton skeletonRoot;
+	scan_folder (s, &skeletonRoot);
+	std::vector<EntryLocation> locations;
+	locate_entries (skeletonRoot.subfolders, std::string(), text.data(), &locations);
+	return locations;
+}
+
+bool Parser::read (std::istream &stream, Folder *new_folder_root, int flags) {
 	if (!new_folder_root)
 		throw std::invalid_argument("Need a root folder object to parse a file");
 	
@@ -37,15 +511,42 @@ bool Parser::read (std::istream &stream, Folder *new_folder_root) {
 	
 	ExceptionMaskReset excMaskReset (stream);
 	try {
-		Json::Reader r;
-		Json::Value json_root;
-		if (r.parse(stream, json_root) == true) {
-			parse_folder_list (json_root, new_folder_root);
+		if (BinaryKeystore::detect (stream)) {
+			BinaryKeystore::read (stream, new_folder_root, (flags & READ_LAZY) != 0);
 			return true;
-		} else {
-			this->errorMsg = r.getFormattedErrorMessages();
-			return false;
 		}
+		if (flags & READ_LAZY) {
+			read_lazy (stream, new_folder_root);
+			return true;
+		}
+		read_stream (stream, new_folder_root);
+		return true;
+	} catch (const std::exception &e) {
+		this->errorMsg = e.what();
+		stream.clear();
+		return false;
+	}
+}
+
+bool Parser::read (std::istream &stream, Folder *new_folder_root, ThreadPool &pool, int flags) {
+	if (!new_folder_root)
+		throw std::invalid_argument("Need a root folder object to parse a file");
+	
+	if (!stream.good()) {
+		this->errorMsg = "Could not open file";
+		return false;
+	}
+	
+	ExceptionMaskReset excMaskReset (stream);
+	try {
+		std::string body = read_all (stream, pool);
+		if (!body.empty() && body[0] == BinaryKeystore::Magic[0]) {
+			BinaryKeystore::read (std::move(body), new_folder_root, (flags & READ_LAZY) != 0, pool);
+			return true;
+		}
+		const SharedText text (new std::string (std::move(body)), WipingDeleter());
+		read_parallel (text, new_folder_root, (flags & READ_LAZY) != 0, pool);
+		return true;
 	} catch (const std::exception &e) {
 		this->errorMsg = e.what();
 		stream.clear();
@@ -57,7 +558,7 @@ const std::string &Parser::error () const {
 	return errorMsg;
 }
 
-void Parser::parse_key (const Json::Value &key_entry, Folder *parent) {
+Entry Parser::parseEntry (const Json::Value &key_entry) {
 	Json::Value title = key_entry.get("title", Json::Value::null),
 		user = key_entry.get("username", Json::Value::null),
 		url = key_entry.get("url", Json::Value::null),
@@ -66,38 +567,19 @@ void Parser::parse_key (const Json::Value &key_entry, Folder *parent) {
 		comment = key_entry.get("comment", Json::Value::null);
 	if (!title.isString() || !user.isString() || !url.isString() || !pwd.isString() || !comment.isString())
 		std::cerr << "Error when parsing key entry: Missing or invalid field\n";
-	Entry ent (title.asString(), user.asString(), url.asString(), pwd.asString(),
+	Entry entry (title.asString(), user.asString(), url.asString(), pwd.asString(),
 		   (email.isString()) ? email.asString() : "",  comment.asString());
-	parent->addEntry (std::move(ent));
-}
-
-void Parser::parse_folder (const Json::Value &folder, Folder *parent) {
-	Json::Value name = folder.get("name", Json::Value::null);
-	if (!name.isString())
-		throw std::runtime_error ("Invalid subfolder entry: missing name");
-	// Create info
-	Folder *f = parent->createSubfolder(name.asString());
-	Json::Value keys = folder.get("keys", Json::Value::null);
-	if (keys.isArray()) {
-		for (const auto &it : keys) {
-			if (!it.isObject())
-				throw std::runtime_error ("Invalid key-entry in folder");
-			parse_key (it, f);
-		}
-	}
-	// Parse subfolders:
-	parse_folder_list (folder, f);
-}
-
-void Parser::parse_folder_list (const Json::Value &item, Folder *parent) {
-	Json::Value list = item.get("folders", Json::Value::null);
-	if (list.isArray()) {
-		for (const auto &it : list) {
-			if (!it.isObject())
-				throw std::runtime_error ("Invalid entry in subfolder list");
-			parse_folder (it, parent);
+	const Json::Value &attachments = key_entry["attachments"];
+	if (attachments.isArray()) {
+		for (const auto &it : attachments) {
+			Json::Value id = it.get("id", Json::Value::null), key = it.get("key", Json::Value::null);
+			if (!id.isString() || !key.isString())
+				throw std::runtime_error ("Invalid attachment entry: missing id or key");
+			entry.addAttachment (Attachment {id.asString(), it.get("name", "").asString(),
+				it.get("size", 0).asUInt64(), from_hex(key.asString())});
 		}
 	}
+	return entry;
 }
 
 // Writer
@@ -139,25 +621,276 @@ void Writer::removeFile (const std::string &file) {
 	}
 }
 
-bool Writer::write (std::ostream &stream, const Folder &rootNode, int flags) {
+/**
+ * Writes Json directly to a stream, in the format of Json::FastWriter or indented similar to Json::StyledWriter.
+ * Only the state of the current nesting level is kept.
+ */
+class JsonStreamWriter
+{
+public:
+	JsonStreamWriter (std::ostream &out, bool formatted) : _out(out), _formatted(formatted), _depth(0), _written(0), _empty(true) { }
+	
+	void beginObject () { _put ('{'); _open(); }
+	void endObject () { _close ('}'); }
+	void beginArray () { _put ('['); _open(); }
+	void endArray () { _close (']'); }
+	
+	/// Start the next member of an object
+	void key (const char *name) {
+		_next();
+		_string (name, strlen(name));
+		if (_formatted)
+			_write (" : ", 3);
+		else
+			_put (':');
+	}
+	
+	/// Start the next element of an array
+	void element () { _next(); }
+	
+	void value (const std::string &s) { _string (s.data(), s.size()); }
+	void value (uint64_t v) {
+		const std::string text = std::to_string (v);
+		_write (text.data(), text.size());
+	}
+	
+	void end () { _put ('\n'); }
+	
+	/// Write an already serialized value
+	void raw (const char *s, size_t n) { _write (s, n); }
+	
+	bool formatted () const { return _formatted; }
+	
+	/// @return Number of bytes written so far
+	uint64_t written () const { return _written; }
+private:
+	std::ostream &_out;
+	const bool _formatted;
+	size_t _depth;
+	uint64_t _written;
+	/// Nothing has been written into the current object or array yet
+	bool _empty;
+	
+	void _put (char c) {
+		_out.put (c);
+		++_written;
+	}
+	
+	void _write (const char *s, size_t n) {
+		_out.write (s, n);
+		_written += n;
+	}
+	
+	void _open () {
+		++_depth;
+		_empty = true;
+	}
+	
+	void _close (char c) {
+		--_depth;
+		if (!_empty)
+			_newline();
+		_put (c);
+		_empty = false;
+	}
+	
+	void _next () {
+		if (!_empty)
+			_put (',');
+		_empty = false;
+		_newline();
+	}
+	
+	void _newline () {
+		if (!_formatted)
+			return;
+		_put ('\n');
+		for (size_t i = 0; i < _depth; ++i)
+			_write ("   ", 3);
+	}
+	
+	/// Write a quoted string, escaped like Json::FastWriter does
+	void _string (const char *s, size_t size) {
+		static const char digits[] = "0123456789ABCDEF";
+		_put ('"');
+		const char *end = s + size;
+		while (s < end) {
+			const char *run = s;
+			while (s < end && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20)
+				++s;
+			_write (run, s - run);
+			if (s == end)
+				break;
+			const char c = *s++;
+			switch (c) {
+			case '"': _write ("\\\"", 2); break;
+			case '\\': _write ("\\\\", 2); break;
+			case '\b': _write ("\\b", 2); break;
+			case '\f': _write ("\\f", 2); break;
+			case '\n': _write ("\\n", 2); break;
+			case '\r': _write ("\\r", 2); break;
+			case '\t': _write ("\\t", 2); break;
+			default: {
+				const char escape[] = {'\\', 'u', '0', '0', digits[(c >> 4) & 0xf], digits[c & 0xf]};
+				_write (escape, sizeof(escape));
+			}
+			}
+		}
+		_put ('"');
+	}
+};
+
+/// Members in the order of Json::FastWriter, which sorts them by name
+static void write_entry (JsonStreamWriter &w, const Entry &entry) {
+	w.beginObject();
+	if (!entry.attachments().empty()) {
+		w.key ("attachments");
+		w.beginArray();
+		for (const Attachment &a : entry.attachments()) {
+			w.element();
+			w.beginObject();
+			w.key ("id");
+			w.value (a.id);
+			w.key ("key");
+			w.value (to_hex (a.key));
+			w.key ("name");
+			w.value (a.name);
+			w.key ("size");
+			w.value (a.size);
+			w.endObject();
+		}
+		w.endArray();
+	}
+	w.key ("comment");
+	w.value (entry.comment());
+	w.key ("email");
+	w.value (entry.email());
+	w.key ("password");
+	w.value (entry.password());
+	w.key ("title");
+	w.value (entry.title());
+	w.key ("url");
+	w.value (entry.url());
+	w.key ("username");
+	w.value (entry.username());
+	w.endObject();
+}
+
+/// Stream buffer that appends to a string, which can be wiped afterwards
+class StringAppender
+	: public std::streambuf
+{
+public:
+	explicit StringAppender (std::string *out) : _out(out) { }
+protected:
+	std::streamsize xsputn (const char *s, std::streamsize n) override {
+		_out->append (s, n);
+		return n;
+	}
+	int_type overflow (int_type c) override {
+		if (!traits_type::eq_int_type (c, traits_type::eof()))
+			_out->push_back (traits_type::to_char_type (c));
+		return traits_type::not_eof (c);
+	}
+private:
+	std::string *_out;
+};
+
+static void write_entries (JsonStreamWriter &w, const Folder &folder, SerializationCache *cache) {
+	// Entries that were not decoded since loading are still in the cleartext they were loaded from
+	const JsonEntrySource *source = dynamic_cast<const JsonEntrySource*> (folder.entrySource());
+	if (source && !w.formatted()) {
+		w.raw (source->data(), source->length());
+		return;
+	}
+	if (!cache) {
+		w.beginArray();
+		for (const Entry &e : folder.entries()) {
+			w.element();
+			write_entry (w, e);
+		}
+		w.endArray();
+		return;
+	}
+	const std::string *fragment = cache->fragment (folder);
+	if (!fragment) {
+		std::string text;
+		StringAppender appender (&text);
+		std::ostream out (&appender);
+		JsonStreamWriter entries (out, false);
+		entries.beginArray();
+		for (const Entry &e : folder.entries()) {
+			entries.element();
+			write_entry (entries, e);
+		}
+		entries.endArray();
+		cache->setFragment (folder, std::move(text));
+		fragment = cache->fragment (folder);
+	}
+	w.raw (fragment->data(), fragment->size());
+}
+
+/**
+ * @param subtreeIndex Append the byte ranges of the subfolders, see Writer::WRITE_SUBTREE_INDEX
+ * @param cache Serialized entries to reuse, only for unformatted output
+ */
+static void write_folder (JsonStreamWriter &w, const Folder &folder, bool subtreeIndex = false, SerializationCache *cache = nullptr) {
+	std::vector<std::pair<uint64_t, uint64_t>> ranges;
+	w.beginObject();
+	if (!folder.subfolders().empty()) {
+		w.key ("folders");
+		w.beginArray();
+		for (const Folder &f : folder.subfolders()) {
+			w.element();
+			const uint64_t begin = w.written();
+			write_folder (w, f, false, cache);
+			if (subtreeIndex)
+				ranges.emplace_back (begin, w.written() - begin);
+		}
+		w.endArray();
+	}
+	if (folder.entryCount() > 0) {
+		w.key ("keys");
+		write_entries (w, folder, cache);
+	}
+	w.key ("name");
+	w.value (folder.name());
+	if (subtreeIndex) {
+		w.key ("subtrees");
+		w.beginArray();
+		for (const auto &r : ranges) {
+			w.element();
+			w.beginArray();
+			w.element();
+			w.value (r.first);
+			w.element();
+			w.value (r.second);
+			w.endArray();
+		}
+		w.endArray();
+	}
+	w.endObject();
+}
+
+bool Writer::write (std::ostream &stream, const Folder &rootNode, int flags, SerializationCache *cache) {
 	if (!stream.good()) {
 		this->errorMsg = "Could not open file";
 		return false;
 	}
 	ExceptionMaskReset excMaskReset (stream);
-	
-	Json::Value jsonRoot;
-	serialize_folder (jsonRoot, rootNode);
-	std::unique_ptr<Json::Writer> wptr;
-	if (flags & WRITE_FORMATTED)
-		wptr.reset(new Json::StyledWriter);
-	else
-		wptr.reset(new Json::FastWriter);
-	std::string text = wptr->write(jsonRoot);
 	try {
-		stream.write (text.data(), text.size());
+		if (flags & WRITE_BINARY) {
+			BinaryKeystore::write (stream, rootNode);
+		} else {
+			// Each part is encrypted as soon as the buffer of the stream is full
+			const bool formatted = (flags & WRITE_FORMATTED) != 0;
+			JsonStreamWriter w (stream, formatted);
+			write_folder (w, rootNode, (flags & WRITE_SUBTREE_INDEX) != 0, formatted ? nullptr : cache);
+			w.end();
+		}
 	} catch (const std::exception &e) {
 		this->errorMsg = e.what();
+		stream.clear();
 		return false;
 	}
 	if (!stream.good()) {
@@ -168,33 +901,115 @@ bool Writer::write (std::ostream &stream, const Folder &rootNode, int flags) {
 	return true;
 }
 
+// CleartextBuffer
+
+CleartextBuffer::~CleartextBuffer () {
+	wipe (&_text);
+}
+
+void CleartextBuffer::_reserve (size_t n) {
+	if (_text.size() + n <= _text.capacity())
+		return;
+	// Move to a larger buffer by hand, so the old one can be wiped
+	std::string larger;
+	larger.reserve (std::max (2 * _text.capacity(), _text.size() + n));
+	larger.assign (_text);
+	wipe (&_text);
+	_text.swap (larger);
+}
+
+std::streamsize CleartextBuffer::xsputn (const char *s, std::streamsize n) {
+	_reserve (n);
+	_text.append (s, n);
+	return n;
+}
+
+CleartextBuffer::int_type CleartextBuffer::overflow (int_type c) {
+	if (!traits_type::eq_int_type (c, traits_type::eof())) {
+		_reserve (1);
+		_text.push_back (traits_type::to_char_type (c));
+	}
+	return traits_type::not_eof (c);
+}
+
+// SerializationCache
+
+SerializationCache::~SerializationCache () {
+	clear();
+}
+
+const std::string *SerializationCache::fragment (const Folder &folder) const {
+	auto it = _fragments.find (folder.id());
+	return (it == _fragments.end()) ? nullptr : &it->second;
+}
+
+void SerializationCache::setFragment (const Folder &folder, std::string fragment) {
+	std::string &f = _fragments[folder.id()];
+	wipe (&f);
+	f = std::move(fragment);
+}
+
+void SerializationCache::invalidate (const Folder &folder) {
+	auto it = _fragments.find (folder.id());
+	if (it == _fragments.end())
+		return;
+	wipe (&it->second);
+	_fragments.erase (it);
+}
+
+void SerializationCache::clear () {
+	for (auto &f : _fragments)
+		wipe (&f.second);
+	_fragments.clear();
+}
+
+size_t SerializationCache::memoryUsage () const {
+	size_t bytes = 0;
+	for (const auto &f : _fragments)
+		bytes += f.second.size();
+	return bytes;
+}
+
+void SerializationCache::entryAdded (const Folder &folder, int) {
+	invalidate (folder);
+}
+
+void SerializationCache::entryChanged (const Folder &folder, int, const Entry &) {
+	invalidate (folder);
+}
+
+void SerializationCache::entryRemoved (const Folder &folder, int, const Entry &) {
+	invalidate (folder);
+}
+
+void SerializationCache::folderRemoved (const Folder &, const Folder &folder) {
+	invalidate (folder);
+	for (const Folder &f : folder.subfolders())
+		folderRemoved (folder, f);
+}
+
 const std::string& Writer::error () const {
 	return errorMsg;
 }
-void Writer::serialize_folder (Json::Value &parent, const Folder &folder) {
-	parent["name"] = Json::Value(folder.name());
-	if (!folder.entries().empty()) {
-		Json::Value keys (Json::arrayValue);
-		for (const auto &it : folder.entries()) {
-			Json::Value key;
-			key["title"] = it.title();
-			key["username"] = it.username();
-			key["url"] = it.url();
-			key["password"] = it.password();
-			key["comment"] = it.comment();
-			key["email"] = it.email();
-			keys.append(key);
-		}
-		parent["keys"] = keys;
-	}
-	if (!folder.subfolders().empty()) {
-		Json::Value subfolders (Json::arrayValue);
-		for (const auto &it : folder.subfolders()) {
+
+void Writer::serializeEntry (Json::Value &key, const Entry &entry) {
+	key["title"] = entry.title();
+	key["username"] = entry.username();
+	key["url"] = entry.url();
+	key["password"] = entry.password();
+	key["comment"] = entry.comment();
+	key["email"] = entry.email();
+	if (!entry.attachments().empty()) {
+		Json::Value attachments (Json::arrayValue);
+		for (const Attachment &a : entry.attachments()) {
 			Json::Value v (Json::objectValue);
-			serialize_folder(v, it);
-			subfolders.append(v);
+			v["id"] = a.id;
+			v["name"] = a.name;
+			v["size"] = (Json::UInt64)a.size;
+			v["key"] = to_hex (a.key);
+			attachments.append (v);
 		}
-		parent["folders"] = subfolders;
+		key["attachments"] = attachments;
 	}
 }
 
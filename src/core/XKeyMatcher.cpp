@@ -0,0 +1,220 @@
+#include "XKeyMatcher.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define XKEY_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace XKey {
+
+static inline char fold_ascii (char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static uint32_t fold_codepoint (uint32_t c) {
+	if (c < 0x80)
+		return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+	if (c >= 0xC0 && c <= 0xDE && c != 0xD7) // Latin-1
+		return c + 0x20;
+	if (c >= 0x100 && c <= 0x17F) { // Latin Extended-A
+		if (c == 0x130)
+			return 'i';
+		if (c == 0x178)
+			return 0xFF;
+		if ((c < 0x138 || (c >= 0x14A && c < 0x178)) && c % 2 == 0)
+			return c + 1;
+		if (((c >= 0x139 && c < 0x149) || (c >= 0x179 && c < 0x17F)) && c % 2 == 1)
+			return c + 1;
+		return c;
+	}
+	if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) // Greek
+		return c + 0x20;
+	if (c >= 0x400 && c <= 0x40F) // Cyrillic
+		return c + 0x50;
+	if (c >= 0x410 && c <= 0x42F)
+		return c + 0x20;
+	return c;
+}
+
+static void append_utf8 (std::string *out, uint32_t cp) {
+	if (cp < 0x80) {
+		out->push_back ((char)cp);
+	} else if (cp < 0x800) {
+		out->push_back ((char)(0xC0 | (cp >> 6)));
+		out->push_back ((char)(0x80 | (cp & 0x3F)));
+	} else if (cp < 0x10000) {
+		out->push_back ((char)(0xE0 | (cp >> 12)));
+		out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+		out->push_back ((char)(0x80 | (cp & 0x3F)));
+	} else {
+		out->push_back ((char)(0xF0 | (cp >> 18)));
+		out->push_back ((char)(0x80 | ((cp >> 12) & 0x3F)));
+		out->push_back ((char)(0x80 | ((cp >> 6) & 0x3F)));
+		out->push_back ((char)(0x80 | (cp & 0x3F)));
+	}
+}
+
+std::string SubstringMatcher::foldCase (const std::string &text) {
+	std::string out;
+	out.reserve (text.size());
+	const unsigned char *p = (const unsigned char*)text.data(), *end = p + text.size();
+	while (p < end) {
+		if (*p < 0x80) {
+			out.push_back (fold_ascii(*p++));
+			continue;
+		}
+		// Decode one UTF-8 sequence. Invalid bytes are copied unchanged.
+		const int length = (*p >= 0xF0 && *p < 0xF8) ? 4 : (*p >= 0xE0) ? 3 : (*p >= 0xC0) ? 2 : 0;
+		bool valid = (length > 0 && end - p >= length);
+		uint32_t cp = (length > 0) ? (*p & (0x7F >> length)) : 0;
+		for (int i = 1; valid && i < length; ++i) {
+			valid = ((p[i] & 0xC0) == 0x80);
+			cp = (cp << 6) | (p[i] & 0x3F);
+		}
+		if (!valid) {
+			out.push_back ((char)*p++);
+			continue;
+		}
+		append_utf8 (&out, fold_codepoint(cp));
+		p += length;
+	}
+	return out;
+}
+
+// Kernels for ASCII needles. The needle is folded, has length m >= 1, and the haystack length n >= m.
+
+static inline bool equal_folded (const char *text, const char *foldedNeedle, size_t length) {
+	for (size_t i = 0; i < length; ++i) {
+		if (fold_ascii(text[i]) != foldedNeedle[i])
+			return false;
+	}
+	return true;
+}
+
+static bool find_scalar (const char *h, size_t n, const char *needle, size_t m) {
+	if (n < m)
+		return false;
+	const char first = needle[0], last = needle[m - 1];
+	for (size_t i = 0; i + m <= n; ++i) {
+		if (fold_ascii(h[i]) == first && fold_ascii(h[i + m - 1]) == last && (m <= 2 || equal_folded (h + i + 1, needle + 1, m - 2)))
+			return true;
+	}
+	return false;
+}
+
+#ifdef XKEY_SIMD_X86
+
+static inline __m128i fold_sse2 (__m128i x) {
+	const __m128i upper = _mm_and_si128 (_mm_cmpgt_epi8 (x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8 (x, _mm_set1_epi8('Z' + 1)));
+	return _mm_or_si128 (x, _mm_and_si128 (upper, _mm_set1_epi8(0x20)));
+}
+
+static bool find_sse2 (const char *h, size_t n, const char *needle, size_t m) {
+	const __m128i first = _mm_set1_epi8 (needle[0]), last = _mm_set1_epi8 (needle[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		const __m128i a = fold_sse2 (_mm_loadu_si128 ((const __m128i*)(h + i)));
+		const __m128i b = fold_sse2 (_mm_loadu_si128 ((const __m128i*)(h + i + m - 1)));
+		unsigned int mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			const int bit = __builtin_ctz (mask);
+			if (m <= 2 || equal_folded (h + i + bit + 1, needle + 1, m - 2))
+				return true;
+			mask &= mask - 1;
+		}
+	}
+	return find_scalar (h + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2 (__m256i x) {
+	const __m256i upper = _mm256_and_si256 (_mm256_cmpgt_epi8 (x, _mm256_set1_epi8('A' - 1)),
+	                                        _mm256_cmpgt_epi8 (_mm256_set1_epi8('Z' + 1), x));
+	return _mm256_or_si256 (x, _mm256_and_si256 (upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static bool find_avx2_blocks (const char *h, size_t n, const char *needle, size_t m, size_t *scanned) {
+	const __m256i first = _mm256_set1_epi8 (needle[0]), last = _mm256_set1_epi8 (needle[m - 1]);
+	bool found = false;
+	size_t i = 0;
+	for (; !found && i + m - 1 + 32 <= n; i += 32) {
+		const __m256i a = fold_avx2 (_mm256_loadu_si256 ((const __m256i*)(h + i)));
+		const __m256i b = fold_avx2 (_mm256_loadu_si256 ((const __m256i*)(h + i + m - 1)));
+		unsigned int mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask && !found; mask &= mask - 1)
+			found = (m <= 2 || equal_folded (h + i + __builtin_ctz(mask) + 1, needle + 1, m - 2));
+	}
+	// Leave the AVX state before returning to SSE code, which otherwise pays for a state transition
+	_mm256_zeroupper();
+	*scanned = i;
+	return found;
+}
+
+static bool find_avx2 (const char *h, size_t n, const char *needle, size_t m) {
+	// Most entry fields are shorter than one block and never enter the AVX state
+	if (n < m - 1 + 32)
+		return find_sse2 (h, n, needle, m);
+	size_t scanned;
+	if (find_avx2_blocks (h, n, needle, m, &scanned))
+		return true;
+	return find_sse2 (h + scanned, n - scanned, needle, m);
+}
+
+#endif
+
+typedef bool (*FindKernel) (const char *h, size_t n, const char *needle, size_t m);
+
+static FindKernel select_kernel (const char **name) {
+#ifdef XKEY_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports ("avx2")) {
+		*name = "avx2";
+		return &find_avx2;
+	}
+	*name = "sse2";
+	return &find_sse2;
+#else
+	*name = "scalar";
+	return &find_scalar;
+#endif
+}
+
+struct KernelSelection
+{
+	KernelSelection () : find(select_kernel(&name)) { }
+	const char *name;
+	FindKernel find;
+};
+
+static const KernelSelection &kernel () {
+	static const KernelSelection selection;
+	return selection;
+}
+
+// SubstringMatcher
+
+SubstringMatcher::SubstringMatcher (const std::string &needle)
+	: _needle(foldCase(needle)),
+	_ascii(std::none_of (needle.begin(), needle.end(), [] (char c) { return (unsigned char)c >= 0x80; }))
+{ }
+
+const char *SubstringMatcher::implementation () {
+	return kernel().name;
+}
+
+bool SubstringMatcher::matches (const char *haystack, size_t length) const {
+	if (_needle.empty())
+		return true;
+	if (length < _needle.size())
+		return false;
+	if (_ascii)
+		return kernel().find (haystack, length, _needle.data(), _needle.size());
+	// Case-folding may change the length of UTF-8 sequences, so fold the whole haystack
+	return foldCase (std::string(haystack, length)).find (_needle) != std::string::npos;
+}
+
+}
@@ -0,0 +1,392 @@
+#include "XKeyMerkle.h"
+#include "XKeyBytes.h"
+
+#include <openssl/evp.h>
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace XKey {
+
+/// Incremental SHA-256 of length-prefixed fields
+class Hasher
+{
+public:
+	Hasher () : _ctx (EVP_MD_CTX_new(), &EVP_MD_CTX_free) {
+		if (!_ctx || EVP_DigestInit_ex (&*_ctx, EVP_sha256(), nullptr) != 1)
+			throw std::runtime_error ("Could not initialize SHA-256");
+	}
+
+	/// Add a type tag, so entries and folders with the same fields hash differently
+	void tag (char t) { _update (&t, 1); }
+
+	void add (uint64_t n) {
+		unsigned char bytes[8];
+		for (int i = 0; i < 8; ++i)
+			bytes[i] = (unsigned char)(n >> (8 * i));
+		_update (bytes, sizeof(bytes));
+	}
+
+	void add (const std::string &s) {
+		add ((uint64_t)s.size());
+		_update (s.data(), s.size());
+	}
+
+	void add (const ContentHash &h) { _update (h.data(), h.size()); }
+
+	ContentHash finish () {
+		ContentHash h;
+		unsigned int length = 0;
+		if (EVP_DigestFinal_ex (&*_ctx, h.data(), &length) != 1 || length != h.size())
+			throw std::runtime_error ("Could not compute SHA-256");
+		return h;
+	}
+private:
+	std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> _ctx;
+
+	void _update (const void *data, size_t length) {
+		if (EVP_DigestUpdate (&*_ctx, data, length) != 1)
+			throw std::runtime_error ("Could not compute SHA-256");
+	}
+};
+
+// MerkleTree
+
+MerkleTree::MerkleTree (const Folder &root)
+	: _root(&root), _inBatch(false)
+{
+	if (root.parent())
+		throw std::invalid_argument ("MerkleTree needs a root folder");
+	hash (root);
+}
+
+ContentHash MerkleTree::hashEntry (const Entry &entry) {
+	Hasher h;
+	h.tag ('E');
+	for (const std::string *field : {&entry.title(), &entry.username(), &entry.url(), &entry.password(), &entry.email(), &entry.comment()})
+		h.add (*field);
+	h.add ((uint64_t)entry.attachments().size());
+	for (const Attachment &a : entry.attachments()) {
+		h.add (a.id);
+		h.add (a.name);
+		h.add (a.size);
+		h.add (a.key);
+	}
+	return h.finish();
+}
+
+std::string MerkleTree::toHex (const ContentHash &hash) {
+	return to_hex (hash.data(), hash.size());
+}
+
+MerkleTree::Node &MerkleTree::_node (const Folder &folder) const {
+	auto it = _nodes.find (folder.id());
+	if (it == _nodes.end()) {
+		Node &n = _nodes[folder.id()];
+		n.entriesDirty = n.dirty = true;
+		return n;
+	}
+	return it->second;
+}
+
+const std::vector<ContentHash> &MerkleTree::entryHashes (const Folder &folder) const {
+	Node &n = _node (folder);
+	if (n.entriesDirty) {
+		n.entries.clear();
+		n.entries.reserve (folder.entries().size());
+		for (const Entry &e : folder.entries())
+			n.entries.push_back (hashEntry (e));
+		n.entriesDirty = false;
+	}
+	return n.entries;
+}
+
+const ContentHash &MerkleTree::hash (const Folder &folder) const {
+	// References into the map stay valid when nodes of subfolders are inserted
+	Node &n = _node (folder);
+	if (!n.dirty)
+		return n.hash;
+	Hasher h;
+	h.tag ('F');
+	h.add (folder.name());
+	const std::vector<ContentHash> &entries = entryHashes (folder);
+	h.add ((uint64_t)entries.size());
+	for (const ContentHash &e : entries)
+		h.add (e);
+	h.add ((uint64_t)folder.subfolders().size());
+	for (const Folder &f : folder.subfolders())
+		h.add (hash (f));
+	n.hash = h.finish();
+	n.dirty = false;
+	return n.hash;
+}
+
+void MerkleTree::_markDirty (const Folder *folder) {
+	for (const Folder *f = folder; f; f = f->parent()) {
+		auto it = _nodes.find (f->id());
+		if (it == _nodes.end())
+			continue;
+		// The ancestors of a dirty node are dirty already
+		if (it->second.dirty && f != folder)
+			return;
+		it->second.dirty = true;
+	}
+}
+
+void MerkleTree::_erase (const Folder &folder) {
+	_nodes.erase (folder.id());
+	for (const Folder &f : folder.subfolders())
+		_erase (f);
+}
+
+void MerkleTree::invalidate (const Folder &folder) {
+	_node(folder).entriesDirty = true;
+	_markDirty (&folder);
+}
+
+void MerkleTree::entryAdded (const Folder &folder, int index) {
+	Node &n = _node (folder);
+	if (_inBatch || n.entriesDirty)
+		n.entriesDirty = true;
+	else
+		n.entries.insert (n.entries.begin() + index, hashEntry (folder.entries()[index]));
+	_markDirty (&folder);
+}
+
+void MerkleTree::entryChanged (const Folder &folder, int index, const Entry &) {
+	Node &n = _node (folder);
+	if (_inBatch || n.entriesDirty)
+		n.entriesDirty = true;
+	else
+		n.entries[index] = hashEntry (folder.entries()[index]);
+	_markDirty (&folder);
+}
+
+void MerkleTree::entryRemoved (const Folder &folder, int index, const Entry &) {
+	Node &n = _node (folder);
+	if (_inBatch || n.entriesDirty)
+		n.entriesDirty = true;
+	else
+		n.entries.erase (n.entries.begin() + index);
+	_markDirty (&folder);
+}
+
+void MerkleTree::folderAdded (const Folder &folder) {
+	_markDirty (folder.parent());
+}
+
+void MerkleTree::folderRemoved (const Folder &parent, const Folder &folder) {
+	_erase (folder);
+	_markDirty (&parent);
+}
+
+void MerkleTree::folderRenamed (const Folder &folder, const std::string &) {
+	_markDirty (&folder);
+}
+
+void MerkleTree::folderMoved (const Folder &folder, const Folder &oldParent, int) {
+	_markDirty (&oldParent);
+	_markDirty (folder.parent());
+}
+
+void MerkleTree::batchStarted (const Folder &) {
+	_inBatch = true;
+}
+
+void MerkleTree::batchCommitted (const Folder &, size_t) {
+	_inBatch = false;
+}
+
+// Diff
+
+static std::string child_path (const std::string &path, const std::string &name) {
+	return (path == "/" ? std::string() : path) + "/" + name;
+}
+
+static void diff_folder (const Folder &a, const MerkleTree &ha, const Folder &b, const MerkleTree &hb,
+                         const std::string &path, std::vector<TreeDifference> *out) {
+	const std::vector<ContentHash> &entriesA = ha.entryHashes (a), &entriesB = hb.entryHashes (b);
+	std::vector<bool> matchedA (entriesA.size()), matchedB (entriesB.size());
+	if (entriesA != entriesB) {
+		// Identical entries first, wherever they are
+		std::map<ContentHash, std::vector<size_t>> unmatched;
+		for (size_t j = entriesB.size(); j-- > 0; )
+			unmatched[entriesB[j]].push_back (j);
+		for (size_t i = 0; i < entriesA.size(); ++i) {
+			auto it = unmatched.find (entriesA[i]);
+			if (it == unmatched.end() || it->second.empty())
+				continue;
+			matchedA[i] = matchedB[it->second.back()] = true;
+			it->second.pop_back();
+		}
+		// Then by title
+		for (size_t i = 0; i < entriesA.size(); ++i) {
+			if (matchedA[i])
+				continue;
+			const Entry &e = a.entries()[i];
+			for (size_t j = 0; j < entriesB.size(); ++j) {
+				if (!matchedB[j] && b.entries()[j].title() == e.title()) {
+					matchedA[i] = matchedB[j] = true;
+					out->push_back (TreeDifference {TreeDifference::ENTRY_CHANGED, path, &e, &b.entries()[j]});
+					break;
+				}
+			}
+		}
+		for (size_t i = 0; i < entriesA.size(); ++i) {
+			if (!matchedA[i])
+				out->push_back (TreeDifference {TreeDifference::ENTRY_REMOVED, path, &a.entries()[i], nullptr});
+		}
+		for (size_t j = 0; j < entriesB.size(); ++j) {
+			if (!matchedB[j])
+				out->push_back (TreeDifference {TreeDifference::ENTRY_ADDED, path, nullptr, &b.entries()[j]});
+		}
+	}
+
+	for (const Folder &f : a.subfolders()) {
+		const Folder *other = b.getSubfolder (f.name());
+		if (!other)
+			out->push_back (TreeDifference {TreeDifference::FOLDER_REMOVED, child_path (path, f.name()), nullptr, nullptr});
+		else if (ha.hash (f) != hb.hash (*other))
+			diff_folder (f, ha, *other, hb, child_path (path, f.name()), out);
+	}
+	for (const Folder &f : b.subfolders()) {
+		if (!a.getSubfolder (f.name()))
+			out->push_back (TreeDifference {TreeDifference::FOLDER_ADDED, child_path (path, f.name()), nullptr, nullptr});
+	}
+}
+
+std::vector<TreeDifference> diffTrees (const Folder &a, const MerkleTree &hashesA, const Folder &b, const MerkleTree &hashesB) {
+	std::vector<TreeDifference> differences;
+	if (hashesA.hash (a) != hashesB.hash (b))
+		diff_folder (a, hashesA, b, hashesB, "/", &differences);
+	return differences;
+}
+
+// Merge
+
+/// Hashes of the three hierarchies of a merge
+struct MergeSides
+{
+	const MerkleTree &base, &ours, &theirs;
+};
+
+static void copy_folder (Folder *target, const Folder &source) {
+	// The merged hierarchy has no observers yet
+	target->entries() = source.entries();
+	for (const Folder &f : source.subfolders())
+		copy_folder (target->createSubfolder (f.name()), f);
+}
+
+/// Entries are matched by their title and the number of previous entries with the same title
+typedef std::pair<std::string, int> EntryKey;
+
+/// Keys of the entries of @p folder, with their index
+struct EntryKeys
+{
+	std::vector<EntryKey> list;
+	std::map<EntryKey, size_t> index;
+
+	explicit EntryKeys (const Folder *folder) {
+		if (!folder)
+			return;
+		std::unordered_map<std::string, int> seen;
+		for (const Entry &e : folder->entries()) {
+			list.emplace_back (e.title(), seen[e.title()]++);
+			index[list.back()] = list.size() - 1;
+		}
+	}
+};
+
+static void merge_folder (const Folder *base, const Folder &ours, const Folder &theirs, Folder *result,
+                          const MergeSides &h, const std::string &path, std::vector<MergeConflict> *conflicts) {
+	const ContentHash &hashOurs = h.ours.hash (ours), &hashTheirs = h.theirs.hash (theirs);
+	if (hashOurs == hashTheirs || (base && h.base.hash (*base) == hashTheirs)) {
+		copy_folder (result, ours);
+		return;
+	}
+	if (base && h.base.hash (*base) == hashOurs) {
+		copy_folder (result, theirs);
+		return;
+	}
+
+	// Entries
+	const EntryKeys keysBase (base), keysOurs (&ours), keysTheirs (&theirs);
+	const std::vector<ContentHash> *entriesBase = base ? &h.base.entryHashes (*base) : nullptr;
+	const std::vector<ContentHash> &entriesOurs = h.ours.entryHashes (ours), &entriesTheirs = h.theirs.entryHashes (theirs);
+	auto conflict = [&] (const std::string &title, const char *reason) {
+		conflicts->push_back (MergeConflict {path, title, reason});
+	};
+	for (size_t i = 0; i < ours.entries().size(); ++i) {
+		const Entry &entry = ours.entries()[i];
+		auto b = keysBase.index.find (keysOurs.list[i]), t = keysTheirs.index.find (keysOurs.list[i]);
+		const ContentHash *hb = (b != keysBase.index.end()) ? &(*entriesBase)[b->second] : nullptr;
+		const ContentHash &ho = entriesOurs[i];
+		if (t == keysTheirs.index.end()) {
+			if (!hb) {
+				result->entries().push_back (entry);
+			} else if (*hb != ho) {
+				result->entries().push_back (entry);
+				conflict (entry.title(), "changed in ours, removed in theirs");
+			}
+			continue;
+		}
+		const ContentHash &ht = entriesTheirs[t->second];
+		if (ho == ht || (hb && *hb == ht)) {
+			result->entries().push_back (entry);
+		} else if (hb && *hb == ho) {
+			result->entries().push_back (theirs.entries()[t->second]);
+		} else {
+			result->entries().push_back (entry);
+			conflict (entry.title(), hb ? "changed on both sides" : "added on both sides with different content");
+		}
+	}
+	for (size_t i = 0; i < theirs.entries().size(); ++i) {
+		if (keysOurs.index.count (keysTheirs.list[i]))
+			continue;
+		const Entry &entry = theirs.entries()[i];
+		auto b = keysBase.index.find (keysTheirs.list[i]);
+		if (b == keysBase.index.end()) {
+			result->entries().push_back (entry);
+		} else if ((*entriesBase)[b->second] != entriesTheirs[i]) {
+			result->entries().push_back (entry);
+			conflict (entry.title(), "removed in ours, changed in theirs");
+		}
+	}
+
+	// Subfolders
+	for (const Folder &o : ours.subfolders()) {
+		const Folder *t = theirs.getSubfolder (o.name());
+		const Folder *b = base ? base->getSubfolder (o.name()) : nullptr;
+		const std::string subPath = child_path (path, o.name());
+		if (t) {
+			merge_folder (b, o, *t, result->createSubfolder (o.name()), h, subPath, conflicts);
+		} else if (!b) {
+			copy_folder (result->createSubfolder (o.name()), o);
+		} else if (h.base.hash (*b) != h.ours.hash (o)) {
+			copy_folder (result->createSubfolder (o.name()), o);
+			conflicts->push_back (MergeConflict {subPath, std::string(), "changed in ours, removed in theirs"});
+		}
+	}
+	for (const Folder &t : theirs.subfolders()) {
+		if (ours.getSubfolder (t.name()))
+			continue;
+		const Folder *b = base ? base->getSubfolder (t.name()) : nullptr;
+		if (!b) {
+			copy_folder (result->createSubfolder (t.name()), t);
+		} else if (h.base.hash (*b) != h.theirs.hash (t)) {
+			copy_folder (result->createSubfolder (t.name()), t);
+			conflicts->push_back (MergeConflict {child_path (path, t.name()), std::string(), "removed in ours, changed in theirs"});
+		}
+	}
+}
+
+RootFolder_Ptr mergeTrees (const Folder &base, const Folder &ours, const Folder &theirs, std::vector<MergeConflict> *conflicts) {
+	const MerkleTree hashBase (base), hashOurs (ours), hashTheirs (theirs);
+	RootFolder_Ptr result = createRootFolder();
+	merge_folder (&base, ours, theirs, result.get(), MergeSides {hashBase, hashOurs, hashTheirs}, "/", conflicts);
+	return result;
+}
+
+}
@@ -0,0 +1,322 @@
+#include "XKeyQuery.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace XKey {
+
+static const struct {
+	const char *name;
+	int field;
+} FieldNames[] = {
+	{"title", QueryPlan::TITLE}, {"user", QueryPlan::USERNAME}, {"username", QueryPlan::USERNAME},
+	{"url", QueryPlan::URL}, {"email", QueryPlan::EMAIL}, {"mail", QueryPlan::EMAIL},
+	{"comment", QueryPlan::COMMENT}, {"note", QueryPlan::COMMENT}
+};
+
+static int field_by_name (std::string name) {
+	std::transform (name.begin(), name.end(), name.begin(), [] (char c) { return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; });
+	for (const auto &f : FieldNames) {
+		if (name == f.name)
+			return f.field;
+	}
+	return 0;
+}
+
+static const char *field_name (int field) {
+	for (const auto &f : FieldNames) {
+		if (f.field == field)
+			return f.name;
+	}
+	return "";
+}
+
+// Lexer
+
+struct QueryToken
+{
+	enum Type { WORD, PHRASE, FIELD, LPAREN, RPAREN, NOT, AND, OR, END };
+	Type type;
+	std::string text;
+	int field;
+};
+
+static std::vector<QueryToken> lex_query (const std::string &query) {
+	std::vector<QueryToken> tokens;
+	auto readPhrase = [&query] (size_t *pos) {
+		const size_t end = query.find ('"', *pos + 1);
+		if (end == std::string::npos)
+			throw std::invalid_argument ("Unterminated quote in query");
+		std::string phrase = query.substr (*pos + 1, end - *pos - 1);
+		*pos = end + 1;
+		return phrase;
+	};
+	size_t pos = 0;
+	while (pos < query.size()) {
+		const char c = query[pos];
+		if (c == ' ' || c == '\t') {
+			++pos;
+		} else if (c == '(' || c == ')') {
+			tokens.push_back (QueryToken {(c == '(') ? QueryToken::LPAREN : QueryToken::RPAREN, std::string(1, c), 0});
+			++pos;
+		} else if (c == '"') {
+			tokens.push_back (QueryToken {QueryToken::PHRASE, readPhrase (&pos), 0});
+		} else if (c == '-' && pos + 1 < query.size() && query[pos + 1] != ' ') {
+			tokens.push_back (QueryToken {QueryToken::NOT, "-", 0});
+			++pos;
+		} else {
+			const size_t end = std::min (query.find_first_of (" \t()\"", pos), query.size());
+			std::string word = query.substr (pos, end - pos);
+			pos = end;
+			const size_t colon = word.find (':');
+			const int field = (colon != std::string::npos) ? field_by_name (word.substr(0, colon)) : 0;
+			if (field) {
+				std::string text = word.substr (colon + 1);
+				if (text.empty() && pos < query.size() && query[pos] == '"')
+					text = readPhrase (&pos);
+				if (text.empty())
+					throw std::invalid_argument ("Missing search text after " + word);
+				tokens.push_back (QueryToken {QueryToken::FIELD, text, field});
+			} else if (word == "OR" || word == "|") {
+				tokens.push_back (QueryToken {QueryToken::OR, word, 0});
+			} else if (word == "AND") {
+				tokens.push_back (QueryToken {QueryToken::AND, word, 0});
+			} else if (word == "NOT") {
+				tokens.push_back (QueryToken {QueryToken::NOT, word, 0});
+			} else {
+				tokens.push_back (QueryToken {QueryToken::WORD, word, 0});
+			}
+		}
+	}
+	tokens.push_back (QueryToken {QueryToken::END, "", 0});
+	return tokens;
+}
+
+// Parser
+
+class QueryParser
+{
+public:
+	QueryParser (QueryPlan *plan, const std::string &query) : _plan(plan), _tokens(lex_query(query)), _pos(0) { }
+
+	size_t parse () {
+		if (_peek() == QueryToken::END)
+			throw std::invalid_argument ("Empty query");
+		const size_t root = _parseOr();
+		if (_peek() == QueryToken::RPAREN)
+			throw std::invalid_argument ("Unexpected ')' in query");
+		return root;
+	}
+private:
+	QueryPlan *_plan;
+	std::vector<QueryToken> _tokens;
+	size_t _pos;
+
+	QueryToken::Type _peek () const { return _tokens[_pos].type; }
+
+	size_t _node (QueryPlan::Kind kind, int fields, std::vector<size_t> children) {
+		_plan->_nodes.push_back (QueryPlan::Node {kind, fields, 0, std::move(children), 0, 0});
+		return _plan->_nodes.size() - 1;
+	}
+
+	size_t _parseOr () {
+		std::vector<size_t> operands {_parseAnd()};
+		while (_peek() == QueryToken::OR) {
+			++_pos;
+			operands.push_back (_parseAnd());
+		}
+		return (operands.size() == 1) ? operands[0] : _node (QueryPlan::OR, 0, std::move(operands));
+	}
+
+	size_t _parseAnd () {
+		std::vector<size_t> operands;
+		for (;;) {
+			const QueryToken::Type t = _peek();
+			if (t == QueryToken::END || t == QueryToken::RPAREN || t == QueryToken::OR)
+				break;
+			if (t == QueryToken::AND) {
+				if (operands.empty())
+					throw std::invalid_argument ("Missing search term before AND");
+				++_pos;
+				continue;
+			}
+			operands.push_back (_parseUnary());
+		}
+		if (operands.empty() || _tokens[_pos - 1].type == QueryToken::AND)
+			throw std::invalid_argument ("Missing search term in query");
+		return (operands.size() == 1) ? operands[0] : _node (QueryPlan::AND, 0, std::move(operands));
+	}
+
+	size_t _parseUnary () {
+		const QueryToken &token = _tokens[_pos++];
+		switch (token.type) {
+		case QueryToken::NOT:
+			if (_peek() == QueryToken::END)
+				throw std::invalid_argument ("Missing search term after " + token.text);
+			return _node (QueryPlan::NOT, 0, std::vector<size_t> {_parseUnary()});
+		case QueryToken::LPAREN: {
+			const size_t inner = _parseOr();
+			if (_peek() != QueryToken::RPAREN)
+				throw std::invalid_argument ("Missing ')' in query");
+			++_pos;
+			return inner;
+		}
+		case QueryToken::WORD:
+		case QueryToken::PHRASE:
+		case QueryToken::FIELD: {
+			const size_t node = _node (QueryPlan::TERM, token.field ? token.field : QueryPlan::ALL_FIELDS, std::vector<size_t>());
+			_plan->_nodes[node].matcher = _plan->_matchers.size();
+			_plan->_matchers.emplace_back (token.text);
+			return node;
+		}
+		default:
+			throw std::invalid_argument ("Unexpected '" + token.text + "' in query");
+		}
+	}
+};
+
+// QueryPlan
+
+QueryPlan::QueryPlan (const std::string &query) {
+	_root = QueryParser (this, query).parse();
+	_optimize (_root);
+}
+
+bool QueryPlan::hasOperators (const std::string &query) {
+	try {
+		for (const QueryToken &t : lex_query (query)) {
+			if (t.type != QueryToken::WORD && t.type != QueryToken::END)
+				return true;
+		}
+		return false;
+	} catch (const std::invalid_argument &) {
+		return true; // Broken query syntax, like an unterminated quote
+	}
+}
+
+void QueryPlan::_optimize (size_t index) {
+	// Flatten nested operators of the same kind
+	if (_nodes[index].kind == AND || _nodes[index].kind == OR) {
+		std::vector<size_t> flat;
+		for (size_t child : _nodes[index].children) {
+			if (_nodes[child].kind == _nodes[index].kind)
+				flat.insert (flat.end(), _nodes[child].children.begin(), _nodes[child].children.end());
+			else
+				flat.push_back (child);
+		}
+		_nodes[index].children.swap (flat);
+	}
+	for (size_t child : _nodes[index].children)
+		_optimize (child);
+
+	Node &node = _nodes[index];
+	switch (node.kind) {
+	case TERM: {
+		// Each field is one scan; a longer needle is less likely to occur
+		int fieldCount = 0;
+		for (int f = node.fields; f; f &= f - 1)
+			++fieldCount;
+		const size_t length = _matchers[node.matcher].needle().size();
+		node.cost = fieldCount;
+		node.selectivity = std::min (0.95, fieldCount * std::pow (0.3, (double)length));
+		break;
+	}
+	case NOT:
+		node.cost = _nodes[node.children[0]].cost;
+		node.selectivity = 1 - _nodes[node.children[0]].selectivity;
+		break;
+	case AND:
+	case OR: {
+		// AND stops at the first operand that fails, OR at the first one that matches:
+		// evaluate the operands with the lowest cost per chance of stopping first
+		const bool isAnd = (node.kind == AND);
+		auto rank = [this, isAnd] (size_t n) {
+			const double stop = isAnd ? 1 - _nodes[n].selectivity : _nodes[n].selectivity;
+			return _nodes[n].cost / std::max (stop, 1e-9);
+		};
+		std::stable_sort (node.children.begin(), node.children.end(), [&rank] (size_t a, size_t b) { return rank(a) < rank(b); });
+		double reach = 1, cost = 0;
+		for (size_t child : node.children) {
+			cost += reach * _nodes[child].cost;
+			reach *= isAnd ? _nodes[child].selectivity : 1 - _nodes[child].selectivity;
+		}
+		node.cost = cost;
+		node.selectivity = isAnd ? reach : 1 - reach;
+		break;
+	}
+	}
+}
+
+bool QueryPlan::_evaluate (size_t index, const Entry &entry) const {
+	const Node &node = _nodes[index];
+	switch (node.kind) {
+	case TERM: {
+		const SubstringMatcher &m = _matchers[node.matcher];
+		return ((node.fields & TITLE) && m.matches (entry.title())) || ((node.fields & USERNAME) && m.matches (entry.username())) ||
+			((node.fields & URL) && m.matches (entry.url())) || ((node.fields & EMAIL) && m.matches (entry.email())) ||
+			((node.fields & COMMENT) && m.matches (entry.comment()));
+	}
+	case NOT:
+		return !_evaluate (node.children[0], entry);
+	case AND:
+		for (size_t child : node.children) {
+			if (!_evaluate (child, entry))
+				return false;
+		}
+		return true;
+	case OR:
+		for (size_t child : node.children) {
+			if (_evaluate (child, entry))
+				return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+bool QueryPlan::matches (const Entry &entry) const {
+	return _evaluate (_root, entry);
+}
+
+static void find_in_folder (const QueryPlan &plan, const Folder *folder, std::vector<SearchResult> *results) {
+	const std::deque<Entry> &entries = folder->entries();
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (plan.matches (entries[i]))
+			results->push_back (SearchResult (&entries[i], folder, i));
+	}
+	for (const Folder &sub : folder->subfolders())
+		find_in_folder (plan, &sub, results);
+}
+
+std::vector<SearchResult> QueryPlan::findAll (const Folder *rootFolder) const {
+	std::vector<SearchResult> results;
+	if (rootFolder)
+		find_in_folder (*this, rootFolder, &results);
+	return results;
+}
+
+void QueryPlan::_describe (size_t index, std::string *out) const {
+	const Node &node = _nodes[index];
+	if (node.kind == TERM) {
+		if (node.fields != ALL_FIELDS)
+			*out += std::string(field_name (node.fields)) + ":";
+		*out += "\"" + _matchers[node.matcher].needle() + "\"";
+		return;
+	}
+	*out += (node.kind == AND) ? "AND(" : (node.kind == OR) ? "OR(" : "NOT(";
+	for (size_t i = 0; i < node.children.size(); ++i) {
+		if (i > 0)
+			*out += ", ";
+		_describe (node.children[i], out);
+	}
+	*out += ")";
+}
+
+std::string QueryPlan::describe () const {
+	std::string out;
+	_describe (_root, &out);
+	return out;
+}
+
+}
@@ -0,0 +1,434 @@
+#include "XKeyRevisions.h"
+#include "CryptRecord.h"
+#include "XKeyAtomicFile.h"
+#include "XKeyBytes.h"
+#include "XKeyJsonSerialization.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+// Unix
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/rand.h>
+
+namespace XKey {
+
+static const char IndexName[] = "index";
+static const int IndexVersion = 1;
+static const char RevisionHeader[] = "*167110-revision* # v:1 #\n";
+static const size_t RevisionHeaderSize = sizeof(RevisionHeader) - 1;
+static const char RevisionSuffix[] = ".rev";
+static const size_t RevisionIdLength = 16;
+
+/// Length of the blocks of the previous revision that are looked up in the new one
+static const size_t DeltaBlockSize = 32;
+static const uint32_t DeltaHashBase = 257;
+enum DeltaOp : char {
+	/// Copy a range of the previous revision: offset and length follow
+	DELTA_COPY = 'c',
+	/// Insert new bytes: length and bytes follow
+	DELTA_INSERT = 'i',
+};
+
+/// Revision file names end up in paths, so only accept the format #record generates
+static bool is_valid_revision_file (const std::string &name) {
+	const size_t idLength = RevisionIdLength * 2;
+	return name.size() == idLength + sizeof(RevisionSuffix) - 1 && name.compare (idLength, std::string::npos, RevisionSuffix) == 0 &&
+		std::all_of (name.begin(), name.begin() + idLength, [] (char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+static std::string new_revision_file () {
+	std::string id (RevisionIdLength, '\0');
+	if (RAND_bytes ((unsigned char*)&id[0], id.size()) != 1)
+		throw std::runtime_error ("Could not generate a revision file name");
+	return to_hex (id) + RevisionSuffix;
+}
+
+// Binary delta
+
+static void put_varint (std::string *out, uint64_t v) {
+	while (v >= 0x80) {
+		out->push_back ((char)(v | 0x80));
+		v >>= 7;
+	}
+	out->push_back ((char)v);
+}
+
+static uint64_t get_varint (const std::string &in, size_t *pos) {
+	uint64_t v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*pos >= in.size())
+			throw std::runtime_error ("Truncated revision delta");
+		const unsigned char c = in[(*pos)++];
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return v;
+	}
+	throw std::runtime_error ("Invalid revision delta");
+}
+
+static uint32_t block_hash (const char *data) {
+	uint32_t h = 0;
+	for (size_t i = 0; i < DeltaBlockSize; ++i)
+		h = h * DeltaHashBase + (unsigned char)data[i];
+	return h;
+}
+
+/**
+ * @brief Encode @p target as copies of ranges of @p base and inserted bytes
+ *
+ * The blocks of @p base at multiples of DeltaBlockSize are indexed by their hash. A rolling hash over
+ * @p target finds them at any offset, and each found block is extended in both directions as far as
+ * the content matches, so the delta is about as large as the changed ranges.
+ */
+static std::string make_delta (const std::string &base, const std::string &target) {
+	std::string delta;
+	put_varint (&delta, target.size());
+	auto insert = [&delta, &target] (size_t begin, size_t end) {
+		if (end > begin) {
+			delta.push_back (DELTA_INSERT);
+			put_varint (&delta, end - begin);
+			delta.append (target, begin, end - begin);
+		}
+	};
+	if (base.size() < DeltaBlockSize || target.size() < DeltaBlockSize) {
+		insert (0, target.size());
+		return delta;
+	}
+	std::unordered_map<uint32_t, size_t> blocks;
+	blocks.reserve (base.size() / DeltaBlockSize);
+	for (size_t offset = 0; offset + DeltaBlockSize <= base.size(); offset += DeltaBlockSize)
+		blocks.emplace (block_hash (&base[offset]), offset);
+	uint32_t power = 1;
+	for (size_t i = 1; i < DeltaBlockSize; ++i)
+		power *= DeltaHashBase;
+
+	// target[pending, pos) is not covered by a copy yet
+	size_t pending = 0, pos = 0;
+	uint32_t h = block_hash (&target[0]);
+	while (pos + DeltaBlockSize <= target.size()) {
+		const auto it = blocks.find (h);
+		if (it != blocks.end() && memcmp (&base[it->second], &target[pos], DeltaBlockSize) == 0) {
+			size_t from = it->second, begin = pos, length = DeltaBlockSize;
+			while (begin > pending && from > 0 && base[from - 1] == target[begin - 1]) {
+				--from;
+				--begin;
+				++length;
+			}
+			while (from + length < base.size() && begin + length < target.size() && base[from + length] == target[begin + length])
+				++length;
+			insert (pending, begin);
+			delta.push_back (DELTA_COPY);
+			put_varint (&delta, from);
+			put_varint (&delta, length);
+			pos = pending = begin + length;
+			if (pos + DeltaBlockSize <= target.size())
+				h = block_hash (&target[pos]);
+			continue;
+		}
+		if (pos + DeltaBlockSize < target.size())
+			h = (h - (unsigned char)target[pos] * power) * DeltaHashBase + (unsigned char)target[pos + DeltaBlockSize];
+		++pos;
+	}
+	insert (pending, target.size());
+	return delta;
+}
+
+static std::string apply_delta (const std::string &base, const std::string &delta) {
+	size_t pos = 0;
+	const uint64_t size = get_varint (delta, &pos);
+	std::string out;
+	out.reserve (size);
+	while (pos < delta.size()) {
+		const char op = delta[pos++];
+		if (op == DELTA_COPY) {
+			const uint64_t from = get_varint (delta, &pos), length = get_varint (delta, &pos);
+			if (from > base.size() || length > base.size() - from)
+				throw std::runtime_error ("Invalid revision delta: range out of bounds");
+			out.append (base, from, length);
+		} else if (op == DELTA_INSERT) {
+			const uint64_t length = get_varint (delta, &pos);
+			if (length > delta.size() - pos)
+				throw std::runtime_error ("Truncated revision delta");
+			out.append (delta, pos, length);
+			pos += length;
+		} else {
+			throw std::runtime_error ("Invalid revision delta: unknown operation");
+		}
+	}
+	if (out.size() != size)
+		throw std::runtime_error ("Invalid revision delta: wrong size");
+	return out;
+}
+
+// RevisionStore
+
+RevisionStore::RevisionStore (const std::string &keystoreFile)
+	: _dir(directoryName(keystoreFile)), _interval(DEFAULT_CHECKPOINT_INTERVAL)
+{ }
+
+RevisionStore::~RevisionStore () {
+	wipe (&_latest);
+}
+
+std::string RevisionStore::directoryName (const std::string &keystoreFile) {
+	return keystoreFile + ".revisions";
+}
+
+bool RevisionStore::exists (const std::string &keystoreFile) {
+	struct stat st;
+	return stat ((directoryName(keystoreFile) + "/" + IndexName).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void RevisionStore::open (const std::string &passphrase, int keyIterationCount) {
+	_cipher.reset();
+	_revisions.clear();
+	_files.clear();
+	_macs.clear();
+	wipe (&_latest);
+	_latest.clear();
+	std::ifstream in (_dir + "/" + IndexName, std::ios::binary);
+	if (!in.is_open()) {
+		// Created by the first #record
+		_cipher.reset (new RecordCipher (passphrase, RecordCipher::generateSalt(), keyIterationCount));
+		return;
+	}
+	const std::string data ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const size_t headerEnd = data.find ('\n');
+	if (headerEnd == std::string::npos)
+		throw std::runtime_error ("Invalid revision index");
+	const std::string header = data.substr (0, headerEnd + 1);
+	int version = 0, iterationCount = 0;
+	char salt[33];
+	if (sscanf (header.c_str(), "*167110-revisions* # v:%i # salt:%32s # count:%i #", &version, salt, &iterationCount) != 3)
+		throw std::runtime_error ("Invalid revision index");
+	if (version != IndexVersion)
+		throw std::runtime_error ("Unsupported revision index version");
+	std::unique_ptr<RecordCipher> cipher (new RecordCipher (passphrase, from_hex(salt), iterationCount));
+	std::string text;
+	try {
+		text = cipher->open (data.substr (headerEnd + 1), header);
+	} catch (const std::runtime_error &) {
+		throw std::runtime_error ("Could not open the revision history: wrong passphrase or corrupt index");
+	}
+	Json::Reader r;
+	Json::Value index;
+	const bool parsed = r.parse (text, index, false);
+	wipe (&text);
+	if (!parsed || !index.isObject() || !index["revisions"].isArray())
+		throw std::runtime_error ("Invalid revision index: " + r.getFormattedErrorMessages());
+	for (const Json::Value &v : index["revisions"]) {
+		const std::string file = v["file"].asString();
+		if (!is_valid_revision_file (file))
+			throw std::runtime_error ("Invalid revision index: invalid revision file name");
+		_revisions.push_back (Revision {v["number"].asUInt(), v["time"].asInt64(), v["checkpoint"].asBool(),
+		                                (size_t)v["size"].asUInt64(), (size_t)v["stored"].asUInt64()});
+		_files.push_back (file);
+		_macs.push_back (from_hex (v["mac"].asString()));
+	}
+	if (!_revisions.empty() && !_revisions.front().checkpoint)
+		throw std::runtime_error ("Invalid revision index: the first revision is not a checkpoint");
+	_interval = std::max (1, index["interval"].asInt());
+	_cipher = std::move(cipher);
+	// Files of saves that were interrupted before the index was written
+	_collectGarbage();
+}
+
+bool RevisionStore::matchesPassphrase (const std::string &passphrase) const {
+	return _cipher && _cipher->matchesPassphrase(passphrase);
+}
+
+void RevisionStore::changePassphrase (const std::string &passphrase, int keyIterationCount) {
+	if (!isOpen())
+		throw std::logic_error ("Revision history is not open");
+	std::unique_ptr<RecordCipher> cipher (new RecordCipher (passphrase, RecordCipher::generateSalt(), keyIterationCount));
+	// Written to new files, so the current index stays valid until it is replaced
+	std::vector<std::string> files, macs;
+	std::vector<Revision> revisions = _revisions;
+	for (size_t i = 0; i < _revisions.size(); ++i) {
+		std::string payload = _load (i);
+		const std::string file = new_revision_file();
+		const std::string sealed = cipher->seal (payload, file);
+		wipe (&payload);
+		AtomicFile::write (_dir + "/" + file, RevisionHeader + sealed, AtomicFile::NO_DIRECTORY_SYNC);
+		files.push_back (file);
+		macs.push_back (RecordCipher::macOf (sealed));
+		revisions[i].storedSize = RevisionHeaderSize + sealed.size();
+	}
+	std::swap (_cipher, cipher);
+	std::swap (_files, files);
+	std::swap (_macs, macs);
+	std::swap (_revisions, revisions);
+	try {
+		_writeIndex();
+	} catch (...) {
+		std::swap (_cipher, cipher);
+		std::swap (_files, files);
+		std::swap (_macs, macs);
+		std::swap (_revisions, revisions);
+		throw;
+	}
+	_collectGarbage();
+}
+
+void RevisionStore::setCheckpointInterval (int interval) {
+	if (interval < 1)
+		throw std::invalid_argument ("The checkpoint interval must be at least 1");
+	_interval = interval;
+}
+
+unsigned RevisionStore::record (const Folder &root, SerializationCache *cache) {
+	if (!isOpen())
+		throw std::logic_error ("Revision history is not open");
+	// Collected in a buffer that is wiped, unlike the storage of an std::ostringstream
+	CleartextBuffer cleartext;
+	std::ostream out (&cleartext);
+	Writer w;
+	if (!w.write (out, root, Writer::WRITE_NONE, cache))
+		throw std::runtime_error ("Could not write revision: " + w.error());
+	std::string text = cleartext.text();
+	if (!_revisions.empty() && _latest.empty())
+		_latest = this->text (_revisions.back().number);
+	if (!_revisions.empty() && text == _latest) {
+		wipe (&text);
+		return _revisions.back().number;
+	}
+
+	int deltas = 0;
+	for (auto it = _revisions.rbegin(); it != _revisions.rend() && !it->checkpoint; ++it)
+		++deltas;
+	bool checkpoint = (_revisions.empty() || deltas + 1 >= _interval);
+	std::string payload;
+	if (!checkpoint) {
+		payload = make_delta (_latest, text);
+		// Not worth it for a mostly new keystore
+		if (payload.size() >= text.size() / 2) {
+			wipe (&payload);
+			checkpoint = true;
+		}
+	}
+	if (checkpoint)
+		payload = text;
+	if (mkdir (_dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+		throw std::runtime_error ("Could not create revision directory: " + std::string(strerror(errno)));
+	const std::string file = new_revision_file();
+	const std::string sealed = _cipher->seal (payload, file);
+	wipe (&payload);
+	AtomicFile::write (_dir + "/" + file, RevisionHeader + sealed, AtomicFile::NO_DIRECTORY_SYNC);
+
+	const unsigned number = _revisions.empty() ? 1 : _revisions.back().number + 1;
+	_revisions.push_back (Revision {number, (int64_t)std::time(nullptr), checkpoint, text.size(), RevisionHeaderSize + sealed.size()});
+	_files.push_back (file);
+	_macs.push_back (RecordCipher::macOf (sealed));
+	try {
+		_writeIndex();
+	} catch (...) {
+		_revisions.pop_back();
+		_files.pop_back();
+		_macs.pop_back();
+		unlink ((_dir + "/" + file).c_str());
+		wipe (&text);
+		throw;
+	}
+	wipe (&_latest);
+	_latest = std::move(text);
+	return number;
+}
+
+void RevisionStore::restore (unsigned number, Folder *root) const {
+	if (!root)
+		throw std::invalid_argument ("Need a root folder to restore the revision to");
+	std::string text = this->text (number);
+	std::istringstream in (text);
+	wipe (&text);
+	Parser parser;
+	if (!parser.read (in, root))
+		throw std::runtime_error ("Could not parse revision " + std::to_string(number) + ": " + parser.error());
+}
+
+std::string RevisionStore::text (unsigned number) const {
+	const size_t index = &_revision(number) - &_revisions.front();
+	size_t checkpoint = index;
+	while (!_revisions[checkpoint].checkpoint)
+		--checkpoint;
+	std::string text = _load (checkpoint);
+	for (size_t i = checkpoint + 1; i <= index; ++i) {
+		std::string delta = _load (i);
+		std::string next = apply_delta (text, delta);
+		wipe (&delta);
+		wipe (&text);
+		text = std::move(next);
+	}
+	return text;
+}
+
+const RevisionStore::Revision &RevisionStore::_revision (unsigned number) const {
+	const auto it = std::find_if (_revisions.begin(), _revisions.end(), [number] (const Revision &r) { return r.number == number; });
+	if (it == _revisions.end())
+		throw std::runtime_error ("No revision " + std::to_string(number));
+	return *it;
+}
+
+std::string RevisionStore::_load (size_t index) const {
+	const std::string &file = _files[index];
+	std::ifstream in (_dir + "/" + file, std::ios::binary);
+	if (!in.is_open())
+		throw std::runtime_error ("Missing revision file " + file);
+	std::string sealed ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (sealed.compare (0, RevisionHeaderSize, RevisionHeader) != 0)
+		throw std::runtime_error ("Invalid revision file " + file);
+	sealed.erase (0, RevisionHeaderSize);
+	if (sealed.size() < RecordCipher::Overhead || RecordCipher::macOf (sealed) != _macs[index])
+		throw std::runtime_error ("Revision file " + file + " does not belong to revision " + std::to_string(_revisions[index].number));
+	return _cipher->open (sealed, file);
+}
+
+void RevisionStore::_writeIndex () const {
+	Json::Value index (Json::objectValue);
+	index["interval"] = _interval;
+	Json::Value &list = index["revisions"] = Json::Value (Json::arrayValue);
+	for (size_t i = 0; i < _revisions.size(); ++i) {
+		const Revision &r = _revisions[i];
+		Json::Value &v = list.append (Json::Value (Json::objectValue));
+		v["number"] = r.number;
+		v["time"] = (Json::Int64)r.time;
+		v["checkpoint"] = r.checkpoint;
+		v["size"] = (Json::UInt64)r.size;
+		v["stored"] = (Json::UInt64)r.storedSize;
+		v["file"] = _files[i];
+		v["mac"] = to_hex (_macs[i]);
+	}
+	const std::string header = "*167110-revisions* # v:" + std::to_string(IndexVersion) + " # salt:" + to_hex(_cipher->salt()) +
+		" # count:" + std::to_string(_cipher->iterationCount()) + " #\n";
+	const std::string path = _dir + "/" + IndexName;
+	// The revision files must be in the directory before the index refers to them
+	AtomicFile::syncDirectory (path);
+	AtomicFile::write (path, header + _cipher->seal (Json::FastWriter().write (index), header));
+}
+
+void RevisionStore::_collectGarbage () const {
+	std::unique_ptr<DIR, int(*)(DIR*)> dir (opendir (_dir.c_str()), &closedir);
+	if (!dir)
+		return;
+	const std::set<std::string> referenced (_files.begin(), _files.end());
+	while (struct dirent *e = readdir (dir.get())) {
+		const std::string name = e->d_name;
+		if (is_valid_revision_file (name) && !referenced.count (name))
+			unlink ((_dir + "/" + name).c_str());
+	}
+}
+
+}
@@ -0,0 +1,245 @@
+#include "XKeySearchIndex.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace XKey {
+
+/// Minimum number of removed documents before the posting lists are compacted
+static const size_t CompactionThreshold = 1024;
+
+static inline char fold_ascii (char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline uint32_t trigram (const char *p) {
+	return ((uint32_t)(unsigned char)fold_ascii(p[0]) << 16) | ((uint32_t)(unsigned char)fold_ascii(p[1]) << 8) |
+		(uint32_t)(unsigned char)fold_ascii(p[2]);
+}
+
+void SearchIndex::collectTrigrams (const std::string &field, std::vector<uint32_t> *out) {
+	// Query tokens are folded by SubstringMatcher, which also folds non-ASCII letters
+	const bool ascii = std::none_of (field.begin(), field.end(), [] (char c) { return (unsigned char)c >= 0x80; });
+	std::string buffer;
+	if (!ascii)
+		buffer = SubstringMatcher::foldCase (field);
+	const std::string &folded = ascii ? field : buffer;
+	for (size_t i = 0; i + 3 <= folded.size(); ++i)
+		out->push_back (trigram (&folded[i]));
+}
+
+static void intersect (std::vector<uint32_t> *inOut, const std::vector<uint32_t> &other) {
+	std::vector<uint32_t> result;
+	std::set_intersection (inOut->begin(), inOut->end(), other.begin(), other.end(), std::back_inserter(result));
+	inOut->swap (result);
+}
+
+// SearchIndex
+
+SearchIndex::SearchIndex (const Folder &root)
+	: _root(0), _dead(0), _generation(0), _locationsValid(false), _inBatch(false)
+{
+	rebuild (root);
+}
+
+void SearchIndex::rebuild (const Folder &root) {
+	if (root.parent())
+		throw std::invalid_argument ("SearchIndex needs a root folder");
+	_root = &root;
+	_docs.clear();
+	_dead = 0;
+	_folderDocs.clear();
+	_postings.clear();
+	_indexFolder (root);
+	_changed();
+}
+
+void SearchIndex::_indexFolder (const Folder &folder) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	for (size_t i = 0; i < folder.entries().size(); ++i)
+		docs.push_back (_addDoc (folder, i));
+	for (const Folder &f : folder.subfolders())
+		_indexFolder (f);
+}
+
+SearchIndex::DocId SearchIndex::_addDoc (const Folder &folder, int index) {
+	const DocId id = _docs.size();
+	_docs.push_back (Doc {folder.id(), index, true});
+	const Entry &e = folder.entries()[index];
+	std::vector<uint32_t> trigrams;
+	collectTrigrams (e.title(), &trigrams);
+	collectTrigrams (e.username(), &trigrams);
+	collectTrigrams (e.url(), &trigrams);
+	collectTrigrams (e.email(), &trigrams);
+	collectTrigrams (e.comment(), &trigrams);
+	std::sort (trigrams.begin(), trigrams.end());
+	trigrams.erase (std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	// Document ids only grow, so the posting lists stay sorted
+	for (uint32_t t : trigrams)
+		_postings[t].push_back (id);
+	return id;
+}
+
+void SearchIndex::_removeDoc (DocId id) {
+	// Posting lists are cleaned up lazily, when they are compacted
+	if (_docs[id].alive) {
+		_docs[id].alive = false;
+		++_dead;
+	}
+}
+
+void SearchIndex::_removeFolder (const Folder &folder) {
+	auto it = _folderDocs.find (folder.id());
+	if (it != _folderDocs.end()) {
+		for (DocId id : it->second)
+			_removeDoc (id);
+		_folderDocs.erase (it);
+	}
+	for (const Folder &f : folder.subfolders())
+		_removeFolder (f);
+}
+
+void SearchIndex::_compactIfNeeded () {
+	// The hierarchy already has its final state while a batch is notified: Indexing it would
+	// make the remaining notifications of the batch refer to documents that have been replaced
+	if (!_inBatch && _dead > CompactionThreshold && _dead > size())
+		rebuild (*_root);
+}
+
+void SearchIndex::_changed () {
+	++_generation;
+	_locationsValid = false;
+}
+
+void SearchIndex::_updateLocations () const {
+	if (_locationsValid)
+		return;
+	_locations.clear();
+	size_t rank = 0;
+	std::vector<const Folder*> stack {_root};
+	while (!stack.empty()) {
+		const Folder *f = stack.back();
+		stack.pop_back();
+		_locations[f->id()] = FolderLocation {f, rank++};
+		for (auto it = f->subfolders().rbegin(); it != f->subfolders().rend(); ++it)
+			stack.push_back (&*it);
+	}
+	_locationsValid = true;
+}
+
+std::vector<SearchResult> SearchIndex::find (const std::string &searchString) const {
+	return find (SearchQuery(searchString));
+}
+
+std::vector<SearchResult> SearchIndex::find (const SearchQuery &query) const {
+	const std::vector<std::string> &tokens = query.tokens();
+	if (tokens.empty())
+		return std::vector<SearchResult>();
+
+	// Candidates: union over all tokens of the intersection of the token's posting lists
+	std::vector<DocId> candidates;
+	bool scanAll = false;
+	for (const std::string &token : tokens) {
+		if (token.size() < 3) {
+			scanAll = true;
+			break;
+		}
+		std::vector<const std::vector<DocId>*> lists;
+		for (size_t i = 0; i + 3 <= token.size(); ++i) {
+			auto it = _postings.find (trigram(&token[i]));
+			if (it == _postings.end()) {
+				lists.clear();
+				break;
+			}
+			lists.push_back (&it->second);
+		}
+		if (lists.empty())
+			continue; // Token does not occur anywhere
+		std::sort (lists.begin(), lists.end(), [] (const std::vector<DocId> *a, const std::vector<DocId> *b) {
+			return a->size() < b->size();
+		});
+		std::vector<DocId> docs (*lists[0]);
+		for (size_t i = 1; i < lists.size() && !docs.empty(); ++i)
+			intersect (&docs, *lists[i]);
+		std::vector<DocId> merged;
+		std::set_union (candidates.begin(), candidates.end(), docs.begin(), docs.end(), std::back_inserter(merged));
+		candidates.swap (merged);
+	}
+	if (scanAll) {
+		candidates.resize (_docs.size());
+		for (DocId i = 0; i < _docs.size(); ++i)
+			candidates[i] = i;
+	}
+
+	// Verify the candidates and bring them into tree order
+	_updateLocations();
+	std::vector<std::pair<size_t, SearchResult>> matches;
+	for (DocId id : candidates) {
+		const Doc &doc = _docs[id];
+		if (!doc.alive)
+			continue;
+		const FolderLocation &loc = _locations.at (doc.folder);
+		const Entry &e = loc.folder->entries()[doc.index];
+		if (query.matches (e))
+			matches.emplace_back (loc.rank, SearchResult (&e, loc.folder, doc.index));
+	}
+	std::sort (matches.begin(), matches.end(), [] (const std::pair<size_t, SearchResult> &a, const std::pair<size_t, SearchResult> &b) {
+		return (a.first != b.first) ? a.first < b.first : a.second.index() < b.second.index();
+	});
+	std::vector<SearchResult> results;
+	results.reserve (matches.size());
+	for (const auto &m : matches)
+		results.push_back (m.second);
+	return results;
+}
+
+void SearchIndex::entryAdded (const Folder &folder, int index) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	for (size_t i = index; i < docs.size(); ++i)
+		++_docs[docs[i]].index;
+	docs.insert (docs.begin() + index, _addDoc (folder, index));
+	_changed();
+}
+
+void SearchIndex::entryChanged (const Folder &folder, int index, const Entry &) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	_removeDoc (docs.at(index));
+	docs[index] = _addDoc (folder, index);
+	_changed();
+	_compactIfNeeded();
+}
+
+void SearchIndex::entryRemoved (const Folder &folder, int index, const Entry &) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	_removeDoc (docs.at(index));
+	docs.erase (docs.begin() + index);
+	for (size_t i = index; i < docs.size(); ++i)
+		--_docs[docs[i]].index;
+	_changed();
+	_compactIfNeeded();
+}
+
+void SearchIndex::folderAdded (const Folder &) {
+	_changed();
+}
+
+void SearchIndex::folderRemoved (const Folder &, const Folder &folder) {
+	_removeFolder (folder);
+	_changed();
+}
+
+void SearchIndex::folderMoved (const Folder &, const Folder &, int) {
+	// Documents refer to folders by id, which is kept when moving
+	_changed();
+}
+
+void SearchIndex::batchStarted (const Folder &) {
+	_inBatch = true;
+}
+
+void SearchIndex::batchCommitted (const Folder &, size_t) {
+	_inBatch = false;
+	_compactIfNeeded();
+}
+
+}
@@ -0,0 +1,61 @@
+#include "XKeySearchSession.h"
+#include "XKeySubtreeFilter.h"
+
+namespace XKey {
+
+static inline bool is_prefix (const std::string &prefix, const std::string &text) {
+	return prefix.size() <= text.size() && text.compare (0, prefix.size(), prefix) == 0;
+}
+
+SearchSession::SearchSession (const Folder *rootFolder, const SubtreeFilter *filter)
+	: _root(rootFolder), _filter(filter), _lastScanned(0)
+{ }
+
+void SearchSession::reset () {
+	_cache.clear();
+	_lastScanned = 0;
+}
+
+void SearchSession::_scanFolder (const SearchQuery &query, const Folder *folder, std::vector<SearchResult> *results) {
+	if (_filter && !_filter->mayMatchAll (*folder, query))
+		return;
+	const std::deque<Entry> &entries = folder->entries();
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (query.matchesAll (entries[i]))
+			results->push_back (SearchResult (&entries[i], folder, i));
+	}
+	_lastScanned += entries.size();
+	for (const Folder &sub : folder->subfolders())
+		_scanFolder (query, &sub, results);
+}
+
+const std::vector<SearchResult> &SearchSession::update (const std::string &searchString) {
+	_lastScanned = 0;
+	// Forget the search strings that are not a prefix of the new one (e.g. after backspace)
+	while (!_cache.empty() && !is_prefix (_cache.back().first, searchString))
+		_cache.pop_back();
+	if (!_cache.empty() && _cache.back().first == searchString)
+		return _cache.back().second;
+
+	const SearchQuery query (searchString);
+	if (query.empty() || !_root)
+		return _noResults;
+	std::vector<SearchResult> results;
+	if (!_cache.empty()) {
+		// Refine: the matches of the extended string are a subset of the previous matches
+		const std::vector<SearchResult> &previous = _cache.back().second;
+		for (const SearchResult &r : previous) {
+			if (query.matchesAll (*r.match()))
+				results.push_back (r);
+		}
+		_lastScanned = previous.size();
+	} else {
+		_scanFolder (query, _root, &results);
+	}
+	if (_cache.size() >= MaxCachedQueries)
+		_cache.erase (_cache.begin());
+	_cache.emplace_back (searchString, std::move(results));
+	return _cache.back().second;
+}
+
+}
@@ -0,0 +1,357 @@
+#include "XKeyShards.h"
+#include "XKeyAtomicFile.h"
+#include "XKeyBytes.h"
+#include "CryptRecord.h"
+#include "XKeyJsonSerialization.h"
+#include "XKeyThreadPool.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+// Unix
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/rand.h>
+
+namespace XKey {
+
+static const char ManifestName[] = "manifest";
+static const int ManifestVersion = 1;
+static const char ShardHeader[] = "*167110-shard* # v:1 #\n";
+static const size_t ShardHeaderSize = sizeof(ShardHeader) - 1;
+static const char ShardSuffix[] = ".shard";
+static const size_t ShardIdLength = 16;
+
+/// Shard file names end up in paths, so only accept the format #save generates
+static bool is_valid_shard_file (const std::string &name) {
+	const size_t idLength = ShardIdLength * 2;
+	return name.size() == idLength + sizeof(ShardSuffix) - 1 && name.compare (idLength, std::string::npos, ShardSuffix) == 0 &&
+		std::all_of (name.begin(), name.begin() + idLength, [] (char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+static std::string new_shard_file () {
+	std::string id (ShardIdLength, '\0');
+	if (RAND_bytes ((unsigned char*)&id[0], id.size()) != 1)
+		throw std::runtime_error ("Could not generate a shard file name");
+	return to_hex (id) + ShardSuffix;
+}
+
+/// A folder at the shard depth and the names of its ancestors below the root
+struct ShardLocation
+{
+	const Folder *folder;
+	Json::Value parent;
+};
+
+/**
+ * Serialize the folders of @p folder above the shard depth to @p node, and collect the folders at the shard depth
+ * in tree order. Like in a keystore file, entries of the root folder are not stored.
+ * @param level Level of @p folder, 0 for the root
+ */
+static void split_trunk (const Folder &folder, int level, int depth, const Json::Value &path, Json::Value &node,
+                         std::vector<ShardLocation> *shards) {
+	if (level > 0) {
+		node["name"] = folder.name();
+		Json::Value &keys = node["keys"] = Json::Value (Json::arrayValue);
+		for (const Entry &e : folder.entries())
+			Writer::serializeEntry (keys.append (Json::Value()), e);
+	}
+	if (level + 1 == depth) {
+		for (const Folder &f : folder.subfolders())
+			shards->push_back (ShardLocation {&f, path});
+		return;
+	}
+	Json::Value &folders = node["folders"] = Json::Value (Json::arrayValue);
+	for (const Folder &f : folder.subfolders()) {
+		Json::Value subPath = path;
+		subPath.append (f.name());
+		split_trunk (f, level + 1, depth, subPath, folders.append (Json::Value (Json::objectValue)), shards);
+	}
+}
+
+static void read_trunk (const Json::Value &node, Folder *folder) {
+	if (!node.isObject())
+		throw std::runtime_error ("Invalid keystore manifest: folder is not an object");
+	for (const Json::Value &e : node["keys"])
+		folder->addEntry (Parser::parseEntry (e));
+	for (const Json::Value &f : node["folders"]) {
+		if (!f["name"].isString())
+			throw std::runtime_error ("Invalid keystore manifest: folder without name");
+		read_trunk (f, folder->createSubfolder (f["name"].asString()));
+	}
+}
+
+static Folder *resolve_parent (Folder *root, const Json::Value &path) {
+	Folder *f = root;
+	for (const Json::Value &name : path) {
+		f = name.isString() ? f->getSubfolder (name.asString()) : nullptr;
+		if (!f)
+			throw std::runtime_error ("Invalid keystore manifest: shard in an unknown folder");
+	}
+	return f;
+}
+
+// ShardedKeystore
+
+ShardedKeystore::ShardedKeystore (const std::string &directory, int depth)
+	: _dir(directory), _depth(depth), _root(nullptr)
+{
+	if (depth < 1)
+		throw std::invalid_argument ("Shard depth must be at least 1");
+}
+
+ShardedKeystore::~ShardedKeystore () {
+	wipe (&_key);
+}
+
+std::string ShardedKeystore::manifestPath (const std::string &directory) {
+	return directory + "/" + ManifestName;
+}
+
+bool ShardedKeystore::isSharded (const std::string &path) {
+	struct stat st;
+	return stat (path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && stat (manifestPath(path).c_str(), &st) == 0;
+}
+
+void ShardedKeystore::setDepth (int depth) {
+	if (depth < 1)
+		throw std::invalid_argument ("Shard depth must be at least 1");
+	if (depth != _depth)
+		_shards.clear();
+	_depth = depth;
+}
+
+void ShardedKeystore::open (const std::string &passphrase, Folder *root, ThreadPool &pool, int flags, int keyIterationCount) {
+	CryptStream crypt (manifestPath(_dir), CryptStream::READ);
+	if (crypt.isEncrypted())
+		crypt.setEncryptionKey (passphrase, nullptr, nullptr, nullptr, keyIterationCount);
+	std::istream in (&crypt);
+	open (in, root, pool, flags);
+}
+
+void ShardedKeystore::open (std::istream &manifestStream, Folder *root, ThreadPool &pool, int flags) {
+	std::string text ((std::istreambuf_iterator<char>(manifestStream)), std::istreambuf_iterator<char>());
+	Json::Value manifest;
+	const bool parsed = Json::Reader().parse (text, manifest, false);
+	wipe (&text);
+	if (!parsed || !manifest.isObject())
+		throw std::runtime_error ("Could not read keystore manifest: wrong passphrase or corrupt file");
+	if (manifest["version"].asInt() != ManifestVersion)
+		throw std::runtime_error ("Unsupported keystore manifest version");
+	const int depth = manifest["depth"].asInt();
+	std::string key = from_hex (manifest["key"].asString());
+	if (depth < 1 || key.size() != RecordCipher::KeyMaterialLength)
+		throw std::runtime_error ("Invalid keystore manifest");
+	const Json::Value &shards = manifest["shards"];
+	if (!shards.isArray())
+		throw std::runtime_error ("Invalid keystore manifest: missing shard list");
+	std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (key);
+
+	// The shards are decoded first, so nothing is added to root if one of them is invalid
+	std::vector<RootFolder_Ptr> parts (shards.size());
+	std::vector<ThreadPool::Task> tasks;
+	for (Json::ArrayIndex i = 0; i < shards.size(); ++i) {
+		const std::string file = shards[i]["file"].asString(), mac = from_hex (shards[i]["mac"].asString());
+		if (!is_valid_shard_file (file))
+			throw std::runtime_error ("Invalid keystore manifest: invalid shard file name");
+		tasks.push_back ([this, &cipher, &parts, file, mac, flags, i] () {
+			std::ifstream in (_dir + "/" + file, std::ios::binary);
+			if (!in.is_open())
+				throw std::runtime_error ("Missing shard file " + file);
+			std::string sealed ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			if (sealed.compare (0, ShardHeaderSize, ShardHeader) != 0)
+				throw std::runtime_error ("Invalid shard file " + file);
+			sealed.erase (0, ShardHeaderSize);
+			if (sealed.size() < RecordCipher::Overhead || RecordCipher::macOf (sealed) != mac)
+				throw std::runtime_error ("Shard file " + file + " does not belong to this version of the keystore");
+			std::string plain = cipher->open (sealed, file);
+			std::istringstream body (plain);
+			wipe (&plain);
+			parts[i] = createRootFolder();
+			Parser parser;
+			if (!parser.read (body, parts[i].get(), flags) || parts[i]->subfolders().size() != 1)
+				throw std::runtime_error ("Could not parse shard file " + file + ": " + parser.error());
+		});
+	}
+	pool.run (std::move(tasks));
+
+	read_trunk (manifest["trunk"], root);
+	std::unordered_map<uint64_t, Shard> loaded;
+	for (Json::ArrayIndex i = 0; i < shards.size(); ++i) {
+		Folder *parent = resolve_parent (root, shards[i]["parent"]);
+		if (parent->getSubfolder (parts[i]->subfolders().front().name()))
+			throw std::runtime_error ("Invalid keystore manifest: two shards for the same folder");
+		// Moved along with its name and content, like the top-level folders by Parser::read
+		Folder *f = parent->createSubfolder (std::string());
+		*f = std::move (parts[i]->subfolders().front());
+		loaded[f->id()] = Shard {shards[i]["file"].asString(), from_hex (shards[i]["mac"].asString()), false};
+	}
+	_depth = depth;
+	wipe (&_key);
+	_key = std::move(key);
+	_shards = std::move(loaded);
+	_root = root;
+}
+
+size_t ShardedKeystore::save (const Folder &root, const std::string &passphrase, int mode, int keyIterationCount) {
+	if (!(mode & USE_ENCRYPTION))
+		throw std::invalid_argument ("Sharded keystores are always encrypted");
+	if (mkdir (_dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+		throw std::runtime_error ("Could not create keystore directory: " + std::string(strerror(errno)));
+	if (_key.empty())
+		_key = RecordCipher::generateKeyMaterial();
+	std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (_key);
+
+	Json::Value manifest (Json::objectValue);
+	std::vector<ShardLocation> locations;
+	split_trunk (root, 0, _depth, Json::Value (Json::arrayValue), manifest["trunk"] = Json::Value (Json::objectValue), &locations);
+	std::unordered_map<uint64_t, Shard> shards;
+	size_t written = 0;
+	Json::Value &list = manifest["shards"] = Json::Value (Json::arrayValue);
+	for (const ShardLocation &l : locations) {
+		auto it = _shards.find (l.folder->id());
+		Shard shard;
+		if (it != _shards.end() && !it->second.dirty) {
+			shard = it->second;
+		} else {
+			// A shard file is never overwritten: the current manifest still refers to it
+			std::ostringstream out;
+			out << "{\"folders\":[";
+			Writer w;
+			if (!w.write (out, *l.folder))
+				throw std::runtime_error ("Could not write shard: " + w.error());
+			std::string plain = out.str();
+			// Replaces the line break the writer ends with
+			plain.back() = ']';
+			plain.push_back ('}');
+			shard.file = new_shard_file();
+			const std::string sealed = cipher->seal (plain, shard.file);
+			wipe (&plain);
+			AtomicFile::write (_dir + "/" + shard.file, ShardHeader + sealed, AtomicFile::NO_DIRECTORY_SYNC);
+			shard.mac = RecordCipher::macOf (sealed);
+			++written;
+		}
+		shard.dirty = false;
+		Json::Value &s = list.append (Json::Value (Json::objectValue));
+		s["parent"] = l.parent;
+		s["name"] = l.folder->name();
+		s["file"] = shard.file;
+		s["mac"] = to_hex (shard.mac);
+		shards[l.folder->id()] = std::move(shard);
+	}
+	manifest["version"] = ManifestVersion;
+	manifest["depth"] = _depth;
+	manifest["key"] = to_hex (_key);
+
+	// The new shards must be in the directory before the manifest refers to them
+	const std::string path = manifestPath (_dir);
+	if (written > 0)
+		AtomicFile::syncDirectory (path);
+	{
+		AtomicFile file (path);
+		std::string text = Json::FastWriter().write (manifest);
+		CryptStream crypt (file.fd(), CryptStream::WRITE, mode);
+		crypt.setEncryptionKey (passphrase, nullptr, nullptr, nullptr, keyIterationCount);
+		std::ostream out (&crypt);
+		out << text;
+		out.flush();
+		wipe (&text);
+		if (!out.good())
+			throw std::runtime_error ("Could not write keystore manifest");
+		crypt.finish();
+		file.commit();
+	}
+	_shards = std::move(shards);
+	_root = &root;
+	_collectGarbage();
+	return written;
+}
+
+void ShardedKeystore::_collectGarbage () const {
+	std::set<std::string> referenced;
+	for (const auto &s : _shards)
+		referenced.insert (s.second.file);
+	DIR *dir = opendir (_dir.c_str());
+	if (!dir)
+		return;
+	std::vector<std::string> obsolete;
+	while (struct dirent *d = readdir (dir)) {
+		const std::string name = d->d_name;
+		// Left over by an interrupted save, or replaced by a newer version
+		if (is_valid_shard_file (name) && referenced.count (name) == 0)
+			obsolete.push_back (name);
+	}
+	closedir (dir);
+	for (const std::string &name : obsolete)
+		unlink ((_dir + "/" + name).c_str());
+}
+
+const Folder *ShardedKeystore::_shardOf (const Folder *folder) const {
+	std::vector<const Folder*> path;
+	for (const Folder *f = folder; f && f != _root && f->parent(); f = f->parent())
+		path.push_back (f);
+	// path.back() is a top-level folder
+	if (path.size() < (size_t)_depth)
+		return nullptr;
+	return path[path.size() - _depth];
+}
+
+void ShardedKeystore::_markDirty (const Folder *folder) {
+	const Folder *shard = _shardOf (folder);
+	if (!shard)
+		return;
+	auto it = _shards.find (shard->id());
+	if (it != _shards.end())
+		it->second.dirty = true;
+}
+
+void ShardedKeystore::invalidate (const Folder &folder) {
+	_markDirty (&folder);
+}
+
+void ShardedKeystore::entryAdded (const Folder &folder, int) {
+	_markDirty (&folder);
+}
+
+void ShardedKeystore::entryChanged (const Folder &folder, int, const Entry &) {
+	_markDirty (&folder);
+}
+
+void ShardedKeystore::entryRemoved (const Folder &folder, int, const Entry &) {
+	_markDirty (&folder);
+}
+
+void ShardedKeystore::folderAdded (const Folder &folder) {
+	_markDirty (folder.parent());
+}
+
+void ShardedKeystore::folderRemoved (const Folder &parent, const Folder &) {
+	// A removed shard is no longer referenced by the next manifest
+	_markDirty (&parent);
+}
+
+void ShardedKeystore::folderRenamed (const Folder &folder, const std::string &) {
+	// The name of a shard's folder is stored in the shard
+	_markDirty (&folder);
+}
+
+void ShardedKeystore::folderMoved (const Folder &folder, const Folder &oldParent, int) {
+	_markDirty (&oldParent);
+	_markDirty (folder.parent());
+	// Modifications below a shard moved deeper are noticed in its new shard, so it is written again if it is moved back
+	auto it = _shards.find (folder.id());
+	if (it != _shards.end())
+		it->second.dirty = true;
+}
+
+}
@@ -0,0 +1,190 @@
+#include "XKeySubtreeFilter.h"
+#include "XKeySearchIndex.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace XKey {
+
+/// Bits per trigram a filter is sized for, and the number of bit positions set per trigram
+static const size_t BitsPerTrigram = 8;
+static const int HashCount = 3;
+static const size_t MinFilterBits = 512;
+
+static inline uint64_t mix (uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void entry_trigrams (const Entry &e, std::vector<uint32_t> *trigrams) {
+	SearchIndex::collectTrigrams (e.title(), trigrams);
+	SearchIndex::collectTrigrams (e.username(), trigrams);
+	SearchIndex::collectTrigrams (e.url(), trigrams);
+	SearchIndex::collectTrigrams (e.email(), trigrams);
+	SearchIndex::collectTrigrams (e.comment(), trigrams);
+}
+
+static void sort_unique (std::vector<uint32_t> *v) {
+	std::sort (v->begin(), v->end());
+	v->erase (std::unique (v->begin(), v->end()), v->end());
+}
+
+// Filter
+
+void SubtreeFilter::Filter::insert (uint32_t trigram) {
+	// Double hashing: the bit positions are h1, h1 + h2, h1 + 2 h2, ...
+	const uint64_t h = mix (trigram), mask = bits.size() * 64 - 1;
+	const uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+	for (int i = 0; i < HashCount; ++i) {
+		const uint64_t bit = (h1 + i * h2) & mask;
+		bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+	++count;
+}
+
+bool SubtreeFilter::Filter::contains (uint32_t trigram) const {
+	const uint64_t h = mix (trigram), mask = bits.size() * 64 - 1;
+	const uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+	for (int i = 0; i < HashCount; ++i) {
+		const uint64_t bit = (h1 + i * h2) & mask;
+		if (!(bits[bit / 64] & ((uint64_t)1 << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+// SubtreeFilter
+
+SubtreeFilter::SubtreeFilter (const Folder &root)
+	: _root(0)
+{
+	rebuild (root);
+}
+
+void SubtreeFilter::rebuild (const Folder &root) {
+	if (root.parent())
+		throw std::invalid_argument ("SubtreeFilter needs a root folder");
+	_root = &root;
+	_filters.clear();
+	std::vector<uint32_t> trigrams;
+	_build (root, &trigrams);
+}
+
+void SubtreeFilter::_build (const Folder &folder, std::vector<uint32_t> *trigrams) const {
+	// The trigrams of the subtree are the ones of the entries and those of all subfolders
+	trigrams->clear();
+	for (const Entry &e : folder.entries())
+		entry_trigrams (e, trigrams);
+	sort_unique (trigrams);
+	std::vector<uint32_t> sub, merged;
+	for (const Folder &f : folder.subfolders()) {
+		_build (f, &sub);
+		merged.clear();
+		std::set_union (trigrams->begin(), trigrams->end(), sub.begin(), sub.end(), std::back_inserter(merged));
+		trigrams->swap (merged);
+	}
+
+	size_t bits = MinFilterBits;
+	while (bits < trigrams->size() * BitsPerTrigram)
+		bits *= 2;
+	Filter &filter = _filters[folder.id()];
+	filter.bits.assign (bits / 64, 0);
+	filter.count = 0;
+	filter.capacity = bits / BitsPerTrigram;
+	filter.dirty = false;
+	for (uint32_t t : *trigrams)
+		filter.insert (t);
+}
+
+const SubtreeFilter::Filter &SubtreeFilter::_filter (const Folder &folder) const {
+	auto it = _filters.find (folder.id());
+	if (it == _filters.end() || it->second.dirty) {
+		std::vector<uint32_t> trigrams;
+		_build (folder, &trigrams);
+		it = _filters.find (folder.id());
+	}
+	return it->second;
+}
+
+bool SubtreeFilter::_mayContain (const Folder &folder, const std::string &token) const {
+	if (token.size() < 3)
+		return true;
+	std::vector<uint32_t> trigrams;
+	SearchIndex::collectTrigrams (token, &trigrams);
+	const Filter &filter = _filter (folder);
+	return std::all_of (trigrams.begin(), trigrams.end(), [&filter] (uint32_t t) { return filter.contains (t); });
+}
+
+bool SubtreeFilter::mayMatch (const Folder &folder, const SearchQuery &query) const {
+	for (const std::string &token : query.tokens()) {
+		if (_mayContain (folder, token))
+			return true;
+	}
+	return false;
+}
+
+bool SubtreeFilter::mayMatchAll (const Folder &folder, const SearchQuery &query) const {
+	for (const std::string &token : query.tokens()) {
+		if (!_mayContain (folder, token))
+			return false;
+	}
+	return !query.empty();
+}
+
+size_t SubtreeFilter::memoryUsage () const {
+	size_t bytes = 0;
+	for (const auto &f : _filters)
+		bytes += f.second.bits.size() * sizeof(uint64_t);
+	return bytes;
+}
+
+void SubtreeFilter::_insertEntry (const Folder &folder, const Entry &entry) {
+	std::vector<uint32_t> trigrams;
+	entry_trigrams (entry, &trigrams);
+	sort_unique (&trigrams);
+	for (const Folder *f = &folder; f; f = f->parent()) {
+		auto it = _filters.find (f->id());
+		if (it == _filters.end() || it->second.dirty)
+			continue; // Built from the subtree when needed
+		Filter &filter = it->second;
+		for (uint32_t t : trigrams)
+			filter.insert (t);
+		// Some of the trigrams were already in the filter, so this overestimates the fill level
+		if (filter.count > 2 * filter.capacity)
+			filter.dirty = true;
+	}
+}
+
+void SubtreeFilter::_markDirty (const Folder *folder) {
+	for (const Folder *f = folder; f; f = f->parent()) {
+		auto it = _filters.find (f->id());
+		if (it != _filters.end())
+			it->second.dirty = true;
+	}
+}
+
+void SubtreeFilter::entryAdded (const Folder &folder, int index) {
+	_insertEntry (folder, folder.entries()[index]);
+}
+
+void SubtreeFilter::entryChanged (const Folder &folder, int index, const Entry &) {
+	_insertEntry (folder, folder.entries()[index]);
+}
+
+void SubtreeFilter::folderRemoved (const Folder &, const Folder &folder) {
+	_filters.erase (folder.id());
+	for (const Folder &f : folder.subfolders())
+		folderRemoved (folder, f);
+}
+
+void SubtreeFilter::folderMoved (const Folder &folder, const Folder &, int) {
+	// The filters of the previous ancestors still contain the trigrams of the folder, which is harmless
+	_markDirty (folder.parent());
+}
+
+}
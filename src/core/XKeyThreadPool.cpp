@@ -0,0 +1,107 @@
+#include "XKeyThreadPool.h"
+
+#include <algorithm>
+
+namespace XKey {
+
+ThreadPool::ThreadPool (unsigned threads)
+	: _pending(0), _round(0), _stop(false)
+{
+	if (threads == 0)
+		threads = std::max (1u, std::thread::hardware_concurrency());
+	for (unsigned i = 0; i < threads; ++i)
+		_workers.emplace_back (new Worker);
+	for (unsigned i = 0; i < threads; ++i)
+		_workers[i]->thread = std::thread (&ThreadPool::_workerMain, this, i);
+}
+
+ThreadPool::~ThreadPool () {
+	{
+		std::lock_guard<std::mutex> lock (_stateMutex);
+		_stop = true;
+	}
+	_workAvailable.notify_all();
+	for (auto &w : _workers)
+		w->thread.join();
+}
+
+void ThreadPool::run (std::vector<Task> tasks) {
+	if (tasks.empty())
+		return;
+	std::lock_guard<std::mutex> runLock (_runMutex);
+	{
+		std::lock_guard<std::mutex> lock (_stateMutex);
+		_pending = tasks.size();
+		_error = nullptr;
+	}
+	// Consecutive tasks go to the same worker, so neighbouring work units stay together
+	// unless they are stolen
+	const size_t perWorker = (tasks.size() + _workers.size() - 1) / _workers.size();
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		Worker &w = *_workers[i / perWorker];
+		std::lock_guard<std::mutex> lock (w.mutex);
+		w.queue.push_front (std::move(tasks[i]));
+	}
+	std::unique_lock<std::mutex> lock (_stateMutex);
+	++_round;
+	_workAvailable.notify_all();
+	_allDone.wait (lock, [this] { return _pending == 0; });
+	if (_error) {
+		std::exception_ptr error = _error;
+		_error = nullptr;
+		std::rethrow_exception (error);
+	}
+}
+
+bool ThreadPool::_takeTask (size_t self, Task *task) {
+	{
+		Worker &own = *_workers[self];
+		std::lock_guard<std::mutex> lock (own.mutex);
+		if (!own.queue.empty()) {
+			*task = std::move (own.queue.back());
+			own.queue.pop_back();
+			return true;
+		}
+	}
+	// Steal the task the owner would execute last
+	for (size_t i = 1; i < _workers.size(); ++i) {
+		Worker &victim = *_workers[(self + i) % _workers.size()];
+		std::lock_guard<std::mutex> lock (victim.mutex);
+		if (!victim.queue.empty()) {
+			*task = std::move (victim.queue.front());
+			victim.queue.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::_workerMain (size_t self) {
+	size_t round = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock (_stateMutex);
+			_workAvailable.wait (lock, [this, round] { return _stop || _round != round; });
+			if (_stop)
+				return;
+			round = _round;
+		}
+		Task task;
+		while (_takeTask (self, &task)) {
+			std::exception_ptr error;
+			try {
+				task();
+			} catch (...) {
+				error = std::current_exception();
+			}
+			task = nullptr;
+			std::lock_guard<std::mutex> lock (_stateMutex);
+			if (error && !_error)
+				_error = error;
+			if (--_pending == 0)
+				_allDone.notify_all();
+		}
+	}
+}
+
+}
@@ -0,0 +1,242 @@
+#include "XKeyTokenIndex.h"
+#include "XKeyAtomicFile.h"
+#include "XKeyBytes.h"
+#include "CryptRecord.h"
+#include "XKeyJournal.h"
+#include "XKeyJsonSerialization.h"
+
+#include <json/json.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+// Unix
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <openssl/evp.h>
+
+namespace XKey {
+
+static const int IndexVersion = 1;
+static const char BlindingLabel[] = "XKey token blinding";
+static const char IndexKeyLabel[] = "XKey token index";
+/// Length of a blinded token in bytes
+static const size_t BlindedLength = 16;
+
+/// Keyed hash of a token, so the index does not contain the words themselves
+class TokenBlinder
+{
+public:
+	explicit TokenBlinder (const std::string &key)
+		: _key(EVP_PKEY_new_mac_key (EVP_PKEY_HMAC, nullptr, (const unsigned char*)key.data(), key.size()), &EVP_PKEY_free)
+	{
+		if (!_key)
+			throw std::runtime_error ("Failed to create token blinding key");
+	}
+	std::string operator() (const std::string &token) const {
+		std::unique_ptr<EVP_MD_CTX, void(*)(EVP_MD_CTX*)> ctx (EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+		unsigned char mac[EVP_MAX_MD_SIZE];
+		size_t length = sizeof(mac);
+		if (!ctx || EVP_DigestSignInit (&*ctx, nullptr, EVP_sha256(), nullptr, &*_key) != 1 ||
+		    EVP_DigestSignUpdate (&*ctx, token.data(), token.size()) != 1 || EVP_DigestSignFinal (&*ctx, mac, &length) != 1)
+		{
+			throw std::runtime_error ("Failed to blind token");
+		}
+		return to_hex (std::string ((const char*)mac, BlindedLength));
+	}
+private:
+	std::unique_ptr<EVP_PKEY, void(*)(EVP_PKEY*)> _key;
+};
+
+static std::string index_header (const std::string &baseId) {
+	return "*167110-index* # v:" + std::to_string(IndexVersion) + " # base:" + to_hex(baseId) + " #\n";
+}
+
+std::string TokenIndex::fileName (const std::string &keystoreFile) {
+	return keystoreFile + ".index";
+}
+
+void TokenIndex::remove (const std::string &keystoreFile) {
+	if (unlink (fileName(keystoreFile).c_str()) != 0 && errno != ENOENT)
+		throw std::runtime_error ("Failed to remove token index file: " + std::string(strerror(errno)));
+}
+
+std::vector<std::string> TokenIndex::tokenize (const std::string &text) {
+	const std::string folded = SubstringMatcher::foldCase (text);
+	std::vector<std::string> tokens;
+	size_t begin = 0;
+	for (size_t i = 0; i <= folded.size(); ++i) {
+		const unsigned char c = (i < folded.size()) ? folded[i] : ' ';
+		if (c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+			continue;
+		if (i > begin)
+			tokens.push_back (folded.substr (begin, i - begin));
+		begin = i + 1;
+	}
+	return tokens;
+}
+
+/// @return The distinct query words, or nothing if there are none
+static std::vector<std::string> query_tokens (const std::string &searchString) {
+	std::vector<std::string> words = TokenIndex::tokenize (searchString);
+	std::sort (words.begin(), words.end());
+	words.erase (std::unique (words.begin(), words.end()), words.end());
+	return words;
+}
+
+void TokenIndex::write (const std::string &keystoreFile, const CryptStream &stream, const std::string &cleartext) {
+	const std::vector<CryptStream::Frame> &frames = stream.frames();
+	if (frames.empty())
+		throw std::invalid_argument ("Token index needs an encrypted keystore that has been written completely");
+	const TokenBlinder blind (stream.deriveKey (BlindingLabel));
+
+	Json::Value index (Json::objectValue);
+	Json::Value &folders = index["folders"] = Json::Value (Json::arrayValue);
+	Json::Value &entries = index["entries"] = Json::Value (Json::arrayValue);
+	std::map<std::string, std::vector<unsigned>> postings;
+	const std::vector<Parser::EntryLocation> locations = Parser::locateEntries (cleartext);
+	for (unsigned i = 0; i < locations.size(); ++i) {
+		const Parser::EntryLocation &loc = locations[i];
+		if (folders.empty() || folders[folders.size() - 1].asString() != loc.folderPath)
+			folders.append (loc.folderPath);
+		// Last block starting at or before the entry
+		auto frame = std::upper_bound (frames.begin(), frames.end(), (uint64_t)loc.begin,
+			[] (uint64_t offset, const CryptStream::Frame &f) { return offset < f.plainOffset; });
+		--frame;
+		Json::Value e (Json::arrayValue);
+		e.append (folders.size() - 1);
+		e.append ((Json::UInt64)frame->offset);
+		e.append ((Json::UInt64)frame->plainOffset);
+		e.append ((Json::UInt64)loc.begin);
+		e.append ((Json::UInt64)loc.end);
+		entries.append (e);
+
+		Json::Reader r;
+		Json::Value key;
+		if (!r.parse (cleartext.data() + loc.begin, cleartext.data() + loc.end, key, false) || !key.isObject())
+			throw std::runtime_error ("Invalid key entry in keystore: " + r.getFormattedErrorMessages());
+		std::vector<std::string> tokens = tokenize (key.get("title", "").asString());
+		const std::vector<std::string> urlTokens = tokenize (key.get("url", "").asString());
+		tokens.insert (tokens.end(), urlTokens.begin(), urlTokens.end());
+		for (const std::string &t : tokens) {
+			std::vector<unsigned> &list = postings[blind(t)];
+			if (list.empty() || list.back() != i)
+				list.push_back (i);
+		}
+	}
+	Json::Value &tokens = index["tokens"] = Json::Value (Json::objectValue);
+	for (const auto &p : postings) {
+		Json::Value &list = tokens[p.first] = Json::Value (Json::arrayValue);
+		for (unsigned i : p.second)
+			list.append (i);
+	}
+
+	Json::FastWriter w;
+	std::string text = w.write (index);
+	const std::string header = index_header (stream.iv());
+	const std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (stream.deriveKey (IndexKeyLabel));
+	const std::string sealed = cipher->seal (text, header);
+	wipe (&text);
+	AtomicFile::write (fileName(keystoreFile), header + sealed);
+}
+
+bool TokenIndex::lookup (const std::string &keystoreFile, CryptStream &stream, const std::string &searchString,
+                         std::vector<Match> *matches)
+{
+	matches->clear();
+	if (!stream.supportsRandomAccess() || Journal::hasRecords (keystoreFile))
+		return false;
+	std::ifstream in (fileName(keystoreFile), std::ios::binary);
+	if (!in.is_open())
+		return false;
+	const std::string data ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const size_t headerEnd = data.find ('\n');
+	if (headerEnd == std::string::npos)
+		return false;
+	const std::string header = data.substr (0, headerEnd + 1);
+	if (header != index_header (stream.iv()))
+		return false; // Index of another version of the keystore, or of an unknown version
+
+	const std::unique_ptr<RecordCipher> cipher = RecordCipher::fromKeyMaterial (stream.deriveKey (IndexKeyLabel));
+	std::string text = cipher->open (data.substr (headerEnd + 1), header);
+	Json::Reader r;
+	Json::Value index;
+	const bool parsed = r.parse (text, index, false);
+	wipe (&text);
+	const Json::Value &folders = index["folders"], &entries = index["entries"], &tokens = index["tokens"];
+	if (!parsed || !folders.isArray() || !entries.isArray() || !tokens.isObject())
+		throw std::runtime_error ("Invalid token index");
+
+	// Intersect the lists of entries containing each word
+	const std::vector<std::string> words = query_tokens (searchString);
+	const TokenBlinder blind (stream.deriveKey (BlindingLabel));
+	std::vector<unsigned> candidates;
+	for (size_t w = 0; w < words.size(); ++w) {
+		const Json::Value &list = tokens[blind(words[w])];
+		std::vector<unsigned> found;
+		for (const Json::Value &i : list)
+			found.push_back (i.asUInt());
+		if (w == 0) {
+			candidates.swap (found);
+		} else {
+			std::vector<unsigned> both;
+			std::set_intersection (candidates.begin(), candidates.end(), found.begin(), found.end(), std::back_inserter(both));
+			candidates.swap (both);
+		}
+		if (candidates.empty())
+			break;
+	}
+
+	for (unsigned i : candidates) {
+		const Json::Value &e = entries[i];
+		if (!e.isArray() || e.size() != 5 || e[0u].asUInt() >= folders.size())
+			throw std::runtime_error ("Invalid token index");
+		const CryptStream::Frame frame {e[1u].asUInt64(), e[2u].asUInt64()};
+		std::string entryText = stream.readRange (frame, e[3u].asUInt64(), e[4u].asUInt64());
+		Json::Value key;
+		const bool valid = r.parse (entryText, key, false) && key.isObject();
+		wipe (&entryText);
+		if (!valid)
+			throw std::runtime_error ("Token index does not match the keystore");
+		matches->push_back (Match {folders[e[0u].asUInt()].asString(), Parser::parseEntry (key)});
+	}
+	return true;
+}
+
+static bool contains_all (const std::vector<std::string> &words, const Entry &entry) {
+	std::vector<std::string> tokens = TokenIndex::tokenize (entry.title());
+	const std::vector<std::string> urlTokens = TokenIndex::tokenize (entry.url());
+	tokens.insert (tokens.end(), urlTokens.begin(), urlTokens.end());
+	for (const std::string &w : words) {
+		if (std::find (tokens.begin(), tokens.end(), w) == tokens.end())
+			return false;
+	}
+	return true;
+}
+
+static void find_in_folder (const std::vector<std::string> &words, const Folder *folder, std::vector<SearchResult> *results) {
+	const std::deque<Entry> &entries = folder->entries();
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (contains_all (words, entries[i]))
+			results->push_back (SearchResult (&entries[i], folder, i));
+	}
+	for (const Folder &sub : folder->subfolders())
+		find_in_folder (words, &sub, results);
+}
+
+std::vector<SearchResult> TokenIndex::find (const std::string &searchString, const Folder *rootFolder) {
+	std::vector<SearchResult> results;
+	const std::vector<std::string> words = query_tokens (searchString);
+	if (rootFolder && !words.empty())
+		find_in_folder (words, rootFolder, &results);
+	return results;
+}
+
+}
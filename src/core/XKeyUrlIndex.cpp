@@ -0,0 +1,337 @@
+#include "XKeyUrlIndex.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <stdexcept>
+
+namespace XKey {
+
+/// Minimum number of removed documents before the index is rebuilt
+static const size_t CompactionThreshold = 1024;
+
+/// Second-level labels below which country code top-level domains register domains (like `example.co.uk`)
+static const char *const SecondLevelLabels[] = {"ac", "co", "com", "edu", "gob", "go", "gov", "ltd", "ne", "net", "or", "org", "plc"};
+
+static inline char fold_ascii (char c) {
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool is_ipv4 (const std::string &host) {
+	int dots = 0;
+	for (char c : host) {
+		if (c == '.')
+			++dots;
+		else if (c < '0' || c > '9')
+			return false;
+	}
+	return dots == 3;
+}
+
+/// @return The labels of the host of @p url, top-level domain first. IP addresses are a single label.
+static std::vector<std::string> reversed_labels (const NormalizedUrl &url) {
+	std::vector<std::string> labels;
+	if (url.isIpAddress()) {
+		labels.push_back (url.host);
+		return labels;
+	}
+	size_t end = url.host.size();
+	for (;;) {
+		const size_t dot = url.host.rfind ('.', end - 1);
+		const size_t begin = (dot == std::string::npos) ? 0 : dot + 1;
+		labels.push_back (url.host.substr (begin, end - begin));
+		if (dot == std::string::npos)
+			break;
+		end = dot;
+	}
+	return labels;
+}
+
+static int default_port (const std::string &scheme) {
+	if (scheme == "https")
+		return 443;
+	if (scheme == "http")
+		return 80;
+	if (scheme == "ftp")
+		return 21;
+	if (scheme == "ssh")
+		return 22;
+	return 0;
+}
+
+/// @return true if the ports of the URLs are known to differ, although one of them is given explicitly
+static bool ports_differ (const std::string &scheme1, int port1, const std::string &scheme2, int port2) {
+	if (port1 == 0 && port2 == 0)
+		return false;
+	const int effective1 = port1 ? port1 : default_port (scheme1), effective2 = port2 ? port2 : default_port (scheme2);
+	return effective1 != 0 && effective2 != 0 && effective1 != effective2;
+}
+
+// NormalizedUrl
+
+bool NormalizedUrl::isIpAddress () const {
+	return host.find (':') != std::string::npos || is_ipv4 (host);
+}
+
+NormalizedUrl NormalizedUrl::parse (const std::string &text) {
+	NormalizedUrl url;
+	const size_t first = text.find_first_not_of (" \t\r\n");
+	if (first == std::string::npos)
+		return url;
+	std::string rest = text.substr (first, text.find_last_not_of (" \t\r\n") + 1 - first);
+
+	const size_t schemeEnd = rest.find ("://");
+	if (schemeEnd != std::string::npos && schemeEnd > 0 &&
+	    std::all_of (rest.begin(), rest.begin() + schemeEnd, [] (char c) { return isalnum((unsigned char)c) || c == '+' || c == '-' || c == '.'; }))
+	{
+		url.scheme = rest.substr (0, schemeEnd);
+		std::transform (url.scheme.begin(), url.scheme.end(), url.scheme.begin(), fold_ascii);
+		rest.erase (0, schemeEnd + 3);
+	} else if (rest.compare (0, 2, "//") == 0) {
+		rest.erase (0, 2);
+	}
+	// Authority: [user[:password]@]host[:port]
+	std::string authority = rest.substr (0, rest.find_first_of ("/?#"));
+	const size_t at = authority.rfind ('@');
+	if (at != std::string::npos)
+		authority.erase (0, at + 1);
+	std::string host, port;
+	if (!authority.empty() && authority[0] == '[') {
+		// IPv6 address
+		const size_t close = authority.find (']');
+		if (close == std::string::npos)
+			return url;
+		host = authority.substr (1, close - 1);
+		if (close + 1 < authority.size()) {
+			if (authority[close + 1] != ':')
+				return url;
+			port = authority.substr (close + 2);
+		}
+		if (host.empty() || !std::all_of (host.begin(), host.end(), [] (char c) { return isxdigit((unsigned char)c) || c == ':' || c == '.'; }))
+			return url;
+	} else {
+		const size_t colon = authority.find (':');
+		host = authority.substr (0, colon);
+		if (colon != std::string::npos)
+			port = authority.substr (colon + 1);
+		// Host names are case-insensitive; internationalized names are compared as they are written
+		host = SubstringMatcher::foldCase (host);
+		if (!host.empty() && host.back() == '.')
+			host.pop_back();
+		if (host.empty() || host.front() == '.' || host.find ("..") != std::string::npos ||
+		    !std::all_of (host.begin(), host.end(), [] (char c) { return isalnum((unsigned char)c) || c == '-' || c == '.' || (unsigned char)c >= 0x80; }))
+		{
+			return url;
+		}
+	}
+	if (!port.empty()) {
+		if (port.size() > 5 || !std::all_of (port.begin(), port.end(), [] (char c) { return c >= '0' && c <= '9'; }))
+			return url;
+		url.port = std::stoi (port);
+		if (url.port > 65535)
+			return url;
+	}
+	url.host = host;
+
+	// Registrable domain: the last two labels, or three below well-known second-level domains of country codes
+	const std::vector<std::string> labels = reversed_labels (url);
+	size_t count = std::min<size_t> (2, labels.size());
+	if (labels.size() >= 3 && labels[0].size() == 2 &&
+	    std::find (std::begin(SecondLevelLabels), std::end(SecondLevelLabels), labels[1]) != std::end(SecondLevelLabels))
+	{
+		count = 3;
+	}
+	url.registrableDomain = labels[count - 1];
+	for (size_t i = count - 1; i > 0; --i)
+		url.registrableDomain += "." + labels[i - 1];
+	return url;
+}
+
+// UrlIndex
+
+UrlIndex::UrlIndex (const Folder &root)
+	: _root(0), _indexed(0), _dead(0), _locationsValid(false), _inBatch(false)
+{
+	rebuild (root);
+}
+
+void UrlIndex::rebuild (const Folder &root) {
+	if (root.parent())
+		throw std::invalid_argument ("UrlIndex needs a root folder");
+	_root = &root;
+	_docs.clear();
+	_nodes.assign (1, Node());
+	_indexed = 0;
+	_dead = 0;
+	_folderDocs.clear();
+	_indexFolder (root);
+	_locationsValid = false;
+}
+
+void UrlIndex::_indexFolder (const Folder &folder) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	for (size_t i = 0; i < folder.entries().size(); ++i)
+		docs.push_back (_addDoc (folder, i));
+	for (const Folder &f : folder.subfolders())
+		_indexFolder (f);
+}
+
+UrlIndex::DocId UrlIndex::_addDoc (const Folder &folder, int index) {
+	const NormalizedUrl url = NormalizedUrl::parse (folder.entries()[index].url());
+	if (!url.valid())
+		return NoDoc;
+	const DocId id = _docs.size();
+	_docs.push_back (Doc {folder.id(), index, true, url.scheme, url.port});
+	uint32_t node = 0;
+	for (const std::string &label : reversed_labels (url)) {
+		auto it = _nodes[node].children.find (label);
+		if (it == _nodes[node].children.end()) {
+			_nodes.push_back (Node());
+			it = _nodes[node].children.emplace (label, _nodes.size() - 1).first;
+		}
+		node = it->second;
+	}
+	_nodes[node].docs.push_back (id);
+	++_indexed;
+	return id;
+}
+
+void UrlIndex::_removeDoc (DocId id) {
+	// Removed documents stay in the trie until it is rebuilt
+	if (id != NoDoc && _docs[id].alive) {
+		_docs[id].alive = false;
+		++_dead;
+	}
+}
+
+void UrlIndex::_removeFolder (const Folder &folder) {
+	auto it = _folderDocs.find (folder.id());
+	if (it != _folderDocs.end()) {
+		for (DocId id : it->second)
+			_removeDoc (id);
+		_folderDocs.erase (it);
+	}
+	for (const Folder &f : folder.subfolders())
+		_removeFolder (f);
+}
+
+void UrlIndex::_compactIfNeeded () {
+	// The hierarchy already has its final state while a batch is notified: Indexing it would
+	// make the remaining notifications of the batch refer to documents that have been replaced
+	if (!_inBatch && _dead > CompactionThreshold && _dead > size())
+		rebuild (*_root);
+}
+
+void UrlIndex::_updateLocations () const {
+	if (_locationsValid)
+		return;
+	_locations.clear();
+	size_t rank = 0;
+	std::vector<const Folder*> stack {_root};
+	while (!stack.empty()) {
+		const Folder *f = stack.back();
+		stack.pop_back();
+		_locations[f->id()] = FolderLocation {f, rank++};
+		for (auto it = f->subfolders().rbegin(); it != f->subfolders().rend(); ++it)
+			stack.push_back (&*it);
+	}
+	_locationsValid = true;
+}
+
+std::vector<UrlIndex::Match> UrlIndex::lookup (const std::string &urlString) const {
+	std::vector<Match> matches;
+	const NormalizedUrl url = NormalizedUrl::parse (urlString);
+	if (!url.valid())
+		return matches;
+	const std::vector<std::string> labels = reversed_labels (url);
+	const size_t registrableLabels = url.isIpAddress() ? 1 : std::count (url.registrableDomain.begin(), url.registrableDomain.end(), '.') + 1;
+
+	// Walk down from the top-level domain; the nodes from the registrable domain on hold matching entries
+	_updateLocations();
+	std::vector<std::pair<size_t, Match>> ranked;
+	uint32_t node = 0;
+	for (size_t depth = 1; depth <= labels.size(); ++depth) {
+		auto it = _nodes[node].children.find (labels[depth - 1]);
+		if (it == _nodes[node].children.end())
+			break;
+		node = it->second;
+		if (depth < registrableLabels)
+			continue;
+		for (DocId id : _nodes[node].docs) {
+			const Doc &doc = _docs[id];
+			if (!doc.alive || ports_differ (doc.scheme, doc.port, url.scheme, url.port))
+				continue;
+			const FolderLocation &loc = _locations.at (doc.folder);
+			const Match m {SearchResult (&loc.folder->entries()[doc.index], loc.folder, doc.index),
+				(int)(labels.size() - depth), !doc.scheme.empty() && doc.scheme == url.scheme};
+			ranked.emplace_back (loc.rank, m);
+		}
+	}
+	std::sort (ranked.begin(), ranked.end(), [] (const std::pair<size_t, Match> &a, const std::pair<size_t, Match> &b) {
+		if (a.second.distance != b.second.distance)
+			return a.second.distance < b.second.distance;
+		if (a.second.sameScheme != b.second.sameScheme)
+			return a.second.sameScheme;
+		return (a.first != b.first) ? a.first < b.first : a.second.result.index() < b.second.result.index();
+	});
+	matches.reserve (ranked.size());
+	for (const auto &r : ranked)
+		matches.push_back (r.second);
+	return matches;
+}
+
+void UrlIndex::entryAdded (const Folder &folder, int index) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	for (size_t i = index; i < docs.size(); ++i) {
+		if (docs[i] != NoDoc)
+			++_docs[docs[i]].index;
+	}
+	docs.insert (docs.begin() + index, _addDoc (folder, index));
+}
+
+void UrlIndex::entryChanged (const Folder &folder, int index, const Entry &oldEntry) {
+	if (folder.entries()[index].url() == oldEntry.url())
+		return;
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	_removeDoc (docs.at(index));
+	docs[index] = _addDoc (folder, index);
+	_compactIfNeeded();
+}
+
+void UrlIndex::entryRemoved (const Folder &folder, int index, const Entry &) {
+	std::vector<DocId> &docs = _folderDocs[folder.id()];
+	_removeDoc (docs.at(index));
+	docs.erase (docs.begin() + index);
+	for (size_t i = index; i < docs.size(); ++i) {
+		if (docs[i] != NoDoc)
+			--_docs[docs[i]].index;
+	}
+	_compactIfNeeded();
+}
+
+void UrlIndex::folderAdded (const Folder &) {
+	_locationsValid = false;
+}
+
+void UrlIndex::folderRemoved (const Folder &, const Folder &folder) {
+	// Observers are notified before the folder is erased, so the index is not compacted here:
+	// a rebuild would index the removed folder again. The next entry modification compacts it.
+	_removeFolder (folder);
+	_locationsValid = false;
+}
+
+void UrlIndex::folderMoved (const Folder &, const Folder &, int) {
+	// Documents refer to folders by id, which is kept when moving
+	_locationsValid = false;
+}
+
+void UrlIndex::batchStarted (const Folder &) {
+	_inBatch = true;
+}
+
+void UrlIndex::batchCommitted (const Folder &, size_t) {
+	_inBatch = false;
+	_compactIfNeeded();
+}
+
+}
@@ -1,16 +1,34 @@
 #include <XKey.h>
 #include <CryptStream.h>
 #include <XKeyJsonSerialization.h>
+#include <XKeyBinaryFormat.h>
+#include <XKeyJournal.h>
+#include <XKeyAtomicFile.h>
+#include <XKeyAttachments.h>
+#include <XKeyThreadPool.h>
+#include <XKeyFuzzySearch.h>
+#include <XKeyQuery.h>
+#include <XKeyTokenIndex.h>
+#include <XKeyUrlIndex.h>
+#include <XKeyExchange.h>
+#include <XKeyMerkle.h>
+#include <XKeyShards.h>
+#include <XKeyRevisions.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <vector>
 #include <cstring>
+#include <memory>
+#include <ctime>
 #include <boost/program_options.hpp>
 
 std::string get_password ();
 void print_folder (const XKey::Folder &f, int print_options, int depth = 0, std::ostream &out = std::cout);
 void print_entry (const XKey::Entry &entry, int print_options, int depth = 0, std::ostream &out = std::cout);
+void print_folder (const XKey::FolderView &f, int print_options, int depth = 0, std::ostream &out = std::cout);
+void print_entry (const XKey::EntryView &entry, int print_options, int depth = 0, std::ostream &out = std::cout);
 
 enum PrintOptions {
 	PRINT_PASSWORD = 4,
@@ -18,10 +36,17 @@ enum PrintOptions {
 };
 
 std::string input_file, output_file, search_path, key_file;
-std::vector<std::string> entry_names;
+std::string attachment_name, attachment_out, find_string, query_string, lookup_string, url_string;
+std::string import_file, export_file, exchange_format, diff_file, merge_file, merge_base;
+/// Passphrase of the input file, empty if it is not encrypted
+std::string input_key;
+std::vector<std::string> entry_names, attach_files;
 bool output_no_encrypt = false, output_no_encode = false, output_no_header = false;
 bool input_no_header = false, input_not_encoded = false, input_not_encrypted = false;
-bool print_passwords = false;
+bool print_passwords = false, find_fuzzy = false, write_index = false, output_binary = false, output_sharded = false;
+bool list_revisions = false, record_revision = false;
+unsigned search_threads = 0, find_limit = 10, revision_number = 0, diff_revision = 0;
+int shard_depth = 0, checkpoint_interval = 0;
 
 int parse_commandline (int argc, const char** argv) {
 	namespace po = boost::program_options; 
@@ -36,7 +61,57 @@ int parse_commandline (int argc, const char** argv) {
 		("output_file,o", po::value<std::string>(&output_file), "Output key-database")
 		("print-passwords,p", po::bool_switch(&print_passwords), "Print passwords in cleartext on the console. "
 			"(Default: no passwords printed)")
+		("find,f", po::value<std::string>(&find_string), "Print all entries containing any of the given words")
+		("query,q", po::value<std::string>(&query_string), "Print all entries matching a query "
+			"like 'url:github user:deploy -title:old' (fields: title, user, url, email, comment; operators: OR, NOT, -, parentheses)")
+		("lookup,l", po::value<std::string>(&lookup_string), "Print all entries whose title or URL contain each of the given words. "
+			"Only decrypts the matching entries if the keystore has a token index (see --write-index)")
+		("url,u", po::value<std::string>(&url_string), "Print the entries for a URL: the ones for the same host first, "
+			"then the ones for its parent domains, like example.com for https://login.example.com/path")
+		("fuzzy", po::bool_switch(&find_fuzzy), "Fuzzy --find: the letters of a word may be spread over a field. "
+			"Prints the best matches first")
+		("limit,n", po::value<unsigned>(&find_limit), "Number of matches printed by --fuzzy (Default: 10)")
+		("threads,j", po::value<unsigned>(&search_threads), "Number of threads to use for opening the keystore "
+			"and for --find (Default: one per processor core)")
+		("attachment,a", po::value<std::string>(&attachment_name), "Extract the attachment with this name "
+			"from the given entries")
+		("attachment-out", po::value<std::string>(&attachment_out), "File to write the extracted attachment to "
+			"(Default: the name of the attachment)")
+		("attach", po::value<std::vector<std::string> >(&attach_files), "Attach this file to the given entries "
+			"and write the result to the output file. May be given several times")
 		
+		("import", po::value<std::string>(&import_file), "Import the entries of a CSV, NDJSON or KeePass XML file "
+			"(or - for standard input) into the search root and write the result to the output file. "
+			"Without an input file, a new keystore is created. "
+			"When importing from standard input, pass the passphrases with --keyfile and XKEY_OUT_PASSPHRASE")
+		("export", po::value<std::string>(&export_file), "Export the entries below the search root to a CSV, NDJSON "
+			"or KeePass XML file (or - for standard output). The file contains the passwords in cleartext")
+		("format", po::value<std::string>(&exchange_format), "Format for --import and --export: csv, ndjson or keepass "
+			"(Default: from the file extension)")
+		("diff", po::value<std::string>(&diff_file), "Print the differences between the input file and this keystore "
+			"below the search root. Only subtrees with different content are compared. "
+			"The keystore is opened with the same passphrase and options as the input file")
+		("merge", po::value<std::string>(&merge_file), "Merge the changes of this keystore and of the input file "
+			"since --merge-base into the output file. Entries changed on both sides are reported and kept "
+			"as in the input file")
+		("merge-base", po::value<std::string>(&merge_base), "Common ancestor of the input file and the --merge keystore")
+		("write-index", po::bool_switch(&write_index), "Write an encrypted token index next to the output file "
+			"for fast --lookup")
+		("out-binary", po::bool_switch(&output_binary), "Write the compact binary format instead of Json. "
+			"Listing such a keystore does not need to decode it")
+		("out-sharded", po::bool_switch(&output_sharded), "Write a directory with one encrypted file per top-level folder "
+			"and a manifest. If the output is the sharded input keystore, only the modified folders are written again")
+		("shard-depth", po::value<int>(&shard_depth), "Level of the folders that --out-sharded stores in files of their own "
+			"(Default: 1, the top-level folders)")
+		("revisions", po::bool_switch(&list_revisions), "List the revisions in the history of the input file")
+		("revision", po::value<unsigned>(&revision_number), "Use this revision from the history of the input file "
+			"instead of its current content. Restore it with an output file")
+		("diff-revision", po::value<unsigned>(&diff_revision), "Print the differences between the input file "
+			"(or --revision) and this revision from its history below the search root")
+		("record-revision", po::bool_switch(&record_revision), "Start a revision history next to the output file. "
+			"Once there is one, every write of the output file records a revision in it")
+		("checkpoint-interval", po::value<int>(&checkpoint_interval), "Number of revisions after which the history "
+			"stores a complete copy instead of a delta (Default: 16)")
 		("out-no-encrypt", po::bool_switch(&output_no_encrypt), "Do not encrypt output file (Default: do encrypt)."
 			"Passphrase will be read from environment variable XKEY_OUT_PASSPHRASE if given")
 		("out-no-encode", po::bool_switch(&output_no_encode), "Do not base64-encode output file, "
@@ -76,6 +151,196 @@ int parse_commandline (int argc, const char** argv) {
 	return 0; 
 }
 
+/// @return The passphrase for the output file
+std::string output_passphrase (std::ostream &status) {
+	const char *envPw = getenv("XKEY_OUT_PASSPHRASE");
+	if (envPw && *envPw != '\0') {
+		status << "Using passphrase from Environment variable XKEY_OUT_PASSPHRASE\n";
+		return envPw;
+	}
+	status << "Output passphrase: ";
+	const std::string outkey = get_password();
+	status << "\n";
+	return outkey;
+}
+
+/**
+ * @brief Open the revision history of the output file, if it has one or --record-revision is given
+ *
+ * Called before the output file is written, so a history that can not be opened is reported before anything
+ * is changed. A history of the input file is still encrypted with its passphrase when @p passphrase is a new one.
+ * @return nullptr if no revision is recorded
+ */
+std::unique_ptr<XKey::RevisionStore> open_output_history (const std::string &passphrase) {
+	std::unique_ptr<XKey::RevisionStore> history;
+	if (output_no_encrypt || (!record_revision && !XKey::RevisionStore::exists (output_file)))
+		return history;
+	history.reset (new XKey::RevisionStore (output_file));
+	if (!XKey::RevisionStore::exists (output_file) || input_key.empty() || input_key == passphrase) {
+		history->open (passphrase);
+		return history;
+	}
+	try {
+		history->open (passphrase);
+	} catch (const std::runtime_error &) {
+		history->open (input_key);
+	}
+	return history;
+}
+
+/// Record @p f in @p history once the output file has been written with @p passphrase
+void record_output_revision (XKey::RevisionStore *history, const XKey::Folder &f, const std::string &passphrase, std::ostream &status) {
+	if (!history)
+		return;
+	if (!history->matchesPassphrase (passphrase)) {
+		// The history follows the passphrase of the keystore
+		history->changePassphrase (passphrase);
+	}
+	if (checkpoint_interval > 0)
+		history->setCheckpointInterval (checkpoint_interval);
+	status << "Recorded revision " << history->record (f) << "\n";
+}
+
+/**
+ * @brief Write the hierarchy below @p f to the output file
+ * @param shards The sharded input keystore, if any. Saving over it only writes the modified shards.
+ */
+int write_keystore (const XKey::Folder &f, std::ostream &status, XKey::ShardedKeystore *shards = nullptr) {
+	int m = 0;
+	if (output_no_encrypt == false)
+		m |=  XKey::USE_ENCRYPTION;
+	if (output_no_encode != true)
+		m |=  XKey::BASE64_ENCODED;
+	if (output_no_header == false)
+		m |=  XKey::EVALUATE_FILE_HEADER;
+	
+	bool pretty_print = (output_no_encrypt && output_no_encode);
+
+	if (output_sharded) {
+		if (output_no_encrypt || output_binary || write_index) {
+			std::cerr << "Error: Sharded keystores are always encrypted Json, without a token index\n";
+			return -1;
+		}
+		XKey::ShardedKeystore created (output_file, (shard_depth > 0) ? shard_depth : 1);
+		XKey::ShardedKeystore &store = (shards && output_file == input_file) ? *shards : created;
+		if (shard_depth > 0)
+			store.setDepth (shard_depth);
+		const std::string outkey = output_passphrase (status);
+		const std::unique_ptr<XKey::RevisionStore> history = open_output_history (outkey);
+		status << "Writing...\n";
+		const size_t written = store.save (f, outkey, m);
+		status << "Wrote " << written << " of " << store.shardCount() << " shards\n";
+		if (!input_file.empty())
+			XKey::AttachmentStore (input_file).copyReferenced (f, XKey::AttachmentStore(output_file));
+		record_output_revision (history.get(), f, outkey, status);
+		return 0;
+	}
+
+	// The output file keeps its previous content until the new one is complete and on disk
+	XKey::AtomicFile file (output_file);
+	XKey::CryptStream crypt_filter (file.fd(), XKey::CryptStream::WRITE, m);
+	
+	std::ostream stream (&crypt_filter);
+	std::string outkey;
+	if (!output_no_encrypt) {
+		outkey = output_passphrase (status);
+		crypt_filter.setEncryptionKey (outkey);
+	}
+	const std::unique_ptr<XKey::RevisionStore> history = open_output_history (outkey);
+	status << "Writing...\n";
+	
+	XKey::Writer w;
+	int writeFlags = XKey::Writer::WRITE_SUBTREE_INDEX;
+	if (pretty_print)
+		writeFlags |= XKey::Writer::WRITE_FORMATTED;
+	if (output_binary)
+		writeFlags = XKey::Writer::WRITE_BINARY;
+	if (write_index && output_binary) {
+		std::cerr << "Error: The token index can only be written for the Json format\n";
+		return -1;
+	}
+	if (write_index && !output_no_encrypt) {
+		// The index needs the cleartext and the positions of the encrypted blocks
+		XKey::CleartextBuffer cleartext;
+		std::ostream text (&cleartext);
+		if (!w.write(text, f, writeFlags)) {
+			std::cerr << "Error: " << w.error() << "\n";
+			return -1;
+		}
+		stream.write (cleartext.text().data(), cleartext.text().size());
+		stream.flush();
+		crypt_filter.finish();
+		file.commit();
+		XKey::TokenIndex::write (output_file, crypt_filter, cleartext.text());
+	} else {
+		if (!w.write(stream, f, writeFlags)) {
+			std::cerr << "Error: " << w.error() << "\n";
+			return -1;
+		}
+		crypt_filter.finish();
+		file.commit();
+		// An index of a previous version of the output file would be ignored, but remove it anyway
+		XKey::TokenIndex::remove (output_file);
+	}
+	// Attachments are stored next to the keystore file
+	if (!input_file.empty())
+		XKey::AttachmentStore (input_file).copyReferenced (f, XKey::AttachmentStore(output_file));
+	record_output_revision (history.get(), f, outkey, status);
+	return 0;
+}
+
+/// Read another keystore with the options and the passphrase @p key of the input file
+void read_keystore (const std::string &file, const std::string &key, XKey::Folder *root, XKey::ThreadPool &pool) {
+	if (XKey::ShardedKeystore::isSharded (file)) {
+		XKey::ShardedKeystore (file).open (key, root, pool);
+		return;
+	}
+	int m = 0;
+	if (!input_no_header)
+		m |= XKey::EVALUATE_FILE_HEADER;
+	if (!input_not_encrypted)
+		m |= XKey::USE_ENCRYPTION;
+	if (!input_not_encoded)
+		m |= XKey::BASE64_ENCODED;
+	XKey::CryptStream crypt_streambuf (file, XKey::CryptStream::READ, m);
+	if (crypt_streambuf.isEncrypted())
+		crypt_streambuf.setEncryptionKey (key);
+	std::istream stream (&crypt_streambuf);
+	XKey::Parser pars;
+	if (!pars.read (stream, root, pool))
+		throw std::runtime_error ("Could not parse keystore file " + file + ": " + pars.error());
+	if (crypt_streambuf.isEncrypted())
+		XKey::Journal (file).open (key, crypt_streambuf.iv(), root, XKey::Journal::READ_ONLY);
+}
+
+/// @return The names of the fields that differ between @p a and @p b
+std::string changed_fields (const XKey::Entry &a, const XKey::Entry &b) {
+	std::string fields;
+	auto check = [&fields] (bool changed, const char *name) {
+		if (changed)
+			fields += (fields.empty() ? "" : ", ") + std::string(name);
+	};
+	check (a.title() != b.title(), "title");
+	check (a.username() != b.username(), "user");
+	check (a.url() != b.url(), "url");
+	check (a.password() != b.password(), "password");
+	check (a.email() != b.email(), "email");
+	check (a.comment() != b.comment(), "comment");
+	check (XKey::MerkleTree::hashEntry(a) != XKey::MerkleTree::hashEntry(b) && fields.empty(), "attachments");
+	return fields;
+}
+
+/// Export the entries below @p f to the export file or standard output
+size_t export_entries (const XKey::Folder &f, XKey::ExchangeFormat format) {
+	if (export_file == "-")
+		return XKey::exportEntries (std::cout, format, f);
+	std::ofstream out (export_file, std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		throw std::runtime_error ("Can not open export file " + export_file);
+	XKey::Writer::setRestrictiveFilePermissions (export_file);
+	return XKey::exportEntries (out, format, f);
+}
+
 int main (int argc, const char** argv)
 {
 	if (parse_commandline (argc, argv) != 0) {
@@ -84,14 +349,65 @@ int main (int argc, const char** argv)
 	
 	XKey::CryptStream::InitCrypto();
 	
-	if (input_file.size() <= 0) {
+	if (input_file.size() <= 0 && import_file.empty()) {
 		std::cerr << "Input file is required!\n";
 		return -1;
 	}
+	if (!import_file.empty() && output_file.empty()) {
+		std::cerr << "Importing needs an output file\n";
+		return -1;
+	}
+	if (!merge_file.empty() && (merge_base.empty() || output_file.empty())) {
+		std::cerr << "Merging needs --merge-base and an output file\n";
+		return -1;
+	}
+	if (!export_file.empty() && (!output_file.empty() || !import_file.empty())) {
+		std::cerr << "Exporting can not be combined with an output file or importing\n";
+		return -1;
+	}
+	if (record_revision && output_no_encrypt) {
+		std::cerr << "The revision history needs an encrypted output file\n";
+		return -1;
+	}
+	// Keep standard output free for the exported entries
+	std::ostream &status = (export_file == "-") ? std::cerr : std::cout;
 	
+	// Destroyed after the hierarchy it observes
+	std::unique_ptr<XKey::ShardedKeystore> sharded_input;
 	XKey::RootFolder_Ptr rootKeyFolder = XKey::createRootFolder();
 
 	try {
+		const std::string &exchange_file = import_file.empty() ? export_file : import_file;
+		XKey::ExchangeFormat import_format = XKey::ExchangeFormat::CSV, export_format = XKey::ExchangeFormat::CSV;
+		if (!exchange_file.empty()) {
+			if (exchange_format.empty() && exchange_file == "-") {
+				std::cerr << "The format of standard input or output needs to be given with --format\n";
+				return -1;
+			}
+			import_format = export_format = XKey::exchangeFormatFromName (exchange_format.empty() ? exchange_file : exchange_format);
+		}
+		std::ifstream import_stream;
+		if (!import_file.empty() && import_file != "-") {
+			import_stream.open (import_file, std::ios::binary);
+			if (!import_stream.is_open()) {
+				std::cerr << "Can not open import file " << import_file << "\n";
+				return -1;
+			}
+		}
+		std::istream &import_in = (import_file == "-") ? std::cin : import_stream;
+		if (input_file.empty()) {
+			// Import into a new keystore, below the search root
+			XKey::Folder *f = &*rootKeyFolder;
+			std::istringstream components (search_path);
+			for (std::string c; std::getline (components, c, '/'); ) {
+				if (!c.empty())
+					f = f->createSubfolder (c);
+			}
+			const size_t count = XKey::importEntries (import_in, import_format, f);
+			status << "Imported " << count << " entries\n";
+			return write_keystore (*rootKeyFolder, status);
+		}
+
 		int m = 0;
 		if (!input_no_header)
 			m |= XKey::EVALUATE_FILE_HEADER;
@@ -99,10 +415,13 @@ int main (int argc, const char** argv)
 			m |= XKey::USE_ENCRYPTION;
 		if (!input_not_encoded)
 			m |= XKey::BASE64_ENCODED;
-		XKey::CryptStream crypt_streambuf (input_file, XKey::CryptStream::READ, m);
+		// A sharded keystore is a directory, the passphrase decrypts its manifest
+		const bool sharded = XKey::ShardedKeystore::isSharded (input_file);
+		XKey::CryptStream crypt_streambuf (sharded ? XKey::ShardedKeystore::manifestPath (input_file) : input_file,
+		                                   XKey::CryptStream::READ, m);
 		
+		std::string key;
 		if (crypt_streambuf.isEncrypted()) {
-			std::string key;
 			if (key_file.size() > 0) {
 				std::ifstream keystream (key_file);
 				if (!keystream.is_open()) {
@@ -113,78 +432,247 @@ int main (int argc, const char** argv)
 			} else {
 				const char *envPw = getenv("XKEY_PASSPHRASE");
 				if (envPw && *envPw != '\0') {
-					std::cout << "Using passphrase from Environment variable XKEY_PASSPHRASE\n";
+					status << "Using passphrase from Environment variable XKEY_PASSPHRASE\n";
 					key = envPw;
 				} else {
-					std::cout << "Password: ";
+					status << "Password: ";
 					key = get_password();
-					std::cout << "\n";
+					status << "\n";
 				}
 			}
 			crypt_streambuf.setEncryptionKey(key);
+			input_key = key;
+		}
+		// Opened with the passphrase of the keystore
+		std::unique_ptr<XKey::RevisionStore> history;
+		if (list_revisions || revision_number > 0 || diff_revision > 0) {
+			if (!XKey::RevisionStore::exists (input_file)) {
+				std::cerr << "The keystore has no revision history\n";
+				return -1;
+			}
+			history.reset (new XKey::RevisionStore (input_file));
+			history->open (key);
+		}
+		if (list_revisions) {
+			for (const XKey::RevisionStore::Revision &r : history->revisions()) {
+				const time_t t = r.time;
+				char date[32];
+				strftime (date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime (&t));
+				std::cout << r.number << "\t" << date << "\t" << (r.checkpoint ? "checkpoint" : "delta") << "\t"
+					<< r.size << " bytes, " << r.storedSize << " stored\n";
+			}
+			std::cout << history->revisions().size() << " revisions\n";
+			return 0;
+		}
+		if (!lookup_string.empty() && output_file.empty() && !sharded && revision_number == 0) {
+			std::vector<XKey::TokenIndex::Match> matches;
+			if (XKey::TokenIndex::lookup (input_file, crypt_streambuf, lookup_string, &matches)) {
+				for (const XKey::TokenIndex::Match &m : matches) {
+					std::cout << m.folderPath << "\n";
+					print_entry (m.entry, print_passwords ? PRINT_PASSWORD : 0, 0);
+				}
+				std::cout << matches.size() << " matches\n";
+				return 0;
+			}
+			std::cout << "No usable token index, searching the whole keystore\n";
 		}
 
 		std::istream stream (&crypt_streambuf);
+		if (!sharded && XKey::BinaryKeystore::detect (stream) && output_file.empty() && export_file.empty() && diff_file.empty() &&
+		    lookup_string.empty() && url_string.empty() && !history &&
+		    query_string.empty() && find_string.empty() && attachment_name.empty() &&
+		    !(crypt_streambuf.isEncrypted() && XKey::Journal::hasRecords (input_file)))
+		{
+			// Listing a binary keystore: print straight from the cleartext, without building the hierarchy
+			const XKey::BinaryKeystore store (stream);
+			XKey::FolderView f = store.root();
+			std::string fullPath;
+			std::istringstream components (search_path);
+			for (std::string c; std::getline (components, c, '/'); ) {
+				if (c.empty())
+					continue;
+				if (!f.findSubfolder (c, &f)) {
+					std::cerr << "Requested path not found.\n";
+					return 0;
+				}
+				fullPath += "/" + c;
+			}
+			std::cout << fullPath << "\n";
+			const int print_options = print_passwords ? PRINT_PASSWORD : 0;
+			if (entry_names.empty()) {
+				print_folder (f, print_options);
+			} else {
+				for (size_t i = 0; i < f.entryCount(); ++i) {
+					const XKey::EntryView e = f.entry (i);
+					if (std::find (entry_names.begin(), entry_names.end(), e.title().str()) != entry_names.end())
+						print_entry (e, print_options | PRINT_COMMENT, 0);
+				}
+			}
+			return 0;
+		}
+		// Decrypts and decodes the top-level folders in parallel
+		XKey::ThreadPool pool (search_threads);
 		XKey::Parser pars;
-		if (!pars.read (stream, &*rootKeyFolder)) {
+		if (sharded) {
+			sharded_input.reset (new XKey::ShardedKeystore (input_file));
+			sharded_input->open (stream, &*rootKeyFolder, pool, XKey::Parser::READ_LAZY);
+			// Imported entries mark the shards to write
+			rootKeyFolder->addObserver (&*sharded_input);
+		} else if (!pars.read (stream, &*rootKeyFolder, pool, XKey::Parser::READ_LAZY)) {
 			std::cerr << "Could not parse keystore file " << input_file << ": " << pars.error() << "\n";
 			return -1;
 		}
+		if (crypt_streambuf.isEncrypted() && !sharded) {
+			// Apply changes that were saved incrementally
+			XKey::Journal journal (input_file);
+			journal.open (key, crypt_streambuf.iv(), &*rootKeyFolder, XKey::Journal::READ_ONLY);
+		}
+		if (revision_number > 0) {
+			// Continues like the input file had the content of the revision
+			if (sharded_input)
+				rootKeyFolder->removeObserver (&*sharded_input);
+			sharded_input.reset();
+			rootKeyFolder = XKey::createRootFolder();
+			history->restore (revision_number, &*rootKeyFolder);
+		}
 		
 		const XKey::Folder *f = &*rootKeyFolder;
 		if (search_path.size() > 0) {
 			// Search path specified:
 			f = XKey::getFolderByPath (&*rootKeyFolder, search_path);
 			// Issue a newline here
-			std::cout << "\n";
+			status << "\n";
 		}
 		if (!f) {
 			std::cerr << "Requested path not found.\n";
 			return 0;
 		}
 		
-		if (output_file.size() > 0) {
-			int m = 0;
-			if (output_no_encrypt == false)
-				m |=  XKey::USE_ENCRYPTION;
-			if (output_no_encode != true)
-				m |=  XKey::BASE64_ENCODED;
-			if (output_no_header == false)
-				m |=  XKey::EVALUATE_FILE_HEADER;
-			
-			bool pretty_print = (output_no_encrypt && output_no_encode);
-
-			XKey::CryptStream crypt_filter (output_file, XKey::CryptStream::WRITE, m);
-			XKey::Writer::setRestrictiveFilePermissions (output_file);
-			
-			std::ostream stream (&crypt_filter);
-			if (!output_no_encrypt) {
-				std::string outkey;
-				const char *envPw = getenv("XKEY_OUT_PASSPHRASE");
-				if (envPw && *envPw != '\0') {
-					std::cout << "Using passphrase from Environment variable XKEY_OUT_PASSPHRASE\n";
-					outkey = envPw;
-				} else {
-					std::cout << "Output passphrase: ";
-					outkey = get_password();
-					std::cout << "\n";
+		if (!diff_file.empty() || diff_revision > 0) {
+			XKey::RootFolder_Ptr other = XKey::createRootFolder();
+			if (diff_revision > 0)
+				history->restore (diff_revision, other.get());
+			else
+				read_keystore (diff_file, key, other.get(), pool);
+			const XKey::Folder *g = XKey::getFolderByPath (other.get(), search_path);
+			if (!g) {
+				std::cerr << "Requested path not found in " << (diff_revision > 0 ? "revision " + std::to_string(diff_revision) : diff_file) << "\n";
+				return -1;
+			}
+			const XKey::MerkleTree hashes (*rootKeyFolder), otherHashes (*other);
+			const std::vector<XKey::TreeDifference> differences = XKey::diffTrees (*f, hashes, *g, otherHashes);
+			for (const XKey::TreeDifference &d : differences) {
+				switch (d.kind) {
+				case XKey::TreeDifference::ENTRY_ADDED: std::cout << "+ " << d.path << ": " << d.after->title() << "\n"; break;
+				case XKey::TreeDifference::ENTRY_REMOVED: std::cout << "- " << d.path << ": " << d.before->title() << "\n"; break;
+				case XKey::TreeDifference::ENTRY_CHANGED:
+					std::cout << "~ " << d.path << ": " << d.before->title() << " (" << changed_fields (*d.before, *d.after) << ")\n";
+					break;
+				case XKey::TreeDifference::FOLDER_ADDED: std::cout << "+ " << d.path << "/\n"; break;
+				case XKey::TreeDifference::FOLDER_REMOVED: std::cout << "- " << d.path << "/\n"; break;
 				}
-				crypt_filter.setEncryptionKey (outkey);
 			}
-			std::cout << "Writing...\n";
-			
-			XKey::Writer w;
-			if (!w.write(stream, *f, (pretty_print) ? XKey::Writer::WRITE_FORMATTED : XKey::Writer::WRITE_NONE)) {
-				std::cerr << "Error: " << w.error() << "\n";
+			std::cout << differences.size() << " differences\n";
+			return differences.empty() ? 0 : 1;
+		}
+		if (!merge_file.empty()) {
+			XKey::RootFolder_Ptr base = XKey::createRootFolder(), theirs = XKey::createRootFolder();
+			read_keystore (merge_base, key, base.get(), pool);
+			read_keystore (merge_file, key, theirs.get(), pool);
+			std::vector<XKey::MergeConflict> conflicts;
+			XKey::RootFolder_Ptr merged = XKey::mergeTrees (*base, *rootKeyFolder, *theirs, &conflicts);
+			for (const XKey::MergeConflict &c : conflicts)
+				std::cout << "Conflict in " << c.path << (c.title.empty() ? "" : ": " + c.title) << " (" << c.reason << ")\n";
+			// Attachments added in the other keystore
+			XKey::AttachmentStore (merge_file).copyReferenced (*theirs, XKey::AttachmentStore(output_file));
+			const int result = write_keystore (*merged, status);
+			return (result == 0 && !conflicts.empty()) ? 1 : result;
+		}
+		if (!attach_files.empty()) {
+			XKey::Folder *target = XKey::getFolderByPath (&*rootKeyFolder, search_path);
+			if (entry_names.empty() || output_file.empty()) {
+				std::cerr << "--attach needs the entries to attach to (-e) and an output file\n";
+				return -1;
+			}
+			// The blobs are stored next to the output file, where the keystore referencing them is written
+			XKey::AttachmentStore store (output_file);
+			std::vector<XKey::Attachment> attachments;
+			for (const std::string &file : attach_files)
+				attachments.push_back (store.addFile (file));
+			size_t count = 0;
+			for (size_t i = 0; i < target->entries().size(); ++i) {
+				XKey::Entry entry = target->entries()[i];
+				if (std::find (entry_names.begin(), entry_names.end(), entry.title()) == entry_names.end())
+					continue;
+				for (const XKey::Attachment &a : attachments)
+					entry.addAttachment (a);
+				target->setEntryAt (i, std::move(entry));
+				++count;
+			}
+			if (count == 0) {
+				for (const XKey::Attachment &a : attachments)
+					store.remove (a);
+				std::cerr << "No matching entry in " << target->fullPath() << "\n";
 				return -1;
 			}
+			status << "Attached " << attachments.size() << " files to " << count << " entries\n";
+			return write_keystore (*rootKeyFolder, status, sharded_input.get());
+		}
+		if (!import_file.empty()) {
+			XKey::Folder *target = XKey::getFolderByPath (&*rootKeyFolder, search_path);
+			const size_t count = XKey::importEntries (import_in, import_format, target);
+			status << "Imported " << count << " entries\n";
+			// The search root only selects the target folder, the whole keystore is written
+			return write_keystore (*rootKeyFolder, status, sharded_input.get());
+		}
+		if (!export_file.empty()) {
+			const size_t count = export_entries (*f, export_format);
+			status << "Exported " << count << " entries\n";
+		} else if (output_file.size() > 0) {
+			return write_keystore (*f, status, sharded_input.get());
 		} else {
 			int print_options = 0;
 			if (print_passwords)
 				print_options |= PRINT_PASSWORD;
 			// No options. Just show a list
 			std::cout << f->fullPath() << "\n";
-			if (entry_names.empty()) {
+			if (!lookup_string.empty()) {
+				const std::vector<XKey::SearchResult> results = XKey::TokenIndex::find (lookup_string, &*rootKeyFolder);
+				for (const XKey::SearchResult &r : results) {
+					std::cout << r.parentFolder()->fullPath() << "\n";
+					print_entry (*r.match(), print_options, 0);
+				}
+				std::cout << results.size() << " matches\n";
+			} else if (!url_string.empty()) {
+				const XKey::UrlIndex index (*rootKeyFolder);
+				const std::vector<XKey::UrlIndex::Match> matches = index.lookup (url_string);
+				for (const XKey::UrlIndex::Match &m : matches) {
+					std::cout << m.result.parentFolder()->fullPath() << "\n";
+					print_entry (*m.result.match(), print_options, 0);
+				}
+				std::cout << matches.size() << " matches\n";
+			} else if (!query_string.empty()) {
+				const std::vector<XKey::SearchResult> results = XKey::QueryPlan(query_string).findAll (f);
+				for (const XKey::SearchResult &r : results) {
+					std::cout << r.parentFolder()->fullPath() << "\n";
+					print_entry (*r.match(), print_options, 0);
+				}
+				std::cout << results.size() << " matches\n";
+			} else if (!find_string.empty() && find_fuzzy) {
+				const std::vector<XKey::RankedResult> results = XKey::findBest (XKey::FuzzyQuery(find_string), f, find_limit);
+				for (const XKey::RankedResult &r : results) {
+					std::cout << r.result.parentFolder()->fullPath() << " (score " << r.score << ")\n";
+					print_entry (*r.result.match(), print_options, 0);
+				}
+				std::cout << results.size() << " matches\n";
+			} else if (!find_string.empty()) {
+				const std::vector<XKey::SearchResult> results = XKey::findAll (XKey::SearchQuery(find_string), f, pool);
+				for (const XKey::SearchResult &r : results) {
+					std::cout << r.parentFolder()->fullPath() << "\n";
+					print_entry (*r.match(), print_options, 0);
+				}
+				std::cout << results.size() << " matches\n";
+			} else if (entry_names.empty()) {
 				print_folder (*f, print_options);
 			}
 			else {
@@ -194,6 +682,15 @@ int main (int argc, const char** argv)
 					if (std::find(entry_names.begin(), entry_names.end(), it.title()) == entry_names.end())
 						continue;
 					print_entry(it, print_options, 0);
+					if (attachment_name.empty())
+						continue;
+					for (const XKey::Attachment &a : it.attachments()) {
+						if (a.name != attachment_name)
+							continue;
+						const std::string target = attachment_out.empty() ? a.name : attachment_out;
+						XKey::AttachmentStore (input_file).extractFile (a, target);
+						std::cout << "Extracted attachment " << a.name << " to " << target << "\n";
+					}
 				}
 			}
 		}
@@ -18,12 +18,21 @@ struct SaveFileOptions {
 	bool use_encoding;
 	bool always_ask_password;
 	int key_iteration_count;
+	/// Append changes to a journal instead of rewriting the keystore
+	bool use_journal;
+	/// Write an encrypted token index next to the keystore, see XKey::TokenIndex
+	bool use_token_index;
+	/// Write the binary body format instead of Json, see XKey::BinaryKeystore
+	bool use_binary_format;
+	/// Record every save in an encrypted revision history next to the keystore, see XKey::RevisionStore
+	bool use_revisions;
 	
 	int makeCryptStreamMode () const;
 	
 	inline SaveFileOptions() : use_encryption(true), cipher_name(DEFAULT_CIPHER_ALGORITHM),
 		digest_name(DEFAULT_DIGEST_ALGORITHM), use_encoding(true),
-		always_ask_password(true), key_iteration_count(DEFAULT_KEY_ITERATION_COUNT) { }
+		always_ask_password(true), key_iteration_count(DEFAULT_KEY_ITERATION_COUNT), use_journal(false),
+		use_token_index(false), use_binary_format(false), use_revisions(false) { }
 	inline ~SaveFileOptions () {
 		// Clear passphrase on destruction
 		std::fill (_lastPassword.begin(), _lastPassword.end(), '\0');
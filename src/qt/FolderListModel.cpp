@@ -1,5 +1,6 @@
 #include "FolderListModel.h"
 #include <XKey.h>
+#include <XKeyBatch.h>
 #include <algorithm>
 #include <cassert>
 #include <QStringList>
@@ -174,7 +175,7 @@ bool FolderListModel::dropMimeData (const QMimeData * data, Qt::DropAction actio
 	if (data->hasFormat("application/x-xkey-folder")) {
 		QString fullPath = data->data ("application/x-xkey-folder");
 
-		XKey::Folder *oldFolder = const_cast<XKey::Folder *> (XKey::getFolderByPath(root, fullPath.toStdString())),
+		XKey::Folder *oldFolder = XKey::getFolderByPath(root, fullPath.toStdString()),
 			*oldParent = (oldFolder) ? oldFolder->parent() : 0;
 		if (!oldFolder || !oldParent || oldParent == parentItem)
 			return false;
@@ -202,22 +203,30 @@ bool FolderListModel::dropMimeData (const QMimeData * data, Qt::DropAction actio
 		if (l.size() >= 2) {
 			// First entry in list is absolute path to root folder
 			QString sourceFolderPath (l.at(0));
-			XKey::Folder *oldFolder = const_cast<XKey::Folder *> (XKey::getFolderByPath(root, sourceFolderPath.toStdString()));
+			XKey::Folder *oldFolder = XKey::getFolderByPath(root, sourceFolderPath.toStdString());
 			if (!oldFolder)
 				return false; // Old parent not found
-			// All additional entries are indices to entries that shall be moved
-			for (int i = 1; i < l.size(); ++i) {
-				bool ok = false;
-				const int index = l.at(i).toInt(&ok);
-				if (ok && index >= 0) {
-					// get entry and make copy to new folder
-					beginInsertRows(parent, parentItem->subfolders().size(), parentItem->subfolders().size()+1);
-					const XKey::Entry &entry = oldFolder->getEntryAt(index);
-					parentItem->addEntry(entry);
-					//
-					endInsertRows();
+			if (oldFolder == parentItem)
+				return false; // Dropped onto the folder the entries come from
+			// All additional entries are indices to entries that shall be moved.
+			// They are copied here; the key table they were dragged from removes them with KeyListModel::removeRows.
+			try {
+				XKey::Batch batch (root);
+				for (int i = 1; i < l.size(); ++i) {
+					bool ok = false;
+					const int index = l.at(i).toInt(&ok);
+					if (ok && index >= 0) {
+						// get entry and make copy to new folder
+						batch.addEntry (parentItem, oldFolder->getEntryAt(index));
+					}
 				}
+				batch.commit();
+			} catch (const std::exception &e) {
+				QMessageBox::warning (0, tr("Error"), tr("Failed to copy entries: %1").arg(QString(e.what())) );
+				return false;
 			}
+			// Entries are no rows of this model: Let the model showing the folder update its rows
+			emit entriesDropped (parentItem);
 			return true;
 		}
 	}
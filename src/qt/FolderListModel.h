@@ -34,6 +34,9 @@ public:
 	void setRootFolder (XKey::Folder *r);
 	
 	bool getModelIndex (const XKey::Folder *folder, QModelIndex *ind);
+signals:
+	/// Emitted after dropped entries were added to @p folder
+	void entriesDropped (XKey::Folder *folder);
 protected:
 	Qt::DropActions supportedDropActions () const override;
 	
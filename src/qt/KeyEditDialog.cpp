@@ -47,10 +47,13 @@ void KeyEditDialog::generatePassphraseClicked () {
 }
 
 void KeyEditDialog::makeChanges () {
+	std::vector<XKey::Attachment> attachments = mEntry->attachments();
 	*mEntry = XKey::Entry ( mUi->titleEdit->text().toStdString(), mUi->usernameEdit->text().toStdString(), mUi->urlEdit->text().toStdString(),
 		mUi->passwordEdit->text().toStdString(),  mUi->emailEdit->text().toStdString(),
 		mUi->commentEdit->toPlainText().toStdString()
 	);
+	// Attachments are not edited in this dialog
+	mEntry->setAttachments (std::move(attachments));
 }
 
 QString KeyEditDialog::generatePassphrase () {
@@ -1,5 +1,6 @@
 #include "KeyListModel.h"
 #include <XKey.h>
+#include <XKeyBatch.h>
 #include <QStringList>
 #include <QMimeData>
 #include <iostream>
@@ -14,8 +15,17 @@ KeyListModel::KeyListModel(QObject *parent)
 KeyListModel::~KeyListModel() { }
 
 void KeyListModel::setCurrentFolder (XKey::Folder *r) {
-	this->_folder = r;
 	beginResetModel();
+	this->_folder = r;
+	_error.clear();
+	// Decode lazily loaded entries now rather than in a model callback
+	if (r && !r->isMaterialized()) {
+		try {
+			r->entries();
+		} catch (const std::exception &e) {
+			_error = QString::fromStdString (e.what());
+		}
+	}
 	endResetModel();
 }
 
@@ -32,7 +42,7 @@ Qt::ItemFlags KeyListModel::flags ( const QModelIndex &) const {
 }
 
 int KeyListModel::rowCount (const QModelIndex &) const {
-	if (!_folder)
+	if (!_folder || !_error.isEmpty())
 		return 0;
 	return this->_folder->entries().size();
 }
@@ -42,7 +52,10 @@ int KeyListModel::columnCount (const QModelIndex &) const {
 }
 
 QVariant KeyListModel::data (const QModelIndex &index, int role) const {
-	if (role == Qt::DisplayRole) {
+	if (role != Qt::DisplayRole || !_folder || !_error.isEmpty())
+		return QVariant();
+	// Exceptions must not propagate into Qt
+	try {
 		const XKey::Entry &entry = _folder->entries().at(index.row());
 		if (index.column() == 0)
 			return QString::fromStdString ( entry.title() );
@@ -52,9 +65,10 @@ QVariant KeyListModel::data (const QModelIndex &index, int role) const {
 			return QString::fromStdString( entry.url() );
 		else
 			return QString::fromStdString( entry.email() );
-		
-	} else
+	} catch (const std::exception &e) {
+		std::cerr << "KeyListModel::data fail: " << e.what() << "\n";
 		return QVariant();
+	}
 }
 
 void KeyListModel::addEntry (XKey::Entry entry) {
@@ -65,6 +79,13 @@ void KeyListModel::addEntry (XKey::Entry entry) {
 	endInsertRows();
 }
 
+void KeyListModel::setEntry (int index, XKey::Entry entry) {
+	if (!_folder)
+		return;
+	_folder->setEntryAt(index, std::move(entry));
+	emit dataChanged(this->index(index, 0), this->index(index, columnCount() - 1));
+}
+
 void KeyListModel::removeEntry (int index) {
 	if (!_folder)
 		return;
@@ -74,11 +95,17 @@ void KeyListModel::removeEntry (int index) {
 }
 
 bool KeyListModel::removeRows (int row, int count, const QModelIndex & parent) {
+	if (!_folder || row < 0 || count <= 0 || row + count > (int)_folder->entries().size())
+		return false;
+	XKey::Folder *root = _folder;
+	while (root->parent())
+		root = root->parent();
 	try {
+		XKey::Batch batch (root);
+		for (int i = row; i < row+count; ++i)
+			batch.removeEntry (_folder, i);
 		beginRemoveRows(parent, row, row+count-1);
-		for (int i = row+count-1; i >= row; --i ) {
-			_folder->removeEntry(i);
-		}
+		batch.commit();
 		endRemoveRows();
 	} catch (const std::exception &e) {
 		std::cerr << "KeyListModel::removeRows fail: " << e.what() << "\n";
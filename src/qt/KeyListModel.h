@@ -1,6 +1,7 @@
 #pragma once
 
 #include <qabstractitemmodel.h>
+#include <QString>
 
 namespace XKey {
 	class Folder;
@@ -24,17 +25,24 @@ public:
 	bool removeRows ( int row, int count, const QModelIndex & parent = QModelIndex() );
 	
 	void addEntry (XKey::Entry entry);
+	void setEntry (int index, XKey::Entry entry);
 	void removeEntry (int index);
 	
 	Qt::ItemFlags flags ( const QModelIndex & index ) const;
 	
+	/// Show the entries of @p r. Lazily loaded entries are decoded here, see #error.
 	void setCurrentFolder (XKey::Folder *r);
 	
 	inline XKey::Folder *folder () const { return _folder; }
 	
+	/// @return Why the entries of the current folder could not be decoded, or an empty string
+	inline const QString &error () const { return _error; }
+	
 	QStringList mimeTypes () const;
 	QMimeData *mimeData (const QModelIndexList &indexes) const;
 	Qt::DropActions supportedDropActions () const;
 private:
 	XKey::Folder *_folder;
+	/// Error decoding the entries of _folder. The model has no rows while it is set.
+	QString _error;
 };
@@ -74,6 +74,10 @@ const std::initializer_list<Option> configOptions = {
 	Option("keystore/key_iteration_count", DEFAULT_KEY_ITERATION_COUNT, &Diag::keyIterationSpinBox, &SFO::key_iteration_count),
 	Option("keystore/algorithm", DEFAULT_CIPHER_ALGORITHM, &Diag::cipherComboBox, &SFO::cipher_name),
 	Option("keystore/digest_algorithm", DEFAULT_DIGEST_ALGORITHM, &Diag::digestAlgoComboBox, &SFO::digest_name),
+	Option("keystore/journal", false, &Diag::journalCheckBox, &SFO::use_journal),
+	Option("keystore/token_index", false, &Diag::tokenIndexCheckBox, &SFO::use_token_index),
+	Option("keystore/binary_format", false, &Diag::binaryFormatCheckBox, &SFO::use_binary_format),
+	Option("keystore/revisions", false, &Diag::revisionsCheckBox, &SFO::use_revisions),
 	Option(GenerationSpecial, false, &Diag::specialCharCheckBox, nullptr),
 	Option(GenerationNumerics, true, &Diag::numericsCheckBox, nullptr),
 	Option(GenerationMixed, true, &Diag::uppercaseCheckBox, nullptr),
@@ -6,7 +6,20 @@
 #include "SettingsDialog.h"
 #include <CryptStream.h>
 #include <XKeyJsonSerialization.h>
+#include <XKeyJournal.h>
+#include <XKeyAtomicFile.h>
+#include <XKeyAttachments.h>
+#include <XKeySearchIndex.h>
+#include <XKeyFuzzySearch.h>
+#include <XKeySearchSession.h>
+#include <XKeySubtreeFilter.h>
+#include <XKeyThreadPool.h>
+#include <XKeyQuery.h>
+#include <XKeyRevisions.h>
+#include <XKeyTokenIndex.h>
+#include <XKeyUrlIndex.h>
 #include <QFileDialog>
+#include <QInputDialog>
 #include <QPushButton>
 #include <QMessageBox>
 #include <QSettings>
@@ -14,9 +27,9 @@
 #include <QShortcut>
 #include <QClipboard>
 #include <cassert>
+#include <limits>
 #include <QtWidgets/QMainWindow>
 #include <QCloseEvent>
-#include <sys/acl.h>
 // UIs
 #include <ui_Main.h>
 #include <ui_About.h>
@@ -45,7 +58,8 @@ private:
 };
 
 XKeyApplication::XKeyApplication(QSettings *sett)
-	: mSettings(sett), mUi(0), mFolders(0), mKeys(0), madeChanges(false), mRecentFiles(0)
+	: mSettings(sett), mUi(0), mFolders(0), mKeys(0), madeChanges(false), mRecentFiles(0),
+	nextSearchResult(0), lastSearchGeneration(0), sessionGeneration(0)
 {
 	using namespace Settings;
 	// Read application settings from hard disk
@@ -81,6 +95,8 @@ XKeyApplication::XKeyApplication(QSettings *sett)
 	
 	connect (mUi->actionAddEntry, SIGNAL(triggered()), this, SLOT(addEntryClicked()));
 	connect (mUi->actionDeleteEntry, SIGNAL(triggered()), this, SLOT(deleteEntryClicked()));
+	connect (mUi->actionAddAttachment, SIGNAL(triggered()), this, SLOT(addAttachmentClicked()));
+	connect (mUi->actionSaveAttachment, SIGNAL(triggered()), this, SLOT(saveAttachmentClicked()));
 	connect (mUi->actionEditEntry, SIGNAL(triggered()), this, SLOT(editEntryClicked()));
 	connect (mUi->actionAddFolder, SIGNAL(triggered()), this, SLOT(addFolderClicked()));
 	connect (mUi->actionDeleteFolder, SIGNAL(triggered()), this, SLOT(deleteFolderClicked()));
@@ -95,6 +111,11 @@ XKeyApplication::XKeyApplication(QSettings *sett)
 	mUi->keyTable->setSelectionBehavior (QAbstractItemView::SelectRows);
 	
 	connect (mUi->keyTable, SIGNAL(doubleClicked(QModelIndex)), this, SLOT(editKey(QModelIndex)));
+	// Dropped entries were added to the folder behind the model's back
+	connect (mFolders, &FolderListModel::entriesDropped, [this] (XKey::Folder *folder) {
+		if (mKeys->folder() == folder)
+			mKeys->setCurrentFolder (folder);
+	});
 	// Search bar:
 	mSearchBar = new QLineEdit (&*mMain);
 	mSearchBar->setMinimumWidth(100);
@@ -103,6 +124,7 @@ XKeyApplication::XKeyApplication(QSettings *sett)
 	searchButton->setObjectName("searchButton");
 	QShortcut *shCut = new QShortcut(QKeySequence("Return"), mSearchBar, 0, 0, Qt::WidgetShortcut);
 	connect (shCut, &QShortcut::activated, this, &XKeyApplication::startSearch);
+	connect (mSearchBar, &QLineEdit::textEdited, this, &XKeyApplication::liveSearch);
 	shCut = new QShortcut(QKeySequence(mSettings->value("shortcut/Search", "Ctrl+F").toString()), &*mMain, 0, 0, Qt::WindowShortcut);
 	connect (shCut, &QShortcut::activated, [this] () { mSearchBar->setFocus(Qt::ShortcutFocusReason); });
 	
@@ -128,6 +150,10 @@ XKeyApplication::XKeyApplication(QSettings *sett)
 
 XKeyApplication::~XKeyApplication() {
 	saveApplicationState();
+	closeJournal();
+	closeSerializationCache();
+	mRevisions.reset();
+	closeSearchIndex();
 	delete mUi;
 }
 
@@ -151,6 +177,10 @@ bool XKeyApplication::askClose () {
 void XKeyApplication::newFile () {
 	if (!askClose())
 		return;
+	closeJournal();
+	closeSerializationCache();
+	mRevisions.reset();
+	closeSearchIndex();
 	this->mRoot = XKey::createRootFolder();
 	this->mFolders->setRootFolder(&*mRoot);
 	this->mKeys->setCurrentFolder (&*mRoot);
@@ -188,10 +218,31 @@ void XKeyApplication::openFile (const QString &filename) {
 		}
 		std::istream isource (&crypt_source);
 		XKey::RootFolder_Ptr newRoot = XKey::createRootFolder();
-		if (p.read(isource, &*newRoot)) {
+		// Decrypt and decode the top-level folders on all cores
+		XKey::ThreadPool pool;
+		if (p.read(isource, &*newRoot, pool, XKey::Parser::READ_LAZY)) {
+			// Apply changes that were saved incrementally
+			std::unique_ptr<XKey::Journal> journal;
+			size_t journalRecords = 0;
+			if (crypt_source.isEncrypted()) {
+				journal.reset (new XKey::Journal (filename.toStdString()));
+				journalRecords = journal->open (password.toStdString(), crypt_source.iv(), &*newRoot);
+			}
 			success = true;
 			// Set attributes:
+			closeJournal();
+			closeSerializationCache();
+			mRevisions.reset();
+			closeSearchIndex();
 			this->mRoot = std::move(newRoot);
+			if (journal && journal->isOpen()) {
+				mJournal = std::move(journal);
+				mRoot->addObserver (&*mJournal);
+			}
+			if (journalRecords > 0) {
+				mUi->statusbar->showMessage(tr("Applied %1 incremental saves from the journal").arg(journalRecords),
+				                            statusBarMessageTimeout);
+			}
 			currentFileName = filename;
 			mSaveOptions.setLastPassword(password.toStdString());
 			this->mFolders->setRootFolder(&*mRoot);
@@ -214,31 +265,6 @@ void XKeyApplication::openFile (const QString &filename) {
 	}
 }
 
-class TmpFile
-{
-public:
-	TmpFile (const std::string &filenamePrefix) {
-		file = filenamePrefix + ".tmp";
-	}
-	~TmpFile () {
-		try {
-			XKey::Writer::removeFile (file);
-		} catch (...) { } // Drop exception
-	}
-	const std::string &name () const { return file; }
-private:
-	std::string file;
-};
-
-void copyAclIfPossible (const std::string &sourceFile, const std::string &targetFile)
-{
-	acl_t acl = acl_get_file(sourceFile.c_str(), ACL_TYPE_ACCESS);
-	if (acl) {
-		acl_set_file(targetFile.c_str(), ACL_TYPE_ACCESS, acl);
-		acl_free(acl);
-	}
-}
-
 void XKeyApplication::saveFile (const QString &filename, SaveFileOptions &sopt) {
 	QString errorMsg;
 	bool success = false;
@@ -279,25 +305,77 @@ void XKeyApplication::saveFile (const QString &filename, SaveFileOptions &sopt)
 			}
 		}
 		const std::string targetFile = filename.toStdString();
-		TmpFile tmpFile (targetFile);
-		XKey::Writer w;
-		XKey::CryptStream crypt_source (tmpFile.name(), XKey::CryptStream::WRITE, sopt.makeCryptStreamMode());
-		copyAclIfPossible (filename.toStdString(), tmpFile.name());
-		
-		crypt_source.setEncryptionKey (passwd.toStdString(), sopt.cipher_name.c_str(),
-					       sopt.digest_name.c_str(), nullptr, sopt.key_iteration_count);
-		// 
-		std::ostream osource (&crypt_source);
-		// If we don't use encryption, we want formatted output.
-		int flags = (sopt.use_encryption == false) ? XKey::Writer::WRITE_FORMATTED : XKey::Writer::WRITE_NONE;
-		if (w.write(osource, *mRoot, flags)) {
-			XKey::Writer::moveFile (tmpFile.name(), targetFile);
+		const bool useJournal = (sopt.use_journal && sopt.use_encryption);
+		if (useJournal && mJournal && filename == currentFileName && !mJournal->needsCompaction()
+		    && mJournal->matchesPassphrase(passwd.toStdString()))
+		{
+			// Only append the changes since the last save
+			mJournal->commit();
+			// The token index does not cover the journalled changes
+			XKey::TokenIndex::remove (targetFile);
 			success = true;
 			madeChanges = false;
 			addRecentFile (filename);
 			sopt.setLastPassword(passwd.toStdString());
+			recordRevision (targetFile, passwd.toStdString(), sopt);
 		} else {
-			errorMsg = QString::fromStdString(w.error());
+			if (!currentFileName.isEmpty() && filename != currentFileName) {
+				// Attachments are stored next to the keystore file: Take them along
+				XKey::AttachmentStore (currentFileName.toStdString()).copyReferenced (*mRoot, XKey::AttachmentStore (targetFile));
+			}
+			// Replaces the previous version only once the new one is complete and on disk
+			XKey::AtomicFile file (targetFile);
+			XKey::Writer w;
+			XKey::CryptStream crypt_source (file.fd(), XKey::CryptStream::WRITE, sopt.makeCryptStreamMode());
+			
+			crypt_source.setEncryptionKey (passwd.toStdString(), sopt.cipher_name.c_str(),
+						       sopt.digest_name.c_str(), nullptr, sopt.key_iteration_count);
+			// 
+			std::ostream osource (&crypt_source);
+			// If we don't use encryption, we want formatted output.
+			int flags = (sopt.use_encryption == false) ? XKey::Writer::WRITE_FORMATTED : XKey::Writer::WRITE_NONE;
+			flags |= XKey::Writer::WRITE_SUBTREE_INDEX;
+			if (sopt.use_binary_format)
+				flags = XKey::Writer::WRITE_BINARY;
+			// The token index needs the Json cleartext and the positions of the encrypted blocks
+			const bool useTokenIndex = (sopt.use_token_index && sopt.use_encryption && !sopt.use_binary_format);
+			XKey::CleartextBuffer cleartext;
+			std::ostream ocleartext (&cleartext);
+			if (!mSerializationCache) {
+				mSerializationCache.reset (new XKey::SerializationCache);
+				mRoot->addObserver (&*mSerializationCache);
+			}
+			if (w.write(useTokenIndex ? ocleartext : osource, *mRoot, flags, &*mSerializationCache)) {
+				if (useTokenIndex) {
+					osource.write (cleartext.text().data(), cleartext.text().size());
+					osource.flush();
+				}
+				crypt_source.finish();
+				file.commit();
+				if (useTokenIndex)
+					XKey::TokenIndex::write (targetFile, crypt_source, cleartext.text());
+				else
+					XKey::TokenIndex::remove (targetFile);
+				success = true;
+				madeChanges = false;
+				currentFileName = filename;
+				addRecentFile (filename);
+				sopt.setLastPassword(passwd.toStdString());
+				// The new base image contains all changes: Start over with an empty journal
+				closeJournal();
+				if (useJournal) {
+					mJournal.reset (new XKey::Journal (targetFile));
+					mJournal->reset (passwd.toStdString(), crypt_source.iv(), sopt.key_iteration_count);
+					mRoot->addObserver (&*mJournal);
+				} else {
+					XKey::Journal::remove (targetFile);
+				}
+				// Blobs of removed attachments are no longer referenced by the saved keystore
+				XKey::AttachmentStore (targetFile).collectGarbage (*mRoot);
+				recordRevision (targetFile, passwd.toStdString(), sopt);
+			} else {
+				errorMsg = QString::fromStdString(w.error());
+			}
 		}
 	} catch (const std::exception &e) {
 		errorMsg = e.what();
@@ -314,6 +392,10 @@ void XKeyApplication::folderSelectionChanged (const QItemSelection &l, const QIt
 	if (indexes.size() == 1) {
 		XKey::Folder *f = static_cast<XKey::Folder *> (indexes.at(0).internalPointer());
 		mKeys->setCurrentFolder(f);
+		if (!mKeys->error().isEmpty()) {
+			QMessageBox::warning (&*mMain, tr("Opening folder failed"),
+				tr("The entries of the folder could not be decoded:\n%1").arg(mKeys->error()));
+		}
 	} else {
 		mKeys->setCurrentFolder(nullptr);
 	}
@@ -322,16 +404,42 @@ void XKeyApplication::folderSelectionChanged (const QItemSelection &l, const QIt
 void XKeyApplication::startSearch () {
 	if (!mSearchBar->text().isEmpty()) {
 		mUi->statusbar->showMessage(tr("Search: %1").arg(mSearchBar->text()));
-		XKey::SearchResult sr;
-		if (mSearchBar->text() == lastSearchString) {
-			// We continue an existing search
-			sr = XKey::continueSearch(lastSearchString.toStdString(), lastSearchResult);
-		} else {
+		openSearchIndex();
+		if (mSearchBar->text() != lastSearchString || mSearchIndex->generation() != lastSearchGeneration) {
 			// We start a new search
 			lastSearchString = mSearchBar->text();
-			sr = XKey::startSearch(lastSearchString.toStdString(), &*mRoot);
+			const std::string text = lastSearchString.toStdString();
+			if (text.find ("://") != std::string::npos && text.find (' ') == std::string::npos) {
+				// A URL: the entries for its host and parent domains
+				lastSearchResults.clear();
+				for (const XKey::UrlIndex::Match &m : mUrlIndex->lookup (text))
+					lastSearchResults.push_back (m.result);
+			} else if (XKey::QueryPlan::hasOperators (text)) {
+				// Field qualifiers and operators: evaluate the compiled query, matches in tree order
+				try {
+					lastSearchResults = XKey::QueryPlan(text).findAll (&*mRoot);
+				} catch (const std::invalid_argument &e) {
+					mUi->statusbar->showMessage(tr("Invalid search query: %1").arg(e.what()), statusBarMessageTimeout);
+					lastSearchString = "";
+					return;
+				}
+			} else {
+				// All substring matches, best match first. Without any, fall back to every fuzzy match.
+				const XKey::FuzzyQuery query (text);
+				lastSearchResults = XKey::rankAll (query, mSearchIndex->find (text));
+				if (lastSearchResults.empty()) {
+					for (const XKey::RankedResult &r : XKey::findBest (query, &*mRoot, std::numeric_limits<size_t>::max()))
+						lastSearchResults.push_back (r.result);
+				}
+			}
+			lastSearchGeneration = mSearchIndex->generation();
+			nextSearchResult = 0;
 		}
-		if (sr.match()) {
+		if (nextSearchResult < lastSearchResults.size()) {
+			// Step to the next match
+			const XKey::SearchResult &sr = lastSearchResults[nextSearchResult++];
+			mUi->statusbar->showMessage(tr("Search: %1 - match %2 of %3").arg(mSearchBar->text())
+				.arg(nextSearchResult).arg(lastSearchResults.size()));
 			// Show all keys of this folder:
 			mKeys->setCurrentFolder( const_cast<XKey::Folder*> (sr.parentFolder()) );
 			QModelIndex fIndex;
@@ -344,15 +452,55 @@ void XKeyApplication::startSearch () {
 			// Next time, start search over
 			lastSearchString = "";
 		}
-		lastSearchResult = sr;
 	}
 }
 
+void XKeyApplication::liveSearch (const QString &text) {
+	if (text.isEmpty() || !mRoot) {
+		mUi->statusbar->clearMessage();
+		return;
+	}
+	openSearchIndex();
+	if (!mSearchSession || mSearchIndex->generation() != sessionGeneration) {
+		// Cached results refer to entries that may have been changed since
+		mSearchSession.reset (new XKey::SearchSession (&*mRoot, &*mSubtreeFilter));
+		sessionGeneration = mSearchIndex->generation();
+	}
+	const std::string searchString = text.toStdString();
+	std::vector<XKey::SearchResult> matches;
+	if (XKey::QueryPlan::hasOperators (searchString)) {
+		// Negations can add matches while typing, so queries are evaluated completely
+		try {
+			matches = XKey::QueryPlan(searchString).findAll (&*mRoot);
+		} catch (const std::invalid_argument &) {
+			mUi->statusbar->showMessage(tr("Search: %1 - incomplete query").arg(text));
+			lastSearchString = "";
+			return;
+		}
+	} else {
+		// Each keystroke only filters the matches of the previous one. All of them are kept, best match first.
+		matches = XKey::rankAll (XKey::FuzzyQuery(searchString), mSearchSession->update (searchString));
+	}
+	if (matches.empty()) {
+		// Live search needs every word, Return matches any word and falls back to fuzzy matching
+		mUi->statusbar->showMessage(tr("Search: %1 - no entry contains every word, press Return to match any word").arg(text));
+		lastSearchString = "";
+		return;
+	}
+	lastSearchResults.swap (matches);
+	lastSearchString = text;
+	lastSearchGeneration = mSearchIndex->generation();
+	nextSearchResult = 0;
+	// Show the best match. Return steps through the others.
+	startSearch();
+}
+
 void XKeyApplication::editKey (const QModelIndex & index) {
-	XKey::Entry &entry = static_cast<XKey::Entry&> (mKeys->folder()->entries().at(index.row()));
+	XKey::Entry entry = mKeys->folder()->entries().at(index.row());
 	KeyEditDialog diag (&entry, mKeys->folder(), &*mMain, &mGenerator, false);
 	if (diag.exec () == QDialog::Accepted) {
 		diag.makeChanges ();
+		mKeys->setEntry (index.row(), std::move(entry));
 		madeChanges = true;
 	}
 }
@@ -413,7 +561,8 @@ void XKeyApplication::setEnabled (bool enabled) {
 	QWidget *widgetList[] = { mUi->keyTable, mUi->keyTree, mMain->findChild<QPushButton*> ("searchButton"), mSearchBar
 	};
 	QAction *actionList[] = { mUi->actionSave, mUi->actionSave_As,
-		mUi->actionAddEntry, mUi->actionEditEntry, mUi->actionDeleteEntry, mUi->actionAddFolder, mUi->actionDeleteFolder
+		mUi->actionAddEntry, mUi->actionEditEntry, mUi->actionDeleteEntry, mUi->actionAddFolder, mUi->actionDeleteFolder,
+		mUi->actionAddAttachment, mUi->actionSaveAttachment
 	};
 	for (QWidget *w : widgetList) {
 		w->setEnabled(enabled);
@@ -423,6 +572,78 @@ void XKeyApplication::setEnabled (bool enabled) {
 	}
 }
 
+void XKeyApplication::closeJournal () {
+	if (mJournal) {
+		if (mRoot)
+			mRoot->removeObserver (&*mJournal);
+		mJournal.reset();
+	}
+}
+
+void XKeyApplication::closeSerializationCache () {
+	if (mSerializationCache) {
+		if (mRoot)
+			mRoot->removeObserver (&*mSerializationCache);
+		mSerializationCache.reset();
+	}
+}
+
+void XKeyApplication::recordRevision (const std::string &keystoreFile, const std::string &passphrase, const SaveFileOptions &sopt) {
+	if (!sopt.use_encryption || (!sopt.use_revisions && !XKey::RevisionStore::exists (keystoreFile)))
+		return;
+	try {
+		if (!mRevisions || mRevisions->directory() != XKey::RevisionStore::directoryName (keystoreFile)) {
+			mRevisions.reset (new XKey::RevisionStore (keystoreFile));
+			mRevisions->open (passphrase, sopt.key_iteration_count);
+		} else if (!mRevisions->matchesPassphrase (passphrase)) {
+			// The history follows the passphrase of the keystore
+			mRevisions->changePassphrase (passphrase, sopt.key_iteration_count);
+		}
+		if (!mSerializationCache) {
+			mSerializationCache.reset (new XKey::SerializationCache);
+			mRoot->addObserver (&*mSerializationCache);
+		}
+		mRevisions->record (*mRoot, &*mSerializationCache);
+	} catch (const std::exception &e) {
+		mRevisions.reset();
+		QMessageBox::warning (&*mMain, tr("Recording the revision failed"),
+			tr("The keystore was saved, but its revision history could not be updated:\n%1").arg(e.what()));
+	}
+}
+
+void XKeyApplication::openSearchIndex () {
+	if (!mSearchIndex) {
+		// Index the keystore on the first search
+		mSearchIndex.reset (new XKey::SearchIndex (*mRoot));
+		mRoot->addObserver (&*mSearchIndex);
+		mUrlIndex.reset (new XKey::UrlIndex (*mRoot));
+		mRoot->addObserver (&*mUrlIndex);
+		mSubtreeFilter.reset (new XKey::SubtreeFilter (*mRoot));
+		mRoot->addObserver (&*mSubtreeFilter);
+	}
+}
+
+void XKeyApplication::closeSearchIndex () {
+	if (mSearchIndex) {
+		if (mRoot)
+			mRoot->removeObserver (&*mSearchIndex);
+		mSearchIndex.reset();
+	}
+	if (mUrlIndex) {
+		if (mRoot)
+			mRoot->removeObserver (&*mUrlIndex);
+		mUrlIndex.reset();
+	}
+	if (mSubtreeFilter) {
+		if (mRoot)
+			mRoot->removeObserver (&*mSubtreeFilter);
+		mSubtreeFilter.reset();
+	}
+	mSearchSession.reset();
+	lastSearchString = "";
+	lastSearchResults.clear();
+}
+
 void XKeyApplication::addEntryClicked () {
 	if (!this->mKeys->folder() || this->mKeys->folder() == &*mRoot)
 		return;
@@ -465,6 +686,62 @@ void XKeyApplication::showSettingsDialog () {
 	diag.exec();
 }
 
+void XKeyApplication::addAttachmentClicked () {
+	QModelIndexList indexes = mUi->keyTable->selectionModel()->selectedRows();
+	if (indexes.size() != 1)
+		return;
+	if (currentFileName.isEmpty()) {
+		// Attachments are stored next to the keystore file
+		QMessageBox::information (&*mMain, tr("Add Attachment"), tr("Please save the keystore before adding attachments."));
+		return;
+	}
+	const QString fileName = QFileDialog::getOpenFileName (&*mMain, tr("Add Attachment"));
+	if (fileName.isEmpty())
+		return;
+	const int row = indexes.at(0).row();
+	try {
+		XKey::Entry entry = mKeys->folder()->entries().at(row);
+		entry.addAttachment (XKey::AttachmentStore (currentFileName.toStdString()).addFile (fileName.toStdString()));
+		mKeys->setEntry (row, std::move(entry));
+		madeChanges = true;
+		mUi->statusbar->showMessage(tr("Attached %1").arg(fileName), statusBarMessageTimeout);
+	} catch (const std::exception &e) {
+		QMessageBox::critical (&*mMain, tr("Adding attachment failed"), QString::fromStdString (e.what()));
+	}
+}
+
+void XKeyApplication::saveAttachmentClicked () {
+	QModelIndexList indexes = mUi->keyTable->selectionModel()->selectedRows();
+	if (indexes.size() != 1)
+		return;
+	const std::vector<XKey::Attachment> &attachments = mKeys->folder()->entries().at(indexes.at(0).row()).attachments();
+	if (attachments.empty()) {
+		mUi->statusbar->showMessage(tr("The selected entry has no attachments."), statusBarMessageTimeout);
+		return;
+	}
+	size_t index = 0;
+	if (attachments.size() > 1) {
+		QStringList names;
+		for (const XKey::Attachment &a : attachments)
+			names << QString::fromStdString (a.name);
+		bool ok = false;
+		const QString name = QInputDialog::getItem (&*mMain, tr("Save Attachment"), tr("Attachment:"), names, 0, false, &ok);
+		if (!ok)
+			return;
+		index = names.indexOf (name);
+	}
+	const XKey::Attachment &attachment = attachments[index];
+	const QString fileName = QFileDialog::getSaveFileName (&*mMain, tr("Save Attachment"), QString::fromStdString (attachment.name));
+	if (fileName.isEmpty())
+		return;
+	try {
+		XKey::AttachmentStore (currentFileName.toStdString()).extractFile (attachment, fileName.toStdString());
+		mUi->statusbar->showMessage(tr("Saved attachment to %1").arg(fileName), statusBarMessageTimeout);
+	} catch (const std::exception &e) {
+		QMessageBox::critical (&*mMain, tr("Saving attachment failed"), QString::fromStdString (e.what()));
+	}
+}
+
 void XKeyApplication::copyPassphraseToClipboard() {
 	QModelIndexList indexes = mUi->keyTable->selectionModel()->selectedRows();
 	if (mKeys && indexes.size() == 1) {
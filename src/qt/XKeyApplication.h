@@ -4,6 +4,7 @@
 #include <XKeyGenerator.h>
 #include "FileDialog.h"
 #include <memory>
+#include <vector>
 
 class QMenu;
 class QSettings;
@@ -14,6 +15,15 @@ class QItemSelection;
 
 class KeyListModel;
 class FolderListModel;
+namespace XKey {
+class Journal;
+class RevisionStore;
+class SearchIndex;
+class SearchSession;
+class SerializationCache;
+class SubtreeFilter;
+class UrlIndex;
+}
 namespace Ui {
 class MainWindow;
 }
@@ -47,6 +57,7 @@ public slots:
 	void editKey (const QModelIndex & index);
 	
 	void startSearch ();
+	void liveSearch (const QString &text);
 	void showSettingsDialog ();
 	void copyPassphraseToClipboard ();
 	
@@ -58,6 +69,8 @@ public slots:
 	void addEntryClicked ();
 	void editEntryClicked ();
 	void deleteEntryClicked ();
+	void addAttachmentClicked ();
+	void saveAttachmentClicked ();
 
 	void aboutDialogClicked ();
 	
@@ -76,10 +89,29 @@ private:
 	SaveFileOptions mSaveOptions;
 	QMenu *mRecentFiles;
 	// Search
+	std::unique_ptr<XKey::SearchIndex> mSearchIndex;
 	QString lastSearchString;
-	XKey::SearchResult lastSearchResult;
+	std::vector<XKey::SearchResult> lastSearchResults;
+	size_t nextSearchResult;
+	uint64_t lastSearchGeneration;
+	std::unique_ptr<XKey::SearchSession> mSearchSession;
+	uint64_t sessionGeneration;
+	std::unique_ptr<XKey::UrlIndex> mUrlIndex;
+	std::unique_ptr<XKey::SubtreeFilter> mSubtreeFilter;
+	// Incremental saves
+	std::unique_ptr<XKey::Journal> mJournal;
+	/// Serialized entries of the folders that did not change since the last full save
+	std::unique_ptr<XKey::SerializationCache> mSerializationCache;
+	/// Revision history of the keystore file, opened by the first save that records a revision
+	std::unique_ptr<XKey::RevisionStore> mRevisions;
 	
 	void setEnabled (bool enabled);
+	void closeJournal ();
+	void closeSerializationCache ();
+	/// Record the saved keystore in its revision history, if enabled
+	void recordRevision (const std::string &keystoreFile, const std::string &passphrase, const SaveFileOptions &sopt);
+	void openSearchIndex ();
+	void closeSearchIndex ();
 	void loadRecentFileList ();
 	
 	/// @return true if the current database shall be closed, false if it shall remain opened
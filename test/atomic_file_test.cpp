@@ -0,0 +1,156 @@
+#include "XKey.h"
+#include "CryptStream.h"
+#include "XKeyAtomicFile.h"
+#include "XKeyJsonSerialization.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace XKey;
+
+static const std::string key = "ABC";
+static const int iterations = 1000;
+
+static std::string file_content (const std::string &path) {
+	std::ifstream in (path, std::ios::binary);
+	return std::string ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+/// @return true if a temporary file of @p path was left behind
+static bool leftovers (const std::string &path) {
+	const size_t slash = path.rfind ('/');
+	const std::string dir = (slash == std::string::npos) ? "." : path.substr (0, slash + 1);
+	const std::string prefix = path.substr (slash + 1) + ".tmp.";
+	bool found = false;
+	if (DIR *d = opendir (dir.c_str())) {
+		while (struct dirent *e = readdir (d))
+			found |= std::string (e->d_name).compare (0, prefix.size(), prefix) == 0;
+		closedir (d);
+	}
+	return found;
+}
+
+static mode_t mode_of (const std::string &path) {
+	struct stat st;
+	return (stat (path.c_str(), &st) == 0) ? (st.st_mode & 07777) : 0;
+}
+
+static RootFolder_Ptr keystore (int entries) {
+	std::mt19937 rnd (42);
+	auto w = [&rnd] () { return "word" + std::to_string(rnd() % 1000); };
+	RootFolder_Ptr root = createRootFolder();
+	for (int i = 0; i < 4; ++i) {
+		Folder *f = root->createSubfolder ("Folder " + std::to_string(i));
+		for (int j = 0; j < entries; ++j)
+			f->addEntry (Entry {w(), w(), "https://" + w() + ".example.org", w(), w() + "@example.org", ""});
+	}
+	return root;
+}
+
+/// Save @p root the way the application does
+static void save (const std::string &path, const Folder &root, int flags) {
+	AtomicFile file (path, flags);
+	CryptStream crypt (file.fd(), CryptStream::WRITE);
+	crypt.setEncryptionKey (key, nullptr, nullptr, nullptr, iterations);
+	std::ostream out (&crypt);
+	Writer w;
+	if (!w.write (out, root))
+		throw std::runtime_error (w.error());
+	crypt.finish();
+	file.commit();
+}
+
+static int check_semantics (const std::string &path) {
+	// A file that happens to have the name of a temporary file is left alone
+	AtomicFile::write (path + ".tmp", "unrelated", AtomicFile::NAMED_TEMPORARY);
+	for (int flags : {AtomicFile::NONE, AtomicFile::NAMED_TEMPORARY}) {
+		unlink (path.c_str());
+		AtomicFile::write (path, "first", flags);
+		if (file_content (path) != "first" || mode_of (path) != 0600) {
+			std::cerr << "New file has wrong content or mode " << std::oct << mode_of (path) << "\n";
+			return 1;
+		}
+		// The mode of the replaced file is kept
+		chmod (path.c_str(), 0640);
+		AtomicFile::write (path, "second", flags);
+		if (file_content (path) != "second" || mode_of (path) != 0640 || leftovers (path)) {
+			std::cerr << "Replacing the file failed\n";
+			return 1;
+		}
+		// Discarded without commit
+		{
+			AtomicFile file (path, flags);
+			if (::write (file.fd(), "third", 5) != 5)
+				return 1;
+			if ((flags & AtomicFile::NAMED_TEMPORARY) && file.isUnnamed())
+				return 1;
+		}
+		if (file_content (path) != "second" || leftovers (path)) {
+			std::cerr << "Discarded content replaced the file\n";
+			return 1;
+		}
+	}
+	if (file_content (path + ".tmp") != "unrelated") {
+		std::cerr << "A file named like a temporary file was replaced\n";
+		return 1;
+	}
+	unlink ((path + ".tmp").c_str());
+	// A keystore written through a CryptStream on the descriptor
+	RootFolder_Ptr root = keystore (10);
+	save (path, *root, AtomicFile::NONE);
+	CryptStream crypt (path, CryptStream::READ);
+	crypt.setEncryptionKey (key, nullptr, nullptr, nullptr, iterations);
+	std::istream in (&crypt);
+	RootFolder_Ptr read = createRootFolder();
+	std::ostringstream a, b;
+	Writer().write (a, *root);
+	if (!Parser().read (in, read.get()) || !Writer().write (b, *read) || a.str() != b.str()) {
+		std::cerr << "Saved keystore differs\n";
+		return 1;
+	}
+	return 0;
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: AtomicFileTest keystore_file [entries per folder] [saves]\n";
+		return -1;
+	}
+	const std::string path (argv[1]);
+	const int entriesPerFolder = (argc > 2) ? atoi(argv[2]) : 500;
+	const int saves = (argc > 3) ? atoi(argv[3]) : 20;
+	XKey::CryptStream::InitCrypto();
+	if (check_semantics (path))
+		return 1;
+	{
+		AtomicFile probe (path);
+		if (!probe.isUnnamed())
+			std::cout << "Unnamed temporary files are not supported here\n";
+	}
+
+	// Cost of durability: the same saves with and without flushing, through an unnamed and a named file
+	RootFolder_Ptr root = keystore (entriesPerFolder);
+	auto ms = [] (std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0; };
+	const struct { const char *name; int flags; } variants[] = {
+		{"rename, no sync", AtomicFile::NAMED_TEMPORARY | AtomicFile::NO_SYNC},
+		{"rename, fdatasync + directory fsync", AtomicFile::NAMED_TEMPORARY},
+		{"O_TMPFILE + linkat, no sync", AtomicFile::NO_SYNC},
+		{"O_TMPFILE + linkat, fdatasync + directory fsync", AtomicFile::NONE},
+	};
+	for (const auto &v : variants) {
+		auto t0 = std::chrono::steady_clock::now();
+		for (int i = 0; i < saves; ++i)
+			save (path, *root, v.flags);
+		auto t1 = std::chrono::steady_clock::now();
+		std::cout << v.name << ": " << ms(t1 - t0) / saves << " ms per save of " << 4 * entriesPerFolder << " entries\n";
+	}
+	unlink (path.c_str());
+	return 0;
+}
@@ -0,0 +1,82 @@
+#include "XKey.h"
+#include "XKeyAttachments.h"
+#include "XKeyJsonSerialization.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace XKey;
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: AttachmentTest keystore_file\n";
+		return -1;
+	}
+	const std::string filename (argv[1]);
+	AttachmentStore store (filename);
+
+	// Content spanning several chunks
+	std::string content;
+	for (size_t i = 0; i < AttachmentStore::ChunkSize * 2 + 100; ++i)
+		content.push_back ((char)(i * 7));
+	std::istringstream in (content);
+	const Attachment a = store.add ("cert.pem", in);
+	std::istringstream emptyIn;
+	const Attachment empty = store.add ("empty", emptyIn);
+
+	RootFolder_Ptr root = createRootFolder();
+	Entry entry {"Title", "User", "Url", "Pwd", "E-Mail", "Comment"};
+	entry.addAttachment (a);
+	entry.addAttachment (empty);
+	root->createSubfolder("A")->addEntry (entry);
+
+	// Only the reference is serialized
+	std::ostringstream json;
+	Writer w;
+	w.write (json, *root);
+	std::istringstream jsonIn (json.str());
+	RootFolder_Ptr copy = createRootFolder();
+	Parser p;
+	if (!p.read (jsonIn, &*copy) || json.str().size() > 1000) {
+		std::cerr << "Failed to serialize attachment reference\n";
+		return 1;
+	}
+	const Attachment &b = copy->subfolders()[0].entries()[0].attachments()[0];
+	std::ostringstream out;
+	store.read (b, out);
+	if (out.str() != content || b.size != content.size()) {
+		std::cerr << "Attachment content differs\n";
+		return 1;
+	}
+	std::ostringstream emptyOut;
+	store.read (copy->subfolders()[0].entries()[0].attachments()[1], emptyOut);
+
+	// Tampering with the blob is detected
+	{
+		std::fstream blob (store.directory() + "/" + a.id, std::ios::in | std::ios::out | std::ios::binary);
+		blob.seekp (100);
+		blob.put ('X');
+	}
+	bool detected = false;
+	try {
+		std::ostringstream tampered;
+		store.read (a, tampered);
+	} catch (const std::exception &e) {
+		detected = true;
+	}
+	if (!detected || !emptyOut.str().empty()) {
+		std::cerr << "Tampered attachment was not detected\n";
+		return 1;
+	}
+
+	// Unreferenced blobs are removed
+	root->subfolders()[0].getEntryAt(0).setAttachments (std::vector<Attachment>{empty});
+	const size_t removed = store.collectGarbage (*root);
+	if (removed != 1 || store.contains(a) || !store.contains(empty)) {
+		std::cerr << "Garbage collection failed\n";
+		return 1;
+	}
+	store.remove (empty);
+	std::cout << "Attachments OK\n";
+	return 0;
+}
@@ -0,0 +1,115 @@
+#include "XKey.h"
+#include "XKeyHandle.h"
+#include "XKeyBatch.h"
+#include "XKeyJsonSerialization.h"
+#include <iostream>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace XKey;
+
+static size_t count_entries (const Folder &f) {
+	size_t n = f.entries().size();
+	for (const Folder &s : f.subfolders())
+		n += count_entries(s);
+	return n;
+}
+
+static std::string dump (const Folder &root) {
+	std::ostringstream out;
+	Writer().write (out, root);
+	return out.str();
+}
+
+/// Write number @p i: adds exactly one entry and changes some folders along the way
+static void modify (Folder *r, int i) {
+	Entry e {"Entry " + std::to_string(i), "", "", "", "", ""};
+	Folder *shared = r->getSubfolder ("Shared");
+	Folder *last = &r->subfolders().back();
+	switch (i % 5) {
+	case 0:
+		r->createSubfolder ("Sub " + std::to_string(i))->addEntry (std::move(e));
+		break;
+	case 1: {
+		Folder *nested = (shared->subfolders().size() < 3) ? shared->createSubfolder ("Nested " + std::to_string(i))
+			: &shared->subfolders().front();
+		nested->addEntry (std::move(e));
+		break;
+	}
+	case 2:
+		if (last != shared)
+			last->setName ("Renamed " + std::to_string(i));
+		last->addEntry (std::move(e));
+		break;
+	case 3: {
+		// Replace an entry and move a nested folder to another top-level folder in one batch
+		Batch batch (r);
+		const int n = shared->entries().size();
+		batch.addEntry (shared, std::move(e));
+		if (n > 1) {
+			const Entry &old = shared->entries()[n - 1];
+			batch.setEntry (shared, n - 1, Entry {old.title() + " changed", "", "", "", "", ""});
+		}
+		if (!shared->subfolders().empty() && last != shared)
+			batch.moveFolder (&shared->subfolders().front(), last);
+		batch.commit();
+		break;
+	}
+	default: {
+		Batch batch (r);
+		if (shared->entries().size() > 1 && last != shared)
+			batch.moveEntry (shared, shared->entries().size() - 1, last);
+		batch.addEntry (shared, std::move(e));
+		batch.commit();
+	}
+	}
+}
+
+int main (int argc, char** argv) {
+	const int numReaders = (argc > 1) ? atoi(argv[1]) : 4;
+	const int numWrites = 200;
+
+	RootFolder_Ptr root = createRootFolder();
+	Folder *f = root->createSubfolder ("Shared");
+	f->addEntry (Entry{"Initial", "User", "Url", "Pwd", "E-Mail", "Comment"});
+	KeystoreHandle handle (std::move(root));
+
+	std::atomic<bool> done (false);
+	std::atomic<int> errors (0);
+	std::vector<std::thread> readers;
+	for (int r = 0; r < numReaders; ++r) {
+		readers.emplace_back ([&handle, &done, &errors] () {
+			uint64_t lastVersion = 0;
+			while (!done.load()) {
+				KeystoreHandle::ReadLock lock = handle.read();
+				// Version n contains exactly n entries
+				if (count_entries(lock.root()) != lock.version() || lock.version() < lastVersion)
+					++errors;
+				lastVersion = lock.version();
+				if (!startSearch ("initial", &lock.root()).hasMatch())
+					++errors;
+			}
+		});
+	}
+	// The same writes applied to a tree of our own, to compare with the published versions
+	RootFolder_Ptr reference = createRootFolder();
+	reference->createSubfolder ("Shared")->addEntry (Entry{"Initial", "User", "Url", "Pwd", "E-Mail", "Comment"});
+	for (int i = 0; i < numWrites; ++i) {
+		handle.write ([i] (Folder *r) { modify (r, i); });
+		modify (reference.get(), i);
+		if (dump (handle.read().root()) != dump (*reference)) {
+			std::cerr << "Version " << handle.version() << " differs from the reference\n";
+			++errors;
+		}
+	}
+	done = true;
+	for (std::thread &t : readers)
+		t.join();
+
+	const size_t pending = handle.collect();
+	std::cout << "Versions: " << handle.version() << ", pending: " << pending
+		<< ", errors: " << errors.load() << "\n";
+	return (errors.load() == 0 && pending == 0) ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+#include "XKey.h"
+#include "XKeyExchange.h"
+#include "XKeySearchIndex.h"
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <random>
+
+using namespace XKey;
+
+/// Field values that need quoting or escaping in some format
+static const char *words[] = {"mail", "a,b", "say \"hi\"", " padded ", "two\nlines", "<tag> & more", "Grüße", "tab\there", "ssh", ""};
+
+static Entry random_entry (std::mt19937 &rnd) {
+	auto w = [&rnd] () { return std::string(words[rnd() % 10]) + std::to_string(rnd() % 100); };
+	return Entry {w(), w(), "https://" + w() + ".example.org", w(), (rnd() % 2) ? w() + "@example.org" : "", (rnd() % 4 == 0) ? w() : ""};
+}
+
+/// Entries are only added below the root, which does not keep entries in a keystore
+static void fill (Folder *f, std::mt19937 &rnd, int depth, int entries) {
+	for (int i = 0; f->parent() && i < entries; ++i)
+		f->addEntry (random_entry(rnd));
+	if (depth > 0) {
+		for (int i = 0; i < 3; ++i)
+			fill (f->createSubfolder ("Folder, " + std::to_string(depth) + "-" + std::to_string(i)), rnd, depth - 1, entries);
+	}
+}
+
+static bool same_tree (const Folder &a, const Folder &b) {
+	if (a.name() != b.name() || a.entries().size() != b.entries().size() || a.subfolders().size() != b.subfolders().size())
+		return false;
+	for (size_t i = 0; i < a.entries().size(); ++i) {
+		const Entry &x = a.entries()[i], &y = b.entries()[i];
+		if (x.title() != y.title() || x.username() != y.username() || x.url() != y.url() || x.password() != y.password() ||
+		    x.email() != y.email() || x.comment() != y.comment())
+			return false;
+	}
+	for (size_t i = 0; i < a.subfolders().size(); ++i) {
+		if (!same_tree (a.subfolders()[i], b.subfolders()[i]))
+			return false;
+	}
+	return true;
+}
+
+static size_t import_text (const std::string &text, ExchangeFormat format, Folder *target) {
+	std::istringstream in (text);
+	return importEntries (in, format, target);
+}
+
+/// @return The message of the exception thrown by importing @p text, or an empty string
+static std::string import_error (const std::string &text, ExchangeFormat format, Folder *target) {
+	try {
+		import_text (text, format, target);
+	} catch (const std::runtime_error &e) {
+		return e.what();
+	}
+	return std::string();
+}
+
+static int check_round_trips (const Folder &root) {
+	for (const char *name : {"csv", "ndjson", "keepass"}) {
+		const ExchangeFormat format = exchangeFormatFromName (name);
+		std::ostringstream out;
+		const size_t exported = exportEntries (out, format, root);
+		RootFolder_Ptr copy = createRootFolder();
+		const size_t imported = import_text (out.str(), format, copy.get());
+		if (exported != imported || !same_tree (root, *copy)) {
+			std::cerr << name << ": round trip differs (" << exported << " exported, " << imported << " imported)\n";
+			return 1;
+		}
+	}
+	// Fields are exported completely, even with an embedded NUL character
+	RootFolder_Ptr nul = createRootFolder();
+	nul->addEntry (Entry {"title", "", "", "", "", std::string ("before\0after", 12)});
+	std::ostringstream out;
+	exportEntries (out, ExchangeFormat::NDJSON, *nul);
+	RootFolder_Ptr back = createRootFolder();
+	if (out.str().find ("\"comment\":\"before\\u0000after\"") == std::string::npos ||
+	    import_text (out.str(), ExchangeFormat::NDJSON, back.get()) != 1 ||
+	    back->getSubfolder ("Imported")->entries()[0].comment() != nul->entries()[0].comment())
+	{
+		std::cerr << "ndjson: field with a NUL character was truncated: " << out.str();
+		return 1;
+	}
+	return 0;
+}
+
+static int check_foreign_files () {
+	RootFolder_Ptr root = createRootFolder();
+	// Column names of another password manager, with a byte order mark, CRLF and an unknown column
+	const std::string csv = "\xef\xbb\xbf" "folder,favorite,type,name,notes,fields,login_uri,login_username,login_password\r\n"
+		"Work,1,login,Mail,\"first\r\nsecond\",,https://mail.example.org,jane,\"se\"\"cret\"\r\n"
+		"\r\n"
+		",,login,Bank,,,https://bank.example.org,j.doe,1234\r\n";
+	if (import_text (csv, ExchangeFormat::CSV, root.get()) != 2) {
+		std::cerr << "CSV: wrong number of entries\n";
+		return 1;
+	}
+	const Folder *work = root->getSubfolder ("Work"), *imported = root->getSubfolder ("Imported");
+	if (!work || work->entries().size() != 1 || work->entries()[0].password() != "se\"cret" ||
+	    work->entries()[0].comment() != "first\r\nsecond" || work->entries()[0].username() != "jane" ||
+	    !imported || imported->entries().size() != 1 || imported->entries()[0].url() != "https://bank.example.org") {
+		std::cerr << "CSV: columns not mapped\n";
+		return 1;
+	}
+
+	// Entries of the top-level group, custom fields, history, metadata and empty groups
+	const std::string xml = "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\n"
+		"<!-- exported --><KeePassFile><Meta><Generator>KeePass</Generator><DatabaseName>Home</DatabaseName></Meta>"
+		"<Root><Group><UUID>AAAA</UUID><Name>Home</Name><IsExpanded>True</IsExpanded>"
+		"<Entry><String><Key>Title</Key><Value>Top</Value></String><String><Key>Password</Key><Value/></String></Entry>"
+		"<Group><Name>Mail &amp; Web</Name>"
+		"<Entry><UUID>BBBB</UUID><Times><LastModificationTime>2020-01-01</LastModificationTime></Times>"
+		"<String><Key>Notes</Key><Value>note</Value></String>"
+		"<String><Key>PIN</Key><Value>12&#51;&#x34;</Value></String>"
+		"<String><Key>Title</Key><Value><![CDATA[<webmail>]]></Value></String>"
+		"<String><Key>E-Mail</Key><Value>a@b.c</Value></String>"
+		"<AutoType><Enabled>True</Enabled></AutoType>"
+		"<History><Entry><String><Key>Title</Key><Value>old</Value></String></Entry></History></Entry>"
+		"<Group><Name>Empty</Name></Group></Group></Group>"
+		"<DeletedObjects><DeletedObject><UUID>CCCC</UUID></DeletedObject></DeletedObjects></Root></KeePassFile>\n";
+	RootFolder_Ptr kp = createRootFolder();
+	if (import_text (xml, ExchangeFormat::KEEPASS_XML, kp.get()) != 2) {
+		std::cerr << "KeePass: wrong number of entries\n";
+		return 1;
+	}
+	const Folder *mail = kp->getSubfolder ("Mail & Web"), *top = kp->getSubfolder ("Imported");
+	if (!mail || mail->entries().size() != 1 || mail->entries()[0].title() != "<webmail>" ||
+	    mail->entries()[0].comment() != "note\nPIN: 1234" || mail->entries()[0].email() != "a@b.c" ||
+	    !mail->getSubfolder ("Empty") || !top || top->entries().size() != 1 || top->entries()[0].title() != "Top") {
+		std::cerr << "KeePass: groups or fields not mapped\n";
+		return 1;
+	}
+	return 0;
+}
+
+static int check_errors () {
+	RootFolder_Ptr root = createRootFolder();
+	const std::string ndjson = "{\"path\":\"/A\",\"title\":\"one\"}\n{\"title\":\"two\"}\n{\"title\":3}\n";
+	std::string error = import_error (ndjson, ExchangeFormat::NDJSON, root.get());
+	if (error.find ("line 3") == std::string::npos || root->getSubfolder("A")->entries().size() != 1 ||
+	    root->getSubfolder("Imported")->entries().size() != 1) {
+		std::cerr << "NDJSON: invalid record not reported (" << error << ")\n";
+		return 1;
+	}
+	error = import_error ("title,password\nx,y\n\"open,z\n", ExchangeFormat::CSV, root.get());
+	if (error.find ("line 4") == std::string::npos) {
+		std::cerr << "CSV: unterminated field not reported (" << error << ")\n";
+		return 1;
+	}
+	if (import_error ("color,size\n1,2\n", ExchangeFormat::CSV, root.get()).empty()) {
+		std::cerr << "CSV: header without entry fields accepted\n";
+		return 1;
+	}
+	error = import_error ("<KeePassFile><Root><Group><Name>x</Name><Entry>\n"
+		"<String><Key>Password</Key><Value Protected=\"True\">AbCd</Value></String></Entry></Group></Root></KeePassFile>",
+		ExchangeFormat::KEEPASS_XML, root.get());
+	if (error.find ("line 2") == std::string::npos) {
+		std::cerr << "KeePass: protected value not reported (" << error << ")\n";
+		return 1;
+	}
+	try {
+		exchangeFormatFromName ("keys.txt");
+		std::cerr << "Unknown format accepted\n";
+		return 1;
+	} catch (const std::invalid_argument &) { }
+	return 0;
+}
+
+int main (int argc, char** argv) {
+	const int entriesPerFolder = (argc > 1) ? atoi(argv[1]) : 5000;
+	std::mt19937 rnd (42);
+	RootFolder_Ptr root = createRootFolder();
+	fill (root.get(), rnd, 2, 3);
+	if (check_round_trips (*root) || check_foreign_files() || check_errors())
+		return 1;
+
+	// Bulk import into a hierarchy that is observed and already has entries
+	RootFolder_Ptr big = createRootFolder();
+	fill (big.get(), rnd, 2, entriesPerFolder / 10);
+	RootFolder_Ptr source = createRootFolder();
+	fill (source.get(), rnd, 2, entriesPerFolder);
+	SearchIndex index (*big);
+	big->addObserver (&index);
+	const ExchangeFormat formats[] = {ExchangeFormat::CSV, ExchangeFormat::NDJSON, ExchangeFormat::KEEPASS_XML};
+	for (ExchangeFormat format : formats) {
+		auto t0 = std::chrono::steady_clock::now();
+		std::ostringstream out;
+		const size_t exported = exportEntries (out, format, *source);
+		auto t1 = std::chrono::steady_clock::now();
+		const size_t imported = import_text (out.str(), format, big.get());
+		auto t2 = std::chrono::steady_clock::now();
+		std::cout << exported << " entries (" << out.str().size() / 1024 << " KiB). Export: "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms, import: "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count() << " ms\n";
+		if (imported != exported)
+			return 1;
+	}
+	const bool indexed = index.find ("ssh1").size() == findAll (SearchQuery("ssh1"), big.get()).size();
+	big->removeObserver (&index);
+	if (!indexed) {
+		std::cerr << "Search index out of date after importing\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+#include "XKey.h"
+#include "CryptStream.h"
+#include "XKeyJournal.h"
+#include "XKeyBatch.h"
+#include "XKeyJsonSerialization.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace XKey;
+
+static std::string dump (const Folder &root) {
+	std::ostringstream out;
+	Writer w;
+	w.write (out, root);
+	return out.str();
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: JournalTest keystore_file\n";
+		return -1;
+	}
+	const std::string filename (argv[1]), key = "ABC";
+	const int iterations = 1000;
+	XKey::CryptStream::InitCrypto();
+
+	RootFolder_Ptr root = createRootFolder();
+	Folder *a = root->createSubfolder ("A");
+	root->createSubfolder ("B");
+	a->addEntry (Entry{"Title1", "User", "Url", "Pwd", "E-Mail", "Comment"});
+	std::string baseId;
+	{
+		CryptStream crypt (filename, CryptStream::WRITE);
+		crypt.setEncryptionKey (key, nullptr, nullptr, nullptr, iterations);
+		std::ostream stream (&crypt);
+		Writer w;
+		if (!w.write (stream, *root))
+			return 1;
+		baseId = crypt.iv();
+	}
+
+	// Record some changes and append them to the journal
+	Journal journal (filename);
+	journal.reset (key, baseId, iterations);
+	root->addObserver (&journal);
+	a->addEntry (Entry{"Title2", "User2", "Url2", "Pwd2", "", ""});
+	a->setEntryAt (0, Entry{"Title1b", "User", "Url", "Pwd", "E-Mail", "Comment"});
+	journal.commit();
+	Folder *c = root->getSubfolder("B")->createSubfolder ("C");
+	c->addEntry (Entry{"Title3", "", "", "", "", ""});
+	moveFolder (root->getSubfolder("A"), c, 0);
+	root->getSubfolder("B")->setName ("B2");
+	journal.commit();
+	root->getSubfolder("B2")->getSubfolder("C")->getSubfolder("A")->removeEntry (1);
+	journal.commit();
+	{
+		// Batched changes are journalled like individual ones
+		Folder *c = root->getSubfolder("B2")->getSubfolder("C");
+		Batch batch (root.get());
+		batch.addEntry (c, Entry{"Title4", "", "", "", "", ""});
+		batch.setEntry (c, 0, Entry{"Title3b", "", "", "", "", ""});
+		batch.moveEntry (c->getSubfolder("A"), 0, c);
+		batch.moveFolder (c->getSubfolder("A"), root.get());
+		batch.commit();
+		journal.commit();
+		// An invalid batch is not applied at all
+		const std::string before = dump (*root);
+		batch.addEntry (c, Entry{"Title5", "", "", "", "", ""});
+		batch.removeEntry (c, 42);
+		bool failed = false;
+		try {
+			batch.commit();
+		} catch (const std::invalid_argument &) {
+			failed = true;
+		}
+		if (!failed || dump(*root) != before || journal.hasPendingChanges()) {
+			std::cerr << "Invalid batch was applied\n";
+			return 1;
+		}
+		batch.rollback();
+	}
+	root->removeObserver (&journal);
+	std::cout << "Journal size: " << journal.size() << "\n";
+
+	// Open base image and replay
+	std::string iv;
+	auto open_base = [&] () {
+		RootFolder_Ptr base = createRootFolder();
+		CryptStream crypt (filename, CryptStream::READ);
+		crypt.setEncryptionKey (key, nullptr, nullptr, nullptr, iterations);
+		std::istream stream (&crypt);
+		Parser p;
+		if (!p.read (stream, base.get()))
+			throw std::runtime_error ("Could not read base image: " + p.error());
+		iv = crypt.iv();
+		return base;
+	};
+	RootFolder_Ptr replayed = open_base();
+	const std::string baseText = dump (*replayed);
+	Journal journal2 (filename);
+	const size_t records = journal2.open (key, iv, replayed.get());
+	std::cout << "Replayed " << records << " records\n";
+	if (records != 4 || dump(*root) != dump(*replayed)) {
+		std::cerr << "Mismatch:\n" << dump(*root) << "\n" << dump(*replayed) << "\n";
+		return 1;
+	}
+
+	// Opened read-only, the interrupted record at the end is left in place
+	const std::string journalFile = Journal::fileName (filename);
+	{
+		std::ofstream out (journalFile, std::ios::binary | std::ios::app);
+		out.write ("\x40\0\0\0abc", 7);
+	}
+	const size_t size = journal2.size() + 7;
+	replayed = open_base();
+	if (Journal (filename).open (key, iv, replayed.get(), Journal::READ_ONLY) != 4 || dump(*root) != dump(*replayed)
+	    || std::ifstream (journalFile, std::ios::binary | std::ios::ate).tellg() != (std::streamoff)size) {
+		std::cerr << "Read-only replay failed or modified the journal\n";
+		return 1;
+	}
+
+	// A corrupt record leaves the hierarchy as it was, without the records before it
+	{
+		std::fstream f (journalFile, std::ios::binary | std::ios::in | std::ios::out);
+		f.seekp (journal2.size() - 1);
+		f.put ('#');
+	}
+	replayed = open_base();
+	try {
+		Journal (filename).open (key, iv, replayed.get(), Journal::READ_ONLY);
+		std::cerr << "Corrupt journal record was accepted\n";
+		return 1;
+	} catch (const std::runtime_error &) { }
+	if (dump(*replayed) != baseText) {
+		std::cerr << "Corrupt journal was partially replayed\n";
+		return 1;
+	}
+	return 0;
+}
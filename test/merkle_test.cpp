@@ -0,0 +1,173 @@
+#include "XKey.h"
+#include "XKeyBatch.h"
+#include "XKeyMerkle.h"
+#include <functional>
+#include <iostream>
+#include <chrono>
+#include <random>
+
+using namespace XKey;
+
+static Entry random_entry (std::mt19937 &rnd) {
+	auto w = [&rnd] () { return "word" + std::to_string(rnd() % 1000); };
+	return Entry {w(), w(), "https://" + w() + ".example.org", w(), w() + "@example.org", ""};
+}
+
+static void fill (Folder *f, std::mt19937 &rnd, int depth, int entries) {
+	for (int i = 0; i < entries; ++i)
+		f->addEntry (random_entry(rnd));
+	if (depth > 0) {
+		for (int i = 0; i < 4; ++i)
+			fill (f->createSubfolder ("Folder " + std::to_string(i)), rnd, depth - 1, entries);
+	}
+}
+
+static int check_incremental (std::mt19937 &rnd) {
+	RootFolder_Ptr root = createRootFolder();
+	fill (root.get(), rnd, 3, 5);
+	MerkleTree tree (*root);
+	root->addObserver (&tree);
+	Folder *a = &root->subfolders()[0], *b = &root->subfolders()[1];
+	const std::vector<std::function<void()>> steps {
+		[&] { a->addEntry (random_entry(rnd)); },
+		[&] { a->setEntryAt (2, random_entry(rnd)); },
+		[&] { a->subfolders()[1].removeEntry (0); },
+		[&] { b->subfolders()[2].setName ("Renamed"); },
+		[&] { b->createSubfolder ("New")->addEntry (random_entry(rnd)); },
+		[&] {
+			a->subfolders()[0].setName ("Moved");
+			moveFolder (&a->subfolders()[0], b, 1);
+		},
+		[&] { root->removeSubfolder (2); },
+		[&] {
+			Batch batch (root.get());
+			batch.addEntry (a, random_entry(rnd));
+			batch.removeEntry (a, 1);
+			batch.setEntry (a, 3, random_entry(rnd));
+			batch.moveEntry (b, 0, &a->subfolders()[0]);
+			batch.addEntry (&b->subfolders()[0], random_entry(rnd));
+			batch.commit();
+		},
+		[&] {
+			// Not reported to observers
+			b->entries().pop_back();
+			tree.invalidate (*b);
+		},
+	};
+	for (size_t i = 0; i < steps.size(); ++i) {
+		const ContentHash before = tree.rootHash();
+		steps[i]();
+		// Query some hashes in between, so not all of them are dirty
+		tree.hash (*b);
+		if (tree.rootHash() == before || tree.rootHash() != MerkleTree(*root).rootHash()) {
+			std::cerr << "Hash not updated after step " << i << "\n";
+			root->removeObserver (&tree);
+			return 1;
+		}
+	}
+	root->removeObserver (&tree);
+	return 0;
+}
+
+static int check_diff (std::mt19937 &rnd) {
+	RootFolder_Ptr a = createRootFolder();
+	fill (a.get(), rnd, 2, 4);
+	RootFolder_Ptr b = cloneFolderTree (*a);
+	b->subfolders()[0].setEntryAt (1, Entry {b->subfolders()[0].entries()[1].title(), "other", "", "", "", ""});
+	b->subfolders()[1].subfolders()[3].addEntry (random_entry(rnd));
+	b->subfolders()[2].removeEntry (0);
+	b->subfolders()[3].removeSubfolder (0);
+	b->createSubfolder ("Added");
+	const MerkleTree ha (*a), hb (*b);
+	const std::vector<TreeDifference> d = diffTrees (*a, ha, *b, hb);
+	const std::vector<TreeDifference::Kind> expected {TreeDifference::ENTRY_CHANGED, TreeDifference::ENTRY_ADDED,
+		TreeDifference::ENTRY_REMOVED, TreeDifference::FOLDER_REMOVED, TreeDifference::FOLDER_ADDED};
+	bool same = (d.size() == expected.size());
+	for (size_t i = 0; same && i < d.size(); ++i)
+		same = (d[i].kind == expected[i]);
+	if (!same || d[1].path != "/Folder 1/Folder 3" || d[3].path != "/Folder 3/Folder 0" || d[0].after->username() != "other") {
+		std::cerr << "Unexpected differences (" << d.size() << ")\n";
+		return 1;
+	}
+	if (!diffTrees (*a, ha, *cloneFolderTree(*a), MerkleTree(*a)).empty()) {
+		std::cerr << "Differences between equal trees\n";
+		return 1;
+	}
+	return 0;
+}
+
+static int check_merge (std::mt19937 &rnd) {
+	RootFolder_Ptr base = createRootFolder();
+	fill (base.get(), rnd, 2, 4);
+	RootFolder_Ptr ours = cloneFolderTree (*base), theirs = cloneFolderTree (*base);
+	auto changed = [] (const Entry &e, const char *password) {
+		return Entry {e.title(), e.username(), e.url(), password, e.email(), e.comment()};
+	};
+	// Non-conflicting changes on both sides
+	ours->subfolders()[0].setEntryAt (0, changed (ours->subfolders()[0].entries()[0], "ours"));
+	theirs->subfolders()[0].setEntryAt (1, changed (theirs->subfolders()[0].entries()[1], "theirs"));
+	theirs->subfolders()[1].subfolders()[0].addEntry (Entry {"added", "", "", "", "", ""});
+	ours->subfolders()[2].removeSubfolder (1);
+	theirs->createSubfolder ("Theirs");
+	// The same change on both sides
+	ours->subfolders()[3].removeEntry (2);
+	theirs->subfolders()[3].removeEntry (2);
+	// Conflicts
+	ours->subfolders()[1].setEntryAt (0, changed (ours->subfolders()[1].entries()[0], "ours"));
+	theirs->subfolders()[1].setEntryAt (0, changed (theirs->subfolders()[1].entries()[0], "theirs"));
+	theirs->subfolders()[2].subfolders()[1].removeEntry (0);
+	ours->subfolders()[3].removeSubfolder (3);
+	theirs->subfolders()[3].subfolders()[3].addEntry (Entry {"kept", "", "", "", "", ""});
+
+	RootFolder_Ptr expected = cloneFolderTree (*ours);
+	expected->subfolders()[0].setEntryAt (1, theirs->subfolders()[0].entries()[1]);
+	expected->subfolders()[1].subfolders()[0].addEntry (Entry {"added", "", "", "", "", ""});
+	expected->createSubfolder ("Theirs");
+	// Folders only in theirs come after the ones of ours
+	Folder *kept = expected->subfolders()[2].createSubfolder ("Folder 1");
+	for (const Entry &e : theirs->subfolders()[2].subfolders()[1].entries())
+		kept->addEntry (e);
+	for (const Folder &f : theirs->subfolders()[2].subfolders()[1].subfolders())
+		kept->createSubfolder (f.name())->entries() = f.entries();
+	Folder *restored = expected->subfolders()[3].createSubfolder ("Folder 3");
+	restored->entries() = theirs->subfolders()[3].subfolders()[3].entries();
+
+	std::vector<MergeConflict> conflicts;
+	RootFolder_Ptr merged = mergeTrees (*base, *ours, *theirs, &conflicts);
+	const MerkleTree hm (*merged), he (*expected);
+	if (hm.rootHash() != he.rootHash() || conflicts.size() != 3) {
+		std::cerr << "Unexpected merge result (" << conflicts.size() << " conflicts, "
+			<< diffTrees (*expected, he, *merged, hm).size() << " differences)\n";
+		for (const MergeConflict &c : conflicts)
+			std::cerr << c.path << ": " << c.title << " (" << c.reason << ")\n";
+		return 1;
+	}
+	return 0;
+}
+
+int main (int argc, char** argv) {
+	const int entriesPerFolder = (argc > 1) ? atoi(argv[1]) : 20;
+	std::mt19937 rnd (42);
+	if (check_incremental (rnd) || check_diff (rnd) || check_merge (rnd))
+		return 1;
+
+	RootFolder_Ptr root = createRootFolder();
+	fill (root.get(), rnd, 5, entriesPerFolder);
+	auto t0 = std::chrono::steady_clock::now();
+	MerkleTree tree (*root);
+	root->addObserver (&tree);
+	auto t1 = std::chrono::steady_clock::now();
+	const int updates = 1000;
+	Folder *leaf = &root->subfolders()[3].subfolders()[2].subfolders()[1].subfolders()[0];
+	for (int i = 0; i < updates; ++i) {
+		leaf->setEntryAt (i % entriesPerFolder, random_entry(rnd));
+		tree.rootHash();
+	}
+	auto t2 = std::chrono::steady_clock::now();
+	const bool same = (tree.rootHash() == MerkleTree(*root).rootHash());
+	root->removeObserver (&tree);
+	std::cout << "Hashing " << entriesPerFolder * 1365 << " entries: "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms, incremental update: "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() / updates << " us\n";
+	return same ? 0 : 1;
+}
@@ -0,0 +1,425 @@
+#include "XKey.h"
+#include "XKeyJsonSerialization.h"
+#include "XKeyBinaryFormat.h"
+#include "XKeyThreadPool.h"
+#include "CryptStream.h"
+#include <json/json.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+using namespace XKey;
+
+static std::string random_text (std::mt19937 &rnd, size_t length) {
+	// Characters that need escaping, multi-byte UTF-8 and plain text
+	static const char *pieces[] = {"a", "Z", "0", " ", "\"", "\\", "/", "\n", "\t", "\x01", "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x94\x91"};
+	std::string out;
+	while (out.size() < length)
+		out += pieces[rnd() % (sizeof(pieces) / sizeof(pieces[0]))];
+	return out;
+}
+
+static void fill (Folder *f, std::mt19937 &rnd, int depth) {
+	for (int i = 0; i < 8; ++i) {
+		Entry e {random_text(rnd, 12), random_text(rnd, 8), random_text(rnd, 30), random_text(rnd, 16),
+		         random_text(rnd, 10), random_text(rnd, (rnd() % 8 == 0) ? 200 : 0)};
+		if (rnd() % 16 == 0)
+			e.addAttachment (Attachment {"id" + std::to_string(rnd()), random_text(rnd, 10), rnd(), std::string(32, (char)rnd())});
+		f->addEntry (e);
+	}
+	if (depth > 0) {
+		for (int i = 0; i < 3; ++i)
+			fill (f->createSubfolder (random_text(rnd, 6) + std::to_string(i)), rnd, depth - 1);
+	}
+}
+
+static bool same_tree (const Folder &a, const Folder &b) {
+	if (a.name() != b.name() || a.entries().size() != b.entries().size() || a.subfolders().size() != b.subfolders().size())
+		return false;
+	for (size_t i = 0; i < a.entries().size(); ++i) {
+		const Entry &x = a.entries()[i], &y = b.entries()[i];
+		if (x.title() != y.title() || x.username() != y.username() || x.url() != y.url() || x.password() != y.password() ||
+		    x.email() != y.email() || x.comment() != y.comment() || x.attachments().size() != y.attachments().size())
+		{
+			return false;
+		}
+		for (size_t j = 0; j < x.attachments().size(); ++j) {
+			const Attachment &p = x.attachments()[j], &q = y.attachments()[j];
+			if (p.id != q.id || p.name != q.name || p.size != q.size || p.key != q.key)
+				return false;
+		}
+	}
+	for (size_t i = 0; i < a.subfolders().size(); ++i) {
+		if (!same_tree (a.subfolders()[i], b.subfolders()[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool read (const std::string &text, RootFolder_Ptr *root, int flags, std::string *error = nullptr) {
+	std::istringstream in (text);
+	*root = createRootFolder();
+	Parser p;
+	const bool ok = p.read (in, root->get(), flags);
+	if (error)
+		*error = p.error();
+	return ok;
+}
+
+static bool read_parallel (const std::string &text, RootFolder_Ptr *root, ThreadPool &pool, int flags) {
+	std::istringstream in (text);
+	*root = createRootFolder();
+	return Parser().read (in, root->get(), pool, flags);
+}
+
+/// Hierarchy with several top-level folders, as in a keystore shared by a few teams
+static RootFolder_Ptr teams (std::mt19937 &rnd, int depth) {
+	RootFolder_Ptr root = createRootFolder();
+	for (int i = 0; i < 12; ++i)
+		fill (root->createSubfolder ("Team " + std::to_string(i)), rnd, depth - i % 3);
+	return root;
+}
+
+static void write_file (const std::string &file, const Folder &root, int mode, int flags) {
+	CryptStream crypt (file, CryptStream::WRITE, mode);
+	crypt.setEncryptionKey ("secret", nullptr, nullptr, nullptr, 1000);
+	std::ostream out (&crypt);
+	Writer().write (out, root, flags);
+}
+
+static bool read_file (const std::string &file, RootFolder_Ptr *root, int mode, ThreadPool *pool, std::string *error = nullptr) {
+	try {
+		CryptStream crypt (file, CryptStream::READ, mode);
+		crypt.setEncryptionKey ("secret", nullptr, nullptr, nullptr, 1000);
+		std::istream in (&crypt);
+		*root = createRootFolder();
+		Parser p;
+		const bool ok = pool ? p.read (in, root->get(), *pool) : p.read (in, root->get());
+		if (error)
+			*error = p.error();
+		return ok;
+	} catch (const std::exception &e) {
+		if (error)
+			*error = e.what();
+		return false;
+	}
+}
+
+/// Parse the way Parser::read did before streaming, with a Json::Value DOM
+static RootFolder_Ptr read_dom (const std::string &text) {
+	Json::Value json;
+	Json::Reader().parse (text, json);
+	RootFolder_Ptr root = createRootFolder();
+	std::vector<std::pair<const Json::Value*, Folder*>> stack {{&json, root.get()}};
+	while (!stack.empty()) {
+		const Json::Value &v = *stack.back().first;
+		Folder *f = stack.back().second;
+		stack.pop_back();
+		for (const Json::Value &k : v["keys"])
+			f->addEntry (Parser::parseEntry (k));
+		// Subfolders in order
+		std::vector<std::pair<const Json::Value*, Folder*>> subfolders;
+		for (const Json::Value &s : v["folders"])
+			subfolders.emplace_back (&s, f->createSubfolder (s["name"].asString()));
+		stack.insert (stack.end(), subfolders.rbegin(), subfolders.rend());
+	}
+	return root;
+}
+
+/// Serialize the way Writer::write did before streaming, with a Json::Value DOM
+static void write_dom (Json::Value &v, const Folder &folder) {
+	v["name"] = folder.name();
+	for (const Entry &e : folder.entries())
+		Writer::serializeEntry (v["keys"].append (Json::Value()), e);
+	for (const Folder &f : folder.subfolders())
+		write_dom (v["folders"].append (Json::Value(Json::objectValue)), f);
+}
+
+int main (int argc, char** argv) {
+	std::mt19937 rnd (3);
+	RootFolder_Ptr r;
+	RootFolder_Ptr root = createRootFolder();
+	fill (root->createSubfolder ("Keys"), rnd, 4);
+	// A field larger than the chunks the stream is read in
+	root->subfolders()[0].addEntry (Entry {"Large", "", "", "", "", random_text(rnd, 200 * 1024)});
+
+	for (int flags : {Writer::WRITE_NONE, Writer::WRITE_FORMATTED}) {
+		std::ostringstream out;
+		Writer w;
+		if (!w.write (out, *root, flags)) {
+			std::cerr << "Write failed: " << w.error() << "\n";
+			return 1;
+		}
+		if (flags == Writer::WRITE_NONE) {
+			Json::Value dom;
+			write_dom (dom, *root);
+			if (out.str() != Json::FastWriter().write (dom)) {
+				std::cerr << "Output differs from Json::FastWriter\n";
+				return 1;
+			}
+		}
+		RootFolder_Ptr streamed, lazy;
+		if (!read (out.str(), &streamed, Parser::READ_NONE) || !read (out.str(), &lazy, Parser::READ_LAZY)) {
+			std::cerr << "Read failed\n";
+			return 1;
+		}
+		if (!same_tree (*root, *streamed) || !same_tree (*root, *lazy) || !same_tree (*root, *read_dom (out.str()))) {
+			std::cerr << "Read hierarchy differs from the written one (flags " << flags << ")\n";
+			return 1;
+		}
+	}
+
+	// Binary format: the same hierarchy, read completely, lazily or through views
+	{
+		root->addEntry (Entry {"Root entry", "", "", "", "", ""});
+		std::ostringstream out;
+		Writer().write (out, *root, Writer::WRITE_BINARY);
+		RootFolder_Ptr eager, lazy;
+		if (!read (out.str(), &eager, Parser::READ_NONE) || !read (out.str(), &lazy, Parser::READ_LAZY) ||
+		    !same_tree (*root, *eager) || !same_tree (*root, *lazy))
+		{
+			std::cerr << "Binary keystore differs from the written one\n";
+			return 1;
+		}
+		std::istringstream in (out.str());
+		const BinaryKeystore store (in);
+		const FolderView keys = store.root().subfolder (0);
+		FolderView found = store.root();
+		const Entry &large = root->subfolders()[0].entries().back();
+		if (store.root().entry(0).title() != "Root entry" || keys.name() != "Keys" || keys.entryCount() != root->subfolders()[0].entries().size() ||
+		    keys.entry(keys.entryCount() - 1).comment() != large.comment() || !store.root().findSubfolder ("Keys", &found) ||
+		    found.subfolderCount() != 3 || store.root().findSubfolder ("Missing", &found))
+		{
+			std::cerr << "Binary keystore views differ from the written hierarchy\n";
+			return 1;
+		}
+		// Truncated or inconsistent tables are rejected
+		std::string damaged = out.str();
+		damaged[4 + 8 + 4] ^= 1;
+		std::string error;
+		if (read (out.str().substr (0, out.str().size() - 1), &r, Parser::READ_NONE, &error) || error.empty() ||
+		    read (damaged, &r, Parser::READ_NONE, &error) || error.empty())
+		{
+			std::cerr << "Damaged binary keystore was accepted\n";
+			return 1;
+		}
+		root->removeEntry (0);
+	}
+
+	// Top-level folders decoded in parallel, with and without subtree index, and from the binary format
+	ThreadPool pool (4);
+	{
+		const RootFolder_Ptr shared = teams (rnd, 3);
+		for (int flags : {(int)Writer::WRITE_NONE, (int)Writer::WRITE_SUBTREE_INDEX, Writer::WRITE_FORMATTED | Writer::WRITE_SUBTREE_INDEX, (int)Writer::WRITE_BINARY}) {
+			std::ostringstream out;
+			Writer().write (out, *shared, flags);
+			RootFolder_Ptr eager, lazy;
+			if (!read_parallel (out.str(), &eager, pool, Parser::READ_NONE) || !read_parallel (out.str(), &lazy, pool, Parser::READ_LAZY) ||
+			    !same_tree (*shared, *eager) || !same_tree (*shared, *lazy))
+			{
+				std::cerr << "Parallel read differs from the written hierarchy (flags " << flags << ")\n";
+				return 1;
+			}
+		}
+		// An outdated index is noticed, and the keystore is read without it
+		std::ostringstream out;
+		Writer().write (out, *shared, Writer::WRITE_SUBTREE_INDEX);
+		std::string outdated = out.str();
+		const size_t index = outdated.rfind ("\"subtrees\":[[");
+		const size_t length = outdated.find (',', index) + 1, lengthEnd = outdated.find (']', length);
+		outdated.replace (length, lengthEnd - length, std::to_string (std::stoull (outdated.substr (length, lengthEnd - length)) - 1));
+		RootFolder_Ptr eager, lazy;
+		if (!read_parallel (outdated, &eager, pool, Parser::READ_NONE) || !read_parallel (outdated, &lazy, pool, Parser::READ_LAZY) ||
+		    !same_tree (*shared, *eager) || !same_tree (*shared, *lazy))
+		{
+			std::cerr << "Keystore with an outdated subtree index was not read correctly\n";
+			return 1;
+		}
+		std::string error;
+		if (read_parallel ("{\"folders\": [{\"name\": \"A\"}, {\"keys\": []}]}", &r, pool, Parser::READ_NONE)) {
+			std::cerr << "Invalid keystore was accepted by the parallel reader\n";
+			return 1;
+		}
+		// Top-level folders with the same name, with a valid subtree index
+		RootFolder_Ptr pair = createRootFolder();
+		pair->createSubfolder ("A")->addEntry (Entry {"a", "", "", "", "", ""});
+		pair->createSubfolder ("B")->addEntry (Entry {"b", "", "", "", "", ""});
+		std::ostringstream named;
+		Writer().write (named, *pair, Writer::WRITE_SUBTREE_INDEX);
+		std::string duplicate = named.str();
+		duplicate.replace (duplicate.find ("\"name\":\"B\""), 10, "\"name\":\"A\"");
+		for (int flags : {(int)Parser::READ_NONE, (int)Parser::READ_LAZY}) {
+			if (read_parallel (duplicate, &r, pool, flags) || read (duplicate, &r, flags)) {
+				std::cerr << "Folders with the same name were accepted (flags " << flags << ")\n";
+				return 1;
+			}
+		}
+		// An empty name is a name like any other
+		RootFolder_Ptr empty = createRootFolder();
+		Folder *unnamed = empty->createSubfolder ("");
+		unnamed->createSubfolder ("")->addEntry (Entry {"a", "", "", "", "", ""});
+		unnamed->createSubfolder ("B");
+		empty->createSubfolder ("B");
+		std::ostringstream emptyOut;
+		Writer().write (emptyOut, *empty, Writer::WRITE_SUBTREE_INDEX);
+		for (const std::string &text : {std::string ("{\"folders\":[{\"name\":\"\"},{\"name\":\"B\"}]}"), emptyOut.str()}) {
+			for (int flags : {(int)Parser::READ_NONE, (int)Parser::READ_LAZY}) {
+				RootFolder_Ptr serial, parallel;
+				if (!read (text, &serial, flags) || !read_parallel (text, &parallel, pool, flags) ||
+				    serial->subfolders().size() != 2 || !same_tree (*serial, *parallel))
+				{
+					std::cerr << "Folder with an empty name was not read (flags " << flags << ")\n";
+					return 1;
+				}
+			}
+		}
+		RootFolder_Ptr emptyRead;
+		if (!read (emptyOut.str(), &emptyRead, Parser::READ_NONE) || !same_tree (*empty, *emptyRead)) {
+			std::cerr << "Folders with empty names differ\n";
+			return 1;
+		}
+	}
+
+	// Encrypted keystores are decrypted by the workers as well. Damaged blocks are rejected.
+	const std::string file = (argc > 2) ? argv[2] : "parser_test.xkey";
+	{
+		const RootFolder_Ptr shared = teams (rnd, 3);
+		const int mode = USE_ENCRYPTION | EVALUATE_FILE_HEADER;
+		for (int encoding : {0, (int)BASE64_ENCODED}) {
+			write_file (file, *shared, mode | encoding, Writer::WRITE_SUBTREE_INDEX);
+			RootFolder_Ptr parallel;
+			std::string error;
+			if (!read_file (file, &parallel, mode | encoding, &pool, &error) || !same_tree (*shared, *parallel)) {
+				std::cerr << "Encrypted keystore was not read correctly in parallel: " << error << "\n";
+				return 1;
+			}
+		}
+		std::fstream damaged (file, std::ios::in | std::ios::out | std::ios::binary);
+		damaged.seekp (-100, std::ios::end);
+		damaged.put ('x');
+		damaged.close();
+		std::string error;
+		if (read_file (file, &r, mode | BASE64_ENCODED, &pool, &error) || error.empty()) {
+			std::cerr << "Damaged encrypted keystore was accepted\n";
+			return 1;
+		}
+	}
+
+	// Unmodified entries are copied from the previous write, or from the cleartext they were loaded from
+	{
+		const RootFolder_Ptr shared = teams (rnd, 2);
+		SerializationCache cache;
+		shared->addObserver (&cache);
+		std::ostringstream first, firstFresh;
+		Writer().write (first, *shared, Writer::WRITE_SUBTREE_INDEX, &cache);
+		Writer().write (firstFresh, *shared, Writer::WRITE_SUBTREE_INDEX);
+		shared->subfolders()[0].subfolders()[1].setEntryAt (0, Entry {"changed", "", "", "", "", ""});
+		shared->subfolders()[2].addEntry (Entry {"added", "", "", "", "", ""});
+		shared->subfolders()[4].setName ("Renamed");
+		shared->subfolders()[3].removeSubfolder (0);
+		std::ostringstream second, secondFresh;
+		Writer().write (second, *shared, Writer::WRITE_SUBTREE_INDEX, &cache);
+		Writer().write (secondFresh, *shared, Writer::WRITE_SUBTREE_INDEX);
+		shared->removeObserver (&cache);
+
+		RootFolder_Ptr lazy;
+		read (first.str(), &lazy, Parser::READ_LAZY);
+		lazy->subfolders()[1].materialize();
+		std::ostringstream copied;
+		Writer().write (copied, *lazy, Writer::WRITE_SUBTREE_INDEX);
+		if (first.str() != firstFresh.str() || second.str() != secondFresh.str() || copied.str() != first.str()) {
+			std::cerr << "Written keystore differs when reusing serialized entries\n";
+			return 1;
+		}
+	}
+
+	// Members in any order, unknown members, comments and non-string fields as accepted by Json::Reader
+	const std::string unusual = "// Keystore\n{\"version\": [1, {\"x\": null}], \"folders\": [{\"name\": \"A\", /* entries */ \"keys\": "
+		"[{\"comment\": \"\\u00e4\\ud83d\\udd11\", \"title\": \"T\", \"username\": \"U\", \"url\": \"\", \"password\": true, "
+		"\"extra\": {\"a\": [true, false]}}], \"folders\": []}, {\"folders\": [{\"name\": \"C\"}], \"name\": \"B\"}]}";
+	if (!read (unusual, &r, Parser::READ_NONE) || !same_tree (*r, *read_dom (unusual)) ||
+	    r->subfolders()[0].entries()[0].comment() != "\xc3\xa4\xf0\x9f\x94\x91" || r->subfolders()[1].subfolders()[0].name() != "C")
+	{
+		std::cerr << "Unusual keystore was not read like Json::Reader does\n";
+		return 1;
+	}
+
+	// Invalid input is reported, not accepted partially
+	for (const std::string invalid : {"", "{\"folders\": [{\"keys\": []}]}", "{\"folders\": [{\"name\": \"A\"}", "{\"folders\": [{\"name\": \"A\\x\"}]}",
+	                                  "{\"folders\": [{\"name\": \"A\", \"keys\": [1]}]}", "{\"folders\": [{\"name\": \"A\", \"keys\": [{\"title\": 1}]}]}", "[]",
+	                                  "{\"folders\": [{\"name\": \"A\", \"folders\": [{\"name\": \"C\"}, {\"keys\": [], \"name\": \"C\"}]}]}"})
+	{
+		std::string error;
+		if (read (invalid, &r, Parser::READ_NONE, &error) || error.empty()) {
+			std::cerr << "Invalid keystore was accepted: " << invalid << "\n";
+			return 1;
+		}
+	}
+
+	// Throughput compared to building a DOM first
+	const int depth = (argc > 1) ? atoi(argv[1]) : 6;
+	RootFolder_Ptr large = createRootFolder();
+	fill (large->createSubfolder ("Keys"), rnd, depth);
+	std::ostringstream out;
+	Writer().write (out, *large);
+	const std::string text = out.str();
+	auto t0 = std::chrono::steady_clock::now();
+	read (text, &r, Parser::READ_NONE);
+	auto t1 = std::chrono::steady_clock::now();
+	RootFolder_Ptr dom = read_dom (text);
+	auto t2 = std::chrono::steady_clock::now();
+	std::ostringstream streamedOut;
+	Writer().write (streamedOut, *r);
+	auto t3 = std::chrono::steady_clock::now();
+	Json::Value domOut;
+	write_dom (domOut, *dom);
+	const std::string domText = Json::FastWriter().write (domOut);
+	auto t4 = std::chrono::steady_clock::now();
+	std::ostringstream binaryOut;
+	Writer().write (binaryOut, *r, Writer::WRITE_BINARY);
+	auto t5 = std::chrono::steady_clock::now();
+	RootFolder_Ptr binary;
+	read (binaryOut.str(), &binary, Parser::READ_NONE);
+	auto t6 = std::chrono::steady_clock::now();
+	// Saving again after changing one entry
+	SerializationCache cache;
+	large->addObserver (&cache);
+	std::ostringstream previous, cached, uncached;
+	Writer().write (previous, *large, Writer::WRITE_NONE, &cache);
+	large->subfolders()[0].subfolders()[1].setEntryAt (0, Entry {"changed", "", "", "", "", ""});
+	auto t10 = std::chrono::steady_clock::now();
+	Writer().write (cached, *large, Writer::WRITE_NONE, &cache);
+	auto t11 = std::chrono::steady_clock::now();
+	Writer().write (uncached, *large);
+	auto t12 = std::chrono::steady_clock::now();
+	large->removeObserver (&cache);
+	auto ms = [] (std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+	std::cout << "Saving after changing one entry: " << ms(t11 - t10) << " ms with cached entries, "
+		<< ms(t12 - t11) << " ms without\n";
+	if (cached.str() != uncached.str()) {
+		std::cerr << "Written keystore differs when reusing serialized entries\n";
+		return 1;
+	}
+	std::cout << text.size() / 1024 << " KiB. Reading: streaming " << ms(t1 - t0) << " ms, Json::Value " << ms(t2 - t1)
+		<< " ms. Writing: streaming " << ms(t3 - t2) << " ms, Json::Value " << ms(t4 - t3) << " ms\n"
+		<< binaryOut.str().size() / 1024 << " KiB binary. Writing " << ms(t5 - t4) << " ms, reading " << ms(t6 - t5) << " ms\n";
+
+	// Opening an encrypted keystore of several teams, on one thread and on all cores
+	const RootFolder_Ptr shared = teams (rnd, depth - 1);
+	const int mode = USE_ENCRYPTION | BASE64_ENCODED | EVALUATE_FILE_HEADER;
+	write_file (file, *shared, mode, Writer::WRITE_SUBTREE_INDEX);
+	ThreadPool cores;
+	RootFolder_Ptr serial, parallel;
+	auto t7 = std::chrono::steady_clock::now();
+	read_file (file, &serial, mode, nullptr);
+	auto t8 = std::chrono::steady_clock::now();
+	read_file (file, &parallel, mode, &cores);
+	auto t9 = std::chrono::steady_clock::now();
+	std::remove (file.c_str());
+	std::cout << "Opening an encrypted keystore of 12 top-level folders: one thread " << ms(t8 - t7) << " ms, "
+		<< cores.size() << " threads " << ms(t9 - t8) << " ms\n";
+	return (same_tree (*r, *dom) && streamedOut.str() == domText && same_tree (*r, *binary) && same_tree (*serial, *parallel)) ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+#include "XKey.h"
+#include "XKeyJsonSerialization.h"
+#include "XKeyRevisions.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace XKey;
+
+static const std::string key = "ABC";
+static const int iterations = 1000;
+
+static Entry random_entry (std::mt19937 &rnd) {
+	auto w = [&rnd] () { return "word" + std::to_string(rnd() % 1000); };
+	return Entry {w(), w(), "https://" + w() + ".example.org", w(), w() + "@example.org", ""};
+}
+
+static RootFolder_Ptr keystore (std::mt19937 &rnd, int entries) {
+	RootFolder_Ptr root = createRootFolder();
+	for (int i = 0; i < 8; ++i) {
+		Folder *f = root->createSubfolder ("Folder " + std::to_string(i));
+		for (int j = 0; j < entries; ++j)
+			f->addEntry (random_entry(rnd));
+	}
+	return root;
+}
+
+/// One edit as between two saves: change, add or remove an entry, or add or remove a folder
+static void modify (Folder *root, std::mt19937 &rnd) {
+	Folder &f = root->subfolders()[rnd() % root->subfolders().size()];
+	switch (rnd() % 5) {
+	case 0: f.addEntry (random_entry(rnd)); break;
+	case 1: if (!f.entries().empty()) f.removeEntry (rnd() % f.entries().size()); break;
+	case 2: root->createSubfolder ("New " + std::to_string(rnd()))->addEntry (random_entry(rnd)); break;
+	case 3: if (root->subfolders().size() > 4) root->removeSubfolder (rnd() % root->subfolders().size()); break;
+	default: if (!f.entries().empty()) f.setEntryAt (rnd() % f.entries().size(), random_entry(rnd)); break;
+	}
+}
+
+static std::string dump (const Folder &root) {
+	std::ostringstream out;
+	Writer().write (out, root);
+	return out.str();
+}
+
+static std::string restored (const RevisionStore &store, unsigned number) {
+	RootFolder_Ptr root = createRootFolder();
+	store.restore (number, root.get());
+	return dump (*root);
+}
+
+static void remove_history (const std::string &keystoreFile) {
+	const std::string dir = RevisionStore::directoryName (keystoreFile);
+	if (DIR *d = opendir (dir.c_str())) {
+		while (struct dirent *e = readdir (d)) {
+			if (e->d_name[0] != '.')
+				unlink ((dir + "/" + e->d_name).c_str());
+		}
+		closedir (d);
+	}
+	rmdir (dir.c_str());
+}
+
+static int check_history (const std::string &file, std::mt19937 &rnd) {
+	RootFolder_Ptr root = keystore (rnd, 20);
+	std::vector<std::string> versions;
+	{
+		RevisionStore store (file);
+		store.open (key, iterations);
+		store.setCheckpointInterval (8);
+		for (int i = 0; i < 20; ++i) {
+			if (i > 0)
+				modify (root.get(), rnd);
+			versions.push_back (dump (*root));
+			if (store.record (*root) != versions.size()) {
+				std::cerr << "Unexpected revision number\n";
+				return 1;
+			}
+		}
+		if (store.record (*root) != versions.size()) {
+			std::cerr << "Unchanged keystore was recorded\n";
+			return 1;
+		}
+	}
+	// Continue in a new session: the base of the next delta is restored first
+	RevisionStore store (file);
+	store.open (key);
+	modify (root.get(), rnd);
+	versions.push_back (dump (*root));
+	store.record (*root);
+	for (const RevisionStore::Revision &r : store.revisions()) {
+		if (r.checkpoint != (r.number % 8 == 1)) {
+			std::cerr << "Revision " << r.number << (r.checkpoint ? " is" : " is not") << " a checkpoint\n";
+			return 1;
+		}
+		if (!r.checkpoint && r.storedSize * 20 > r.size) {
+			std::cerr << "Delta of revision " << r.number << " has " << r.storedSize << " bytes for " << r.size << "\n";
+			return 1;
+		}
+		if (restored (store, r.number) != versions[r.number - 1]) {
+			std::cerr << "Revision " << r.number << " differs\n";
+			return 1;
+		}
+	}
+	try {
+		RevisionStore (file).open ("wrong");
+		std::cerr << "Wrong passphrase was accepted\n";
+		return 1;
+	} catch (const std::runtime_error &) { }
+
+	// New passphrase for all revisions
+	store.changePassphrase ("new", iterations);
+	RevisionStore reopened (file);
+	reopened.open ("new");
+	if (reopened.revisions().size() != versions.size() || restored (reopened, 5) != versions[4]) {
+		std::cerr << "History differs after changing the passphrase\n";
+		return 1;
+	}
+	return 0;
+}
+
+static int check_tampering (const std::string &file, std::mt19937 &rnd) {
+	RootFolder_Ptr root = keystore (rnd, 5);
+	RevisionStore store (file);
+	store.open (key, iterations);
+	store.record (*root);
+	modify (root.get(), rnd);
+	store.record (*root);
+	// Swap the two revision files
+	const std::string dir = store.directory();
+	std::vector<std::string> files;
+	if (DIR *d = opendir (dir.c_str())) {
+		while (struct dirent *e = readdir (d)) {
+			const std::string name = e->d_name;
+			if (name.size() > 4 && name.compare (name.size() - 4, 4, ".rev") == 0)
+				files.push_back (name);
+		}
+		closedir (d);
+	}
+	if (files.size() != 2)
+		return 1;
+	rename ((dir + "/" + files[0]).c_str(), (dir + "/swap").c_str());
+	rename ((dir + "/" + files[1]).c_str(), (dir + "/" + files[0]).c_str());
+	rename ((dir + "/swap").c_str(), (dir + "/" + files[1]).c_str());
+	for (unsigned number : {1, 2}) {
+		try {
+			restored (store, number);
+			std::cerr << "Swapped revision file was accepted\n";
+			return 1;
+		} catch (const std::runtime_error &) { }
+	}
+	return 0;
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: RevisionTest keystore_file [entries per folder] [revisions]\n";
+		return -1;
+	}
+	const std::string file (argv[1]);
+	const int entriesPerFolder = (argc > 2) ? atoi(argv[2]) : 500;
+	const int count = (argc > 3) ? atoi(argv[3]) : 100;
+	XKey::CryptStream::InitCrypto();
+	std::mt19937 rnd (42);
+	remove_history (file);
+	if (check_history (file, rnd))
+		return 1;
+	remove_history (file);
+	if (check_tampering (file, rnd))
+		return 1;
+	remove_history (file);
+
+	// Storage of a long history, and restoring the newest revision and the one furthest from a checkpoint
+	RootFolder_Ptr root = keystore (rnd, entriesPerFolder);
+	RevisionStore store (file);
+	store.open (key, iterations);
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; ++i) {
+		modify (root.get(), rnd);
+		store.record (*root);
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	size_t stored = 0, copies = 0;
+	for (const RevisionStore::Revision &r : store.revisions()) {
+		stored += r.storedSize;
+		copies += r.size;
+	}
+	const unsigned latest = store.revisions().back().number;
+	unsigned furthest = latest;
+	while (store.revisions()[furthest - 1].checkpoint || furthest % store.checkpointInterval() != 0)
+		--furthest;
+	auto t2 = std::chrono::steady_clock::now();
+	const bool same = restored (store, latest) == dump (*root);
+	auto t3 = std::chrono::steady_clock::now();
+	restored (store, furthest);
+	auto t4 = std::chrono::steady_clock::now();
+	remove_history (file);
+	auto ms = [] (std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+	std::cout << count << " revisions: " << stored / 1024 << " KiB stored, " << copies / 1024 << " KiB as complete copies, "
+		<< ms(t1 - t0) / count << " ms per revision. Restoring the newest: " << ms(t3 - t2)
+		<< " ms, revision " << furthest << ": " << ms(t4 - t3) << " ms\n";
+	return same ? 0 : 1;
+}
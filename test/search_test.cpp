@@ -0,0 +1,472 @@
+#include "XKey.h"
+#include "XKeyBatch.h"
+#include "XKeySearchIndex.h"
+#include "XKeyThreadPool.h"
+#include "XKeyFuzzySearch.h"
+#include "XKeySearchSession.h"
+#include "XKeySubtreeFilter.h"
+#include "XKeyQuery.h"
+#include "XKeyUrlIndex.h"
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+
+using namespace XKey;
+
+static const char *words[] = {"mail", "Bank", "github", "server", "ssh", "Deploy", "admin", "shop", "vpn", "wiki"};
+
+static Entry random_entry (std::mt19937 &rnd) {
+	auto w = [&rnd] () { return std::string(words[rnd() % 10]) + std::to_string(rnd() % 100); };
+	return Entry {w(), w(), "https://" + w() + ".example.org", "pwd", w() + "@example.org", (rnd() % 4 == 0) ? w() + " " + w() : ""};
+}
+
+static void fill (Folder *f, std::mt19937 &rnd, int depth, int entries) {
+	for (int i = 0; i < entries; ++i)
+		f->addEntry (random_entry(rnd));
+	if (depth > 0) {
+		for (int i = 0; i < 4; ++i)
+			fill (f->createSubfolder ("Folder " + std::to_string(i)), rnd, depth - 1, entries);
+	}
+}
+
+/// All matches, the way the GUI used to step through them
+static std::vector<SearchResult> serial_search (const std::string &query, const Folder &root, const SubtreeFilter *filter = nullptr) {
+	std::vector<SearchResult> results;
+	for (SearchResult r = startSearch (query, &root, filter); r.hasMatch(); r = continueSearch (query, r, filter))
+		results.push_back (r);
+	return results;
+}
+
+static bool same_results (const std::vector<SearchResult> &a, const std::vector<SearchResult> &b) {
+	if (a.size() != b.size())
+		return false;
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (a[i].match() != b[i].match() || a[i].parentFolder() != b[i].parentFolder() || a[i].index() != b[i].index())
+			return false;
+	}
+	return true;
+}
+
+static int check (const char *step, const SearchIndex &index, const SubtreeFilter &filter, const Folder &root, ThreadPool &pool) {
+	const std::vector<std::string> queries {"github", "BANK1", "ssh4 vpn77", "example.org", "a", "nothing-here", "mail2 de"};
+	for (const std::string &q : queries) {
+		const std::vector<SearchResult> all = findAll (SearchQuery(q), &root);
+		if (!same_results (index.find(q), all)) {
+			std::cerr << step << ": index and findAll differ for \"" << q << "\"\n";
+			return 1;
+		}
+		if (!same_results (findAll(SearchQuery(q), &root, pool), all)) {
+			std::cerr << step << ": parallel and serial findAll differ for \"" << q << "\"\n";
+			return 1;
+		}
+		if (!same_results (serial_search(q, root), all)) {
+			std::cerr << step << ": continueSearch and findAll differ for \"" << q << "\"\n";
+			return 1;
+		}
+		if (!same_results (findAll(SearchQuery(q), &root, &filter), all) || !same_results (serial_search(q, root, &filter), all)) {
+			std::cerr << step << ": search pruned by the subtree filter differs for \"" << q << "\"\n";
+			return 1;
+		}
+		SearchSession session (&root), pruned (&root, &filter);
+		if (!same_results (pruned.update(q), session.update(q)) || pruned.lastScanned() > session.lastScanned()) {
+			std::cerr << step << ": search session pruned by the subtree filter differs for \"" << q << "\"\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// Subtrees without any entry containing a word are skipped
+static int check_subtree_filter () {
+	RootFolder_Ptr root = createRootFolder();
+	Folder *work = root->createSubfolder ("Work"), *home = root->createSubfolder ("Home");
+	work->addEntry (Entry {"GitHub", "octocat", "https://github.com", "", "", ""});
+	home->createSubfolder ("Bank")->addEntry (Entry {"Savings", "", "https://bank.example", "", "", ""});
+	SubtreeFilter filter (*root);
+	root->addObserver (&filter);
+	if (filter.mayMatch (*home, SearchQuery("github")) || !filter.mayMatch (*root, SearchQuery("GITHUB")) ||
+	    !filter.mayMatch (*home, SearchQuery("savings github")) || filter.mayMatchAll (*home, SearchQuery("savings github")) ||
+	    !filter.mayMatch (*home, SearchQuery("gi")))
+	{
+		std::cerr << "Subtree filter does not prune as expected\n";
+		return 1;
+	}
+	// Added entries and moved folders are found in their new place
+	home->subfolders()[0].addEntry (Entry {"Bank GitHub", "", "", "", "", ""});
+	home = moveFolder (work, home, 0)->parent();
+	const SearchQuery query ("octocat");
+	if (!filter.mayMatch (*home, SearchQuery("github")) || !same_results (findAll (query, root.get(), &filter), findAll (query, root.get()))) {
+		std::cerr << "Subtree filter is not updated\n";
+		return 1;
+	}
+	root->removeObserver (&filter);
+	return 0;
+}
+
+static void all_entries (const Folder &folder, std::vector<SearchResult> *out) {
+	for (size_t i = 0; i < folder.entries().size(); ++i)
+		out->push_back (SearchResult (&folder.entries()[i], &folder, i));
+	for (const Folder &f : folder.subfolders())
+		all_entries (f, out);
+}
+
+/// Compare the bounded top-k selection with scoring and sorting every entry
+static int check_fuzzy (const Folder &root) {
+	std::vector<SearchResult> entries;
+	all_entries (root, &entries);
+	const std::vector<std::string> queries {"gthb", "Bank1", "ssh4 vpn", "exmpl", "dplyky", "zzz"};
+	for (const std::string &q : queries) {
+		const FuzzyQuery query (q);
+		std::vector<RankedResult> expected;
+		for (const SearchResult &r : entries) {
+			const int score = query.score (*r.match());
+			if (score > 0)
+				expected.push_back (RankedResult {r, score});
+		}
+		std::stable_sort (expected.begin(), expected.end(), [] (const RankedResult &a, const RankedResult &b) {
+			return a.score > b.score;
+		});
+		expected.resize (std::min<size_t> (expected.size(), 10));
+		const std::vector<RankedResult> best = findBest (query, &root, 10);
+		bool same = (best.size() == expected.size());
+		for (size_t i = 0; same && i < best.size(); ++i)
+			same = (best[i].score == expected[i].score && best[i].result.match() == expected[i].result.match());
+		if (!same) {
+			std::cerr << "findBest differs from a full ranking for \"" << q << "\"\n";
+			return 1;
+		}
+	}
+	// The entry with the exact title wins over scattered matches
+	const std::vector<RankedResult> best = findBest (FuzzyQuery("github deploy"), &root, 1);
+	if (best.empty() || best[0].result.match()->title() != "GitHub deploy key") {
+		std::cerr << "Fuzzy search ranks the wrong entry first\n";
+		return 1;
+	}
+	// Ranking all candidates keeps those the query does not match, after the matches
+	const FuzzyQuery query ("gthb");
+	const std::vector<SearchResult> ranked = rankAll (query, entries);
+	const std::vector<RankedResult> top = findBest (query, entries, entries.size());
+	bool same = (ranked.size() == entries.size() && top.size() <= ranked.size());
+	for (size_t i = 0; same && i < top.size(); ++i)
+		same = (ranked[i].match() == top[i].result.match());
+	for (size_t i = top.size(); same && i < ranked.size(); ++i)
+		same = (query.score (*ranked[i].match()) == 0);
+	if (!same) {
+		std::cerr << "rankAll differs from findBest for \"gthb\"\n";
+		return 1;
+	}
+	return 0;
+}
+
+/// Type a search string character by character and delete it again
+static int check_session (const Folder &root) {
+	std::vector<SearchResult> entries;
+	all_entries (root, &entries);
+	SearchSession session (&root);
+	const std::string typed = "git dep";
+	std::vector<std::string> steps;
+	for (size_t i = 1; i <= typed.size(); ++i)
+		steps.push_back (typed.substr (0, i));
+	for (size_t i = typed.size() - 1; i > 0; --i)
+		steps.push_back (typed.substr (0, i));
+	size_t previous = 0;
+	for (size_t step = 0; step < steps.size(); ++step) {
+		const SearchQuery query (steps[step]);
+		std::vector<SearchResult> expected;
+		for (const SearchResult &r : entries) {
+			if (query.matchesAll (*r.match()))
+				expected.push_back (r);
+		}
+		if (!same_results (session.update (steps[step]), expected)) {
+			std::cerr << "Search session differs for \"" << steps[step] << "\"\n";
+			return 1;
+		}
+		// Typing only checks the previous matches again, backspace does not search at all
+		const size_t scanned = (step == 0) ? entries.size() : (step < typed.size()) ? previous : 0;
+		previous = expected.size();
+		if (session.lastScanned() != scanned) {
+			std::cerr << "Search session scanned " << session.lastScanned() << " entries for \"" << steps[step] << "\"\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static bool contains (const std::string &field, const std::string &word) {
+	return SubstringMatcher(word).matches (field);
+}
+
+/// Evaluate query plans and compare them with the equivalent conditions
+static int check_query (const Folder &root) {
+	std::vector<SearchResult> entries;
+	all_entries (root, &entries);
+	const std::vector<std::pair<std::string, std::function<bool(const Entry&)>>> queries {
+		{"url:github user:deploy -title:bank", [] (const Entry &e) {
+			return contains (e.url(), "github") && contains (e.username(), "deploy") && !contains (e.title(), "bank");
+		}},
+		{"(title:ssh1 OR title:vpn2) AND NOT mail", [] (const Entry &e) {
+			return (contains (e.title(), "ssh1") || contains (e.title(), "vpn2")) && !contains (e.title(), "mail") &&
+				!contains (e.username(), "mail") && !contains (e.url(), "mail") && !contains (e.email(), "mail") &&
+				!contains (e.comment(), "mail");
+		}},
+		{"comment:\"wiki1\" | email:\"admin5\"", [] (const Entry &e) {
+			return contains (e.comment(), "wiki1") || contains (e.email(), "admin5");
+		}},
+	};
+	for (const auto &q : queries) {
+		const QueryPlan plan (q.first);
+		std::vector<SearchResult> expected;
+		for (const SearchResult &r : entries) {
+			if (q.second (*r.match()))
+				expected.push_back (r);
+		}
+		if (expected.empty() || !same_results (plan.findAll (&root), expected)) {
+			std::cerr << "Query \"" << q.first << "\" (" << plan.describe() << ") has wrong results\n";
+			return 1;
+		}
+	}
+	// The field-scoped long word is evaluated before the short word in all fields
+	const std::string plan = QueryPlan ("a url:example.org").describe();
+	if (plan != "AND(url:\"example.org\", \"a\")") {
+		std::cerr << "Unexpected query plan " << plan << "\n";
+		return 1;
+	}
+	for (const char *broken : {"title:", "\"open", "(a OR b", "a OR", "a)", "NOT"}) {
+		try {
+			QueryPlan p (broken);
+			std::cerr << "No syntax error for " << broken << "\n";
+			return 1;
+		} catch (const std::invalid_argument &) { }
+	}
+	return 0;
+}
+
+/// URL normalization and autofill lookups, also after modifications
+static int check_url () {
+	const struct {
+		const char *url, *scheme, *host, *registrable;
+		int port;
+	} urls[] = {
+		{"https://Login.Corp.Example.com/path?q=1", "https", "login.corp.example.com", "example.com", 0},
+		{"  HTTP://user:pw@www.example.co.uk:8080/ ", "http", "www.example.co.uk", "example.co.uk", 8080},
+		{"github.com", "", "github.com", "github.com", 0},
+		{"intranet:8443/login", "", "intranet", "intranet", 8443},
+		{"ssh://[2001:db8::1]:22", "ssh", "2001:db8::1", "2001:db8::1", 22},
+		{"https://192.168.1.10/admin", "https", "192.168.1.10", "192.168.1.10", 0},
+		{"example.org.", "", "example.org", "example.org", 0},
+	};
+	for (const auto &u : urls) {
+		const NormalizedUrl n = NormalizedUrl::parse (u.url);
+		if (n.scheme != u.scheme || n.host != u.host || n.registrableDomain != u.registrable || n.port != u.port) {
+			std::cerr << "Wrong normalization of " << u.url << ": " << n.scheme << " " << n.host << " "
+				<< n.registrableDomain << " " << n.port << "\n";
+			return 1;
+		}
+	}
+	for (const char *invalid : {"", "my bank", "https://", "host:port", "a..b"}) {
+		if (NormalizedUrl::parse (invalid).valid()) {
+			std::cerr << "Invalid URL " << invalid << " was accepted\n";
+			return 1;
+		}
+	}
+
+	RootFolder_Ptr root = createRootFolder();
+	Folder *work = root->createSubfolder ("Work"), *home = root->createSubfolder ("Home");
+	work->addEntry (Entry {"Corp SSO", "", "https://login.corp.example.com", "", "", ""});
+	work->addEntry (Entry {"Example", "", "http://example.com", "", "", ""});
+	work->addEntry (Entry {"Mail", "", "https://mail.example.com", "", "", ""});
+	home->addEntry (Entry {"Example https", "", "https://example.com/account", "", "", ""});
+	home->addEntry (Entry {"TLD", "", "com", "", "", ""});
+	home->addEntry (Entry {"Other port", "", "https://login.corp.example.com:8443", "", "", ""});
+	home->addEntry (Entry {"No URL", "", "", "", "", ""});
+	UrlIndex index (*root);
+	root->addObserver (&index);
+	auto titles = [&index] (const std::string &url) {
+		std::string out;
+		for (const UrlIndex::Match &m : index.lookup (url))
+			out += m.result.match()->title() + ";";
+		return out;
+	};
+	const std::pair<std::string, std::string> lookups[] = {
+		{"https://login.corp.example.com/path", "Corp SSO;Example https;Example;"},
+		{"https://login.corp.example.com:8443/", "Other port;"},
+		{"https://www.example.com", "Example https;Example;"},
+		{"https://other.org", ""},
+	};
+	for (const auto &l : lookups) {
+		if (titles (l.first) != l.second) {
+			std::cerr << "Lookup of " << l.first << " found " << titles (l.first) << "\n";
+			return 1;
+		}
+	}
+	work->setEntryAt (1, Entry {"Example moved", "", "https://shop.example.com", "", "", ""});
+	work->removeEntry (0);
+	home->addEntry (Entry {"Corp", "", "corp.example.com", "", "", ""});
+	moveFolder (home, work, 0);
+	const std::string found = titles ("https://login.corp.example.com/");
+	root->removeObserver (&index);
+	if (found != "Corp;Example https;" || index.size() != 6) {
+		std::cerr << "Lookup after modifications found " << found << "\n";
+		return 1;
+	}
+
+	// Removing a folder with more entries than the index compacts after
+	RootFolder_Ptr large = createRootFolder();
+	Folder *a = large->createSubfolder ("A");
+	for (int i = 0; i < 1500; ++i)
+		a->addEntry (Entry {"A" + std::to_string(i), "", "https://a" + std::to_string(i) + ".example.com", "", "", ""});
+	large->createSubfolder ("B")->addEntry (Entry {"B", "", "https://b.example.com", "", "", ""});
+	UrlIndex largeIndex (*large);
+	large->addObserver (&largeIndex);
+	large->removeSubfolder (0);
+	try {
+		if (largeIndex.size() != 1 || largeIndex.lookup ("https://b.example.com").size() != 1 ||
+		    !largeIndex.lookup ("https://a1.example.com").empty())
+		{
+			std::cerr << "Lookup after removing a large folder failed\n";
+			return 1;
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "Lookup after removing a large folder failed: " << e.what() << "\n";
+		return 1;
+	}
+	large->removeObserver (&largeIndex);
+	return 0;
+}
+
+/// Compare the matcher kernels with a naive search on random text around the vector widths
+static int check_matcher (std::mt19937 &rnd) {
+	const char alphabet[] = "abcABC xyz\xc3\x84\xc3\xa4";
+	for (int round = 0; round < 20000; ++round) {
+		std::string haystack, needle;
+		const size_t n = rnd() % 80, m = 1 + rnd() % 5;
+		for (size_t i = 0; i < n; ++i)
+			haystack.push_back (alphabet[rnd() % (sizeof(alphabet) - 1)]);
+		for (size_t i = 0; i < m; ++i)
+			needle.push_back ("abcAB"[rnd() % 5]);
+		if (round % 4 == 0)
+			needle = "\xc3\xa4" + needle;
+		const bool expected = SubstringMatcher::foldCase(haystack).find (SubstringMatcher::foldCase(needle)) != std::string::npos;
+		if (SubstringMatcher(needle).matches (haystack) != expected) {
+			std::cerr << "Matcher (" << SubstringMatcher::implementation() << ") failed for \"" << needle
+				<< "\" in \"" << haystack << "\"\n";
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// Removing more entries than the indexes compact after in a single batch
+static int check_large_batch () {
+	std::mt19937 rnd (3);
+	RootFolder_Ptr root = createRootFolder();
+	Folder *f = root->createSubfolder ("Many");
+	for (int i = 0; i < 4000; ++i)
+		f->addEntry (random_entry(rnd));
+	SearchIndex index (*root);
+	root->addObserver (&index);
+	UrlIndex urls (*root);
+	root->addObserver (&urls);
+	Batch batch (root.get());
+	for (int i = 0; i < 3000; ++i)
+		batch.removeEntry (f, i);
+	batch.setEntry (f, 3500, Entry {"GitHub after the batch", "", "https://github.com", "", "", ""});
+	batch.addEntry (f, random_entry(rnd));
+	try {
+		batch.commit();
+	} catch (const std::exception &e) {
+		std::cerr << "Large batch failed: " << e.what() << "\n";
+		return 1;
+	}
+	root->removeObserver (&index);
+	root->removeObserver (&urls);
+	for (const char *q : {"github", "after the batch", "ssh4", "a"}) {
+		if (!same_results (index.find(q), findAll (SearchQuery(q), root.get()))) {
+			std::cerr << "Large batch: index and findAll differ for \"" << q << "\"\n";
+			return 1;
+		}
+	}
+	// The URL index equals one built from the result
+	const UrlIndex fresh (*root);
+	auto results = [] (const std::vector<UrlIndex::Match> &matches) {
+		std::vector<SearchResult> out;
+		for (const UrlIndex::Match &m : matches)
+			out.push_back (m.result);
+		return out;
+	};
+	for (size_t i = 0; i < f->entries().size(); i += 50) {
+		const std::string &url = f->entries()[i].url();
+		if (!same_results (results (urls.lookup(url)), results (fresh.lookup(url)))) {
+			std::cerr << "Large batch: URL index differs for " << url << "\n";
+			return 1;
+		}
+	}
+	if (urls.size() != fresh.size() || urls.lookup("https://github.com").size() != 1) {
+		std::cerr << "Large batch: URL index differs\n";
+		return 1;
+	}
+	return 0;
+}
+
+int main (int argc, char** argv) {
+	const int entriesPerFolder = (argc > 1) ? atoi(argv[1]) : 20;
+	std::mt19937 rnd (42);
+	{
+		std::mt19937 matcherRnd (7);
+		if (check_matcher (matcherRnd))
+			return 1;
+	}
+	RootFolder_Ptr root = createRootFolder();
+	fill (root.get(), rnd, 4, entriesPerFolder);
+
+	ThreadPool pool (4);
+	SearchIndex index (*root);
+	root->addObserver (&index);
+	SubtreeFilter filter (*root);
+	root->addObserver (&filter);
+	if (check ("Initial", index, filter, *root, pool))
+		return 1;
+
+	// Modifications are tracked by the index
+	Folder *f = &root->subfolders()[1];
+	f->addEntry (Entry {"GitHub deploy key", "", "", "", "", ""});
+	f->setEntryAt (0, random_entry(rnd));
+	f->removeEntry (3);
+	f->subfolders()[2].setName ("Renamed");
+	root->removeSubfolder (0);
+	root->subfolders()[1].subfolders()[0].setName ("Moved");
+	moveFolder (&root->subfolders()[1].subfolders()[0], &root->subfolders()[0], 0);
+	Batch batch (root.get());
+	for (int i = 0; i < 10; ++i)
+		batch.addEntry (&root->subfolders()[2], random_entry(rnd));
+	batch.removeEntry (&root->subfolders()[2], 0);
+	batch.commit();
+	if (check ("Modified", index, filter, *root, pool))
+		return 1;
+	if (check_fuzzy (*root) || check_session (*root) || check_query (*root) || check_url () || check_subtree_filter ()
+	    || check_large_batch ())
+		return 1;
+
+	const std::string query = "github42";
+	auto t0 = std::chrono::steady_clock::now();
+	const size_t indexed = index.find(query).size();
+	auto t1 = std::chrono::steady_clock::now();
+	const size_t serial = findAll(SearchQuery(query), root.get()).size();
+	auto t2 = std::chrono::steady_clock::now();
+	const size_t parallel = findAll(SearchQuery(query), root.get(), pool).size();
+	auto t3 = std::chrono::steady_clock::now();
+	const size_t pruned = findAll(SearchQuery(query), root.get(), &filter).size();
+	auto t4 = std::chrono::steady_clock::now();
+	std::cout << index.size() << " entries, " << indexed << " matches. Index: "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count() << " us, findAll: "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() << " us, parallel ("
+		<< pool.size() << " threads): " << std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() << " us, pruned: "
+		<< std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count() << " us (" << filter.memoryUsage() / 1024 << " KiB of filters)\n";
+	root->removeObserver (&filter);
+	root->removeObserver (&index);
+	return (indexed == serial && parallel == serial && pruned == serial) ? 0 : 1;
+}
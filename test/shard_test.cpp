@@ -0,0 +1,204 @@
+#include "XKey.h"
+#include "XKeyBatch.h"
+#include "XKeyJsonSerialization.h"
+#include "XKeyShards.h"
+#include "XKeyThreadPool.h"
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <dirent.h>
+
+using namespace XKey;
+
+static const std::string key = "ABC";
+static const int iterations = 1000;
+
+static Entry random_entry (std::mt19937 &rnd) {
+	auto w = [&rnd] () { return "word" + std::to_string(rnd() % 1000); };
+	return Entry {w(), w(), "https://" + w() + ".example.org", w(), w() + "@example.org", ""};
+}
+
+static void fill (Folder *f, std::mt19937 &rnd, int depth, int entries) {
+	for (int i = 0; i < entries; ++i)
+		f->addEntry (random_entry(rnd));
+	if (depth > 0) {
+		for (int i = 0; i < 3; ++i)
+			fill (f->createSubfolder ("Folder " + std::to_string(i)), rnd, depth - 1, entries);
+	}
+}
+
+/// Hierarchy with several top-level folders, as in a keystore shared by a few teams. The root has no entries.
+static RootFolder_Ptr teams (std::mt19937 &rnd, int depth, int entries) {
+	RootFolder_Ptr root = createRootFolder();
+	for (int i = 0; i < 8; ++i)
+		fill (root->createSubfolder ("Team " + std::to_string(i)), rnd, depth, entries);
+	return root;
+}
+
+static std::string dump (const Folder &root) {
+	std::ostringstream out;
+	Writer().write (out, root);
+	return out.str();
+}
+
+static std::vector<std::string> shard_files (const std::string &dir) {
+	std::vector<std::string> files;
+	DIR *d = opendir (dir.c_str());
+	while (struct dirent *e = (d ? readdir (d) : nullptr)) {
+		const std::string name = e->d_name;
+		if (name.size() > 6 && name.compare (name.size() - 6, 6, ".shard") == 0)
+			files.push_back (name);
+	}
+	if (d)
+		closedir (d);
+	return files;
+}
+
+static RootFolder_Ptr reopen (const std::string &dir, ThreadPool &pool, int flags = Parser::READ_NONE) {
+	RootFolder_Ptr root = createRootFolder();
+	ShardedKeystore (dir).open (key, root.get(), pool, flags, iterations);
+	return root;
+}
+
+/// Save after @p modify and check the number of written shards and the saved hierarchy
+static int check_save (ShardedKeystore &store, Folder *root, ThreadPool &pool, size_t expected, const char *what,
+                       const std::function<void()> &modify) {
+	modify();
+	const size_t written = store.save (*root, key, BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER, iterations);
+	if (written != expected || shard_files (store.directory()).size() != store.shardCount() ||
+	    dump (*reopen (store.directory(), pool, Parser::READ_LAZY)) != dump (*root)) {
+		std::cerr << what << ": " << written << " shards written, expected " << expected << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+static int check_incremental (const std::string &dir, std::mt19937 &rnd, ThreadPool &pool) {
+	RootFolder_Ptr root = teams (rnd, 2, 3);
+	ShardedKeystore store (dir);
+	if (check_save (store, root.get(), pool, 8, "First save", [] { }))
+		return 1;
+	root->addObserver (&store);
+	Folder *a = &root->subfolders()[0], *b = &root->subfolders()[1];
+	const int failed =
+		check_save (store, root.get(), pool, 0, "Unchanged", [] { }) ||
+		check_save (store, root.get(), pool, 1, "Entry changed", [&] { a->subfolders()[1].setEntryAt (0, random_entry(rnd)); }) ||
+		check_save (store, root.get(), pool, 1, "Shard renamed", [&] { b->setName ("Renamed"); }) ||
+		check_save (store, root.get(), pool, 2, "Folder moved", [&] {
+			a->subfolders()[2].setName ("Moved");
+			moveFolder (&a->subfolders()[2], &b->subfolders()[0], 0);
+		}) ||
+		check_save (store, root.get(), pool, 0, "Shard removed", [&] { root->removeSubfolder (5); }) ||
+		check_save (store, root.get(), pool, 1, "Shard added", [&] { root->createSubfolder ("New")->addEntry (random_entry(rnd)); }) ||
+		check_save (store, root.get(), pool, 3, "Batch", [&] {
+			Batch batch (root.get());
+			batch.addEntry (&root->subfolders()[2], random_entry(rnd));
+			batch.moveEntry (&root->subfolders()[3], 0, &root->subfolders()[4].subfolders()[0]);
+			batch.commit();
+		}) ||
+		check_save (store, root.get(), pool, 1, "Invalidated", [&] {
+			// Not reported to observers
+			root->subfolders()[6].entries().pop_back();
+			store.invalidate (root->subfolders()[6]);
+		});
+	root->removeObserver (&store);
+	return failed;
+}
+
+static int check_depth (const std::string &dir, std::mt19937 &rnd, ThreadPool &pool) {
+	// The top-level folders and their entries are stored in the manifest
+	RootFolder_Ptr root = teams (rnd, 2, 2);
+	ShardedKeystore store (dir, 2);
+	if (check_save (store, root.get(), pool, 24, "Depth 2", [] { }))
+		return 1;
+	root->addObserver (&store);
+	const int failed =
+		check_save (store, root.get(), pool, 0, "Entry above the shards", [&] { root->subfolders()[1].addEntry (random_entry(rnd)); }) ||
+		check_save (store, root.get(), pool, 1, "Entry in a shard", [&] { root->subfolders()[1].subfolders()[2].removeEntry (0); }) ||
+		check_save (store, root.get(), pool, 24, "Depth changed", [&] { store.setDepth (1); store.setDepth (2); });
+	root->removeObserver (&store);
+	return failed;
+}
+
+static int check_tampering (const std::string &dir, std::mt19937 &rnd, ThreadPool &pool) {
+	RootFolder_Ptr root = teams (rnd, 1, 2);
+	ShardedKeystore store (dir);
+	store.save (*root, key, BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER, iterations);
+	// Keep the current version of one shard, then replace it with a newer one
+	root->addObserver (&store);
+	const std::vector<std::string> before = shard_files (dir);
+	std::vector<std::string> contents;
+	for (const std::string &f : before) {
+		std::ifstream in (dir + "/" + f, std::ios::binary);
+		contents.emplace_back ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	}
+	root->subfolders()[3].addEntry (random_entry(rnd));
+	store.save (*root, key, BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER, iterations);
+	root->removeObserver (&store);
+	// Put an old shard in place of the new one, and swap the files of two shards
+	const std::vector<std::string> after = shard_files (dir);
+	std::string added, removed;
+	for (const std::string &f : after) {
+		if (std::find (before.begin(), before.end(), f) == before.end())
+			added = f;
+	}
+	for (size_t i = 0; i < before.size(); ++i) {
+		if (std::find (after.begin(), after.end(), before[i]) == after.end())
+			removed = contents[i];
+	}
+	const std::string newer = [&] { std::ifstream in (dir + "/" + added, std::ios::binary);
+		return std::string ((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()); } ();
+	for (const std::string *replacement : {&removed, &contents[after[0] == added ? 1 : 0]}) {
+		std::ofstream (dir + "/" + added, std::ios::binary | std::ios::trunc) << *replacement;
+		try {
+			reopen (dir, pool);
+			std::cerr << "Replaced shard was accepted\n";
+			return 1;
+		} catch (const std::runtime_error &) { }
+	}
+	std::ofstream (dir + "/" + added, std::ios::binary | std::ios::trunc) << newer;
+	try {
+		RootFolder_Ptr r = createRootFolder();
+		ShardedKeystore (dir).open ("wrong", r.get(), pool, Parser::READ_NONE, iterations);
+		std::cerr << "Wrong passphrase was accepted\n";
+		return 1;
+	} catch (const std::runtime_error &) { }
+	return dump (*reopen (dir, pool)) == dump (*root) ? 0 : 1;
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: ShardTest keystore_directory [entries per folder]\n";
+		return -1;
+	}
+	const std::string dir (argv[1]);
+	const int entriesPerFolder = (argc > 2) ? atoi(argv[2]) : 40;
+	XKey::CryptStream::InitCrypto();
+	std::mt19937 rnd (42);
+	ThreadPool pool;
+	if (check_incremental (dir, rnd, pool) || check_depth (dir, rnd, pool) || check_tampering (dir, rnd, pool))
+		return 1;
+
+	// Saving after changing one entry, compared to writing all shards
+	RootFolder_Ptr root = teams (rnd, 4, entriesPerFolder);
+	ShardedKeystore store (dir);
+	auto t0 = std::chrono::steady_clock::now();
+	store.save (*root, key, BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER, iterations);
+	auto t1 = std::chrono::steady_clock::now();
+	root->addObserver (&store);
+	root->subfolders()[2].subfolders()[0].setEntryAt (0, random_entry(rnd));
+	store.save (*root, key, BASE64_ENCODED | USE_ENCRYPTION | EVALUATE_FILE_HEADER, iterations);
+	auto t2 = std::chrono::steady_clock::now();
+	root->removeObserver (&store);
+	const bool same = dump (*reopen (dir, pool, Parser::READ_LAZY)) == dump (*root);
+	auto t3 = std::chrono::steady_clock::now();
+	auto ms = [] (std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+	std::cout << "8 shards of " << entriesPerFolder * 121 << " entries each. Saving all: " << ms(t1 - t0)
+		<< " ms, after changing one entry: " << ms(t2 - t1) << " ms, opening: " << ms(t3 - t2) << " ms\n";
+	return same ? 0 : 1;
+}
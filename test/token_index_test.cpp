@@ -0,0 +1,132 @@
+#include "XKey.h"
+#include "CryptStream.h"
+#include "XKeyJournal.h"
+#include "XKeyJsonSerialization.h"
+#include "XKeyTokenIndex.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace XKey;
+
+static const std::string Key = "ABC";
+static const int Iterations = 1000;
+
+static void write_keystore (const std::string &filename, const Folder &root, int mode, bool withIndex) {
+	CryptStream crypt (filename, CryptStream::WRITE, mode);
+	crypt.setEncryptionKey (Key, nullptr, nullptr, nullptr, Iterations);
+	std::ostream stream (&crypt);
+	std::ostringstream text;
+	Writer w;
+	if (!w.write (text, root))
+		throw std::runtime_error ("Failed to write keystore");
+	stream << text.str();
+	stream.flush();
+	if (withIndex)
+		TokenIndex::write (filename, crypt, text.str());
+}
+
+/// @return 1 if the index could not be used, 0 on success
+static int lookup (const std::string &filename, int mode, const std::string &search, std::vector<TokenIndex::Match> *matches) {
+	CryptStream crypt (filename, CryptStream::READ, mode);
+	crypt.setEncryptionKey (Key, nullptr, nullptr, nullptr, Iterations);
+	return TokenIndex::lookup (filename, crypt, search, matches) ? 0 : 1;
+}
+
+int main (int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: TokenIndexTest keystore_file\n";
+		return -1;
+	}
+	const std::string filename (argv[1]);
+	XKey::CryptStream::InitCrypto();
+
+	RootFolder_Ptr root = createRootFolder();
+	Folder *folders[] = {root->createSubfolder ("Web"), root->createSubfolder ("Mail"), nullptr};
+	folders[2] = folders[1]->createSubfolder ("Old");
+	for (int i = 0; i < 3000; ++i) {
+		const std::string n = std::to_string(i);
+		folders[i % 3]->addEntry (Entry{"Entry " + n + ((i % 100 == 0) ? " Größe" : ""), "user" + n,
+			"https://host" + std::to_string(i % 50) + ".example.org/path", "secret" + n, "", "comment " + n});
+	}
+
+	const int modes[] = {USE_ENCRYPTION | BASE64_ENCODED | EVALUATE_FILE_HEADER, USE_ENCRYPTION | EVALUATE_FILE_HEADER};
+	for (int mode : modes) {
+		write_keystore (filename, *root, mode, true);
+		const char *searches[] = {"host7 example", "ENTRY 1234", "host3", "größe", "entry 300 GRÖßE", "nothing", "org", "example.org/path 5"};
+		for (const char *search : searches) {
+			std::vector<TokenIndex::Match> matches;
+			if (lookup (filename, mode, search, &matches) != 0) {
+				std::cerr << "Token index not used\n";
+				return 1;
+			}
+			const std::vector<SearchResult> expected = TokenIndex::find (search, root.get());
+			bool same = (matches.size() == expected.size());
+			for (size_t i = 0; same && i < matches.size(); ++i) {
+				same = matches[i].folderPath == expected[i].parentFolder()->fullPath() &&
+					matches[i].entry.title() == expected[i].match()->title() &&
+					matches[i].entry.password() == expected[i].match()->password();
+			}
+			if (!same) {
+				std::cerr << "Lookup of '" << search << "' found " << matches.size() << " entries, expected " << expected.size() << "\n";
+				return 1;
+			}
+			std::cout << search << ": " << matches.size() << " matches\n";
+		}
+	}
+
+	// A modified index is rejected
+	const int mode = modes[0];
+	write_keystore (filename, *root, mode, true);
+	{
+		std::fstream f (TokenIndex::fileName(filename), std::ios::in | std::ios::out | std::ios::binary);
+		f.seekg (-40, std::ios::end);
+		const char c = f.get() ^ 1;
+		f.seekp (-40, std::ios::end);
+		f.put (c);
+	}
+	bool rejected = false;
+	try {
+		std::vector<TokenIndex::Match> matches;
+		lookup (filename, mode, "host7", &matches);
+	} catch (const std::runtime_error &) {
+		rejected = true;
+	}
+	if (!rejected) {
+		std::cerr << "Modified token index was accepted\n";
+		return 1;
+	}
+
+	// The index of a previous version of the keystore, or with changes in the journal, is not used
+	std::vector<TokenIndex::Match> matches;
+	write_keystore (filename, *root, mode, true);
+	const std::string previousIndex = TokenIndex::fileName(filename) + ".previous";
+	std::rename (TokenIndex::fileName(filename).c_str(), previousIndex.c_str());
+	write_keystore (filename, *root, mode, false);
+	std::rename (previousIndex.c_str(), TokenIndex::fileName(filename).c_str());
+	if (lookup (filename, mode, "host7", &matches) == 0) {
+		std::cerr << "Outdated token index was used\n";
+		return 1;
+	}
+	write_keystore (filename, *root, mode, true);
+	{
+		CryptStream crypt (filename, CryptStream::READ, mode);
+		crypt.setEncryptionKey (Key, nullptr, nullptr, nullptr, Iterations);
+		Journal journal (filename);
+		journal.reset (Key, crypt.iv(), Iterations);
+		root->addObserver (&journal);
+		folders[0]->addEntry (Entry{"Entry new", "", "https://host7.example.org", "", "", ""});
+		journal.commit();
+		root->removeObserver (&journal);
+	}
+	if (lookup (filename, mode, "host7", &matches) == 0) {
+		std::cerr << "Token index was used despite journalled changes\n";
+		return 1;
+	}
+	Journal::remove (filename);
+	TokenIndex::remove (filename);
+	std::cout << "Token index test passed\n";
+	return 0;
+}